@@ -0,0 +1,107 @@
+// Renders drawing scripts (see script.h) to BMP files without a window, as
+// many at once as there are cores.
+// Windows: build the batch project in paint.sln.
+// Linux:   g++ -O2 -std=c++20 -pthread -I../paint batch.cpp ../paint/*.cpp -o batch
+//          (every paint/*.cpp except main.cpp, which needs windows.h)
+//
+// batch [--out DIR] [--format 24|32] [--threads N] [--encode] SCRIPT...
+//
+// Each SCRIPT is written as DIR/NAME.bmp, next to the script without --out.
+// --encode writes each script in the binary form as NAME.pds instead.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "script.h"
+#include "thread_pool.h"
+
+static double NowMs() {
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bool EncodeScriptFile(const ScriptJob& Job, std::string& Error) {
+    DrawingScript script;
+    if (!LoadScript(Job.Input, script, Error)) {
+        return false;
+    }
+    std::vector<uint8_t> encoded = EncodeScript(script);
+    std::ofstream file(Job.Output, std::ios::binary);
+    file.write((const char*)encoded.data(), encoded.size());
+    if (!file) {
+        Error = "can't write " + Job.Output.string();
+        return false;
+    }
+    return true;
+}
+
+int main(int ArgumentCount, char** Arguments) {
+    std::filesystem::path outDir;
+    BmpFormat format = BMP_24_BIT;
+    bool isEncoding = false;
+    std::vector<ScriptJob> jobs;
+    for (int i = 1; i < ArgumentCount; i++) {
+        if (!strcmp(Arguments[i], "--out") && i + 1 < ArgumentCount) {
+            outDir = Arguments[++i];
+        }
+        else if (!strcmp(Arguments[i], "--format") && i + 1 < ArgumentCount) {
+            format = atoi(Arguments[++i]) == 32 ? BMP_32_BIT : BMP_24_BIT;
+        }
+        else if (!strcmp(Arguments[i], "--threads") && i + 1 < ArgumentCount) {
+            SetWorkerLimit(atoi(Arguments[++i]));
+        }
+        else if (!strcmp(Arguments[i], "--encode")) {
+            isEncoding = true;
+        }
+        else if (Arguments[i][0] == '-') {
+            jobs.clear();
+            break;
+        }
+        else {
+            ScriptJob job;
+            job.Input = Arguments[i];
+            jobs.push_back(job);
+        }
+    }
+    if (jobs.empty()) {
+        fprintf(stderr, "usage: %s [--out DIR] [--format 24|32] [--threads N] [--encode] SCRIPT...\n", Arguments[0]);
+        return 2;
+    }
+
+    for (ScriptJob& job : jobs) {
+        std::filesystem::path name = job.Input.filename();
+        name.replace_extension(isEncoding ? ".pds" : ".bmp");
+        job.Output = outDir.empty() ? job.Input.parent_path() / name : outDir / name;
+    }
+    if (!outDir.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(outDir, error);
+    }
+
+    double start = NowMs();
+    if (isEncoding) {
+        for (ScriptJob& job : jobs) {
+            job.Succeeded = EncodeScriptFile(job, job.Error);
+        }
+    }
+    else {
+        RunScriptJobs(jobs, format);
+    }
+    double elapsedMs = NowMs() - start;
+
+    int failed = 0;
+    for (const ScriptJob& job : jobs) {
+        if (!job.Succeeded) {
+            fprintf(stderr, "%s: %s\n", job.Input.string().c_str(), job.Error.c_str());
+            failed++;
+        }
+    }
+    printf("%d of %d scripts in %.1f ms, %.1f jobs/s on %d threads\n", (int)jobs.size() - failed, (int)jobs.size(),
+        elapsedMs, jobs.size() / elapsedMs * 1e3, WorkerCount());
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,33 @@
+#include "allocations.h"
+
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+static std::atomic<size_t> Count{ 0 };
+static std::atomic<size_t> Bytes{ 0 };
+
+void* operator new(size_t Size) {
+    Count.fetch_add(1, std::memory_order_relaxed);
+    Bytes.fetch_add(Size, std::memory_order_relaxed);
+    if (void* block = malloc(Size ? Size : 1)) {
+        return block;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* Block) noexcept {
+    free(Block);
+}
+
+void operator delete(void* Block, size_t) noexcept {
+    free(Block);
+}
+
+size_t AllocationCount() {
+    return Count.load();
+}
+
+size_t AllocationBytes() {
+    return Bytes.load();
+}
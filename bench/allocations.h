@@ -0,0 +1,8 @@
+#pragma once
+#include <stddef.h>
+
+// Totals over every allocation through operator new in the process, worker
+// threads included. Replacing the global operators lives in its own file so
+// the compiler can't pair them up with inlined allocations.
+size_t AllocationCount();
+size_t AllocationBytes();
@@ -0,0 +1,2402 @@
+// Headless benchmarks for the platform-independent parts of paint.
+// Windows: build the bench project in paint.sln.
+// Linux:   g++ -O2 -std=c++20 -pthread -I../paint bench.cpp allocations.cpp ../paint/*.cpp -o bench
+//          (every paint/*.cpp except main.cpp, which needs windows.h)
+//
+// bench                   comparisons against the code each change replaced
+// bench --suite           every drawing operation at 720p to 8K
+// bench --json FILE       the suite, also written to FILE for tracking
+// bench --validate N [--seed S]
+//                         N random operations per canvas size, each checked
+//                         against the reference rasterizer, then the
+//                         validator itself, the BMP loader and the damage
+//                         tracker
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stack>
+#include <string>
+#include <vector>
+
+#include "allocations.h"
+#include "antialias.h"
+#include "blend.h"
+#include "bmp.h"
+#include "damage.h"
+#include "fill.h"
+#include "filter.h"
+#include "floating.h"
+#include "gradient.h"
+#include "history.h"
+#include "input.h"
+#include "layers.h"
+#include "raster.h"
+#include "reserved_memory.h"
+#include "script.h"
+#include "selection.h"
+#include "span.h"
+#include "stroke.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "transform.h"
+#include "validate.h"
+#include "viewport.h"
+
+struct Resolution {
+    const char* Name;
+    int Width;
+    int Height;
+};
+
+static const Resolution Resolutions[] = {
+    { "1080p", 1920, 1080 },
+    { "4K", 3840, 2160 },
+    { "8K", 7680, 4320 },
+};
+
+// Plain linear pixels, for the pre-tile versions kept as baselines.
+struct Framebuffer {
+    u32* Pixels;
+    int Width;
+    int Height;
+};
+
+static double NowMs() {
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Stand-in for one user edit: a 256x24 stroke-sized block at a random spot.
+static void ScribbleRect(Framebuffer& Target, std::mt19937& Rng) {
+    int w = 256, h = 24;
+    int x0 = Rng() % (Target.Width - w);
+    int y0 = Rng() % (Target.Height - h);
+    u32 color = Rng() & 0xffffff;
+    for (int y = y0; y < y0 + h; y++) {
+        for (int x = x0; x < x0 + w; x++) {
+            Target.Pixels[(size_t)y * Target.Width + x] = color;
+        }
+    }
+}
+
+static void ScribbleRect(Canvas& Target, std::mt19937& Rng) {
+    int w = 256, h = 24;
+    int x0 = Rng() % (Target.Width - w);
+    int y0 = Rng() % (Target.Height - h);
+    u32 color = Rng() & 0xffffff;
+    FillRect(Target, x0, y0, x0 + w, y0 + h, color);
+}
+
+static void BenchHistory(const Resolution& Res) {
+    const int steps = 200;
+    std::vector<u32> pixels((size_t)Res.Width * Res.Height, 0x222222);
+    Framebuffer framebuffer = { pixels.data(), Res.Width, Res.Height };
+
+    // Previous scheme: one full copy of the framebuffer per step. Only a few are
+    // kept alive so the benchmark itself doesn't run out of memory at 4K.
+    std::mt19937 rng(1);
+    std::deque<std::vector<u32>> frames;
+    double fullMs = 0;
+    for (int i = 0; i < steps; i++) {
+        ScribbleRect(framebuffer, rng);
+        double start = NowMs();
+        frames.push_back(std::vector<u32>(pixels.begin(), pixels.end()));
+        fullMs += NowMs() - start;
+        if (frames.size() > 2) {
+            frames.pop_front();
+        }
+    }
+    size_t fullBytes = pixels.size() * sizeof(u32);
+
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0x222222);
+    DrawingHistory history;
+    InitDrawingHistory(history, canvas, (size_t)-1);
+    size_t baseBytes = HistoryBytes(history);
+
+    rng.seed(1);
+    double tileMs = 0;
+    for (int i = 0; i < steps; i++) {
+        ScribbleRect(canvas, rng);
+        double start = NowMs();
+        SaveDrawingState(history, canvas);
+        tileMs += NowMs() - start;
+    }
+    size_t tileBytes = (HistoryBytes(history) - baseBytes) / steps;
+
+    double undoStart = NowMs();
+    while (UndoDrawing(history, canvas)) {
+    }
+    double undoMs = (NowMs() - undoStart) / steps;
+
+    printf("history %-6s full-frame: %9zu B/step %7.3f ms/snapshot | tiles: %7zu B/step %7.3f ms/snapshot %7.3f ms/undo (base %zu B)\n",
+        Res.Name, fullBytes, fullMs / steps, tileBytes, tileMs / steps, undoMs, baseBytes);
+}
+
+// The stack-of-pairs fill that FloodFill replaced, kept as the baseline.
+static void LegacyFloodFill(u32* pixels, int canvasWidth, int canvasHeight, int x, int y, u32 replacementColor) {
+    std::stack<std::pair<int, int>> stack;
+    u32 targetColor = pixels[y * canvasWidth + x];
+    if (targetColor == replacementColor) {
+        return;
+    }
+
+    stack.push(std::make_pair(x, y));
+    int dx[] = { 0, 0, -1, 1 };
+    int dy[] = { -1, 1, 0, 0 };
+
+    while (!stack.empty()) {
+        std::pair<int, int> current = stack.top();
+        stack.pop();
+        x = current.first;
+        y = current.second;
+
+        if (pixels[y * canvasWidth + x] == targetColor) {
+            pixels[y * canvasWidth + x] = replacementColor;
+            for (int i = 0; i < 4; i++) {
+                int newX = x + dx[i];
+                int newY = y + dy[i];
+                if (newX >= 0 && newX < canvasWidth && newY >= 0 && newY < canvasHeight) {
+                    if (pixels[newY * canvasWidth + newX] == targetColor) {
+                        stack.push(std::make_pair(newX, newY));
+                    }
+                }
+            }
+        }
+    }
+}
+
+enum FillScene {
+    SCENE_EMPTY,
+    SCENE_MAZE,
+    SCENE_CHECKERBOARD
+};
+
+static const char* FillSceneNames[] = { "full-canvas", "maze", "checkerboard" };
+
+static void BuildFillScene(std::vector<u32>& Pixels, int Width, int Height, FillScene Scene) {
+    for (int y = 0; y < Height; y++) {
+        for (int x = 0; x < Width; x++) {
+            u32 value = 0x222222;
+            if (Scene == SCENE_MAZE && x % 8 == 7) {
+                // Walls every 8 columns with the opening alternating between
+                // top and bottom, so the region is one long serpentine path.
+                bool gapAtTop = (x / 8) % 2 == 0;
+                bool isGap = gapAtTop ? y < 4 : y >= Height - 4;
+                if (!isGap) {
+                    value = 0xffffff;
+                }
+            }
+            if (Scene == SCENE_CHECKERBOARD && ((x ^ y) & 1)) {
+                value = 0x242424; // within tolerance of the background
+            }
+            Pixels[(size_t)y * Width + x] = value;
+        }
+    }
+}
+
+static void BenchFloodFill(const Resolution& Res) {
+    std::vector<u32> pixels((size_t)Res.Width * Res.Height);
+
+    for (int scene = SCENE_EMPTY; scene <= SCENE_CHECKERBOARD; scene++) {
+        // The checkerboard is only one region with a tolerance, which the old
+        // fill doesn't support.
+        double legacyMs = -1;
+        if (scene != SCENE_CHECKERBOARD) {
+            BuildFillScene(pixels, Res.Width, Res.Height, (FillScene)scene);
+            double start = NowMs();
+            LegacyFloodFill(pixels.data(), Res.Width, Res.Height, 0, 0, 0xff0000);
+            legacyMs = NowMs() - start;
+        }
+
+        FillTolerance tolerance = { TOLERANCE_EXACT, 0 };
+        if (scene == SCENE_CHECKERBOARD) {
+            tolerance = { TOLERANCE_CHANNEL, 4 };
+        }
+        BuildFillScene(pixels, Res.Width, Res.Height, (FillScene)scene);
+        Canvas canvas;
+        InitCanvas(canvas, Res.Width, Res.Height, 0);
+        LoadCanvasPixels(canvas, pixels.data(), Res.Width);
+        double start = NowMs();
+        FloodFill(canvas, 0, 0, 0xff0000, tolerance);
+        double spanMs = NowMs() - start;
+
+        if (legacyMs >= 0) {
+            printf("fill    %-6s %-13s legacy %8.2f ms | scanline %7.2f ms (%.1fx)\n", Res.Name, FillSceneNames[scene], legacyMs, spanMs, legacyMs / spanMs);
+        }
+        else {
+            printf("fill    %-6s %-13s legacy      n/a    | scanline %7.2f ms\n", Res.Name, FillSceneNames[scene], spanMs);
+        }
+    }
+}
+
+// Per-pixel versions of ClearScreen and the filled shapes as they were before
+// the span layer, for comparison.
+static void LegacyDrawPixel(Framebuffer& Target, int X, int Y, u32 Color) {
+    if (X >= 0 && X < Target.Width && Y >= 0 && Y < Target.Height) {
+        Target.Pixels[Y * Target.Width + X] = Color;
+    }
+}
+
+static void LegacyClearScreen(Framebuffer& Target, u32 Color) {
+    for (int Index = 0; Index < Target.Width * Target.Height; ++Index) {
+        Target.Pixels[Index] = Color;
+    }
+}
+
+static void LegacyFilledRectangle(Framebuffer& Target, int X0, int Y0, int X1, int Y1, u32 Color) {
+    for (int i = Y0; i < Y1; i++) {
+        for (int j = X0; j < X1; j++) {
+            LegacyDrawPixel(Target, j, i, Color);
+        }
+    }
+}
+
+static void LegacyFilledCircle(Framebuffer& Target, int X, int Y, int Radius, u32 Color) {
+    int x = Radius;
+    int y = 0;
+    int err = 0;
+    while (x >= y) {
+        for (int i = -x; i <= x; i++) {
+            LegacyDrawPixel(Target, X + i, Y + y, Color);
+            LegacyDrawPixel(Target, X + i, Y - y, Color);
+        }
+        for (int i = -y; i <= y; i++) {
+            LegacyDrawPixel(Target, X + i, Y + x, Color);
+            LegacyDrawPixel(Target, X + i, Y - x, Color);
+        }
+        if (err <= 0) {
+            y += 1;
+            err += 2 * y + 1;
+        }
+        if (err > 0) {
+            x -= 1;
+            err -= 2 * x + 1;
+        }
+    }
+}
+
+template <typename Fn>
+static double MeasureMs(int Repeats, Fn&& Body) {
+    double start = NowMs();
+    for (int i = 0; i < Repeats; i++) {
+        Body(i);
+    }
+    return (NowMs() - start) / Repeats;
+}
+
+static void BenchSpans(const Resolution& Res) {
+    std::vector<u32> pixels((size_t)Res.Width * Res.Height);
+    Framebuffer framebuffer = { pixels.data(), Res.Width, Res.Height };
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0);
+    double megapixels = (double)Res.Width * Res.Height / 1e6;
+    int radius = Res.Height / 2 - 1;
+    double circleMegapixels = 3.14159 * radius * radius / 1e6;
+    const int repeats = 10;
+
+    double clearMs = MeasureMs(repeats, [&](int i) { LegacyClearScreen(framebuffer, i); });
+    double rectMs = MeasureMs(repeats, [&](int i) { LegacyFilledRectangle(framebuffer, 0, 0, Res.Width, Res.Height, i); });
+    double circleMs = MeasureMs(repeats, [&](int i) { LegacyFilledCircle(framebuffer, Res.Width / 2, Res.Height / 2, radius, i); });
+    printf("spans   %-6s %-7s clear %8.1f Mpix/s  filled-rect %8.1f Mpix/s  filled-circle %8.1f Mpix/s\n",
+        Res.Name, "legacy", megapixels / clearMs * 1e3, megapixels / rectMs * 1e3, circleMegapixels / circleMs * 1e3);
+
+    SpanKernel best = GetSpanKernel();
+    for (int kernel = SPAN_KERNEL_SCALAR; kernel <= best; kernel++) {
+        SetSpanKernel((SpanKernel)kernel);
+        clearMs = MeasureMs(repeats, [&](int i) { ClearScreen(canvas, i); });
+        rectMs = MeasureMs(repeats, [&](int i) { DrawRectangle(canvas, 0, 0, Res.Width, Res.Height, i, 1, true); });
+        circleMs = MeasureMs(repeats, [&](int i) { DrawCircle(canvas, Res.Width / 2, Res.Height / 2, radius, i, 1, true); });
+        printf("spans   %-6s %-7s clear %8.1f Mpix/s  filled-rect %8.1f Mpix/s  filled-circle %8.1f Mpix/s\n",
+            Res.Name, SpanKernelName((SpanKernel)kernel), megapixels / clearMs * 1e3, megapixels / rectMs * 1e3, circleMegapixels / circleMs * 1e3);
+    }
+    SetSpanKernel(best);
+}
+
+// Brush stamped at every Bresenham step, as DrawLine and DrawStraightLine did
+// before the swept stroke. Returns the number of pixel writes.
+static size_t LegacyDrawLine(Framebuffer& Target, int X1, int Y1, int X2, int Y2, u32 Color, int LineWidth, BrushShape Brush) {
+    size_t writes = 0;
+    int dx = abs(X2 - X1);
+    int dy = abs(Y2 - Y1);
+    int sx = (X1 < X2) ? 1 : -1;
+    int sy = (Y1 < Y2) ? 1 : -1;
+    int err = dx - dy;
+    int err2;
+
+    for (;;) {
+        int BrushSize = LineWidth / 2;
+        for (int i = -BrushSize; i <= BrushSize; i++) {
+            for (int j = -BrushSize; j <= BrushSize; j++) {
+                int distance = (i * i) + (j * j);
+                if (Brush != ROUND_BRUSH || distance <= (BrushSize * BrushSize)) {
+                    int x = X1 + i;
+                    int y = Y1 + j;
+                    if (x >= 0 && x < Target.Width && y >= 0 && y < Target.Height) {
+                        Target.Pixels[y * Target.Width + x] = Color;
+                        writes++;
+                    }
+                }
+            }
+        }
+        if (X1 == X2 && Y1 == Y2) {
+            break;
+        }
+        err2 = 2 * err;
+        if (err2 > -dy) {
+            err -= dy;
+            X1 += sx;
+        }
+        if (err2 < dx) {
+            err += dx;
+            Y1 += sy;
+        }
+    }
+    return writes;
+}
+
+static size_t CountColor(const Canvas& Target, const PixelRect& Rect, u32 Color) {
+    std::vector<u32> row(Rect.X1 - Rect.X0);
+    size_t count = 0;
+    for (int y = Rect.Y0; y < Rect.Y1; y++) {
+        ReadCanvasSpan(Target, y, Rect.X0, Rect.X1, row.data());
+        count += std::count(row.begin(), row.end(), Color);
+    }
+    return count;
+}
+
+static size_t CountColor(const Canvas& Target, u32 Color) {
+    return CountColor(Target, CanvasBounds(Target), Color);
+}
+
+static void BenchStrokes() {
+    const Resolution res = { "4K", 3840, 2160 };
+    std::vector<u32> pixels((size_t)res.Width * res.Height, 0);
+    Framebuffer framebuffer = { pixels.data(), res.Width, res.Height };
+    Canvas canvas;
+    InitCanvas(canvas, res.Width, res.Height, 0);
+
+    const int segments = 64;
+    std::mt19937 rng(7);
+    std::vector<int> coords(segments * 4);
+    for (int i = 0; i < segments; i++) {
+        coords[i * 4 + 0] = 200 + rng() % (res.Width - 400);
+        coords[i * 4 + 1] = 200 + rng() % (res.Height - 400);
+        coords[i * 4 + 2] = coords[i * 4 + 0] + (int)(rng() % 301) - 150;
+        coords[i * 4 + 3] = coords[i * 4 + 1] + (int)(rng() % 301) - 150;
+    }
+
+    const int widths[] = { 1, 2, 5, 10, 20, 35, 50 };
+    for (int brush = ROUND_BRUSH; brush <= SQUARE_BRUSH; brush++) {
+        for (int width : widths) {
+            // Coverage and write counts, one segment at a time so the segments
+            // don't hide each other.
+            size_t covered = 0, legacyWrites = 0, sweptWrites = 0;
+            for (int i = 0; i < segments; i++) {
+                const int* c = &coords[i * 4];
+                legacyWrites += LegacyDrawLine(framebuffer, c[0], c[1], c[2], c[3], 1, width, (BrushShape)brush);
+                ClearScreen(canvas, 0);
+                DrawLine(canvas, c[0], c[1], c[2], c[3], 1, width, (BrushShape)brush);
+                covered += CountColor(canvas, 1);
+            }
+            // Spans never overlap, so the swept stroke writes exactly what it covers.
+            sweptWrites = covered;
+
+            double legacyMs = MeasureMs(3, [&](int r) {
+                for (int i = 0; i < segments; i++) {
+                    const int* c = &coords[i * 4];
+                    LegacyDrawLine(framebuffer, c[0], c[1], c[2], c[3], r, width, (BrushShape)brush);
+                }
+            });
+            double sweptMs = MeasureMs(3, [&](int r) {
+                for (int i = 0; i < segments; i++) {
+                    const int* c = &coords[i * 4];
+                    DrawLine(canvas, c[0], c[1], c[2], c[3], r, width, (BrushShape)brush);
+                }
+            });
+
+            printf("stroke  %-6s width %2d  legacy overdraw %5.2fx %8.1f Mpix/s | swept overdraw %4.2fx %8.1f Mpix/s\n",
+                brush == ROUND_BRUSH ? "round" : "square", width,
+                (double)legacyWrites / covered, covered / 1e6 / legacyMs * 1e3,
+                (double)sweptWrites / covered, covered / 1e6 / sweptMs * 1e3);
+        }
+    }
+}
+
+// DrawCircle's outline before the span ring: a LineWidth square stamped on all
+// eight octant points at every midpoint step. Returns the number of pixel
+// writes.
+static size_t LegacyDrawCircle(Canvas& Target, int X, int Y, int Radius, u32 Color, int LineWidth) {
+    size_t writes = 0;
+    int x = Radius;
+    int y = 0;
+    int err = 0;
+    while (x >= y) {
+        for (int i = -LineWidth / 2; i <= LineWidth / 2; i++) {
+            for (int j = -LineWidth / 2; j <= LineWidth / 2; j++) {
+                DrawPixel(Target, X + x + i, Y + y + j, Color);
+                DrawPixel(Target, X + y + i, Y + x + j, Color);
+                DrawPixel(Target, X - y + i, Y + x + j, Color);
+                DrawPixel(Target, X - x + i, Y + y + j, Color);
+                DrawPixel(Target, X - x + i, Y - y + j, Color);
+                DrawPixel(Target, X - y + i, Y - x + j, Color);
+                DrawPixel(Target, X + y + i, Y - x + j, Color);
+                DrawPixel(Target, X + x + i, Y - y + j, Color);
+                writes += 8;
+            }
+        }
+        if (err <= 0) {
+            y += 1;
+            err += 2 * y + 1;
+        }
+        if (err > 0) {
+            x -= 1;
+            err -= 2 * x + 1;
+        }
+    }
+    return writes;
+}
+
+static void BenchCircles() {
+    const Resolution res = { "4K", 3840, 2160 };
+    Canvas canvas;
+    InitCanvas(canvas, res.Width, res.Height, 0);
+    int cx = res.Width / 2, cy = res.Height / 2;
+
+    const int radii[] = { 20, 200, res.Height / 3 };
+    const int widths[] = { 1, 2, 5, 20, 50 };
+    for (int radius : radii) {
+        for (int width : widths) {
+            // Spans never overlap, so the ring writes exactly what it covers.
+            ClearScreen(canvas, 0);
+            size_t legacyWrites = LegacyDrawCircle(canvas, cx, cy, radius, 1, width);
+            size_t legacyCovered = CountColor(canvas, 1);
+            ClearScreen(canvas, 0);
+            DrawCircle(canvas, cx, cy, radius, 1, width, false);
+            size_t ringWrites = CountColor(canvas, 1);
+
+            int repeats = radius < 100 ? 200 : 10;
+            double legacyMs = MeasureMs(repeats, [&](int r) { LegacyDrawCircle(canvas, cx, cy, radius, r, width); });
+            double ringMs = MeasureMs(repeats, [&](int r) { DrawCircle(canvas, cx, cy, radius, r, width, false); });
+            printf("circle  radius %4d width %2d  legacy %9zu writes (%5.2fx overdraw) %8.1f us | ring %8zu writes %8.1f us (%.2fx speedup)\n",
+                radius, width, legacyWrites, (double)legacyWrites / legacyCovered, legacyMs * 1e3, ringWrites, ringMs * 1e3, legacyMs / ringMs);
+        }
+    }
+}
+
+// Cost of the anti-aliased primitives over the aliased ones drawing the same
+// shapes: short strokes at several widths, and circles.
+static void BenchAntiAlias() {
+    const Resolution res = { "4K", 3840, 2160 };
+    Canvas canvas;
+    InitCanvas(canvas, res.Width, res.Height, 0);
+    // Every tile starts with its own pixels, so neither side pays for the
+    // first copy out of a uniform tile.
+    for (int y = 0; y < res.Height; y++) {
+        FillSpan(canvas, y, 0, res.Width, y);
+    }
+
+    const int segments = 64;
+    std::mt19937 rng(7);
+    std::vector<int> coords(segments * 4);
+    for (int i = 0; i < segments; i++) {
+        coords[i * 4 + 0] = 200 + rng() % (res.Width - 400);
+        coords[i * 4 + 1] = 200 + rng() % (res.Height - 400);
+        coords[i * 4 + 2] = coords[i * 4 + 0] + (int)(rng() % 301) - 150;
+        coords[i * 4 + 3] = coords[i * 4 + 1] + (int)(rng() % 301) - 150;
+    }
+
+    const int widths[] = { 1, 2, 5, 10, 20, 50 };
+    for (int brush = ROUND_BRUSH; brush <= SQUARE_BRUSH; brush++) {
+        for (int width : widths) {
+            double aliasedMs = MeasureMs(5, [&](int r) {
+                for (int i = 0; i < segments; i++) {
+                    const int* c = &coords[i * 4];
+                    DrawLine(canvas, c[0], c[1], c[2], c[3], r, width, (BrushShape)brush);
+                }
+            });
+            double smoothMs = MeasureMs(5, [&](int r) {
+                for (int i = 0; i < segments; i++) {
+                    const int* c = &coords[i * 4];
+                    DrawLineAA(canvas, c[0], c[1], c[2], c[3], r, width, (BrushShape)brush);
+                }
+            });
+            printf("aa      %-6s width %2d  aliased %7.1f us/segment | anti-aliased %7.1f us/segment (%.2fx)\n",
+                brush == ROUND_BRUSH ? "round" : "square", width, aliasedMs * 1e3 / segments, smoothMs * 1e3 / segments, smoothMs / aliasedMs);
+        }
+    }
+
+    int radius = res.Height / 3;
+    for (int filled = 0; filled <= 1; filled++) {
+        double aliasedMs = MeasureMs(10, [&](int r) { DrawCircle(canvas, res.Width / 2, res.Height / 2, radius, r, 5, filled); });
+        double smoothMs = MeasureMs(10, [&](int r) { DrawCircleAA(canvas, res.Width / 2, res.Height / 2, radius, r, 5, filled); });
+        printf("aa      %-15s aliased %7.1f us/circle  | anti-aliased %7.1f us/circle  (%.2fx)\n",
+            filled ? "filled-circle" : "circle", aliasedMs * 1e3, smoothMs * 1e3, smoothMs / aliasedMs);
+    }
+}
+
+// A wandering stroke at 4K drawn opaque, then blended at half opacity in each
+// mode. Every stroke starts from a snapshot of the tiles, as the undo history
+// holds one in the app, so both sides pay for copying the tiles they touch.
+static void BenchBlend() {
+    const Resolution res = { "4K", 3840, 2160 };
+    Canvas canvas;
+    InitCanvas(canvas, res.Width, res.Height, 0);
+    for (int y = 0; y < res.Height; y++) {
+        FillSpan(canvas, y, 0, res.Width, y * 0x010101);
+    }
+
+    const int segments = 400;
+    std::vector<int> points(2 * (segments + 1));
+    std::mt19937 rng(29);
+    int x = res.Width / 2, y = res.Height / 2;
+    for (int i = 0; i <= segments; i++) {
+        points[2 * i] = x;
+        points[2 * i + 1] = y;
+        x = std::clamp(x + (int)(rng() % 41) - 20, 0, res.Width - 1);
+        y = std::clamp(y + (int)(rng() % 41) - 20, 0, res.Height - 1);
+    }
+
+    static const char* modeNames[] = { "normal", "multiply", "screen", "add" };
+    const int widths[] = { 2, 10, 40 };
+    for (int width : widths) {
+        for (int antiAlias = 0; antiAlias <= 1; antiAlias++) {
+            auto stroke = [&](int Repeat, uint8_t Opacity, BlendMode Mode) {
+                std::vector<TileRef> committed = canvas.Tiles;
+                BeginBlendedStroke(canvas, Opacity, Mode);
+                for (int i = 0; i < segments; i++) {
+                    const int* p = &points[2 * i];
+                    if (antiAlias) {
+                        DrawLineAA(canvas, p[0], p[1], p[2], p[3], 0x4080c0 + Repeat, width, ROUND_BRUSH);
+                    }
+                    else {
+                        DrawLine(canvas, p[0], p[1], p[2], p[3], 0x4080c0 + Repeat, width, ROUND_BRUSH);
+                    }
+                }
+                EndBlendedStroke(canvas);
+            };
+            double opaqueMs = MeasureMs(5, [&](int r) { stroke(r, 255, BLEND_NORMAL); });
+            printf("blend   width %2d %-8s opaque %7.2f ms |", width, antiAlias ? "aa" : "aliased", opaqueMs);
+            for (int mode = 0; mode < BLEND_MODE_COUNT; mode++) {
+                double blendMs = MeasureMs(5, [&](int r) { stroke(r, 128, (BlendMode)mode); });
+                printf(" %s %.2fx", modeNames[mode], blendMs / opaqueMs);
+            }
+            printf("\n");
+        }
+    }
+}
+
+// Freehand input from a 1000 Hz mouse: two seconds of a quick looping stroke,
+// rounded to whole pixels like mouse positions, with a pixel of hand jitter.
+// Drawing a segment per move against queueing the moves and drawing the
+// smoothed curve once per 60 Hz frame, at 1080p. Lag is how old the input the
+// stroke has reached is when a frame is drawn; error is how far the drawn
+// points are from the path the hand meant.
+static void BenchInput() {
+    const double eventMs = 1.0, frameMs = 1000.0 / 60;
+    const int events = 2000;
+    auto path = [](double Ms) {
+        double t = Ms / 1000;
+        return InputPoint{ (float)(960 + 600 * sin(2.1 * t) + 120 * sin(9.7 * t)), (float)(540 + 380 * sin(3.3 * t) + 90 * cos(7.9 * t)), Ms };
+    };
+    std::mt19937 rng(31);
+    std::uniform_real_distribution<float> jitter(-1.0f, 1.0f);
+    std::vector<InputPoint> moves(events);
+    for (int i = 0; i < events; i++) {
+        InputPoint p = path((i + 1) * eventMs);
+        moves[i] = { roundf(p.X + jitter(rng)), roundf(p.Y + jitter(rng)), p.Time };
+    }
+    InputPoint start = path(0);
+    start.X = roundf(start.X);
+    start.Y = roundf(start.Y);
+
+    // Distance to the nearest point of the intended path within 50 ms.
+    auto error = [&](const InputPoint& P) {
+        float nearest = 1e9f;
+        for (double ms = std::max(P.Time - 50, 0.0); ms <= P.Time + 50; ms += 0.25) {
+            InputPoint q = path(ms);
+            nearest = std::min(nearest, hypotf(P.X - q.X, P.Y - q.Y));
+        }
+        return nearest;
+    };
+    auto rmsError = [&](const std::vector<InputPoint>& Points) {
+        double sum = 0;
+        for (const InputPoint& p : Points) {
+            float e = error(p);
+            sum += e * e;
+        }
+        return sqrt(sum / Points.size());
+    };
+
+    // Smoothing alone, handed a frame's moves at a time.
+    std::vector<InputPoint> placed;
+    StrokeSmoother smoother;
+    const int strokes = 200;
+    double smoothMs = MeasureMs(1, [&](int) {
+        for (int s = 0; s < strokes; s++) {
+            placed.clear();
+            BeginSmoothStroke(smoother, start, StrokeSpacing(10), placed);
+            for (int i = 0; i < events; i += 17) {
+                SmoothStroke(smoother, &moves[i], std::min(17, events - i), placed);
+            }
+            EndSmoothStroke(smoother, placed);
+        }
+    });
+    printf("input   smoothing %.1f M moves/s\n", strokes * events / smoothMs / 1000);
+    printf("input   rms error  moves %.2f px | smoothed %.2f px\n", rmsError(moves), rmsError(placed));
+
+    Canvas canvas;
+    InitCanvas(canvas, 1920, 1080, 0);
+    const int widths[] = { 2, 10, 40 };
+    for (int width : widths) {
+        int segments = 0;
+        double perMoveMs = MeasureMs(3, [&](int r) {
+            segments = 0;
+            int x = (int)start.X, y = (int)start.Y;
+            for (const InputPoint& move : moves) {
+                if ((int)move.X != x || (int)move.Y != y) {
+                    DrawLine(canvas, x, y, (int)move.X, (int)move.Y, 0x4080c0 + r, width, ROUND_BRUSH);
+                    x = (int)move.X;
+                    y = (int)move.Y;
+                    segments++;
+                }
+            }
+        });
+        printf("input   width %2d per move  %7.2f ms %5d segments |", width, perMoveMs, segments);
+
+        int smoothSegments = 0;
+        double lagSum = 0, lagMax = 0, frameMax = 0;
+        int frames = 0;
+        double smoothedMs = MeasureMs(3, [&](int r) {
+            smoothSegments = 0;
+            lagSum = lagMax = frameMax = 0;
+            frames = 0;
+            placed.clear();
+            BeginSmoothStroke(smoother, start, StrokeSpacing(width), placed);
+            int x = (int)start.X, y = (int)start.Y;
+            size_t next = 0;
+            for (double frame = frameMs; next < moves.size(); frame += frameMs) {
+                double frameStart = NowMs();
+                size_t end = next;
+                while (end < moves.size() && moves[end].Time <= frame) {
+                    end++;
+                }
+                placed.clear();
+                SmoothStroke(smoother, &moves[next], end - next, placed);
+                next = end;
+                if (next == moves.size()) {
+                    EndSmoothStroke(smoother, placed);
+                }
+                for (const InputPoint& p : placed) {
+                    int px = (int)lroundf(p.X), py = (int)lroundf(p.Y);
+                    if (px != x || py != y) {
+                        DrawLine(canvas, x, y, px, py, 0x4080c0 + r, width, ROUND_BRUSH);
+                        x = px;
+                        y = py;
+                        smoothSegments++;
+                    }
+                }
+                if (!placed.empty()) {
+                    double lag = frame - placed.back().Time;
+                    lagSum += lag;
+                    lagMax = std::max(lagMax, lag);
+                    frames++;
+                }
+                frameMax = std::max(frameMax, NowMs() - frameStart);
+            }
+        });
+        printf(" per frame %7.2f ms %5d segments, lag %.1f ms avg %.1f max, slowest frame %.2f ms\n",
+            smoothedMs, smoothSegments, lagSum / frames, lagMax, frameMax);
+    }
+}
+
+// What tracing costs: an empty scope off and on, and a 400 segment stroke at
+// 1080p with every raster call traced against untraced, then writing it out.
+static void BenchTrace() {
+    const int scopes = 10000000;
+    volatile int sink = 0;
+    auto emptyScopes = [&](int) {
+        for (int i = 0; i < scopes; i++) {
+            TraceScope trace("empty");
+            sink = sink + 1;
+        }
+    };
+    ResetTrace();
+    double offMs = MeasureMs(1, emptyScopes);
+    SetTracing(true);
+    double onMs = MeasureMs(1, emptyScopes);
+    SetTracing(false);
+    printf("trace   empty scope off %.2f ns | on %.2f ns\n", offMs * 1e6 / scopes, onMs * 1e6 / scopes);
+
+    Canvas canvas;
+    InitCanvas(canvas, 1920, 1080, 0);
+    const int segments = 400;
+    std::mt19937 rng(37);
+    std::vector<int> points(2 * (segments + 1));
+    for (int i = 0; i <= segments; i++) {
+        points[2 * i] = 200 + (int)(rng() % 1520);
+        points[2 * i + 1] = 100 + (int)(rng() % 880);
+    }
+    auto stroke = [&](int Repeat) {
+        for (int i = 0; i < segments; i++) {
+            const int* p = &points[2 * i];
+            DrawLineAA(canvas, p[0], p[1], p[2], p[3], 0x4080c0 + Repeat, 10, ROUND_BRUSH);
+            TraceFrame(0);
+        }
+    };
+    ResetTrace();
+    double strokeOffMs = MeasureMs(5, stroke);
+    SetTracing(true);
+    double strokeOnMs = MeasureMs(5, stroke);
+    SetTracing(false);
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path();
+    double jsonMs = MeasureMs(1, [&](int) { WriteTraceJson(dir / "paint_bench_trace.json"); });
+    double csvMs = MeasureMs(1, [&](int) { WriteTraceSummary(dir / "paint_bench_trace.csv"); });
+    uintmax_t jsonBytes = std::filesystem::file_size(dir / "paint_bench_trace.json");
+    std::filesystem::remove(dir / "paint_bench_trace.json");
+    std::filesystem::remove(dir / "paint_bench_trace.csv");
+    printf("trace   aa stroke off %.2f ms | on %.2f ms (%.1f%%) | json %.1f ms, %.1f MB | csv %.1f ms\n",
+        strokeOffMs, strokeOnMs, (strokeOnMs / strokeOffMs - 1) * 100, jsonMs, jsonBytes / 1e6, csvMs);
+    ResetTrace();
+}
+
+// Flattens Rect of every visible layer, bottom first, the way a stack without
+// caches would on every change.
+static void NaiveFlatten(const LayerStack& Stack, const PixelRect& Rect, std::vector<u32>& Out) {
+    int width = Rect.X1 - Rect.X0;
+    Out.resize((size_t)width * (Rect.Y1 - Rect.Y0));
+    std::vector<u32> row(width);
+    for (int y = Rect.Y0; y < Rect.Y1; y++) {
+        u32* dest = Out.data() + (size_t)(y - Rect.Y0) * width;
+        std::fill(dest, dest + width, Stack.Backdrop);
+        for (const auto& layer : Stack.Layers) {
+            if (layer->Visible) {
+                ReadCanvasSpan(layer->Pixels, y, Rect.X0, Rect.X1, row.data());
+                CompositeRow(dest, row.data(), width, layer->Opacity);
+            }
+        }
+    }
+}
+
+// Compositing cost against layer count at 4K: a full recomposite, and the
+// update after one stroke segment on a layer in the middle of the stack, each
+// against flattening every layer. Presenting reads only the composite.
+static void BenchLayers() {
+    const Resolution res = { "4K", 3840, 2160 };
+    const int counts[] = { 2, 8, 32 };
+    for (int count : counts) {
+        LayerStack stack;
+        InitLayerStack(stack, res.Width, res.Height, 0x222222, DEFAULT_HISTORY_BUDGET);
+        std::mt19937 rng(23);
+        for (int i = 0; i < count; i++) {
+            if (i > 0) {
+                AddLayer(stack);
+            }
+            Layer& layer = ActiveLayer(stack);
+            for (int j = 0; j < 24; j++) {
+                DrawRectangle(layer.Pixels, rng() % res.Width, rng() % res.Height, 600, 400, rng() & 0xffffff, 1, true);
+            }
+            for (int j = 0; j < 24; j++) {
+                int x = rng() % res.Width, y = rng() % res.Height;
+                DrawLineAA(layer.Pixels, x, y, x + (int)(rng() % 801) - 400, y + (int)(rng() % 801) - 400, rng() & 0xffffff, 20, ROUND_BRUSH);
+            }
+            if (i % 2) {
+                SetLayerOpacity(stack, i, 191);
+            }
+        }
+        SetActiveLayer(stack, count / 2);
+        UpdateComposite(stack);
+
+        double fullMs = MeasureMs(3, [&](int) {
+            InvalidateLayers(stack);
+            UpdateComposite(stack);
+        });
+        std::vector<u32> flat;
+        double naiveFullMs = MeasureMs(3, [&](int) { NaiveFlatten(stack, CanvasBounds(stack.Composite), flat); });
+
+        // Strokes a quarter of the way in, 200 pixels per segment.
+        const int segments = 50;
+        int x = res.Width / 4, y = res.Height / 4;
+        double updateMs = 0;
+        for (int i = 0; i < segments; i++) {
+            DrawLine(ActiveLayer(stack).Pixels, x + i * 20, y, x + i * 20 + 200, y + 40, i, 20, ROUND_BRUSH);
+            double start = NowMs();
+            UpdateComposite(stack);
+            updateMs += NowMs() - start;
+        }
+        double naiveStrokeMs = MeasureMs(1, [&](int) {
+            for (int i = 0; i < segments; i++) {
+                PixelRect rect = { x + i * 20 - 10, y - 10, x + i * 20 + 211, y + 51 };
+                NaiveFlatten(stack, rect, flat);
+            }
+        });
+
+        std::vector<u32> frame((size_t)res.Width * res.Height);
+        double presentMs = MeasureMs(3, [&](int) { ResolveCanvas(stack.Composite, CanvasBounds(stack.Composite), frame.data(), res.Width); });
+        printf("layers  %-3s %2d layers  full %7.2f ms (flatten %7.2f ms, %5.1fx) | stroke update %6.1f us/segment (flatten %6.1f us, %5.1fx) | present %5.2f ms\n",
+            res.Name, count, fullMs, naiveFullMs, naiveFullMs / fullMs, updateMs * 1e3 / segments, naiveStrokeMs * 1e3 / segments,
+            naiveStrokeMs / updateMs, presentMs);
+    }
+}
+
+// A drawing session at one refresh: every frame a few segments of a wandering
+// stroke are drawn, then the frame's damage is taken and "presented". Compares
+// the pixels handed to the blit against presenting the whole frame each time.
+static void BenchDamage(const Resolution& Res) {
+    DamageTracker damage;
+    InitDamageTracker(damage, Res.Width, Res.Height);
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0);
+    canvas.Damage = &damage;
+
+    const int frames = 240;
+    const int segmentsPerFrame = 4;
+    std::mt19937 rng(11);
+    int x = Res.Width / 2, y = Res.Height / 2;
+    size_t presented = 0, rects = 0;
+    double damageMs = 0;
+
+    for (int frame = 0; frame < frames; frame++) {
+        for (int i = 0; i < segmentsPerFrame; i++) {
+            int nx = std::clamp(x + (int)(rng() % 41) - 20, 0, Res.Width - 1);
+            int ny = std::clamp(y + (int)(rng() % 41) - 20, 0, Res.Height - 1);
+            DrawLine(canvas, x, y, nx, ny, frame, 10, ROUND_BRUSH);
+            x = nx;
+            y = ny;
+        }
+        double start = NowMs();
+        std::vector<PixelRect> frameRects = TakeDamage(damage);
+        damageMs += NowMs() - start;
+        for (const PixelRect& rect : frameRects) {
+            presented += (size_t)(rect.X1 - rect.X0) * (rect.Y1 - rect.Y0);
+        }
+        rects += frameRects.size();
+    }
+
+    // Cost of the bookkeeping itself, spans reported straight to the tracker.
+    const int adds = 1 << 20;
+    double addStart = NowMs();
+    for (int i = 0; i < adds; i++) {
+        int ay = (i * 7) % Res.Height;
+        AddDamage(damage, { 100 + (i & 31), ay, 140 + (i & 31), ay + 1 });
+        if ((i & 1023) == 1023) {
+            TakeDamage(damage);
+        }
+    }
+    double addMs = NowMs() - addStart;
+
+    size_t full = (size_t)Res.Width * Res.Height * frames;
+    printf("damage  %-5s presented %6.3f%% of full frames  %5.2f rects/frame  take %6.2f us/frame  add %5.1f ns\n",
+        Res.Name, 100.0 * presented / full, (double)rects / frames, damageMs * 1e3 / frames, addMs * 1e6 / adds);
+}
+
+// Startup, clear and memory cost of the tiled canvas against one linear
+// allocation, up to a 16K canvas that is mostly left empty.
+static void BenchCanvas() {
+    const Resolution sizes[] = {
+        { "1080p", 1920, 1080 },
+        { "4K", 3840, 2160 },
+        { "8K", 7680, 4320 },
+        { "16K", 16384, 16384 },
+    };
+    for (const Resolution& res : sizes) {
+        size_t linearBytes = (size_t)res.Width * res.Height * sizeof(u32);
+        double start = NowMs();
+        {
+            std::vector<u32> pixels((size_t)res.Width * res.Height, 0x222222);
+            Framebuffer framebuffer = { pixels.data(), res.Width, res.Height };
+            double clearStart = NowMs();
+            LegacyClearScreen(framebuffer, 0xffffff);
+            double clearMs = NowMs() - clearStart;
+            printf("canvas  %-6s linear  startup %8.2f ms  clear %8.3f ms  %11zu B\n", res.Name, clearStart - start, clearMs, linearBytes);
+        }
+
+        start = NowMs();
+        Canvas canvas;
+        InitCanvas(canvas, res.Width, res.Height, 0x222222);
+        double initMs = NowMs() - start;
+        start = NowMs();
+        ClearScreen(canvas, 0xffffff);
+        double clearMs = NowMs() - start;
+        size_t emptyBytes = CanvasBytes(canvas);
+
+        // A sketch in one corner: 200 strokes inside a 2048x2048 area.
+        std::mt19937 rng(3);
+        for (int i = 0; i < 200; i++) {
+            int x = rng() % 2048, y = rng() % 2048;
+            DrawLine(canvas, x, y, x + (int)(rng() % 201) - 100, y + (int)(rng() % 201) - 100, 0, 8, ROUND_BRUSH);
+        }
+        size_t paintedBytes = CanvasBytes(canvas);
+        printf("canvas  %-6s tiled   startup %8.2f ms  clear %8.3f ms  %11zu B empty, %11zu B after sketch (%.2f%%)\n",
+            res.Name, initMs, clearMs, emptyBytes, paintedBytes, 100.0 * paintedBytes / linearBytes);
+    }
+}
+
+// The flips as they were on the linear framebuffer: a triple swap through a
+// temporary, the vertical one walking columns.
+static void LegacyFlipHorizontal(Framebuffer& Target) {
+    u32* pixels = Target.Pixels;
+    std::vector<u32> tempRow(Target.Width);
+    for (int y = 0; y < Target.Height; ++y) {
+        int left = 0;
+        int right = Target.Width - 1;
+        while (left < right) {
+            std::swap(tempRow[left], pixels[y * Target.Width + left]);
+            std::swap(pixels[y * Target.Width + left], pixels[y * Target.Width + right]);
+            std::swap(tempRow[left], pixels[y * Target.Width + right]);
+            ++left;
+            --right;
+        }
+    }
+}
+
+static void LegacyFlipVertical(Framebuffer& Target) {
+    u32* pixels = Target.Pixels;
+    std::vector<u32> tempColumn(Target.Height);
+    for (int x = 0; x < Target.Width; ++x) {
+        int top = 0;
+        int bottom = Target.Height - 1;
+        while (top < bottom) {
+            std::swap(tempColumn[top], pixels[top * Target.Width + x]);
+            std::swap(pixels[top * Target.Width + x], pixels[bottom * Target.Width + x]);
+            std::swap(tempColumn[top], pixels[bottom * Target.Width + x]);
+            ++top;
+            --bottom;
+        }
+    }
+}
+
+static void BenchTransforms(const Resolution& Res) {
+    std::vector<u32> pixels((size_t)Res.Width * Res.Height);
+    std::mt19937 rng(5);
+    for (u32& pixel : pixels) {
+        pixel = rng();
+    }
+    Framebuffer framebuffer = { pixels.data(), Res.Width, Res.Height };
+    double megapixels = (double)Res.Width * Res.Height / 1e6;
+    const int repeats = 4;
+
+    double horizontalMs = MeasureMs(repeats, [&](int) { LegacyFlipHorizontal(framebuffer); });
+    double verticalMs = MeasureMs(repeats, [&](int) { LegacyFlipVertical(framebuffer); });
+    printf("xform   %-6s legacy  flip-h %8.1f Mpix/s  flip-v %8.1f Mpix/s\n", Res.Name, megapixels / horizontalMs * 1e3, megapixels / verticalMs * 1e3);
+
+    // Every tile holds noise, so nothing can be shared as a uniform tile.
+    static const char* names[] = { "flip-h", "flip-v", "rot-90", "rot-180", "rot-270", "transpose" };
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0);
+    LoadCanvasPixels(canvas, pixels.data(), Res.Width);
+    printf("xform   %-6s tiles  ", Res.Name);
+    for (int transform = TRANSFORM_FLIP_HORIZONTAL; transform <= TRANSFORM_TRANSPOSE; transform++) {
+        double ms = MeasureMs(repeats, [&](int) { TransformCanvas(canvas, (CanvasTransform)transform); });
+        printf(" %s %8.1f", names[transform], megapixels / ms * 1e3);
+    }
+    printf(" Mpix/s (%d workers)\n", WorkerCount());
+}
+
+// Growing a two-layer canvas of noise by 256x144 pixels and shrinking it back,
+// each resize an undo step followed by the composite update, against copying
+// the image into a larger buffer. Then growing the window's framebuffer by
+// committing reserved pages against reallocating it.
+static void BenchResize(const Resolution& Res) {
+    int grownWidth = Res.Width + 256, grownHeight = Res.Height + 144;
+    std::vector<u32> pixels((size_t)Res.Width * Res.Height);
+    std::mt19937 rng(41);
+    for (u32& pixel : pixels) {
+        pixel = rng();
+    }
+    LayerStack stack;
+    InitLayerStack(stack, Res.Width, Res.Height, 0x222222, DEFAULT_HISTORY_BUDGET);
+    LoadCanvasPixels(ActiveLayer(stack).Pixels, pixels.data(), Res.Width);
+    AddLayer(stack);
+    LoadCanvasPixels(ActiveLayer(stack).Pixels, pixels.data(), Res.Width);
+    SaveLayerState(stack);
+    UpdateComposite(stack);
+
+    const int repeats = 8;
+    double resizeMs = MeasureMs(repeats, [&](int Repeat) {
+        bool isGrowing = Repeat % 2 == 0;
+        ResizeLayers(stack, isGrowing ? grownWidth : Res.Width, isGrowing ? grownHeight : Res.Height);
+        SaveLayerState(stack);
+        UpdateComposite(stack);
+    });
+    double copyMs = MeasureMs(repeats, [&](int) {
+        std::vector<u32> grown((size_t)grownWidth * grownHeight, 0x222222);
+        for (int y = 0; y < Res.Height; y++) {
+            memcpy(&grown[(size_t)y * grownWidth], &pixels[(size_t)y * Res.Width], Res.Width * sizeof(u32));
+        }
+    });
+
+    // Only the growing is timed; the old frame is written first, as it
+    // would have been presented.
+    size_t bytes = (size_t)Res.Width * Res.Height * sizeof(u32);
+    size_t grownBytes = (size_t)grownWidth * grownHeight * sizeof(u32);
+    double commitMs = 0, reallocMs = 0;
+    for (int i = 0; i < repeats; i++) {
+        ReservedMemory memory;
+        ReserveMemory(memory, grownBytes);
+        CommitMemory(memory, bytes);
+        memset(memory.Data, 1, bytes);
+        double start = NowMs();
+        CommitMemory(memory, grownBytes);
+        commitMs += NowMs() - start;
+        ReleaseMemory(memory);
+
+        std::vector<uint8_t> frame(bytes, 1);
+        start = NowMs();
+        std::vector<uint8_t> grown(grownBytes);
+        memcpy(grown.data(), frame.data(), bytes);
+        reallocMs += NowMs() - start;
+    }
+    printf("resize  %-6s +256x144 layers %7.3f ms (copy %7.2f ms, %6.1fx) | framebuffer commit %6.3f ms (realloc %6.2f ms)\n",
+        Res.Name, resizeMs, copyMs, copyMs / resizeMs, commitMs / repeats, reallocMs / repeats);
+}
+
+// The rainbow pencil's colour before the hue table, in the COLORREF byte order
+// it returned.
+static u32 LegacyHSVToRGB(float Hue, float Saturation, float Value) {
+    int hi = (int)(Hue * 6.0f) % 6;
+    float f = Hue * 6.0f - hi;
+    float p = Value * (1.0f - Saturation);
+    float q = Value * (1.0f - f * Saturation);
+    float t = Value * (1.0f - (1.0f - f) * Saturation);
+    auto rgb = [](float R, float G, float B) {
+        return (u32)(uint8_t)(R * 255) | (u32)(uint8_t)(G * 255) << 8 | (u32)(uint8_t)(B * 255) << 16;
+    };
+    switch (hi) {
+    case 0:
+        return rgb(Value, t, p);
+    case 1:
+        return rgb(q, Value, p);
+    case 2:
+        return rgb(p, Value, t);
+    case 3:
+        return rgb(p, q, Value);
+    case 4:
+        return rgb(t, p, Value);
+    default:
+        return rgb(Value, p, q);
+    }
+}
+
+// A gradient as a straightforward per-pixel float loop would draw it into a
+// linear framebuffer, for comparison.
+static void LegacyLinearGradient(Framebuffer& Target, int X0, int Y0, int X1, int Y1, u32 From, u32 To) {
+    float dx = (float)(X1 - X0), dy = (float)(Y1 - Y0);
+    float length2 = dx * dx + dy * dy;
+    for (int y = 0; y < Target.Height; y++) {
+        for (int x = 0; x < Target.Width; x++) {
+            float t = std::clamp(((x - X0) * dx + (y - Y0) * dy) / length2, 0.0f, 1.0f);
+            u32 pixel = 0;
+            for (int shift = 0; shift < 24; shift += 8) {
+                float from = (float)((From >> shift) & 0xff), to = (float)((To >> shift) & 0xff);
+                pixel |= (u32)(from + (to - from) * t + 0.5f) << shift;
+            }
+            Target.Pixels[(size_t)y * Target.Width + x] = pixel;
+        }
+    }
+}
+
+static void BenchGradient(const Resolution& Res) {
+    const int hues = 1 << 20;
+    const float step = 1.0f / hues;
+    volatile u32 sink = 0;
+    double hsvMs = MeasureMs(1, [&](int) {
+        u32 sum = 0;
+        for (int i = 0; i < hues; i++) {
+            sum += LegacyHSVToRGB(i * step, 1.0f, 1.0f);
+        }
+        sink = sum;
+    });
+    double tableMs = MeasureMs(1, [&](int) {
+        u32 sum = 0;
+        for (int i = 0; i < hues; i++) {
+            sum += HueColor(i * step);
+        }
+        sink = sum;
+    });
+    printf("hue     float HSV %6.2f ns  table %6.2f ns  %5.1fx\n", hsvMs * 1e6 / hues, tableMs * 1e6 / hues, hsvMs / tableMs);
+
+    std::vector<u32> pixels((size_t)Res.Width * Res.Height);
+    Framebuffer framebuffer = { pixels.data(), Res.Width, Res.Height };
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0);
+    const int repeats = 10;
+    // Corner to corner, so every tile is interpolated, and a radius that
+    // reaches past the edges.
+    GradientFill linear = { GRADIENT_LINEAR, 0, 0, Res.Width, Res.Height, 0x102040, 0x183050 };
+    GradientFill radial = { GRADIENT_RADIAL, Res.Width / 2, Res.Height / 2, Res.Width, Res.Height, 0xff8000, 0x0040c0 };
+    double legacyMs = MeasureMs(repeats, [&](int) { LegacyLinearGradient(framebuffer, 0, 0, Res.Width, Res.Height, linear.From, linear.To); });
+    printf("gradient %-6s %-7s linear %7.2f ms\n", Res.Name, "legacy", legacyMs);
+
+    SpanKernel best = GetSpanKernel();
+    for (int kernel = SPAN_KERNEL_SCALAR; kernel <= best; kernel++) {
+        SetSpanKernel((SpanKernel)kernel);
+        double ms[2][2];
+        for (int dither = 0; dither < 2; dither++) {
+            linear.Dither = radial.Dither = dither;
+            ms[0][dither] = MeasureMs(repeats, [&](int) { FillGradient(canvas, linear); });
+            ms[1][dither] = MeasureMs(repeats, [&](int) { FillGradient(canvas, radial); });
+        }
+        printf("gradient %-6s %-7s linear %7.2f ms  dithered %7.2f ms | radial %7.2f ms  dithered %7.2f ms  (%4.1fx legacy linear)\n",
+            Res.Name, SpanKernelName((SpanKernel)kernel), ms[0][0], ms[0][1], ms[1][0], ms[1][1], legacyMs / ms[0][0]);
+    }
+    SetSpanKernel(best);
+}
+
+// The same drawing with no selection and under three: a rectangle over the
+// whole canvas, all solid rows, which is the bare cost of clipping; an
+// ellipse; and a magic wand selection full of holes, scanned bit by bit. The
+// last two also leave part of the drawing out.
+static void BenchSelection(const Resolution& Res) {
+    Canvas base;
+    InitCanvas(base, Res.Width, Res.Height, 0x404040);
+    // Specks on every third row, for the wand to select around.
+    for (int y = 0; y < Res.Height; y += 3) {
+        for (int x = y % 37; x < Res.Width; x += 37) {
+            DrawPixel(base, x, y, 0x404041);
+        }
+    }
+    FillTolerance exact = { TOLERANCE_EXACT, 0 };
+    struct MaskCase {
+        const char* Name;
+        std::shared_ptr<const SelectionMask> Mask;
+    };
+    const MaskCase masks[] = {
+        { "none", nullptr },
+        { "rect", std::make_shared<const SelectionMask>(SelectRectangle(Res.Width, Res.Height, CanvasBounds(base))) },
+        { "ellipse", std::make_shared<const SelectionMask>(SelectEllipse(Res.Width, Res.Height, Res.Width / 8, Res.Height / 8, Res.Width * 3 / 4, Res.Height * 3 / 4)) },
+        { "wand", std::make_shared<const SelectionMask>(SelectSimilar(base, 1, 1, exact)) },
+    };
+
+    const int segments = 64;
+    std::mt19937 rng(22);
+    std::vector<int> coords(segments * 4);
+    for (int i = 0; i < segments; i++) {
+        coords[i * 4 + 0] = 100 + rng() % (Res.Width - 200);
+        coords[i * 4 + 1] = 100 + rng() % (Res.Height - 200);
+        coords[i * 4 + 2] = coords[i * 4 + 0] + (int)(rng() % 201) - 100;
+        coords[i * 4 + 3] = coords[i * 4 + 1] + (int)(rng() % 201) - 100;
+    }
+    struct PrimitiveCase {
+        const char* Name;
+        std::function<void(Canvas&, u32)> Draw;
+    };
+    const PrimitiveCase primitives[] = {
+        { "lines-10", [&](Canvas& Target, u32 Color) {
+            for (int i = 0; i < segments; i++) {
+                const int* c = &coords[i * 4];
+                DrawLine(Target, c[0], c[1], c[2], c[3], Color, 10, ROUND_BRUSH);
+            }
+        } },
+        { "lines-10-aa", [&](Canvas& Target, u32 Color) {
+            for (int i = 0; i < segments; i++) {
+                const int* c = &coords[i * 4];
+                DrawLineAA(Target, c[0], c[1], c[2], c[3], Color, 10, ROUND_BRUSH);
+            }
+        } },
+        { "filled-rect", [&](Canvas& Target, u32 Color) { DrawRectangle(Target, Res.Width / 8, Res.Height / 8, Res.Width * 3 / 4, Res.Height * 3 / 4, Color, 1, true); } },
+        { "filled-circle", [&](Canvas& Target, u32 Color) { DrawCircle(Target, Res.Width / 2, Res.Height / 2, Res.Height / 2 - 1, Color, 1, true); } },
+        { "flood-fill", [&](Canvas& Target, u32 Color) { FloodFill(Target, 1, 1, Color, exact); } },
+        { "gradient", [&](Canvas& Target, u32 Color) { FillGradient(Target, { GRADIENT_LINEAR, 0, 0, Res.Width, Res.Height, Color, 0x0000ff }); } },
+    };
+
+    // Each run starts from the same pixels, put back outside the timing.
+    const int repeats = 5;
+    Canvas canvas = base;
+    for (const PrimitiveCase& primitive : primitives) {
+        double ms[4];
+        for (int m = 0; m < 4; m++) {
+            canvas.Selection = masks[m].Mask;
+            double total = 0;
+            for (int r = 0; r < repeats; r++) {
+                canvas.Tiles = base.Tiles;
+                double start = NowMs();
+                primitive.Draw(canvas, 0xff0000 + r);
+                total += NowMs() - start;
+            }
+            ms[m] = total / repeats;
+        }
+        printf("select  %-6s %-13s none %8.2f ms", Res.Name, primitive.Name, ms[0]);
+        for (int m = 1; m < 4; m++) {
+            printf(" | %-7s %8.2f ms %+6.1f%%", masks[m].Name, ms[m], (ms[m] / ms[0] - 1) * 100);
+        }
+        printf("\n");
+    }
+}
+
+// What the window showed before there was a pyramid to read: every canvas
+// pixel averaged into its block, for every frame.
+static void LegacyZoomOut(const Canvas& Source, int Shift, u32* Dest, size_t DestStride) {
+    int block = 1 << Shift;
+    int width = Source.Width >> Shift;
+    std::vector<u32> row(Source.Width);
+    std::vector<uint32_t> sums((size_t)width * 4);
+    for (int y = 0; y < Source.Height >> Shift; y++) {
+        std::fill(sums.begin(), sums.end(), 0);
+        for (int sy = y * block; sy < (y + 1) * block; sy++) {
+            ReadCanvasSpan(Source, sy, 0, Source.Width, row.data());
+            for (int x = 0; x < width * block; x++) {
+                u32 pixel = row[x];
+                uint32_t* sum = &sums[(size_t)(x >> Shift) * 4];
+                sum[0] += pixel & 0xff;
+                sum[1] += pixel >> 8 & 0xff;
+                sum[2] += pixel >> 16 & 0xff;
+                sum[3] += pixel >> 24;
+            }
+        }
+        int area = block * block;
+        for (int x = 0; x < width; x++) {
+            const uint32_t* sum = &sums[(size_t)x * 4];
+            Dest[(size_t)y * DestStride + x] = (sum[0] + area / 2) / area | (sum[1] + area / 2) / area << 8 | (sum[2] + area / 2) / area << 16 | (sum[3] + area / 2) / area << 24;
+        }
+    }
+}
+
+// A 16K canvas with no uniform tiles in a 1080p window, zoomed all the way
+// out: a frame from the pyramid against averaging the canvas down each time,
+// and what keeping the pyramid up to date costs as it is drawn on.
+static void BenchViewport() {
+    const Resolution res = { "16K", 15360, 8640 };
+    const int windowWidth = 1920, windowHeight = 1080;
+    PixelRect window = { 0, 0, windowWidth, windowHeight };
+    std::vector<u32> screen((size_t)windowWidth * windowHeight);
+    Canvas canvas;
+    InitCanvas(canvas, res.Width, res.Height, 0);
+    GradientFill gradient = { GRADIENT_RADIAL, res.Width / 2, res.Height / 2, 0, 0, 0xff8000, 0x0040c0, true };
+    FillGradient(canvas, gradient);
+
+    double legacyMs = MeasureMs(2, [&](int) { LegacyZoomOut(canvas, -MIN_ZOOM, screen.data(), windowWidth); });
+    SpanKernel best = GetSpanKernel();
+    for (int kernel = SPAN_KERNEL_SCALAR; kernel <= best; kernel++) {
+        SetSpanKernel((SpanKernel)kernel);
+        double buildMs = MeasureMs(2, [&](int) {
+            MipPyramid mips;
+            UpdateMipPyramid(mips, canvas, MIP_LEVELS);
+        });
+        printf("viewport %-5s %-7s pyramid built %8.2f ms\n", res.Name, SpanKernelName((SpanKernel)kernel), buildMs);
+    }
+    SetSpanKernel(best);
+
+    MipPyramid mips;
+    UpdateMipPyramid(mips, canvas, MIP_LEVELS);
+    Viewport view = { MIN_ZOOM, 0, 0 };
+    double presentMs = MeasureMs(20, [&](int) { PresentViewport(view, canvas, mips, window, screen.data(), windowWidth, 0); });
+    printf("viewport %-5s 1/16x  rescaled each frame %8.2f ms | from the pyramid %6.3f ms (%.0fx)\n", res.Name, legacyMs, presentMs, legacyMs / presentMs);
+
+    // Strokes as the mouse draws them, each followed by the frame showing it.
+    DamageTracker damage;
+    InitDamageTracker(damage, res.Width, res.Height);
+    canvas.Damage = &damage;
+    const int segments = 256;
+    std::mt19937 rng(23);
+    int x = res.Width / 2, y = res.Height / 2;
+    double strokeMs = MeasureMs(segments, [&](int i) {
+        int nextX = std::clamp(x + (int)(rng() % 61) - 30, 0, res.Width - 1);
+        int nextY = std::clamp(y + (int)(rng() % 61) - 30, 0, res.Height - 1);
+        DrawLine(canvas, x, y, nextX, nextY, i, 10, ROUND_BRUSH);
+        MarkMipsStale(mips, TakeDamage(damage));
+        UpdateMipPyramid(mips, canvas, MIP_LEVELS);
+        PresentViewport(view, canvas, mips, window, screen.data(), windowWidth, 0);
+        x = nextX;
+        y = nextY;
+    });
+    // An edit of the whole canvas leaves every tile of the pyramid to redo.
+    gradient.Shape = GRADIENT_LINEAR;
+    FillGradient(canvas, gradient);
+    double start = NowMs();
+    MarkMipsStale(mips, TakeDamage(damage));
+    UpdateMipPyramid(mips, canvas, MIP_LEVELS);
+    double wholeMs = NowMs() - start;
+    canvas.Damage = nullptr;
+    printf("viewport %-5s 1/16x  frame after a stroke segment %6.3f ms | pyramid update after a whole-canvas gradient %7.2f ms\n",
+        res.Name, strokeMs, wholeMs);
+
+    const int zooms[] = { 0, MAX_ZOOM };
+    for (int zoom : zooms) {
+        view = { zoom, -res.Width / 3, -res.Height / 3 };
+        double ms = MeasureMs(20, [&](int) { PresentViewport(view, canvas, mips, window, screen.data(), windowWidth, 0); });
+        printf("viewport %-5s %2dx    frame %6.3f ms\n", res.Name, 1 << zoom, ms);
+    }
+}
+
+// What a blur cost before running sums: every pixel adds up its whole
+// window, along rows and then down columns.
+static void LegacyBoxBlur(Framebuffer& Target, int Radius) {
+    std::vector<u32> rows((size_t)Target.Width * Target.Height);
+    float scale = 1.0f / (2 * Radius + 1);
+    for (int pass = 0; pass < 2; pass++) {
+        const u32* source = pass == 0 ? Target.Pixels : rows.data();
+        u32* dest = pass == 0 ? rows.data() : Target.Pixels;
+        for (int y = 0; y < Target.Height; y++) {
+            for (int x = 0; x < Target.Width; x++) {
+                int sums[4] = {};
+                for (int k = -Radius; k <= Radius; k++) {
+                    int sx = pass == 0 ? std::clamp(x + k, 0, Target.Width - 1) : x;
+                    int sy = pass == 1 ? std::clamp(y + k, 0, Target.Height - 1) : y;
+                    u32 pixel = source[(size_t)sy * Target.Width + sx];
+                    for (int c = 0; c < 4; c++) {
+                        sums[c] += pixel >> c * 8 & 0xff;
+                    }
+                }
+                u32 mean = 0;
+                for (int c = 0; c < 4; c++) {
+                    mean |= (u32)lrintf(sums[c] * scale) << c * 8;
+                }
+                dest[(size_t)y * Target.Width + x] = mean;
+            }
+        }
+    }
+}
+
+// Every filter over a whole canvas of noise, so no tile is uniform, per
+// kernel. Each run starts from the same canvas, sharing its tiles, so the
+// copy on first write is counted as it would be under the undo history.
+static void BenchFilters(const Resolution& Res) {
+    std::vector<u32> noise((size_t)Res.Width * Res.Height);
+    std::mt19937 rng(29);
+    for (u32& pixel : noise) {
+        pixel = rng() & 0xffffff;
+    }
+    Canvas source;
+    InitCanvas(source, Res.Width, Res.Height, 0);
+    LoadCanvasPixels(source, noise.data(), Res.Width);
+    double megapixels = (double)Res.Width * Res.Height / 1e6;
+
+    struct FilterCase {
+        const char* Name;
+        ImageFilter Filter;
+    };
+    const FilterCase cases[] = {
+        { "box r2", { FILTER_BOX_BLUR, 2 } },
+        { "box r8", { FILTER_BOX_BLUR, 8 } },
+        { "box r32", { FILTER_BOX_BLUR, 32 } },
+        { "box r128", { FILTER_BOX_BLUR, 128 } },
+        { "gaussian r2", { FILTER_GAUSSIAN_BLUR, 2 } },
+        { "gaussian r8", { FILTER_GAUSSIAN_BLUR, 8 } },
+        { "gaussian r32", { FILTER_GAUSSIAN_BLUR, 32 } },
+        { "unsharp r4", { FILTER_UNSHARP_MASK, 4, 150 } },
+        { "invert", { FILTER_INVERT } },
+        { "bright/contrast", { FILTER_BRIGHTNESS_CONTRAST, 0, 0, 20, 130 } },
+        { "threshold", { FILTER_THRESHOLD } },
+    };
+    const int repeats = 3;
+    SpanKernel best = GetSpanKernel();
+    for (const FilterCase& test : cases) {
+        printf("filter  %-6s %-15s", Res.Name, test.Name);
+        // The old way only for small radii; it grows with the radius.
+        if (test.Filter.Kind == FILTER_BOX_BLUR && test.Filter.Radius <= 8) {
+            std::vector<u32> pixels = noise;
+            Framebuffer framebuffer = { pixels.data(), Res.Width, Res.Height };
+            printf(" legacy %8.2f ms |", MeasureMs(1, [&](int) { LegacyBoxBlur(framebuffer, test.Filter.Radius); }));
+        }
+        else {
+            printf("                    |");
+        }
+        double bestMs = 0;
+        for (int kernel = SPAN_KERNEL_SCALAR; kernel <= best; kernel++) {
+            SetSpanKernel((SpanKernel)kernel);
+            bestMs = MeasureMs(repeats, [&](int) {
+                Canvas canvas = source;
+                ApplyFilter(canvas, test.Filter, CanvasBounds(canvas));
+            });
+            printf(" %s %8.2f ms", SpanKernelName((SpanKernel)kernel), bestMs);
+        }
+        printf("  %7.1f Mpix/s\n", megapixels / bestMs * 1e3);
+    }
+    SetSpanKernel(best);
+}
+
+// Dragging a floating 2000x2000 region about a 4K canvas: every frame puts
+// back the tiles the last one covered and resamples the region at its new
+// place. Three drags of 60 frames each move it, turn it and grow it; the
+// worst frame counts, since that is the one that misses the display.
+static void BenchFloatingRegion(const Resolution& Res) {
+    std::vector<u32> noise((size_t)Res.Width * Res.Height);
+    std::mt19937 rng(31);
+    for (u32& pixel : noise) {
+        pixel = rng() & 0xffffff;
+    }
+    Canvas source;
+    InitCanvas(source, Res.Width, Res.Height, 0);
+    LoadCanvasPixels(source, noise.data(), Res.Width);
+    const int size = 2000;
+    PixelRect rect = { (Res.Width - size) / 2, (Res.Height - size) / 2, (Res.Width + size) / 2, (Res.Height + size) / 2 };
+
+    struct DragCase {
+        const char* Name;
+        std::function<RegionPlacement(const RegionPlacement&, int)> Move;
+    };
+    const DragCase drags[] = {
+        { "move", [](const RegionPlacement& Start, int Frame) { RegionPlacement p = Start; p.CenterX += Frame * 3.0f; p.CenterY += Frame * 1.5f; return p; } },
+        { "rotate", [](const RegionPlacement& Start, int Frame) { RegionPlacement p = Start; p.Angle = Frame * 0.01f; return p; } },
+        { "scale", [](const RegionPlacement& Start, int Frame) { RegionPlacement p = Start; p.ScaleX = p.ScaleY = 1 + Frame * 0.005f; return p; } },
+    };
+    const char* filterNames[] = { "nearest", "bilinear", "lanczos" };
+    const int frames = 60;
+    SpanKernel best = GetSpanKernel();
+    for (int filter = RESAMPLE_NEAREST; filter <= RESAMPLE_LANCZOS; filter++) {
+        for (const DragCase& drag : drags) {
+            printf("float   %-6s %-8s %-7s", Res.Name, filterNames[filter], drag.Name);
+            for (int kernel = SPAN_KERNEL_SCALAR; kernel <= best; kernel++) {
+                SetSpanKernel((SpanKernel)kernel);
+                Canvas canvas = source;
+                FloatingRegion region;
+                LiftRegion(region, canvas, rect, 0);
+                RegionPlacement start = region.Placement;
+                double totalMs = 0;
+                double worstMs = 0;
+                for (int frame = 1; frame <= frames; frame++) {
+                    double begin = NowMs();
+                    PlaceRegion(region, canvas, drag.Move(start, frame), (ResampleFilter)filter);
+                    double ms = NowMs() - begin;
+                    totalMs += ms;
+                    worstMs = std::max(worstMs, ms);
+                }
+                printf(" %s %6.2f ms (worst %6.2f)", SpanKernelName((SpanKernel)kernel), totalMs / frames, worstMs);
+            }
+            printf("\n");
+        }
+    }
+    SetSpanKernel(best);
+}
+
+// Thumbnail jobs as a server would run them: 256 scripts of 200 random
+// operations on 256x256 canvases, each parsed from the binary form and
+// rendered, on one thread and then one job per worker. Files are left out.
+static void BenchScripts() {
+    const int jobs = 256;
+    std::vector<std::vector<uint8_t>> encoded(jobs);
+    size_t bytes = 0;
+    for (int i = 0; i < jobs; i++) {
+        std::mt19937 rng(100 + i);
+        DrawingScript script;
+        script.Width = 256;
+        script.Height = 256;
+        script.Background = 0xffffff;
+        for (int j = 0; j < 200; j++) {
+            script.Ops.push_back(RandomRasterOp(rng, script.Width, script.Height));
+        }
+        encoded[i] = EncodeScript(script);
+        bytes += encoded[i].size();
+    }
+    auto render = [&](int Job) {
+        DrawingScript script;
+        std::string error;
+        ParseScript(encoded[Job].data(), encoded[Job].size(), script, error);
+        Canvas canvas;
+        RenderScript(script, canvas);
+    };
+
+    double parseMs = MeasureMs(3, [&](int) {
+        DrawingScript script;
+        std::string error;
+        for (const auto& data : encoded) {
+            ParseScript(data.data(), data.size(), script, error);
+        }
+    });
+    SetWorkerLimit(1);
+    double serialMs = MeasureMs(3, [&](int) {
+        for (int i = 0; i < jobs; i++) {
+            render(i);
+        }
+    });
+    SetWorkerLimit(0);
+    double parallelMs = MeasureMs(3, [&](int) { ParallelFor(jobs, render); });
+    printf("script  256x256 x %d  %.1f bytes/op, parse %.1f MB/s | 1 thread %7.1f jobs/s | %d threads %7.1f jobs/s\n", jobs,
+        (double)bytes / (jobs * 200), bytes / parseMs / 1e3, jobs / serialMs * 1e3, WorkerCount(), jobs / parallelMs * 1e3);
+}
+
+// SaveImage as it was: the headers, then one 4-byte write per pixel.
+static bool LegacySaveImage(const Framebuffer& Source, const std::filesystem::path& Path) {
+    uint8_t header[54] = { 'B', 'M' };
+    std::ofstream file(Path, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    file.write((const char*)header, sizeof(header));
+    for (int y = 0; y < Source.Height; y++) {
+        for (int x = 0; x < Source.Width; x++) {
+            const u32* pixel = Source.Pixels + (Source.Height - 1 - y) * Source.Width + x;
+            file.write((const char*)pixel, sizeof(u32));
+        }
+    }
+    file.close();
+    return true;
+}
+
+static void BenchExport(const Resolution& Res) {
+    std::vector<u32> pixels((size_t)Res.Width * Res.Height);
+    std::mt19937 rng(9);
+    for (u32& pixel : pixels) {
+        pixel = rng();
+    }
+    Framebuffer framebuffer = { pixels.data(), Res.Width, Res.Height };
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0);
+    LoadCanvasPixels(canvas, pixels.data(), Res.Width);
+
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "paint_bench_export.bmp";
+    double legacyMs = MeasureMs(1, [&](int) { LegacySaveImage(framebuffer, path); });
+    size_t legacyBytes = std::filesystem::file_size(path);
+    double ms32 = MeasureMs(3, [&](int) { WriteBmp(canvas, path, BMP_32_BIT); });
+    size_t bytes32 = std::filesystem::file_size(path);
+    double ms24 = MeasureMs(3, [&](int) { WriteBmp(canvas, path, BMP_24_BIT); });
+    size_t bytes24 = std::filesystem::file_size(path);
+    std::filesystem::remove(path);
+
+    printf("export  %-6s legacy %8.1f ms %7.1f MB/s | 32-bit %7.1f ms %7.1f MB/s | 24-bit %7.1f ms %7.1f MB/s (%.0f%% of the 32-bit size)\n",
+        Res.Name, legacyMs, legacyBytes / 1e3 / legacyMs, ms32, bytes32 / 1e3 / ms32, ms24, bytes24 / 1e3 / ms24, 100.0 * bytes24 / bytes32);
+}
+
+// Reads the whole file through a stream and converts it a pixel at a time
+// into a linear buffer, as a straightforward loader would.
+static bool StreamLoadBmp(const std::filesystem::path& Path, std::vector<u32>& Pixels) {
+    std::ifstream file(Path, std::ios::in | std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    uint8_t header[54];
+    file.read((char*)header, sizeof(header));
+    int width = *(int32_t*)(header + 18);
+    int height = *(int32_t*)(header + 22);
+    int bits = *(uint16_t*)(header + 28);
+    int bytesPerPixel = bits / 8;
+    size_t stride = ((size_t)width * bytesPerPixel + 3) & ~(size_t)3;
+    file.seekg(*(uint32_t*)(header + 10));
+    Pixels.resize((size_t)width * height);
+    std::vector<uint8_t> row(stride);
+    for (int y = 0; y < height; y++) {
+        file.read((char*)row.data(), stride);
+        u32* out = &Pixels[(size_t)(height - 1 - y) * width];
+        for (int x = 0; x < width; x++) {
+            const uint8_t* pixel = &row[(size_t)x * bytesPerPixel];
+            out[x] = pixel[0] | (pixel[1] << 8) | (pixel[2] << 16);
+        }
+    }
+    return (bool)file;
+}
+
+static void BenchLoad(const Resolution& Res) {
+    std::vector<u32> pixels((size_t)Res.Width * Res.Height);
+    std::mt19937 rng(10);
+    for (u32& pixel : pixels) {
+        pixel = rng() & 0xFFFFFF;
+    }
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0);
+    LoadCanvasPixels(canvas, pixels.data(), Res.Width);
+
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "paint_bench_load.bmp";
+    for (BmpFormat format : { BMP_32_BIT, BMP_24_BIT }) {
+        WriteBmp(canvas, path, format);
+        size_t bytes = std::filesystem::file_size(path);
+        std::vector<u32> streamed;
+        double streamMs = MeasureMs(3, [&](int) { StreamLoadBmp(path, streamed); });
+        Canvas loaded;
+        InitCanvas(loaded, 1, 1, 0);
+        double mappedMs = MeasureMs(3, [&](int) { LoadBmp(loaded, path); });
+        printf("load    %-6s %s stream %7.1f ms %7.1f MB/s | mapped %7.1f ms %7.1f MB/s (%.1fx)\n",
+            Res.Name, format == BMP_32_BIT ? "32-bit" : "24-bit", streamMs, bytes / 1e3 / streamMs, mappedMs, bytes / 1e3 / mappedMs, streamMs / mappedMs);
+    }
+    std::filesystem::remove(path);
+}
+
+// Throughput of the parallel paths with the worker pool capped at 1 .. N
+// threads. The canvas is reloaded with noise before every operation so no
+// tile starts out uniform.
+static void BenchScaling(const Resolution& Res) {
+    std::vector<u32> noise((size_t)Res.Width * Res.Height);
+    std::mt19937 rng(13);
+    for (u32& pixel : noise) {
+        pixel = rng() & 0xffffff;
+    }
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0);
+    double megapixels = (double)Res.Width * Res.Height / 1e6;
+    int radius = Res.Height / 2 - 1;
+
+    struct ScalingCase {
+        const char* Name;
+        double Megapixels;
+        std::function<void(int)> Run;
+    };
+    const ScalingCase cases[] = {
+        { "filled-rect", megapixels * 0.81, [&](int i) { FillRect(canvas, Res.Width / 20 + 3, Res.Height / 20 + 3, Res.Width * 19 / 20 - 3, Res.Height * 19 / 20 - 3, i); } },
+        { "filled-circle", 3.14159 * radius * radius / 1e6, [&](int i) { DrawCircle(canvas, Res.Width / 2, Res.Height / 2, radius, i, 1, true); } },
+        { "stroke-50", 50.0 * Res.Height * 1.4 / 1e6, [&](int i) { DrawLine(canvas, 100, 100, Res.Width - 100, Res.Height - 100, i, 50, ROUND_BRUSH); } },
+        { "clear", megapixels, [&](int i) { ClearScreen(canvas, i); } },
+        { "flood-fill", megapixels, [&](int i) { FloodFill(canvas, 0, 0, i, { TOLERANCE_CHANNEL, 255 }); } },
+        { "flip-v", megapixels, [&](int) { FlipScreenVertical(canvas); } },
+        { "gaussian-8", megapixels, [&](int) { ApplyFilter(canvas, { FILTER_GAUSSIAN_BLUR, 8 }, CanvasBounds(canvas)); } },
+    };
+
+    int workers = WorkerCount();
+    for (const ScalingCase& scaling : cases) {
+        printf("scale   %-6s %-14s", Res.Name, scaling.Name);
+        double serialMs = 0;
+        for (int limit = 1; limit <= workers; limit++) {
+            SetWorkerLimit(limit);
+            double ms = 0;
+            for (int i = 0; i < 3; i++) {
+                LoadCanvasPixels(canvas, noise.data(), Res.Width);
+                double start = NowMs();
+                scaling.Run(i + 1);
+                ms += NowMs() - start;
+            }
+            ms /= 3;
+            if (limit == 1) {
+                serialMs = ms;
+            }
+            printf(" %d: %7.0f Mpix/s (%.2fx)", limit, scaling.Megapixels / ms * 1e3, serialMs / ms);
+        }
+        printf("\n");
+    }
+    SetWorkerLimit(0);
+}
+
+struct SuiteResult {
+    std::string Name;
+    const Resolution* Res;
+    int Ops;
+    double NsPerOp;
+    double MinNs;
+    double PixelsPerOp;
+    double AllocationsPerOp;
+    double AllocationBytesPerOp;
+};
+
+static const Resolution SuiteResolutions[] = {
+    { "720p", 1280, 720 },
+    { "1080p", 1920, 1080 },
+    { "4K", 3840, 2160 },
+    { "8K", 7680, 4320 },
+};
+
+// Each operation is timed on its own so Prepare, which sets up the next one,
+// stays out of the numbers. Runs until SUITE_MIN_MS of measured time, within
+// the operation count limits, after one untimed warm-up.
+constexpr double SUITE_MIN_MS = 100;
+constexpr int SUITE_MIN_OPS = 3;
+constexpr int SUITE_MAX_OPS = 2000;
+
+template <typename PrepareFn, typename RunFn>
+static void MeasureOp(std::vector<SuiteResult>& Results, const char* Name, const Resolution& Res, double PixelsPerOp, PrepareFn&& Prepare, RunFn&& Run) {
+    Prepare(0);
+    Run(0);
+
+    double totalMs = 0, minMs = 1e30;
+    size_t allocations = 0, allocationBytes = 0;
+    int ops = 0;
+    while (ops < SUITE_MIN_OPS || (totalMs < SUITE_MIN_MS && ops < SUITE_MAX_OPS)) {
+        Prepare(ops + 1);
+        size_t countBefore = AllocationCount();
+        size_t bytesBefore = AllocationBytes();
+        double start = NowMs();
+        Run(ops + 1);
+        double ms = NowMs() - start;
+        allocations += AllocationCount() - countBefore;
+        allocationBytes += AllocationBytes() - bytesBefore;
+        totalMs += ms;
+        minMs = std::min(minMs, ms);
+        ops++;
+    }
+
+    SuiteResult result = { Name, &Res, ops, totalMs * 1e6 / ops, minMs * 1e6, PixelsPerOp, (double)allocations / ops, (double)allocationBytes / ops };
+    printf("suite   %-6s %-20s %13.0f ns/op %9.1f Mpix/s %8.1f allocs/op %11.0f B/op %5d ops\n",
+        Res.Name, Name, result.NsPerOp, PixelsPerOp / result.NsPerOp * 1e3, result.AllocationsPerOp, result.AllocationBytesPerOp, ops);
+    Results.push_back(result);
+}
+
+template <typename RunFn>
+static void MeasureOp(std::vector<SuiteResult>& Results, const char* Name, const Resolution& Res, double PixelsPerOp, RunFn&& Run) {
+    MeasureOp(Results, Name, Res, PixelsPerOp, [](int) {}, Run);
+}
+
+// Pixels one call of Draw covers, drawn on its own into an empty canvas.
+// Bounds only limits the count, so it may be loose.
+template <typename DrawFn>
+static double CoveredPixels(const Resolution& Res, const PixelRect& Bounds, DrawFn&& Draw) {
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0);
+    Draw(canvas, 1);
+    return (double)CountColor(canvas, Intersect(Bounds, CanvasBounds(canvas)), 1);
+}
+
+static void SuiteStrokes(std::vector<SuiteResult>& Results, const Resolution& Res, Canvas& Target) {
+    // Short freehand segments, as mouse moves produce them, and long straight
+    // lines across the canvas.
+    const int segments = 64;
+    std::mt19937 rng(21);
+    std::vector<int> shortCoords(segments * 4), longCoords(segments * 4);
+    for (int i = 0; i < segments; i++) {
+        int* c = &shortCoords[i * 4];
+        c[0] = 100 + rng() % (Res.Width - 200);
+        c[1] = 100 + rng() % (Res.Height - 200);
+        c[2] = c[0] + (int)(rng() % 121) - 60;
+        c[3] = c[1] + (int)(rng() % 121) - 60;
+        c = &longCoords[i * 4];
+        c[0] = rng() % Res.Width;
+        c[1] = rng() % (Res.Height / 4);
+        c[2] = rng() % Res.Width;
+        c[3] = Res.Height - 1 - rng() % (Res.Height / 4);
+    }
+
+    struct StrokeCase {
+        const char* Name;
+        const std::vector<int>* Coords;
+        int Width;
+        BrushShape Brush;
+        bool AntiAlias = false;
+    };
+    const StrokeCase cases[] = {
+        { "line-1px", &shortCoords, 1, ROUND_BRUSH },
+        { "line-round-10", &shortCoords, 10, ROUND_BRUSH },
+        { "line-square-10", &shortCoords, 10, SQUARE_BRUSH },
+        { "line-round-50", &shortCoords, 50, ROUND_BRUSH },
+        { "straight-line-1px", &longCoords, 1, ROUND_BRUSH },
+        { "straight-line-10", &longCoords, 10, ROUND_BRUSH },
+        { "line-1px-aa", &shortCoords, 1, ROUND_BRUSH, true },
+        { "line-round-10-aa", &shortCoords, 10, ROUND_BRUSH, true },
+        { "line-square-10-aa", &shortCoords, 10, SQUARE_BRUSH, true },
+    };
+    for (const StrokeCase& stroke : cases) {
+        const std::vector<int>& coords = *stroke.Coords;
+        double covered = 0;
+        for (int i = 0; i < segments; i++) {
+            const int* c = &coords[i * 4];
+            PixelRect bounds = { std::min(c[0], c[2]) - stroke.Width, std::min(c[1], c[3]) - stroke.Width, std::max(c[0], c[2]) + stroke.Width + 1, std::max(c[1], c[3]) + stroke.Width + 1 };
+            covered += CoveredPixels(Res, bounds, [&](Canvas& canvas, u32 color) { DrawLine(canvas, c[0], c[1], c[2], c[3], color, stroke.Width, stroke.Brush); });
+        }
+        // Anti-aliased strokes are counted by their aliased pixels; the
+        // blended edge comes on top.
+        MeasureOp(Results, stroke.Name, Res, covered / segments, [&](int i) {
+            const int* c = &coords[(i % segments) * 4];
+            if (stroke.AntiAlias) {
+                DrawLineAA(Target, c[0], c[1], c[2], c[3], i, stroke.Width, stroke.Brush);
+            }
+            else {
+                DrawLine(Target, c[0], c[1], c[2], c[3], i, stroke.Width, stroke.Brush);
+            }
+        });
+    }
+}
+
+static void SuiteShapes(std::vector<SuiteResult>& Results, const Resolution& Res, Canvas& Target) {
+    int x = Res.Width / 4, y = Res.Height / 4;
+    int width = Res.Width / 2, height = Res.Height / 2;
+    int radius = Res.Height / 3;
+    int cx = Res.Width / 2, cy = Res.Height / 2;
+    PixelRect rectBounds = { x - 8, y - 8, x + width + 8, y + height + 8 };
+    PixelRect circleBounds = { cx - radius - 8, cy - radius - 8, cx + radius + 9, cy + radius + 9 };
+
+    auto rectangle = [&](Canvas& canvas, u32 color) { DrawRectangle(canvas, x, y, width, height, color, 5, false); };
+    auto filledRectangle = [&](Canvas& canvas, u32 color) { DrawRectangle(canvas, x, y, width, height, color, 5, true); };
+    auto circle = [&](Canvas& canvas, u32 color) { DrawCircle(canvas, cx, cy, radius, color, 5, false); };
+    auto filledCircle = [&](Canvas& canvas, u32 color) { DrawCircle(canvas, cx, cy, radius, color, 5, true); };
+
+    MeasureOp(Results, "rectangle", Res, CoveredPixels(Res, rectBounds, rectangle), [&](int i) { rectangle(Target, i); });
+    MeasureOp(Results, "rectangle-filled", Res, CoveredPixels(Res, rectBounds, filledRectangle), [&](int i) { filledRectangle(Target, i); });
+    MeasureOp(Results, "circle", Res, CoveredPixels(Res, circleBounds, circle), [&](int i) { circle(Target, i); });
+    MeasureOp(Results, "circle-filled", Res, CoveredPixels(Res, circleBounds, filledCircle), [&](int i) { filledCircle(Target, i); });
+
+    auto ellipse = [&](Canvas& canvas, u32 color) { DrawEllipse(canvas, x, y, width, height, color, 5, false); };
+    auto filledEllipse = [&](Canvas& canvas, u32 color) { DrawEllipse(canvas, x, y, width, height, color, 5, true); };
+    MeasureOp(Results, "ellipse", Res, CoveredPixels(Res, rectBounds, ellipse), [&](int i) { ellipse(Target, i); });
+    MeasureOp(Results, "ellipse-filled", Res, CoveredPixels(Res, rectBounds, filledEllipse), [&](int i) { filledEllipse(Target, i); });
+
+    auto smoothCircle = [&](Canvas& canvas, u32 color) { DrawCircleAA(canvas, cx, cy, radius, color, 5, false); };
+    auto smoothFilledCircle = [&](Canvas& canvas, u32 color) { DrawCircleAA(canvas, cx, cy, radius, color, 5, true); };
+    MeasureOp(Results, "circle-aa", Res, CoveredPixels(Res, circleBounds, smoothCircle), [&](int i) { smoothCircle(Target, i); });
+    MeasureOp(Results, "circle-filled-aa", Res, CoveredPixels(Res, circleBounds, smoothFilledCircle), [&](int i) { smoothFilledCircle(Target, i); });
+}
+
+static void SuiteCanvasOps(std::vector<SuiteResult>& Results, const Resolution& Res, const std::vector<u32>& Noise) {
+    double pixels = (double)Res.Width * Res.Height;
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0);
+    MeasureOp(Results, "clear", Res, pixels, [&](int i) { ClearScreen(canvas, i); });
+
+    LoadCanvasPixels(canvas, Noise.data(), Res.Width);
+    MeasureOp(Results, "flip-horizontal", Res, pixels, [&](int) { FlipScreenHorizontal(canvas); });
+    MeasureOp(Results, "flip-vertical", Res, pixels, [&](int) { FlipScreenVertical(canvas); });
+
+    // Each fill starts from a freshly loaded scene; the whole background is
+    // one region in both.
+    static const char* fillNames[] = { "flood-fill", "flood-fill-maze" };
+    std::vector<u32> scene((size_t)Res.Width * Res.Height);
+    Canvas fillCanvas;
+    InitCanvas(fillCanvas, Res.Width, Res.Height, 0);
+    for (int fillScene = SCENE_EMPTY; fillScene <= SCENE_MAZE; fillScene++) {
+        BuildFillScene(scene, Res.Width, Res.Height, (FillScene)fillScene);
+        double region = (double)std::count(scene.begin(), scene.end(), scene[0]);
+        MeasureOp(Results, fillNames[fillScene], Res, region,
+            [&](int) { LoadCanvasPixels(fillCanvas, scene.data(), Res.Width); },
+            [&](int) { FloodFill(fillCanvas, 0, 0, 0xff0000, { TOLERANCE_EXACT, 0 }); });
+    }
+}
+
+// One undo step is a 256x24 block, as ScribbleRect draws it.
+static void SuiteHistory(std::vector<SuiteResult>& Results, const Resolution& Res) {
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0x222222);
+    DrawingHistory history;
+    InitDrawingHistory(history, canvas, (size_t)-1);
+    std::mt19937 rng(23);
+    double stepPixels = 256 * 24;
+
+    MeasureOp(Results, "history-save", Res, stepPixels,
+        [&](int) { ScribbleRect(canvas, rng); },
+        [&](int) { SaveDrawingState(history, canvas); });
+
+    // Walk the recorded steps back and forth, switching direction at either end.
+    MeasureOp(Results, "history-undo", Res, stepPixels,
+        [&](int) {
+            if (history.Index == 0) {
+                while (RedoDrawing(history, canvas)) {
+                }
+            }
+        },
+        [&](int) { UndoDrawing(history, canvas); });
+    MeasureOp(Results, "history-redo", Res, stepPixels,
+        [&](int) {
+            if (history.Index == history.Entries.size()) {
+                while (UndoDrawing(history, canvas)) {
+                }
+            }
+        },
+        [&](int) { RedoDrawing(history, canvas); });
+}
+
+static void SuiteFiles(std::vector<SuiteResult>& Results, const Resolution& Res, const std::vector<u32>& Noise) {
+    double pixels = (double)Res.Width * Res.Height;
+    Canvas canvas;
+    InitCanvas(canvas, Res.Width, Res.Height, 0);
+    LoadCanvasPixels(canvas, Noise.data(), Res.Width);
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "paint_bench_suite.bmp";
+
+    MeasureOp(Results, "save-bmp-32", Res, pixels, [&](int) { WriteBmp(canvas, path, BMP_32_BIT); });
+    MeasureOp(Results, "save-bmp-24", Res, pixels, [&](int) { WriteBmp(canvas, path, BMP_24_BIT); });
+    Canvas loaded;
+    InitCanvas(loaded, 1, 1, 0);
+    MeasureOp(Results, "load-bmp-24", Res, pixels, [&](int) { LoadBmp(loaded, path); });
+    std::filesystem::remove(path);
+}
+
+static std::string JsonEscape(const std::string& Text) {
+    std::string out;
+    for (char c : Text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+static bool WriteSuiteJson(const std::vector<SuiteResult>& Results, const char* Path) {
+    FILE* file = fopen(Path, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "{\n  \"workers\": %d,\n  \"span_kernel\": \"%s\",\n  \"results\": [\n", WorkerCount(), SpanKernelName(GetSpanKernel()));
+    for (size_t i = 0; i < Results.size(); i++) {
+        const SuiteResult& result = Results[i];
+        fprintf(file, "    { \"name\": \"%s\", \"resolution\": \"%s\", \"width\": %d, \"height\": %d, \"ops\": %d, "
+            "\"ns_per_op\": %.1f, \"min_ns\": %.1f, \"pixels_per_op\": %.0f, \"mpix_per_s\": %.3f, "
+            "\"allocations_per_op\": %.2f, \"allocated_bytes_per_op\": %.1f }%s\n",
+            JsonEscape(result.Name).c_str(), result.Res->Name, result.Res->Width, result.Res->Height, result.Ops,
+            result.NsPerOp, result.MinNs, result.PixelsPerOp, result.PixelsPerOp / result.NsPerOp * 1e3,
+            result.AllocationsPerOp, result.AllocationBytesPerOp, i + 1 < Results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+static void RunSuite(std::vector<SuiteResult>& Results) {
+    for (const Resolution& res : SuiteResolutions) {
+        std::vector<u32> noise((size_t)res.Width * res.Height);
+        std::mt19937 rng(19);
+        for (u32& pixel : noise) {
+            pixel = rng() & 0xffffff;
+        }
+
+        Canvas canvas;
+        InitCanvas(canvas, res.Width, res.Height, 0x222222);
+        SuiteStrokes(Results, res, canvas);
+        SuiteShapes(Results, res, canvas);
+        SuiteCanvasOps(Results, res, noise);
+        SuiteHistory(Results, res);
+        SuiteFiles(Results, res, noise);
+    }
+}
+
+static void PutBytes32(std::vector<uint8_t>& Bytes, size_t At, uint32_t Value) {
+    for (int i = 0; i < 4; i++) {
+        Bytes[At + i] = (uint8_t)(Value >> (8 * i));
+    }
+}
+
+static void PutBytes16(std::vector<uint8_t>& Bytes, size_t At, uint32_t Value) {
+    Bytes[At] = (uint8_t)Value;
+    Bytes[At + 1] = (uint8_t)(Value >> 8);
+}
+
+// A BMP laid out by hand, for what WriteBmp never writes: top-down rows,
+// BI_BITFIELDS, alpha bytes that must be ignored and junk in the row padding.
+// Pixels run top to bottom.
+static std::vector<uint8_t> BuildTestBmp(const std::vector<u32>& Pixels, int Width, int Height, int Bits, bool TopDown, bool BitFields) {
+    size_t rowBytes = ((size_t)Width * (Bits / 8) + 3) & ~(size_t)3;
+    size_t offset = 54 + (BitFields ? 12 : 0);
+    std::vector<uint8_t> bytes(offset + rowBytes * Height, 0xa5);
+    std::fill(bytes.begin(), bytes.begin() + offset, 0);
+    bytes[0] = 'B';
+    bytes[1] = 'M';
+    PutBytes32(bytes, 2, (uint32_t)bytes.size());
+    PutBytes32(bytes, 10, (uint32_t)offset);
+    PutBytes32(bytes, 14, 40);
+    PutBytes32(bytes, 18, (uint32_t)Width);
+    PutBytes32(bytes, 22, (uint32_t)(TopDown ? -Height : Height));
+    PutBytes16(bytes, 26, 1);
+    PutBytes16(bytes, 28, (uint32_t)Bits);
+    PutBytes32(bytes, 30, BitFields ? 3 : 0);
+    PutBytes32(bytes, 34, (uint32_t)(rowBytes * Height));
+    if (BitFields) {
+        PutBytes32(bytes, 54, 0x00ff0000);
+        PutBytes32(bytes, 58, 0x0000ff00);
+        PutBytes32(bytes, 62, 0x000000ff);
+    }
+    int pixelBytes = Bits / 8;
+    for (int y = 0; y < Height; y++) {
+        uint8_t* row = &bytes[offset + rowBytes * (TopDown ? y : Height - 1 - y)];
+        for (int x = 0; x < Width; x++) {
+            u32 pixel = Pixels[(size_t)y * Width + x];
+            uint8_t* out = row + (size_t)x * pixelBytes;
+            out[0] = (uint8_t)pixel;
+            out[1] = (uint8_t)(pixel >> 8);
+            out[2] = (uint8_t)(pixel >> 16);
+            if (pixelBytes == 4) {
+                out[3] = 0xff;
+            }
+        }
+    }
+    return bytes;
+}
+
+static bool WriteBytes(const std::filesystem::path& Path, const std::vector<uint8_t>& Bytes) {
+    std::ofstream file(Path, std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write((const char*)Bytes.data(), Bytes.size());
+    return (bool)file;
+}
+
+static bool CanvasEquals(const Canvas& Target, const std::vector<u32>& Pixels, int Width, int Height) {
+    if (Target.Width != Width || Target.Height != Height) {
+        return false;
+    }
+    std::vector<u32> row(Width);
+    for (int y = 0; y < Height; y++) {
+        ReadCanvasSpan(Target, y, 0, Width, row.data());
+        if (memcmp(row.data(), &Pixels[(size_t)y * Width], Width * sizeof(u32)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Noise over the top half and one colour below, so loaded tiles come out both
+// ways. The alpha byte stays clear, as LoadBmp leaves it.
+static std::vector<u32> TestImage(int Width, int Height, std::mt19937& Rng) {
+    std::vector<u32> pixels((size_t)Width * Height);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        pixels[i] = i < pixels.size() / 2 ? Rng() & 0xffffff : 0x3366cc;
+    }
+    return pixels;
+}
+
+// LoadBmp against WriteBmp and against hand-built files in the layouts other
+// programs write, then against broken files, which must be refused and leave
+// the canvas alone. Widths 1 to 5 give every amount of row padding.
+static bool ValidateBmp() {
+    const int sizes[][2] = { { 1, 1 }, { 2, 3 }, { 3, 2 }, { 4, 5 }, { 5, 7 }, { 64, 64 }, { 65, 63 }, { 130, 129 } };
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "paint_validate.bmp";
+    std::mt19937 rng(9);
+    int checked = 0;
+    for (const auto& size : sizes) {
+        int width = size[0];
+        int height = size[1];
+        std::vector<u32> pixels = TestImage(width, height, rng);
+        Canvas source;
+        InitCanvas(source, width, height, 0);
+        LoadCanvasPixels(source, pixels.data(), width);
+
+        for (BmpFormat format : { BMP_32_BIT, BMP_24_BIT }) {
+            Canvas loaded;
+            InitCanvas(loaded, 1, 1, 0);
+            if (!WriteBmp(source, path, format) || !LoadBmp(loaded, path) || !CanvasEquals(loaded, pixels, width, height)) {
+                printf("validate bmp: %dx%d %s doesn't load back as written\n", width, height, format == BMP_32_BIT ? "32-bit" : "24-bit");
+                std::filesystem::remove(path);
+                return false;
+            }
+            checked++;
+        }
+        for (int bits : { 24, 32 }) {
+            for (bool topDown : { false, true }) {
+                for (bool bitFields : { false, true }) {
+                    if (bitFields && bits != 32) {
+                        continue;
+                    }
+                    Canvas loaded;
+                    InitCanvas(loaded, 1, 1, 0);
+                    if (!WriteBytes(path, BuildTestBmp(pixels, width, height, bits, topDown, bitFields)) || !LoadBmp(loaded, path) || !CanvasEquals(loaded, pixels, width, height)) {
+                        printf("validate bmp: %dx%d %d-bit%s%s doesn't load\n", width, height, bits, topDown ? " top-down" : "", bitFields ? " BI_BITFIELDS" : "");
+                        std::filesystem::remove(path);
+                        return false;
+                    }
+                    checked++;
+                }
+            }
+        }
+    }
+
+    struct BadFile {
+        const char* Name;
+        std::vector<uint8_t> Bytes;
+    };
+    std::vector<u32> small = TestImage(5, 4, rng);
+    std::vector<uint8_t> good = BuildTestBmp(small, 5, 4, 32, false, false);
+    auto changed = [&](const std::vector<uint8_t>& Base, size_t At, uint32_t Value, bool Wide) {
+        std::vector<uint8_t> bytes = Base;
+        if (Wide) {
+            PutBytes32(bytes, At, Value);
+        }
+        else {
+            PutBytes16(bytes, At, Value);
+        }
+        return bytes;
+    };
+    std::vector<uint8_t> bitFields = BuildTestBmp(small, 5, 4, 32, false, true);
+    std::vector<BadFile> bad = {
+        { "empty", {} },
+        { "cut inside the file header", { good.begin(), good.begin() + 10 } },
+        { "cut inside the info header", { good.begin(), good.begin() + 53 } },
+        { "missing the last pixel byte", { good.begin(), good.end() - 1 } },
+        { "not BM", changed(good, 0, 'X' | 'M' << 8, false) },
+        { "core header", changed(good, 14, 12, true) },
+        { "zero width", changed(good, 18, 0, true) },
+        { "negative width", changed(good, 18, (uint32_t)-5, true) },
+        { "zero height", changed(good, 22, 0, true) },
+        { "INT32_MIN height", changed(good, 22, 0x80000000u, true) },
+        { "taller than the pixels", changed(good, 22, 5, true) },
+        { "8-bit", changed(good, 28, 8, false) },
+        { "16-bit", changed(good, 28, 16, false) },
+        { "RLE8", changed(good, 30, 1, true) },
+        { "24-bit BI_BITFIELDS", changed(BuildTestBmp(small, 5, 4, 24, false, false), 30, 3, true) },
+        { "BI_BITFIELDS with RGBA masks", changed(bitFields, 54, 0x000000ff, true) },
+        { "pixels past the end", changed(good, 10, (uint32_t)good.size(), true) },
+        { "pixel offset overflowing", changed(good, 10, 0xffffffffu, true) },
+        { "wider than BMP_MAX_SIDE", BuildTestBmp(std::vector<u32>(BMP_MAX_SIDE + 1), BMP_MAX_SIDE + 1, 1, 24, false, false) },
+        { "taller than BMP_MAX_SIDE", BuildTestBmp(std::vector<u32>(BMP_MAX_SIDE + 1), 1, BMP_MAX_SIDE + 1, 32, true, false) },
+    };
+    std::vector<u32> before = TestImage(7, 9, rng);
+    for (const BadFile& file : bad) {
+        Canvas target;
+        InitCanvas(target, 7, 9, 0);
+        LoadCanvasPixels(target, before.data(), 7);
+        if (!WriteBytes(path, file.Bytes) || LoadBmp(target, path) || !CanvasEquals(target, before, 7, 9)) {
+            printf("validate bmp: loaded a file that is %s\n", file.Name);
+            std::filesystem::remove(path);
+            return false;
+        }
+    }
+    std::filesystem::remove(path);
+    printf("validate bmp: %d files load back, %d broken ones refused\n", checked, (int)bad.size());
+    return true;
+}
+
+static bool SameRect(const PixelRect& A, const PixelRect& B) {
+    return A.X0 == B.X0 && A.Y0 == B.Y0 && A.X1 == B.X1 && A.Y1 == B.Y1;
+}
+
+// What a present would hand to the blit: no more than MaxRects rectangles,
+// inside the bounds, not overlapping, and covering every pixel in Covered.
+static bool PresentsCoverage(DamageTracker& Damage, const std::vector<uint8_t>& Covered) {
+    int width = Damage.Bounds.X1;
+    std::vector<PixelRect> rects = TakeDamage(Damage);
+    if ((int)rects.size() > Damage.MaxRects || HasDamage(Damage)) {
+        return false;
+    }
+    std::vector<uint8_t> presented(Covered.size(), 0);
+    for (size_t i = 0; i < rects.size(); i++) {
+        const PixelRect& rect = rects[i];
+        if (IsEmpty(rect) || !SameRect(Intersect(rect, Damage.Bounds), rect)) {
+            return false;
+        }
+        for (size_t j = i + 1; j < rects.size(); j++) {
+            if (!IsEmpty(Intersect(rect, rects[j]))) {
+                return false;
+            }
+        }
+        for (int y = rect.Y0; y < rect.Y1; y++) {
+            std::fill(&presented[(size_t)y * width + rect.X0], &presented[(size_t)y * width + rect.X1], 1);
+        }
+    }
+    for (size_t i = 0; i < Covered.size(); i++) {
+        if (Covered[i] && !presented[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The damage tracker: merging, clipping to its bounds, the cap on pending
+// rectangles, and random damage presented in full.
+static bool ValidateDamage() {
+    struct Case {
+        const char* Name;
+        std::vector<PixelRect> Added;
+        std::vector<PixelRect> Expected;
+    };
+    const std::vector<Case> cases = {
+        { "side by side", { { 0, 0, 10, 10 }, { 10, 0, 20, 10 } }, { { 0, 0, 20, 10 } } },
+        { "one above the other", { { 0, 0, 10, 10 }, { 0, 10, 10, 20 } }, { { 0, 0, 10, 20 } } },
+        { "overlapping", { { 0, 0, 100, 100 }, { 50, 50, 150, 150 } }, { { 0, 0, 150, 150 } } },
+        { "contained", { { 0, 0, 100, 100 }, { 20, 20, 30, 30 } }, { { 0, 0, 100, 100 } } },
+        { "far apart", { { 0, 0, 100, 100 }, { 500, 200, 600, 300 } }, { { 0, 0, 100, 100 }, { 500, 200, 600, 300 } } },
+        { "joined by a third", { { 0, 0, 100, 100 }, { 300, 0, 400, 100 }, { 100, 0, 300, 100 } }, { { 0, 0, 400, 100 } } },
+        { "over the top-left", { { -50, -20, 10, 10 } }, { { 0, 0, 10, 10 } } },
+        { "over the bottom-right", { { 630, 350, 700, 400 } }, { { 630, 350, 640, 360 } } },
+        { "over everything", { { -1, -1, 641, 361 } }, { { 0, 0, 640, 360 } } },
+        { "outside", { { 640, 0, 700, 10 }, { -10, -10, 0, 0 }, { 10, 10, 10, 20 } }, {} },
+    };
+    for (const Case& test : cases) {
+        DamageTracker damage;
+        InitDamageTracker(damage, 640, 360);
+        for (const PixelRect& rect : test.Added) {
+            AddDamage(damage, rect);
+        }
+        std::vector<PixelRect> rects = TakeDamage(damage);
+        bool matches = rects.size() == test.Expected.size();
+        for (size_t i = 0; matches && i < rects.size(); i++) {
+            matches = std::any_of(rects.begin(), rects.end(), [&](const PixelRect& R) { return SameRect(R, test.Expected[i]); });
+        }
+        if (!matches) {
+            printf("validate damage: %s: got", test.Name);
+            for (const PixelRect& rect : rects) {
+                printf(" (%d, %d)-(%d, %d)", rect.X0, rect.Y0, rect.X1, rect.Y1);
+            }
+            printf(", expected %d rects\n", (int)test.Expected.size());
+            return false;
+        }
+    }
+
+    // Dots all over the frame pile up far past MaxRects and should end up as
+    // the whole frame.
+    DamageTracker damage;
+    InitDamageTracker(damage, 640, 360);
+    for (int y = 0; y < 360; y += 7) {
+        for (int x = 0; x < 640; x += 13) {
+            AddDamage(damage, { x, y, x + 1, y + 1 });
+            if ((int)damage.Rects.size() > damage.MaxRects) {
+                printf("validate damage: %d rects pending, over the cap of %d\n", (int)damage.Rects.size(), damage.MaxRects);
+                return false;
+            }
+        }
+    }
+    AddDamage(damage, { 639, 359, 640, 360 });
+    std::vector<PixelRect> full = TakeDamage(damage);
+    if (full.size() != 1 || !SameRect(full[0], damage.Bounds)) {
+        printf("validate damage: scattered dots gave %d rects rather than the whole frame\n", (int)full.size());
+        return false;
+    }
+
+    // Random strokes, boxes and stray rectangles partly off the frame; every
+    // damaged pixel must be presented.
+    std::mt19937 rng(5);
+    const int rounds = 200;
+    for (int round = 0; round < rounds; round++) {
+        int width = 64 + (int)(rng() % 600);
+        int height = 64 + (int)(rng() % 400);
+        InitDamageTracker(damage, width, height);
+        std::vector<uint8_t> covered((size_t)width * height, 0);
+        int adds = 1 + (int)(rng() % 300);
+        int x = (int)(rng() % width), y = (int)(rng() % height);
+        for (int i = 0; i < adds; i++) {
+            PixelRect rect;
+            if (rng() % 4 != 0) {
+                // A brush dab next to the last one.
+                x += (int)(rng() % 31) - 15;
+                y += (int)(rng() % 31) - 15;
+                int radius = 1 + (int)(rng() % 12);
+                rect = { x - radius, y - radius, x + radius + 1, y + radius + 1 };
+            }
+            else {
+                int x0 = (int)(rng() % (width + 100)) - 50;
+                int y0 = (int)(rng() % (height + 100)) - 50;
+                rect = { x0, y0, x0 + 1 + (int)(rng() % 200), y0 + 1 + (int)(rng() % 200) };
+            }
+            AddDamage(damage, rect);
+            PixelRect clipped = Intersect(rect, damage.Bounds);
+            for (int py = clipped.Y0; py < clipped.Y1; py++) {
+                for (int px = clipped.X0; px < clipped.X1; px++) {
+                    covered[(size_t)py * width + px] = 1;
+                }
+            }
+            if ((int)damage.Rects.size() > damage.MaxRects) {
+                printf("validate damage: %d rects pending, over the cap of %d\n", (int)damage.Rects.size(), damage.MaxRects);
+                return false;
+            }
+        }
+        if (!PresentsCoverage(damage, covered)) {
+            printf("validate damage: round %d (%dx%d, %d rects) doesn't present all of its damage\n", round, width, height, adds);
+            return false;
+        }
+    }
+    printf("validate damage: %d cases and %d random frames presented in full\n", (int)cases.size() + 1, rounds);
+    return true;
+}
+
+// Pixels changed behind the validator's back, inside the box of a rectangle
+// outline that doesn't cover them, must be caught every time, and the first
+// mismatch kept.
+static bool ValidateValidator() {
+    Canvas canvas;
+    InitCanvas(canvas, 64, 64, 0xffffff);
+    RasterValidator validator;
+    SetValidation(validator, canvas, true);
+    RasterOp outline;
+    outline.Kind = RASTER_RECTANGLE;
+    outline.X = 10;
+    outline.Y = 10;
+    outline.Width = 20;
+    outline.Height = 20;
+    outline.LineWidth = 1;
+    const u32 tampered[] = { 0xff0000, 0x00ff00 };
+    for (int i = 0; i < 2; i++) {
+        FillRect(canvas, 20, 20, 21, 21, tampered[i]);
+        if (RunRasterOp(validator, canvas, outline)) {
+            printf("validate validator: mismatch %d went unnoticed\n", i + 1);
+            return false;
+        }
+    }
+    if (!validator.HasFailure || validator.Failure.X != 20 || validator.Failure.Y != 20 || validator.Failure.Actual != tampered[0]) {
+        printf("validate validator: the first mismatch wasn't the one kept\n");
+        return false;
+    }
+    printf("validate validator: both mismatches caught, the first kept\n");
+    return true;
+}
+
+// Odd sizes so the operations cross partial tiles on the right and bottom.
+static bool RunValidation(int Ops, uint32_t Seed) {
+    const Resolution sizes[] = {
+        { "64x64", 64, 64 },
+        { "333x257", 333, 257 },
+        { "640x360", 640, 360 },
+        { "1000x70", 1000, 70 },
+    };
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        const Resolution& size = sizes[i];
+        RasterValidator validator;
+        double start = NowMs();
+        int ran = ReplayRandomOps(validator, Seed + i, size.Width, size.Height, Ops);
+        double ms = NowMs() - start;
+        if (validator.HasFailure) {
+            const ValidationFailure& failure = validator.Failure;
+            printf("validate %-8s seed %u: mismatch at op %d: %s\n", size.Name, Seed + i, ran, DescribeRasterOp(failure.Op).c_str());
+            printf("         first differing pixel (%d, %d): expected 0x%08x, got 0x%08x\n", failure.X, failure.Y, failure.Expected, failure.Actual);
+            if (!failure.DiffImage.empty()) {
+                printf("         diff image: %s\n", failure.DiffImage.string().c_str());
+            }
+            return false;
+        }
+        printf("validate %-8s seed %u: %d ops match (%.0f ops/s)\n", size.Name, Seed + i, ran, ran / ms * 1e3);
+    }
+    return ValidateValidator() && ValidateBmp() && ValidateDamage();
+}
+
+int main(int ArgumentCount, char** Arguments) {
+    bool suite = false;
+    const char* jsonPath = nullptr;
+    int validateOps = 0;
+    uint32_t seed = 1;
+    for (int i = 1; i < ArgumentCount; i++) {
+        if (!strcmp(Arguments[i], "--suite")) {
+            suite = true;
+        }
+        else if (!strcmp(Arguments[i], "--json") && i + 1 < ArgumentCount) {
+            suite = true;
+            jsonPath = Arguments[++i];
+        }
+        else if (!strcmp(Arguments[i], "--validate") && i + 1 < ArgumentCount) {
+            validateOps = atoi(Arguments[++i]);
+        }
+        else if (!strcmp(Arguments[i], "--seed") && i + 1 < ArgumentCount) {
+            seed = (uint32_t)strtoul(Arguments[++i], nullptr, 10);
+        }
+        else {
+            fprintf(stderr, "usage: %s [--suite] [--json FILE] [--validate N [--seed S]]\n", Arguments[0]);
+            return 2;
+        }
+    }
+    if (validateOps > 0) {
+        return RunValidation(validateOps, seed) ? 0 : 1;
+    }
+    if (suite) {
+        std::vector<SuiteResult> results;
+        RunSuite(results);
+        if (jsonPath && !WriteSuiteJson(results, jsonPath)) {
+            fprintf(stderr, "can't write %s\n", jsonPath);
+            return 1;
+        }
+        return 0;
+    }
+
+    for (const Resolution& res : Resolutions) {
+        BenchHistory(res);
+    }
+    for (const Resolution& res : Resolutions) {
+        BenchFloodFill(res);
+    }
+    for (const Resolution& res : Resolutions) {
+        BenchSpans(res);
+    }
+    BenchStrokes();
+    BenchCircles();
+    BenchAntiAlias();
+    BenchBlend();
+    BenchInput();
+    BenchTrace();
+    BenchLayers();
+    BenchScripts();
+    BenchGradient(Resolutions[1]);
+    BenchSelection(Resolutions[0]);
+    BenchViewport();
+    BenchFilters(Resolutions[1]);
+    BenchFloatingRegion(Resolutions[1]);
+    for (const Resolution& res : Resolutions) {
+        BenchResize(res);
+    }
+    for (const Resolution& res : Resolutions) {
+        BenchDamage(res);
+    }
+    BenchCanvas();
+    BenchTransforms(Resolutions[1]);
+    BenchTransforms(Resolutions[2]);
+    for (const Resolution& res : Resolutions) {
+        BenchExport(res);
+    }
+    for (const Resolution& res : Resolutions) {
+        BenchLoad(res);
+    }
+    BenchScaling(Resolutions[2]);
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include "antialias.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "ellipse.h"
+#include "span.h"
+#include "trace.h"
+
+// Fraction of a pixel covered, given how far its centre is inside the point
+// where coverage reaches zero, in pixels. A whole pixel or more is 255, which
+// replaces the pixel outright.
+static uint8_t CoverageFromDepth(double Depth) {
+    return (uint8_t)std::clamp((int)(Depth * 256), 0, 255);
+}
+
+CoverageStroke MakeCoverageStroke(int X1, int Y1, int X2, int Y2, int LineWidth, BrushShape Brush) {
+    CoverageStroke s;
+    s.Inner = MakeStroke(X1, Y1, X2, Y2, LineWidth, Brush);
+    s.Outer = MakeStroke(X1, Y1, X2, Y2, 2 * s.Inner.Radius + 2, Brush);
+    s.InverseLength = s.Inner.LengthSquared > 0 ? 1 / sqrt((double)s.Inner.LengthSquared) : 0;
+    s.Support = (s.Inner.Radius + 0.5) * (llabs(s.Inner.DX) + llabs(s.Inner.DY)) * s.InverseLength;
+    return s;
+}
+
+uint8_t StrokeCoverage(const CoverageStroke& S, int X, int Y) {
+    const Stroke& inner = S.Inner;
+    int64_t u = (int64_t)X - inner.AX;
+    int64_t v = (int64_t)Y - inner.AY;
+    double across = S.InverseLength > 0 ? (double)llabs(u * inner.DY - v * inner.DX) * S.InverseLength : 0;
+
+    if (inner.Brush == SQUARE_BRUSH) {
+        // The square swept to half a pixel past the aliased reach is where
+        // three slabs overlap: its x and y extents and a band along the
+        // segment. Depth is to the nearest slab side, exact inside; off the
+        // corners it falls a little short, which keeps them square. Half
+        // coverage on the outline itself.
+        double half = inner.Radius + 0.5;
+        int64_t minU = std::min<int64_t>(0, inner.DX);
+        int64_t maxU = std::max<int64_t>(0, inner.DX);
+        int64_t minV = std::min<int64_t>(0, inner.DY);
+        int64_t maxV = std::max<int64_t>(0, inner.DY);
+        double slabs = (double)std::max(std::max(minU - u, u - maxU), std::max(minV - v, v - maxV)) - half;
+        if (S.InverseLength > 0) {
+            slabs = std::max(slabs, across - S.Support);
+        }
+        return CoverageFromDepth(0.5 - slabs);
+    }
+
+    // Round: full at Radius from the segment, none at Radius + 1. Beside the
+    // segment the distance is to its line, otherwise to the nearer end.
+    int64_t dot = u * inner.DX + v * inner.DY;
+    double distance = across;
+    if (dot <= 0 || dot >= inner.LengthSquared) {
+        if (dot > 0) {
+            u -= inner.DX;
+            v -= inner.DY;
+        }
+        distance = sqrt((double)(u * u + v * v));
+    }
+    return CoverageFromDepth(inner.Radius + 1 - distance);
+}
+
+uint8_t RingCoverage(int64_t DX, int64_t DY, int Inner, int Outer) {
+    // Distance in 1/256 pixels, rounded down, so circles stay in integers.
+    int64_t distance = IntSqrt((DX * DX + DY * DY) << 16);
+    int64_t depth = std::min(256 * ((int64_t)Outer + 1) - distance, distance - 256 * ((int64_t)Inner - 1));
+    return (uint8_t)std::clamp<int64_t>(depth, 0, 255);
+}
+
+// Blends the pixels X0 <= x < X1 of row Y, which must be a canvas row, by
+// Cover(x). Zero coverage at either end is trimmed first.
+template <typename CoverFn>
+static void BlendEdge(Canvas& Target, int Y, int X0, int X1, u32 Color, std::vector<uint8_t>& Coverage, CoverFn&& Cover) {
+    X0 = std::max(X0, 0);
+    X1 = std::min(X1, Target.Width);
+    if (X0 >= X1) {
+        return;
+    }
+    Coverage.resize(X1 - X0);
+    for (int x = X0; x < X1; x++) {
+        Coverage[x - X0] = Cover(x);
+    }
+    int first = 0;
+    int last = X1 - X0;
+    while (first < last && Coverage[first] == 0) {
+        first++;
+    }
+    while (last > first && Coverage[last - 1] == 0) {
+        last--;
+    }
+    if (first < last) {
+        BlendSpan(Target, Y, X0 + first, &Coverage[first], last - first, Color);
+    }
+}
+
+void DrawLineAA(Canvas& Target, int X1, int Y1, int X2, int Y2, u32 Color, int LineWidth, BrushShape Brush) {
+    TraceScope trace("DrawLineAA");
+    CoverageStroke stroke = MakeCoverageStroke(X1, Y1, X2, Y2, LineWidth, Brush);
+    int startY = std::max(stroke.Outer.Y0, 0);
+    int endY = std::min(stroke.Outer.Y1, Target.Height);
+    bool isLarge = (size_t)std::max(endY - startY, 0) * (2 * stroke.Inner.Radius + 1) >= PARALLEL_RASTER_PIXELS;
+    std::vector<PixelSpan> spans;
+    std::vector<uint8_t> coverage;
+    for (int y = startY; y < endY; y++) {
+        int outer0, outer1, inner0, inner1;
+        if (!StrokeRowSpan(stroke.Outer, y, outer0, outer1)) {
+            continue;
+        }
+        // A one pixel line has only a few pixels exactly on the segment; they
+        // come out at full coverage, so the whole row is blended instead.
+        if (stroke.Inner.Radius == 0 || !StrokeRowSpan(stroke.Inner, y, inner0, inner1)) {
+            inner0 = outer1;
+            inner1 = outer1;
+        }
+        if (isLarge) {
+            AddSpan(Target, spans, y, inner0, inner1);
+        }
+        else {
+            FillSpan(Target, y, inner0, inner1, Color);
+        }
+        auto cover = [&](int x) { return StrokeCoverage(stroke, x, y); };
+        BlendEdge(Target, y, outer0, inner0, Color, coverage, cover);
+        BlendEdge(Target, y, inner1, outer1, Color, coverage, cover);
+    }
+    if (isLarge) {
+        FillSpans(Target, spans, Color);
+    }
+}
+
+void DrawCircleAA(Canvas& Target, int X, int Y, int Radius, u32 Color, int LineWidth, bool isFilled) {
+    TraceScope trace("DrawCircleAA");
+    int inner, outer;
+    RingBounds(Radius, LineWidth, isFilled, inner, outer);
+    if (outer < 0) {
+        return;
+    }
+
+    // The aliased circle's spans are filled. Per row, as offsets from X,
+    // coverage reaches out to edge, and nothing closer than hole gets any.
+    Ellipse ring = MakeCircle(X, Y, Radius, LineWidth, isFilled);
+    int64_t outer2 = (int64_t)outer * outer;
+    int64_t hole2 = (int64_t)(inner - 1) * (inner - 1);
+    bool isLarge = (size_t)3 * outer2 >= PARALLEL_RASTER_PIXELS;
+    std::vector<PixelSpan> spans;
+    std::vector<uint8_t> coverage;
+    auto full = [&](int Row, int From, int To) {
+        if (isLarge) {
+            AddSpan(Target, spans, Row, From, To);
+        }
+        else {
+            FillSpan(Target, Row, From, To, Color);
+        }
+    };
+
+    int startY = std::max(Y - outer, 0);
+    int endY = std::min(Y + outer + 1, Target.Height);
+    for (int row = startY; row < endY; row++) {
+        int64_t dy = row - Y;
+        int64_t dy2 = dy * dy;
+        int edge = (int)IntSqrt(outer2 + 2 * outer - dy2);
+        int hole = inner >= 1 && hole2 >= dy2 ? (int)IntSqrt(hole2 - dy2) : -1;
+        int holeStart = hole >= 0 ? X - hole : X;
+        int holeEnd = hole >= 0 ? X + hole + 1 : X;
+
+        // Blends From <= x < To, less the hole.
+        auto cover = [&](int x) { return RingCoverage(x - X, dy, inner, outer); };
+        auto blend = [&](int From, int To) {
+            BlendEdge(Target, row, From, std::min(To, holeStart), Color, coverage, cover);
+            BlendEdge(Target, row, std::max(From, holeEnd), To, Color, coverage, cover);
+        };
+        int x0, x1, hole0, hole1;
+        if (!EllipseRowSpan(ring, row, x0, x1, hole0, hole1)) {
+            blend(X - edge, X + edge + 1);
+            continue;
+        }
+        full(row, x0, hole0);
+        full(row, hole1, x1);
+        blend(X - edge, x0);
+        blend(hole0, hole1);
+        blend(x1, X + edge + 1);
+    }
+    if (isLarge) {
+        FillSpans(Target, spans, Color);
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+
+#include "raster.h"
+#include "stroke.h"
+
+// Anti-aliased lines and circles. Pixel centres sit on integer coordinates as
+// in the aliased primitives, and each shape has the same footprint as its
+// aliased version: those pixels are filled as plain spans, and only the pixels
+// within one more pixel of the edge are blended, by 8-bit coverage.
+
+// A stroke's aliased pixels (Inner) and the pixels that may get some coverage
+// (Outer, one pixel wider).
+struct CoverageStroke {
+    Stroke Inner;
+    Stroke Outer;
+    double InverseLength; // 1 / |B - A|, 0 for a dot
+    double Support;       // square brush: how far it reaches across the segment
+};
+
+CoverageStroke MakeCoverageStroke(int X1, int Y1, int X2, int Y2, int LineWidth, BrushShape Brush);
+
+// Coverage of a pixel outside the stroke's aliased pixels.
+uint8_t StrokeCoverage(const CoverageStroke& S, int X, int Y);
+
+// The aliased circle (see RingBounds) is the ring of pixels whose distance
+// from the centre rounds to Inner to Outer; Inner <= 0 leaves no hole.
+// Coverage of a pixel outside it, DX and DY away from the centre: full at
+// Inner to Outer, none a pixel further out or in.
+uint8_t RingCoverage(int64_t DX, int64_t DY, int Inner, int Outer);
+
+void DrawLineAA(Canvas& Target, int X1, int Y1, int X2, int Y2, u32 Color, int LineWidth, BrushShape Brush);
+void DrawCircleAA(Canvas& Target, int X, int Y, int Radius, u32 Color, int LineWidth, bool isFilled);
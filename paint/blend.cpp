@@ -0,0 +1,92 @@
+#include "blend.h"
+
+#include <algorithm>
+
+#include "span.h"
+#include "trace.h"
+
+void BeginBlendedStroke(Canvas& Target, uint8_t Opacity, BlendMode Mode) {
+    EndBlendedStroke(Target);
+    if (Opacity == 255 && Mode == BLEND_NORMAL) {
+        return;
+    }
+    auto stroke = std::make_shared<BlendedStroke>();
+    stroke->Opacity = Opacity;
+    stroke->Mode = Mode;
+    stroke->Before.resize(Target.Tiles.size());
+    stroke->Coverage.resize(Target.Tiles.size());
+    stroke->Colors.resize(Target.Tiles.size());
+    Target.Blend = std::move(stroke);
+}
+
+void EndBlendedStroke(Canvas& Target) {
+    Target.Blend.reset();
+}
+
+void BlendStrokeRun(Canvas& Target, int Tile, int Y, int X0, const uint8_t* Coverage, int Count, u32 Color) {
+    BlendedStroke& stroke = *Target.Blend;
+    TileRef& before = stroke.Before[Tile];
+    u32& color = stroke.Colors[Tile];
+    if (!before) {
+        before = Target.Tiles[Tile];
+        stroke.Coverage[Tile] = std::make_unique<uint8_t[]>(TILE_SIZE * TILE_SIZE);
+        color = Color;
+    }
+    else if (color != Color) {
+        color = BLEND_MIXED_COLORS;
+    }
+
+    int offset = (Y & TILE_MASK) * TILE_SIZE + (X0 & TILE_MASK);
+    uint8_t* coverage = stroke.Coverage[Tile].get() + offset;
+    bool isRaised = false;
+    if (Coverage) {
+        for (int i = 0; i < Count; i++) {
+            isRaised |= Coverage[i] > coverage[i];
+            coverage[i] = std::max(coverage[i], Coverage[i]);
+        }
+    }
+    else {
+        for (int i = 0; i < Count; i++) {
+            isRaised |= coverage[i] != 255;
+            coverage[i] = 255;
+        }
+    }
+    if (!isRaised && color == Color) {
+        return;
+    }
+
+    // Writing copies the tile on first use, so the old one stays as it was.
+    u32 uniform[TILE_SIZE];
+    const u32* from = uniform;
+    if (before->Pixels.empty()) {
+        std::fill(uniform, uniform + Count, before->Uniform);
+    }
+    else {
+        from = before->Pixels.data() + offset;
+    }
+    StrokeRow(WritableTile(Target, Tile) + offset, from, coverage, Count, Color, stroke.Opacity, stroke.Mode);
+}
+
+void BlendStrokeSpan(Canvas& Target, int Y, int X0, const uint8_t* Coverage, int Count, u32 Color) {
+    if (Y < 0 || Y >= Target.Height) {
+        return;
+    }
+    int x0 = std::max(X0, 0);
+    int x1 = std::min(X0 + Count, Target.Width);
+    if (x0 >= x1) {
+        return;
+    }
+    TracePixelsWritten(x1 - x0);
+    if (Coverage) {
+        Coverage += x0 - X0;
+    }
+    for (int x = x0; x < x1;) {
+        int end = std::min(x1, (x | TILE_MASK) + 1);
+        BlendStrokeRun(Target, TileIndex(Target, x, Y), Y, x, Coverage, end - x, Color);
+        if (Coverage) {
+            Coverage += end - x;
+        }
+        x = end;
+    }
+    MarkDirty(Target, x0, Y, x1, Y + 1);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include "canvas.h"
+
+// How a stroke's colour S combines with the pixel D it lands on, per colour
+// channel; transparency, the top byte, is always S's:
+//   normal     S
+//   multiply   S * D / 255
+//   screen     S + D - S * D / 255
+//   add        min(S + D, 255)
+// The pixel then moves from D towards that by its coverage times the stroke's
+// opacity, a = Div255(Coverage * Opacity), as BlendRow mixes: every channel
+// becomes (B * a' + D * (256 - a')) >> 8 with a' = a + (a >> 7). Divisions by
+// 255 round to nearest. On a layer, D is what the layer holds there, not what
+// shows through it.
+enum BlendMode {
+    BLEND_NORMAL,
+    BLEND_MULTIPLY,
+    BLEND_SCREEN,
+    BLEND_ADD
+};
+
+constexpr int BLEND_MODE_COUNT = 4;
+
+// Fully transparent yet with colour in it, which no premultiplied pixel is, so
+// it never matches a stroke colour.
+constexpr u32 BLEND_MIXED_COLORS = 0xffffffff;
+
+// A stroke being drawn with opacity or a blend mode. Each pixel's result
+// depends only on what it was before the stroke and the highest coverage any
+// part of the stroke gave it, so overlapping stamps and segments don't build
+// up: every pixel is blended once, however often it is drawn over.
+struct BlendedStroke {
+    uint8_t Opacity = 255;
+    BlendMode Mode = BLEND_NORMAL;
+
+    // Per tile, set when the stroke first touches it: the tile as it was,
+    // shared with the history rather than copied, and the highest coverage
+    // of each of its pixels so far, TILE_SIZE * TILE_SIZE.
+    std::vector<TileRef> Before;
+    std::vector<std::unique_ptr<uint8_t[]>> Coverage;
+    // Per tile, the colour all of its stroke pixels were blended with, or
+    // BLEND_MIXED_COLORS. A run that raises no coverage in a single-colour
+    // tile would come out the same, so it is skipped.
+    std::vector<u32> Colors;
+};
+
+// From here on the raster functions blend what they draw on Target as one
+// stroke, until EndBlendedStroke or the tile grid is replaced. Ends the
+// stroke already in progress. At full opacity in normal mode blending is the
+// same as drawing, so no stroke is started and spans are written as usual.
+void BeginBlendedStroke(Canvas& Target, uint8_t Opacity, BlendMode Mode);
+void EndBlendedStroke(Canvas& Target);
+
+// Blends Count pixels of row Y from X0 into Target's stroke, each at its own
+// coverage, or at full coverage when Coverage is null. Clipped; reports
+// damage like BlendSpan.
+void BlendStrokeSpan(Canvas& Target, int Y, int X0, const uint8_t* Coverage, int Count, u32 Color);
+// The same within one tile, already clipped, without reporting damage. Tiles
+// are independent, so different tiles can be done on different threads.
+void BlendStrokeRun(Canvas& Target, int Tile, int Y, int X0, const uint8_t* Coverage, int Count, u32 Color);
@@ -0,0 +1,342 @@
+#include "bmp.h"
+
+#include <string.h>
+#include <fstream>
+#include <vector>
+
+#include "cpu.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+constexpr int BMP_FILE_HEADER_BYTES = 14;
+constexpr int BMP_INFO_HEADER_BYTES = 40;
+
+static uint32_t Get16(const uint8_t* At) {
+    return At[0] | At[1] << 8;
+}
+
+static uint32_t Get32(const uint8_t* At) {
+    return Get16(At) | Get16(At + 2) << 16;
+}
+
+static void Put16(uint8_t* At, uint32_t Value) {
+    At[0] = (uint8_t)Value;
+    At[1] = (uint8_t)(Value >> 8);
+}
+
+static void Put32(uint8_t* At, uint32_t Value) {
+    Put16(At, Value);
+    Put16(At + 2, Value >> 16);
+}
+
+static size_t BmpRowBytes(int Width, BmpFormat Format) {
+    size_t bytes = (size_t)Width * (Format == BMP_24_BIT ? 3 : 4);
+    return (bytes + 3) & ~(size_t)3;
+}
+
+// BITMAPFILEHEADER and BITMAPINFOHEADER, spelled out byte by byte so the
+// layout doesn't depend on windows.h or struct packing.
+static void BuildBmpHeader(uint8_t* Header, int Width, int Height, BmpFormat Format) {
+    size_t imageBytes = BmpRowBytes(Width, Format) * Height;
+    memset(Header, 0, BMP_FILE_HEADER_BYTES + BMP_INFO_HEADER_BYTES);
+
+    Header[0] = 'B';
+    Header[1] = 'M';
+    Put32(Header + 2, (uint32_t)(BMP_FILE_HEADER_BYTES + BMP_INFO_HEADER_BYTES + imageBytes));
+    Put32(Header + 10, BMP_FILE_HEADER_BYTES + BMP_INFO_HEADER_BYTES);
+
+    uint8_t* info = Header + BMP_FILE_HEADER_BYTES;
+    Put32(info, BMP_INFO_HEADER_BYTES);
+    Put32(info + 4, (uint32_t)Width);
+    Put32(info + 8, (uint32_t)Height); // positive: bottom-up
+    Put16(info + 12, 1);
+    Put16(info + 14, Format == BMP_24_BIT ? 24 : 32);
+    Put32(info + 20, (uint32_t)imageBytes);
+}
+
+static void PackBGRScalar(const u32* Source, uint8_t* Dest, int Count) {
+    for (int i = 0; i < Count; i++) {
+        Dest[3 * i] = (uint8_t)Source[i];
+        Dest[3 * i + 1] = (uint8_t)(Source[i] >> 8);
+        Dest[3 * i + 2] = (uint8_t)(Source[i] >> 16);
+    }
+}
+
+#if PAINT_X86
+PAINT_TARGET_AVX2 static void PackBGRAVX2(const u32* Source, uint8_t* Dest, int Count) {
+    // Per 128-bit lane, move the 12 colour bytes to the front, then pull the
+    // two lanes' 12 bytes together. Each store writes 32 bytes but only
+    // advances 24, so the loop stops while there is room for the overhang.
+    const __m256i shuffle = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    int i = 0;
+    for (; i + 11 <= Count; i += 8) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i*)(Source + i));
+        __m256i packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(pixels, shuffle), compact);
+        _mm256_storeu_si256((__m256i*)(Dest + 3 * i), packed);
+    }
+    PackBGRScalar(Source + i, Dest + 3 * i, Count - i);
+}
+#endif
+
+void PackBGR(const u32* Source, uint8_t* Dest, int Count) {
+#if PAINT_X86
+    if (GetCpuFeatures().AVX2) {
+        PackBGRAVX2(Source, Dest, Count);
+        return;
+    }
+#endif
+    PackBGRScalar(Source, Dest, Count);
+}
+
+static void UnpackBGRScalar(const uint8_t* Source, u32* Dest, int Count) {
+    for (int i = 0; i < Count; i++) {
+        Dest[i] = Source[3 * i] | Source[3 * i + 1] << 8 | Source[3 * i + 2] << 16;
+    }
+}
+
+#if PAINT_X86
+PAINT_TARGET_AVX2 static void UnpackBGRAVX2(const uint8_t* Source, u32* Dest, int Count) {
+    // Spread 24 bytes over the two lanes, 12 each, then give every pixel its
+    // own dword. Each load reads 32 bytes but only consumes 24, so the loop
+    // stops while the overhang is still inside the source.
+    const __m256i spread = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+    const __m256i shuffle = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    int i = 0;
+    for (; i + 11 <= Count; i += 8) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(Source + 3 * i));
+        __m256i pixels = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(bytes, spread), shuffle);
+        _mm256_storeu_si256((__m256i*)(Dest + i), pixels);
+    }
+    UnpackBGRScalar(Source + 3 * i, Dest + i, Count - i);
+}
+#endif
+
+void UnpackBGR(const uint8_t* Source, u32* Dest, int Count) {
+#if PAINT_X86
+    if (GetCpuFeatures().AVX2) {
+        UnpackBGRAVX2(Source, Dest, Count);
+        return;
+    }
+#endif
+    UnpackBGRScalar(Source, Dest, Count);
+}
+
+// 32-bit rows keep their colour bytes; alpha is cleared because the canvas
+// compares whole pixel values.
+static void CopyBGRX(const uint8_t* Source, u32* Dest, int Count) {
+    int i = 0;
+#if PAINT_SSE2
+    __m128i rgb = _mm_set1_epi32(0x00ffffff);
+    for (; i + 4 <= Count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(Source + 4 * i));
+        _mm_storeu_si128((__m128i*)(Dest + i), _mm_and_si128(pixels, rgb));
+    }
+#endif
+    for (; i < Count; i++) {
+        Dest[i] = Get32(Source + 4 * i) & 0x00ffffff;
+    }
+}
+
+struct BmpLayout {
+    int Width;
+    int Height;
+    int BitsPerPixel;
+    bool TopDown;
+    size_t PixelOffset;
+    size_t RowBytes;
+};
+
+static bool ParseBmpHeader(const uint8_t* Data, size_t Size, BmpLayout& Layout) {
+    if (Size < BMP_FILE_HEADER_BYTES + BMP_INFO_HEADER_BYTES || Data[0] != 'B' || Data[1] != 'M') {
+        return false;
+    }
+    const uint8_t* info = Data + BMP_FILE_HEADER_BYTES;
+    uint32_t infoBytes = Get32(info);
+    int32_t width = (int32_t)Get32(info + 4);
+    int32_t height = (int32_t)Get32(info + 8);
+    uint32_t bits = Get16(info + 14);
+    uint32_t compression = Get32(info + 16);
+    if (infoBytes < BMP_INFO_HEADER_BYTES || width <= 0 || height == 0 || height == INT32_MIN) {
+        return false;
+    }
+    if (bits != 24 && bits != 32) {
+        return false;
+    }
+
+    // BI_RGB, or for 32-bit files BI_BITFIELDS with the usual BGRA masks.
+    const uint32_t BI_RGB_COMPRESSION = 0;
+    const uint32_t BI_BITFIELDS_COMPRESSION = 3;
+    if (compression == BI_BITFIELDS_COMPRESSION && bits == 32) {
+        // The masks follow the 40 byte header, or are part of a longer one.
+        size_t masks = BMP_FILE_HEADER_BYTES + BMP_INFO_HEADER_BYTES;
+        if (masks + 12 > Size || Get32(Data + masks) != 0x00ff0000 || Get32(Data + masks + 4) != 0x0000ff00 || Get32(Data + masks + 8) != 0x000000ff) {
+            return false;
+        }
+    }
+    else if (compression != BI_RGB_COMPRESSION) {
+        return false;
+    }
+
+    Layout.Width = width;
+    Layout.Height = height < 0 ? -height : height;
+    Layout.TopDown = height < 0;
+    Layout.BitsPerPixel = (int)bits;
+    Layout.PixelOffset = Get32(Data + 10);
+    Layout.RowBytes = ((size_t)width * (bits / 8) + 3) & ~(size_t)3;
+    if (Layout.Width > BMP_MAX_SIDE || Layout.Height > BMP_MAX_SIDE) {
+        return false;
+    }
+    return Layout.PixelOffset <= Size && Layout.RowBytes * Layout.Height <= Size - Layout.PixelOffset;
+}
+
+bool LoadBmp(Canvas& Target, const std::filesystem::path& Path) {
+    TraceScope trace("LoadBmp");
+    MappedFile file;
+    if (!MapFile(file, Path)) {
+        return false;
+    }
+    BmpLayout layout;
+    if (!ParseBmpHeader(file.Data, file.Size, layout)) {
+        UnmapFile(file);
+        return false;
+    }
+
+    Canvas loaded;
+    loaded.Width = layout.Width;
+    loaded.Height = layout.Height;
+    loaded.TilesX = (layout.Width + TILE_SIZE - 1) / TILE_SIZE;
+    loaded.TilesY = (layout.Height + TILE_SIZE - 1) / TILE_SIZE;
+    loaded.LiveBytes = Target.LiveBytes;
+    loaded.Tiles.resize((size_t)loaded.TilesX * loaded.TilesY);
+
+    // Each job converts one row of tiles, reading its file rows front to back.
+    // Tiles that turn out a single colour keep only that colour.
+    ParallelFor(loaded.TilesY, [&](int TileRow) {
+        int y0 = TileRow * TILE_SIZE;
+        int rows = std::min(TILE_SIZE, layout.Height - y0);
+        for (int tx = 0; tx < loaded.TilesX; tx++) {
+            int tile = TileRow * loaded.TilesX + tx;
+            int x0 = tx * TILE_SIZE;
+            int width = std::min(TILE_SIZE, layout.Width - x0);
+            TileRef result = MakePixelTile(loaded);
+            u32* pixels = result->Pixels.data();
+
+            bool isUniform = true;
+            for (int y = 0; y < rows; y++) {
+                int fileRow = layout.TopDown ? y0 + y : layout.Height - 1 - (y0 + y);
+                const uint8_t* source = file.Data + layout.PixelOffset + layout.RowBytes * fileRow;
+                u32* row = pixels + y * TILE_SIZE;
+                if (layout.BitsPerPixel == 24) {
+                    UnpackBGR(source + 3 * x0, row, width);
+                }
+                else {
+                    CopyBGRX(source + 4 * x0, row, width);
+                }
+                for (int x = 0; x < width && isUniform; x++) {
+                    isUniform = row[x] == pixels[0];
+                }
+            }
+            loaded.Tiles[tile] = isUniform ? MakeUniformTile(loaded, pixels[0]) : std::move(result);
+        }
+    });
+    UnmapFile(file);
+
+    PixelRect before = CanvasBounds(Target);
+    SetCanvasTiles(Target, loaded.Width, loaded.Height, std::move(loaded.Tiles));
+    PixelRect after = Union(before, CanvasBounds(Target));
+    MarkDirty(Target, after.X0, after.Y0, after.X1, after.Y1);
+    return true;
+}
+
+bool WriteBmp(const Canvas& Source, const std::filesystem::path& Path, BmpFormat Format, const std::function<void(int)>& OnRows) {
+    TraceScope trace("WriteBmp");
+    std::ofstream file(Path, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    uint8_t header[BMP_FILE_HEADER_BYTES + BMP_INFO_HEADER_BYTES];
+    BuildBmpHeader(header, Source.Width, Source.Height, Format);
+    file.write((const char*)header, sizeof(header));
+
+    // Whole rows are assembled into one buffer and written in a single call.
+    size_t rowBytes = BmpRowBytes(Source.Width, Format);
+    int rowsPerBatch = (int)std::max<size_t>(1, BMP_WRITE_BUFFER_BYTES / rowBytes);
+    std::vector<uint8_t> buffer(rowBytes * rowsPerBatch, 0);
+    std::vector<u32> row(Format == BMP_24_BIT ? Source.Width : 0);
+
+    for (int done = 0; done < Source.Height;) {
+        int count = std::min(rowsPerBatch, Source.Height - done);
+        for (int i = 0; i < count; i++) {
+            int y = Source.Height - 1 - (done + i);
+            uint8_t* out = &buffer[rowBytes * i];
+            if (Format == BMP_24_BIT) {
+                ReadCanvasSpan(Source, y, 0, Source.Width, row.data());
+                PackBGR(row.data(), out, Source.Width);
+            }
+            else {
+                ReadCanvasSpan(Source, y, 0, Source.Width, (u32*)out);
+            }
+        }
+        file.write((const char*)buffer.data(), rowBytes * count);
+        if (!file) {
+            return false;
+        }
+        done += count;
+        if (OnRows) {
+            OnRows(done);
+        }
+    }
+
+    file.close();
+    return !file.fail();
+}
+
+bool StartExport(ExportJob& Job, const Canvas& Source, const std::filesystem::path& Path, BmpFormat Format, ExportProgress Progress) {
+    if (IsExportRunning(Job)) {
+        return false;
+    }
+    FinishExport(Job);
+
+    Canvas snapshot = Source;
+    snapshot.Damage = nullptr;
+    snapshot.Blend.reset();
+    Job.RowsDone = 0;
+    Job.RowCount = Source.Height;
+    Job.Finished = false;
+    Job.Succeeded = false;
+
+    Job.Thread = std::thread([&Job, snapshot = std::move(snapshot), Path, Format, Progress = std::move(Progress)] {
+        if (IsTracing()) {
+            SetTraceThreadName("export");
+        }
+        bool succeeded = WriteBmp(snapshot, Path, Format, [&](int RowsDone) {
+            Job.RowsDone = RowsDone;
+            if (Progress) {
+                Progress(RowsDone, Job.RowCount, false, false);
+            }
+        });
+        Job.Succeeded = succeeded;
+        Job.Finished = true;
+        if (Progress) {
+            Progress(Job.RowsDone, Job.RowCount, true, succeeded);
+        }
+    });
+    return true;
+}
+
+bool IsExportRunning(const ExportJob& Job) {
+    return Job.Thread.joinable() && !Job.Finished;
+}
+
+void FinishExport(ExportJob& Job) {
+    if (Job.Thread.joinable()) {
+        Job.Thread.join();
+    }
+}
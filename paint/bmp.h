@@ -0,0 +1,53 @@
+#pragma once
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <thread>
+
+#include "canvas.h"
+
+enum BmpFormat {
+    BMP_32_BIT,
+    BMP_24_BIT  // rows packed to BGR and padded to 4 bytes
+};
+
+// Rows are written in batches of about this many bytes.
+constexpr size_t BMP_WRITE_BUFFER_BYTES = 4 * 1024 * 1024;
+
+// Writes Source bottom-up. OnRows, when given, is called with the number of
+// rows written so far after every batch.
+bool WriteBmp(const Canvas& Source, const std::filesystem::path& Path, BmpFormat Format, const std::function<void(int)>& OnRows = nullptr);
+
+// Drops the alpha byte: Count BGRA pixels to 3 * Count bytes.
+void PackBGR(const u32* Source, uint8_t* Dest, int Count);
+
+// Larger images are refused by LoadBmp rather than allocated.
+constexpr int BMP_MAX_SIDE = 1 << 16;
+
+// Replaces Target with a 24- or 32-bit uncompressed BMP, top-down or
+// bottom-up. The file is memory-mapped and converted straight into tiles, one
+// row of tiles per job on the worker pool. Returns false, leaving Target
+// alone, if the file can't be read or isn't a supported BMP.
+bool LoadBmp(Canvas& Target, const std::filesystem::path& Path);
+
+// The inverse of PackBGR, with a zero alpha byte.
+void UnpackBGR(const uint8_t* Source, u32* Dest, int Count);
+
+// Called on the export thread: after every batch of rows, then once more with
+// Finished set. Keep it short; the UI thread should do the real work.
+typedef std::function<void(int RowsDone, int RowCount, bool Finished, bool Succeeded)> ExportProgress;
+
+struct ExportJob {
+    std::thread Thread;
+    std::atomic<int> RowsDone{ 0 };
+    int RowCount = 0;
+    std::atomic<bool> Finished{ false };
+    bool Succeeded = false;
+};
+
+// Snapshots Source (tile pointers only, later edits copy their tiles) and
+// writes it on a background thread. Returns false if Job is still running.
+bool StartExport(ExportJob& Job, const Canvas& Source, const std::filesystem::path& Path, BmpFormat Format, ExportProgress Progress);
+bool IsExportRunning(const ExportJob& Job);
+// Waits for the thread; Job can be started again afterwards.
+void FinishExport(ExportJob& Job);
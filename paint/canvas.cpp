@@ -0,0 +1,150 @@
+#include "canvas.h"
+
+#include <algorithm>
+#include <string.h>
+
+CanvasTile::~CanvasTile() {
+    if (LiveBytes) {
+        *LiveBytes -= Bytes();
+    }
+}
+
+void InitCanvas(Canvas& Target, int Width, int Height, u32 Color) {
+    Target.Width = Width;
+    Target.Height = Height;
+    Target.TilesX = (Width + TILE_SIZE - 1) / TILE_SIZE;
+    Target.TilesY = (Height + TILE_SIZE - 1) / TILE_SIZE;
+    if (!Target.LiveBytes) {
+        Target.LiveBytes = std::make_shared<std::atomic<size_t>>(0);
+    }
+    Target.Tiles.assign((size_t)Target.TilesX * Target.TilesY, MakeUniformTile(Target, Color));
+    Target.Blend.reset();
+}
+
+size_t CanvasBytes(const Canvas& Target) {
+    return Target.LiveBytes ? Target.LiveBytes->load() : 0;
+}
+
+void SetCanvasTiles(Canvas& Target, int Width, int Height, std::vector<TileRef> Tiles) {
+    Target.Width = Width;
+    Target.Height = Height;
+    Target.TilesX = (Width + TILE_SIZE - 1) / TILE_SIZE;
+    Target.TilesY = (Height + TILE_SIZE - 1) / TILE_SIZE;
+    Target.Tiles = std::move(Tiles);
+    Target.Blend.reset();
+}
+
+TileRef MakeUniformTile(const Canvas& Target, u32 Color) {
+    auto tile = std::make_shared<CanvasTile>();
+    tile->Uniform = Color;
+    tile->LiveBytes = Target.LiveBytes;
+    *Target.LiveBytes += tile->Bytes();
+    return tile;
+}
+
+TileRef MakePixelTile(const Canvas& Target) {
+    auto tile = std::make_shared<CanvasTile>();
+    tile->Pixels.resize(TILE_SIZE * TILE_SIZE);
+    tile->LiveBytes = Target.LiveBytes;
+    *Target.LiveBytes += tile->Bytes();
+    return tile;
+}
+
+u32* WritableTile(Canvas& Target, int Tile) {
+    TileRef& slot = Target.Tiles[Tile];
+    if (slot.use_count() == 1 && !slot->Pixels.empty()) {
+        return slot->Pixels.data();
+    }
+
+    auto tile = std::make_shared<CanvasTile>();
+    tile->Uniform = slot->Uniform;
+    if (slot->Pixels.empty()) {
+        tile->Pixels.assign(TILE_SIZE * TILE_SIZE, slot->Uniform);
+    }
+    else {
+        tile->Pixels = slot->Pixels;
+    }
+    tile->LiveBytes = Target.LiveBytes;
+    *Target.LiveBytes += tile->Bytes();
+    slot = std::move(tile);
+    return slot->Pixels.data();
+}
+
+void SetTileUniform(Canvas& Target, int Tile, const TileRef& Uniform) {
+    Target.Tiles[Tile] = Uniform;
+}
+
+void ReadCanvasSpan(const Canvas& Target, int Y, int X0, int X1, u32* Out) {
+    while (X0 < X1) {
+        int end = std::min(X1, (X0 | TILE_MASK) + 1);
+        const CanvasTile& tile = *Target.Tiles[TileIndex(Target, X0, Y)];
+        if (tile.Pixels.empty()) {
+            std::fill(Out, Out + (end - X0), tile.Uniform);
+        }
+        else {
+            memcpy(Out, &tile.Pixels[(Y & TILE_MASK) * TILE_SIZE + (X0 & TILE_MASK)], (end - X0) * sizeof(u32));
+        }
+        Out += end - X0;
+        X0 = end;
+    }
+}
+
+void WriteCanvasSpan(Canvas& Target, int Y, int X0, int X1, const u32* In) {
+    while (X0 < X1) {
+        int end = std::min(X1, (X0 | TILE_MASK) + 1);
+        u32* pixels = WritableTile(Target, TileIndex(Target, X0, Y));
+        memcpy(pixels + (Y & TILE_MASK) * TILE_SIZE + (X0 & TILE_MASK), In, (end - X0) * sizeof(u32));
+        In += end - X0;
+        X0 = end;
+    }
+}
+
+bool IsRegionUniform(const Canvas& Target, const PixelRect& Rect, u32& Color) {
+    bool first = true;
+    for (int ty = Rect.Y0 >> TILE_SHIFT; ty <= (Rect.Y1 - 1) >> TILE_SHIFT; ty++) {
+        for (int tx = Rect.X0 >> TILE_SHIFT; tx <= (Rect.X1 - 1) >> TILE_SHIFT; tx++) {
+            const CanvasTile& tile = *Target.Tiles[ty * Target.TilesX + tx];
+            if (!tile.Pixels.empty() || (!first && tile.Uniform != Color)) {
+                return false;
+            }
+            Color = tile.Uniform;
+            first = false;
+        }
+    }
+    return !first;
+}
+
+void LoadCanvasPixels(Canvas& Target, const u32* Pixels, size_t Stride) {
+    for (int tile = 0; tile < (int)Target.Tiles.size(); tile++) {
+        PixelRect bounds = TileBounds(Target, tile);
+        const u32* first = Pixels + (size_t)bounds.Y0 * Stride + bounds.X0;
+        int width = bounds.X1 - bounds.X0;
+
+        bool isUniform = true;
+        for (int y = 0; y < bounds.Y1 - bounds.Y0 && isUniform; y++) {
+            const u32* row = first + (size_t)y * Stride;
+            for (int x = 0; x < width; x++) {
+                if (row[x] != first[0]) {
+                    isUniform = false;
+                    break;
+                }
+            }
+        }
+
+        if (isUniform) {
+            SetTileUniform(Target, tile, MakeUniformTile(Target, first[0]));
+            continue;
+        }
+        u32* pixels = WritableTile(Target, tile);
+        for (int y = 0; y < bounds.Y1 - bounds.Y0; y++) {
+            memcpy(pixels + y * TILE_SIZE, first + (size_t)y * Stride, width * sizeof(u32));
+        }
+    }
+}
+
+void ResolveCanvas(const Canvas& Target, const PixelRect& Rect, u32* Dest, size_t DestStride) {
+    for (int y = Rect.Y0; y < Rect.Y1; y++) {
+        ReadCanvasSpan(Target, y, Rect.X0, Rect.X1, Dest);
+        Dest += DestStride;
+    }
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "damage.h"
+#include "rect.h"
+
+typedef uint32_t u32;
+
+// Pixels are premultiplied colour with transparency, 255 - alpha, in the top
+// byte. Plain 0x00RRGGBB colours, which is everything the tools draw and every
+// loaded image, are opaque; anti-aliased edges blend towards LAYER_CLEAR and
+// stay premultiplied. Only layers above the bottom one show the difference.
+constexpr u32 LAYER_CLEAR = 0xff000000;
+
+constexpr int TILE_SIZE = 64;
+constexpr int TILE_SHIFT = 6;
+constexpr int TILE_MASK = TILE_SIZE - 1;
+
+// One TILE_SIZE x TILE_SIZE block of pixels. A tile that holds a single colour
+// stores only that colour; pixel storage is allocated on the first write that
+// breaks it up. Tiles are shared by pointer between the canvas and the undo
+// history and are never written while shared, so WritableTile copies first.
+struct CanvasTile {
+    u32 Uniform = 0;
+    std::vector<u32> Pixels; // TILE_SIZE * TILE_SIZE, empty when every pixel is Uniform
+    std::shared_ptr<std::atomic<size_t>> LiveBytes;
+
+    ~CanvasTile();
+    size_t Bytes() const { return sizeof(CanvasTile) + Pixels.size() * sizeof(u32); }
+};
+
+typedef std::shared_ptr<CanvasTile> TileRef;
+
+struct BlendedStroke;
+struct SelectionMask;
+
+// A drawing target. Damage, when set, is told about every pixel the raster
+// functions write so the change can be presented. Blend, when set, makes
+// them blend into a stroke in progress instead of writing (see blend.h).
+// Selection, when set, limits them to its pixels (see selection.h); whole
+// canvas operations like transforms and resizing ignore it, and drop it.
+struct Canvas {
+    int Width = 0;
+    int Height = 0;
+    int TilesX = 0;
+    int TilesY = 0;
+    std::vector<TileRef> Tiles;
+
+    // Bytes held by every tile created for this canvas, including the ones
+    // only the undo history still references.
+    std::shared_ptr<std::atomic<size_t>> LiveBytes;
+
+    DamageTracker* Damage = nullptr;
+    std::shared_ptr<BlendedStroke> Blend;
+    std::shared_ptr<const SelectionMask> Selection;
+};
+
+// Every tile starts out as the same shared uniform tile, so this costs
+// O(tiles) pointers no matter how large the canvas is. A canvas that already
+// has a byte counter keeps it, so several canvases can share one.
+void InitCanvas(Canvas& Target, int Width, int Height, u32 Color);
+size_t CanvasBytes(const Canvas& Target);
+
+// Swaps in a whole new tile grid, possibly for a different canvas size. A
+// stroke in progress ends, since its tiles no longer line up.
+void SetCanvasTiles(Canvas& Target, int Width, int Height, std::vector<TileRef> Tiles);
+
+inline PixelRect CanvasBounds(const Canvas& Target) {
+    return { 0, 0, Target.Width, Target.Height };
+}
+
+inline int TileIndex(const Canvas& Target, int X, int Y) {
+    return (Y >> TILE_SHIFT) * Target.TilesX + (X >> TILE_SHIFT);
+}
+
+// Canvas-space pixels covered by a tile, clipped to the canvas.
+inline PixelRect TileBounds(const Canvas& Target, int Tile) {
+    int x = (Tile % Target.TilesX) * TILE_SIZE;
+    int y = (Tile / Target.TilesX) * TILE_SIZE;
+    return { x, y, std::min(x + TILE_SIZE, Target.Width), std::min(y + TILE_SIZE, Target.Height) };
+}
+
+TileRef MakeUniformTile(const Canvas& Target, u32 Color);
+// A new unshared tile with pixel storage, for building tiles from scratch.
+TileRef MakePixelTile(const Canvas& Target);
+
+// Pixels of a tile that can be written in place, TILE_SIZE per row. Copies the
+// tile first if anything else references it.
+u32* WritableTile(Canvas& Target, int Tile);
+
+// Replaces a whole tile with a single colour, dropping its pixel storage.
+void SetTileUniform(Canvas& Target, int Tile, const TileRef& Uniform);
+
+inline u32 GetPixel(const Canvas& Target, int X, int Y) {
+    const CanvasTile& tile = *Target.Tiles[TileIndex(Target, X, Y)];
+    if (tile.Pixels.empty()) {
+        return tile.Uniform;
+    }
+    return tile.Pixels[(Y & TILE_MASK) * TILE_SIZE + (X & TILE_MASK)];
+}
+
+// Row access across tile boundaries; the span must lie inside the canvas.
+// Like WritableTile, these don't report damage; callers mark what they wrote.
+void ReadCanvasSpan(const Canvas& Target, int Y, int X0, int X1, u32* Out);
+void WriteCanvasSpan(Canvas& Target, int Y, int X0, int X1, const u32* In);
+
+// True when every pixel in Rect comes from uniform tiles of one colour.
+bool IsRegionUniform(const Canvas& Target, const PixelRect& Rect, u32& Color);
+
+// Replaces the whole canvas with a linear image of the same size. Tiles that
+// come out a single colour are stored as uniform tiles.
+void LoadCanvasPixels(Canvas& Target, const u32* Pixels, size_t Stride);
+
+// Copies Rect out to a linear buffer, Dest pointing at its top-left pixel.
+void ResolveCanvas(const Canvas& Target, const PixelRect& Rect, u32* Dest, size_t DestStride);
+
+inline void MarkDirty(Canvas& Target, int X0, int Y0, int X1, int Y1) {
+    if (Target.Damage) {
+        AddDamage(*Target.Damage, { X0, Y0, X1, Y1 });
+    }
+}
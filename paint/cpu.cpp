@@ -0,0 +1,37 @@
+#include "cpu.h"
+
+#if defined(_MSC_VER) && PAINT_X86
+#include <intrin.h>
+#endif
+
+static CpuFeatures DetectCpuFeatures() {
+    CpuFeatures features = {};
+#if PAINT_X86
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    features.SSE2 = (info[3] >> 26) & 1;
+    bool osxsave = (info[2] >> 27) & 1;
+    bool avx = (info[2] >> 28) & 1;
+
+    // AVX2 also needs the OS to save the YMM registers on context switches.
+    if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(info, 7, 0);
+        features.AVX2 = (info[1] >> 5) & 1;
+    }
+#else
+    __builtin_cpu_init();
+    features.SSE2 = __builtin_cpu_supports("sse2");
+    features.AVX2 = __builtin_cpu_supports("avx2");
+#endif
+#endif
+    return features;
+}
+
+const CpuFeatures& GetCpuFeatures() {
+    static CpuFeatures features = DetectCpuFeatures();
+    return features;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PAINT_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(_M_X64) || defined(__SSE2__)
+#define PAINT_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// MSVC lets any function use any intrinsic; GCC and Clang need the target
+// spelled out on functions that are only called after a runtime check.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define PAINT_TARGET_AVX2
+#else
+#define PAINT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+struct CpuFeatures {
+    bool SSE2;
+    bool AVX2;
+};
+
+const CpuFeatures& GetCpuFeatures();
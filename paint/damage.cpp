@@ -0,0 +1,101 @@
+#include "damage.h"
+
+#include <stdint.h>
+
+// Blitting a few extra pixels is cheaper than another StretchDIBits call, so
+// rectangles merge when their union is at most this much bigger than the two
+// of them, or small in absolute terms.
+constexpr int64_t MERGE_SLACK_PIXELS = 64 * 64;
+
+static int64_t Area(const PixelRect& R) {
+    return IsEmpty(R) ? 0 : (int64_t)(R.X1 - R.X0) * (R.Y1 - R.Y0);
+}
+
+static bool Contains(const PixelRect& Outer, const PixelRect& Inner) {
+    return Inner.X0 >= Outer.X0 && Inner.Y0 >= Outer.Y0 && Inner.X1 <= Outer.X1 && Inner.Y1 <= Outer.Y1;
+}
+
+bool ShouldMergeDamage(const PixelRect& A, const PixelRect& B) {
+    int64_t separate = Area(A) + Area(B);
+    int64_t merged = Area(Union(A, B));
+    return merged <= 2 * separate || merged - separate <= MERGE_SLACK_PIXELS;
+}
+
+// Merges pairs until nothing overlaps and nothing is worth merging, then keeps
+// merging the cheapest pair while there are more than Limit rectangles.
+static void Coalesce(std::vector<PixelRect>& Rects, size_t Limit) {
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (size_t i = 0; i < Rects.size() && !merged; i++) {
+            for (size_t j = i + 1; j < Rects.size(); j++) {
+                bool overlaps = !IsEmpty(Intersect(Rects[i], Rects[j]));
+                if (overlaps || ShouldMergeDamage(Rects[i], Rects[j])) {
+                    Rects[i] = Union(Rects[i], Rects[j]);
+                    Rects.erase(Rects.begin() + j);
+                    merged = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    while (Rects.size() > Limit) {
+        size_t bestI = 0, bestJ = 1;
+        int64_t bestWaste = INT64_MAX;
+        for (size_t i = 0; i < Rects.size(); i++) {
+            for (size_t j = i + 1; j < Rects.size(); j++) {
+                int64_t waste = Area(Union(Rects[i], Rects[j])) - Area(Rects[i]) - Area(Rects[j]);
+                if (waste < bestWaste) {
+                    bestWaste = waste;
+                    bestI = i;
+                    bestJ = j;
+                }
+            }
+        }
+        Rects[bestI] = Union(Rects[bestI], Rects[bestJ]);
+        Rects.erase(Rects.begin() + bestJ);
+        Coalesce(Rects, Rects.size());
+    }
+}
+
+void InitDamageTracker(DamageTracker& Damage, int Width, int Height) {
+    Damage.Bounds = { 0, 0, Width, Height };
+    Damage.Rects.clear();
+}
+
+void AddDamage(DamageTracker& Damage, PixelRect Rect) {
+    Rect = Intersect(Rect, Damage.Bounds);
+    if (IsEmpty(Rect)) {
+        return;
+    }
+
+    // Primitives report one span or band at a time, almost always next to the
+    // previous one, so try the most recent rectangle first.
+    if (!Damage.Rects.empty()) {
+        PixelRect& last = Damage.Rects.back();
+        if (Contains(last, Rect)) {
+            return;
+        }
+        if (ShouldMergeDamage(last, Rect)) {
+            last = Union(last, Rect);
+            return;
+        }
+    }
+
+    Damage.Rects.push_back(Rect);
+    if ((int)Damage.Rects.size() > Damage.MaxRects) {
+        Coalesce(Damage.Rects, Damage.MaxRects / 2);
+    }
+}
+
+bool HasDamage(const DamageTracker& Damage) {
+    return !Damage.Rects.empty();
+}
+
+std::vector<PixelRect> TakeDamage(DamageTracker& Damage) {
+    std::vector<PixelRect> rects;
+    rects.swap(Damage.Rects);
+    Coalesce(rects, Damage.MaxRects);
+    return rects;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <vector>
+
+#include "rect.h"
+
+// Collects the regions written since the last present. Nearby rectangles are
+// merged as they come in so the list stays short; MaxRects bounds it hard.
+struct DamageTracker {
+    PixelRect Bounds = { 0, 0, 0, 0 };
+    int MaxRects = 16;
+    std::vector<PixelRect> Rects;
+};
+
+void InitDamageTracker(DamageTracker& Damage, int Width, int Height);
+void AddDamage(DamageTracker& Damage, PixelRect Rect);
+bool HasDamage(const DamageTracker& Damage);
+
+// Returns the pending damage as non-overlapping rectangles and resets it.
+std::vector<PixelRect> TakeDamage(DamageTracker& Damage);
+
+// Merges two rectangles when their bounding box wastes little area over
+// drawing them separately.
+bool ShouldMergeDamage(const PixelRect& A, const PixelRect& B);
@@ -0,0 +1,130 @@
+#include "ellipse.h"
+
+#include <stdlib.h>
+#include <algorithm>
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+#include "stroke.h"
+
+// A * B / C rounded down, where the product may need all 128 bits but the
+// quotient fits in 64.
+static uint64_t MulDiv(uint64_t A, uint64_t B, uint64_t C) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    uint64_t high;
+    uint64_t low = _umul128(A, B, &high);
+    uint64_t remainder;
+    return _udiv128(high, low, C, &remainder);
+#elif defined(__SIZEOF_INT128__)
+    return (uint64_t)((unsigned __int128)A * B / C);
+#else
+    // Multiply in 32-bit halves, then divide a bit at a time. The high half
+    // is below C because the quotient fits.
+    uint64_t a0 = A & 0xffffffff, a1 = A >> 32;
+    uint64_t b0 = B & 0xffffffff, b1 = B >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    uint64_t middle = (p00 >> 32) + (p01 & 0xffffffff) + (p10 & 0xffffffff);
+    uint64_t low = middle << 32 | (p00 & 0xffffffff);
+    uint64_t remainder = p11 + (p01 >> 32) + (p10 >> 32) + (middle >> 32);
+    uint64_t quotient = 0;
+    for (int bit = 63; bit >= 0; bit--) {
+        bool carry = remainder >> 63;
+        remainder = remainder << 1 | (low >> bit & 1);
+        quotient <<= 1;
+        if (carry || remainder >= C) {
+            remainder -= C;
+            quotient |= 1;
+        }
+    }
+    return quotient;
+#endif
+}
+
+// Offsets are measured in half pixels from the box centre, so pixel x sits at
+// 2x + 1 - SumX, which has the parity of Width + 1. Returns the largest offset
+// on row offset PY whose pixel is inside the ellipse of a Width x Height box,
+// or -1 if the row has none.
+static int64_t HalfExtent(int64_t Width, int64_t Height, int64_t PY) {
+    if (Width <= 0 || Height <= 0 || llabs(PY) >= Height) {
+        return -1;
+    }
+    // (PX / Width)^2 + (PY / Height)^2 <= 1, cleared of fractions. Circles
+    // skip the division; otherwise the product passes 64 bits on boxes over
+    // about 55000 pixels.
+    int64_t limit = Height * Height - PY * PY;
+    if (Width != Height) {
+        limit = (int64_t)MulDiv(Width * Width, limit, Height * Height);
+    }
+    int64_t extent = IntSqrt(limit);
+    if ((extent & 1) == (Width & 1)) {
+        extent--;
+    }
+    return extent;
+}
+
+static Ellipse MakeBox(int64_t SumX, int64_t SumY, int64_t Width, int64_t Height, int64_t HoleWidth, int64_t HoleHeight) {
+    Ellipse e;
+    e.SumX = SumX;
+    e.SumY = SumY;
+    e.Width = std::max<int64_t>(Width, 0);
+    e.Height = std::max<int64_t>(Height, 0);
+    // The hole keeps the box's parity, so both share the same pixel centres.
+    bool hasHole = HoleWidth > 0 && HoleHeight > 0;
+    e.HoleWidth = hasHole ? HoleWidth : 0;
+    e.HoleHeight = hasHole ? HoleHeight : 0;
+    e.Y0 = (int)((SumY - e.Height) / 2);
+    e.Y1 = (int)((SumY + e.Height) / 2);
+    return e;
+}
+
+Ellipse MakeEllipse(int X, int Y, int Width, int Height, int LineWidth, bool isFilled) {
+    int64_t width = abs(Width);
+    int64_t height = abs(Height);
+    int64_t sumX = 2 * (int64_t)std::min(X, X + Width) + width;
+    int64_t sumY = 2 * (int64_t)std::min(Y, Y + Height) + height;
+    if (isFilled) {
+        return MakeBox(sumX, sumY, width, height, 0, 0);
+    }
+    return MakeBox(sumX, sumY, width, height, width - 2 * (int64_t)LineWidth, height - 2 * (int64_t)LineWidth);
+}
+
+void RingBounds(int Radius, int LineWidth, bool isFilled, int& Inner, int& Outer) {
+    if (isFilled) {
+        Inner = 0;
+        Outer = Radius;
+    }
+    else {
+        Inner = Radius - LineWidth / 2;
+        Outer = Radius + LineWidth / 2;
+    }
+}
+
+Ellipse MakeCircle(int X, int Y, int Radius, int LineWidth, bool isFilled) {
+    int inner, outer;
+    RingBounds(Radius, LineWidth, isFilled, inner, outer);
+    // Distances rounding to Inner or more are outside the box of 2 Inner - 1.
+    int64_t size = outer >= 0 ? 2 * (int64_t)outer + 1 : 0;
+    int64_t holeSize = 2 * (int64_t)inner - 1;
+    return MakeBox(2 * (int64_t)X + 1, 2 * (int64_t)Y + 1, size, size, holeSize, holeSize);
+}
+
+bool EllipseRowSpan(const Ellipse& E, int Y, int& X0, int& X1, int& HoleX0, int& HoleX1) {
+    int64_t py = 2 * (int64_t)Y + 1 - E.SumY;
+    int64_t extent = HalfExtent(E.Width, E.Height, py);
+    if (extent < 0) {
+        return false;
+    }
+    X0 = (int)((E.SumX - 1 - extent) / 2);
+    X1 = (int)((E.SumX - 1 + extent) / 2) + 1;
+    int64_t hole = HalfExtent(E.HoleWidth, E.HoleHeight, py);
+    if (hole < 0) {
+        HoleX0 = X1;
+        HoleX1 = X1;
+    }
+    else {
+        HoleX0 = (int)((E.SumX - 1 - hole) / 2);
+        HoleX1 = (int)((E.SumX - 1 + hole) / 2) + 1;
+    }
+    return true;
+}
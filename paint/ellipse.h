@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+
+// An axis-aligned ellipse inscribed in a box of pixels, less an optional hole:
+// a second ellipse with the same centre inscribed in a smaller box. A pixel is
+// inside when its centre is on or inside the ellipse, so each row is a single
+// span, or two either side of the hole.
+//
+// A circle of radius R is the ellipse in the (2R+1)^2 box centred on its
+// pixel, which is every pixel whose distance from the centre rounds to at most
+// R. Row arithmetic is exact in 64 bits for boxes up to 55000 pixels a side.
+struct Ellipse {
+    int64_t SumX, SumY;             // X0 + X1 and Y0 + Y1 of the box: twice its centre
+    int64_t Width, Height;          // box size, 0 for nothing
+    int64_t HoleWidth, HoleHeight;  // 0 for no hole
+
+    int Y0; // rows Y0 <= y < Y1 may be covered
+    int Y1;
+};
+
+// The ellipse in the rectangle DrawRectangle would draw for the same corner
+// and size. The outline is LineWidth thick at the ends of the axes.
+Ellipse MakeEllipse(int X, int Y, int Width, int Height, int LineWidth, bool isFilled);
+
+// A circle is the ring of pixels whose distance from its centre rounds to
+// Inner to Outer: 0 to Radius filled, Radius - LineWidth / 2 to
+// Radius + LineWidth / 2 for an outline.
+void RingBounds(int Radius, int LineWidth, bool isFilled, int& Inner, int& Outer);
+Ellipse MakeCircle(int X, int Y, int Radius, int LineWidth, bool isFilled);
+
+// Half-open span [X0, X1) the ellipse covers on row Y, false if none, with
+// the hole [HoleX0, HoleX1) taken out of it. Without a hole on the row both
+// are X1.
+bool EllipseRowSpan(const Ellipse& E, int Y, int& X0, int& X1, int& HoleX0, int& HoleX1);
@@ -0,0 +1,297 @@
+#include "fill.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "cpu.h"
+#include "span.h"
+#include "trace.h"
+
+struct FillSeed {
+    int X;
+    int Y;
+};
+
+// Each matcher answers "does this pixel belong to the region" for one pixel and
+// for four consecutive pixels at once (bit i set when P[i] matches).
+
+struct ExactMatch {
+    u32 Target;
+
+    bool Match(u32 P) const { return P == Target; }
+
+    int Match4(const u32* P) const {
+#if PAINT_SSE2
+        __m128i pixels = _mm_loadu_si128((const __m128i*)P);
+        return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(pixels, _mm_set1_epi32((int)Target))));
+#else
+        return Match(P[0]) | Match(P[1]) << 1 | Match(P[2]) << 2 | Match(P[3]) << 3;
+#endif
+    }
+};
+
+struct ChannelMatch {
+    u32 Target;
+    int Amount;
+
+    bool Match(u32 P) const {
+        for (int shift = 0; shift < 24; shift += 8) {
+            int diff = (int)((P >> shift) & 0xff) - (int)((Target >> shift) & 0xff);
+            if (diff > Amount || diff < -Amount) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int Match4(const u32* P) const {
+#if PAINT_SSE2
+        __m128i pixels = _mm_loadu_si128((const __m128i*)P);
+        __m128i target = _mm_set1_epi32((int)Target);
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(pixels, target), _mm_subs_epu8(target, pixels));
+        __m128i over = _mm_subs_epu8(diff, _mm_set1_epi8((char)std::min(Amount, 255)));
+        over = _mm_and_si128(over, _mm_set1_epi32(0x00ffffff));
+        return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(over, _mm_setzero_si128())));
+#else
+        return Match(P[0]) | Match(P[1]) << 1 | Match(P[2]) << 2 | Match(P[3]) << 3;
+#endif
+    }
+};
+
+struct DistanceMatch {
+    u32 Target;
+    int Amount;
+
+    bool Match(u32 P) const {
+        int dr = (int)((P >> 16) & 0xff) - (int)((Target >> 16) & 0xff);
+        int dg = (int)((P >> 8) & 0xff) - (int)((Target >> 8) & 0xff);
+        int db = (int)(P & 0xff) - (int)(Target & 0xff);
+        return dr * dr + dg * dg + db * db <= Amount * Amount;
+    }
+
+    int Match4(const u32* P) const {
+#if PAINT_SSE2
+        __m128i rgb = _mm_set1_epi32(0x00ffffff);
+        __m128i zero = _mm_setzero_si128();
+        __m128i pixels = _mm_and_si128(_mm_loadu_si128((const __m128i*)P), rgb);
+        __m128i target = _mm_and_si128(_mm_set1_epi32((int)Target), rgb);
+
+        // Widen to 16 bits, square and pair-sum with madd, then fold the two
+        // halves of each pixel together.
+        __m128i targetWide = _mm_unpacklo_epi8(target, zero);
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(pixels, zero), targetWide);
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(pixels, zero), targetWide);
+        lo = _mm_madd_epi16(lo, lo);
+        hi = _mm_madd_epi16(hi, hi);
+        lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+        hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+        __m128i sums = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 0, 2, 0)));
+
+        __m128i limit = _mm_set1_epi32(Amount * Amount + 1);
+        return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(sums, limit)));
+#else
+        return Match(P[0]) | Match(P[1]) << 1 | Match(P[2]) << 2 | Match(P[3]) << 3;
+#endif
+    }
+};
+
+// First x in [X, End) where Match(Row[x]) != WantMatch, or End.
+template <typename Matcher>
+static int ScanRight(const u32* Row, int X, int End, bool WantMatch, const Matcher& M) {
+    // Long uniform runs are the common case; test 16 pixels per step until one
+    // of them differs, then narrow down below.
+    int want = WantMatch ? 0xf : 0;
+    while (X + 16 <= End) {
+        if (M.Match4(Row + X) != want || M.Match4(Row + X + 4) != want || M.Match4(Row + X + 8) != want || M.Match4(Row + X + 12) != want) {
+            break;
+        }
+        X += 16;
+    }
+    while (X + 4 <= End) {
+        int same = M.Match4(Row + X);
+        if (!WantMatch) {
+            same = ~same & 0xf;
+        }
+        if (same != 0xf) {
+            while (same & 1) {
+                same >>= 1;
+                X++;
+            }
+            return X;
+        }
+        X += 4;
+    }
+    while (X < End && M.Match(Row[X]) == WantMatch) {
+        X++;
+    }
+    return X;
+}
+
+// Row[X] matches; returns the smallest x >= Begin with Row[x .. X] all matching.
+template <typename Matcher>
+static int ScanLeft(const u32* Row, int X, int Begin, const Matcher& M) {
+    while (X - 4 >= Begin) {
+        int same = M.Match4(Row + X - 4);
+        if (same != 0xf) {
+            int i = 3;
+            while (same & (1 << i)) {
+                i--;
+            }
+            return X - 4 + i + 1;
+        }
+        X -= 4;
+    }
+    while (X > Begin && M.Match(Row[X - 1])) {
+        X--;
+    }
+    return X;
+}
+
+static void MarkVisited(std::vector<uint64_t>& Visited, size_t RowWords, int Y, int X0, int X1) {
+    uint64_t* row = &Visited[(size_t)Y * RowWords];
+    for (int x = X0; x < X1;) {
+        int bit = x & 63;
+        int count = std::min(64 - bit, X1 - x);
+        uint64_t bits = count == 64 ? ~0ull : ((1ull << count) - 1) << bit;
+        row[x >> 6] |= bits;
+        x += count;
+    }
+}
+
+static bool IsVisited(const std::vector<uint64_t>& Visited, size_t RowWords, int X, int Y) {
+    return (Visited[(size_t)Y * RowWords + (X >> 6)] >> (X & 63)) & 1;
+}
+
+// Row scans over the canvas, one tile segment at a time. A uniform tile either
+// matches across its whole segment or not at all.
+template <typename Matcher>
+static int ScanCanvasRight(const Canvas& Target, int Y, int X, int End, bool WantMatch, const Matcher& M) {
+    while (X < End) {
+        int tileX = X & ~TILE_MASK;
+        int segmentEnd = std::min(End, tileX + TILE_SIZE);
+        const CanvasTile& tile = *Target.Tiles[TileIndex(Target, X, Y)];
+        if (tile.Pixels.empty()) {
+            if (M.Match(tile.Uniform) != WantMatch) {
+                return X;
+            }
+        }
+        else {
+            const u32* row = &tile.Pixels[(Y & TILE_MASK) * TILE_SIZE];
+            int x = ScanRight(row, X - tileX, segmentEnd - tileX, WantMatch, M) + tileX;
+            if (x < segmentEnd) {
+                return x;
+            }
+        }
+        X = segmentEnd;
+    }
+    return End;
+}
+
+// Pixel X matches; returns the smallest x >= Begin with [x, X] all matching.
+template <typename Matcher>
+static int ScanCanvasLeft(const Canvas& Target, int Y, int X, int Begin, const Matcher& M) {
+    while (X > Begin) {
+        int tileX = (X - 1) & ~TILE_MASK;
+        int segmentBegin = std::max(Begin, tileX);
+        const CanvasTile& tile = *Target.Tiles[TileIndex(Target, X - 1, Y)];
+        if (tile.Pixels.empty()) {
+            if (!M.Match(tile.Uniform)) {
+                return X;
+            }
+        }
+        else {
+            // ScanLeft never reads Row[X] itself, so X may sit one past the tile.
+            const u32* row = &tile.Pixels[(Y & TILE_MASK) * TILE_SIZE];
+            int x = ScanLeft(row, X - tileX, segmentBegin - tileX, M) + tileX;
+            if (x > segmentBegin) {
+                return x;
+            }
+        }
+        X = segmentBegin;
+    }
+    return X;
+}
+
+// Finds the region as a list of maximal horizontal runs. Runs are maximal over
+// matching pixels, so a run is either entirely visited or not at all and only a
+// run's first pixel needs checking against the visited mask.
+template <typename Matcher>
+static void FindRegion(const Canvas& Target, int X, int Y, const Matcher& M, std::vector<PixelSpan>& Spans) {
+    int width = Target.Width;
+    int height = Target.Height;
+    size_t rowWords = (width + 63) / 64;
+    std::vector<uint64_t> visited(rowWords * height, 0);
+    std::vector<FillSeed> seeds;
+    seeds.push_back({ X, Y });
+
+    while (!seeds.empty()) {
+        FillSeed seed = seeds.back();
+        seeds.pop_back();
+        if (IsVisited(visited, rowWords, seed.X, seed.Y)) {
+            continue;
+        }
+
+        int x0 = ScanCanvasLeft(Target, seed.Y, seed.X, 0, M);
+        int x1 = ScanCanvasRight(Target, seed.Y, seed.X + 1, width, true, M);
+        MarkVisited(visited, rowWords, seed.Y, x0, x1);
+        Spans.push_back({ seed.Y, x0, x1 });
+
+        for (int ny = seed.Y - 1; ny <= seed.Y + 1; ny += 2) {
+            if (ny < 0 || ny >= height) {
+                continue;
+            }
+            int x = x0;
+            while (x < x1) {
+                x = ScanCanvasRight(Target, ny, x, x1, false, M);
+                if (x >= x1) {
+                    break;
+                }
+                if (!IsVisited(visited, rowWords, x, ny)) {
+                    seeds.push_back({ x, ny });
+                }
+                x = ScanCanvasRight(Target, ny, x, x1, true, M);
+            }
+        }
+    }
+}
+
+void FindFillRegion(const Canvas& Target, int X, int Y, FillTolerance Tolerance, std::vector<PixelSpan>& Spans) {
+    if (X < 0 || X >= Target.Width || Y < 0 || Y >= Target.Height) {
+        return;
+    }
+    u32 targetColor = GetPixel(Target, X, Y);
+    switch (Tolerance.Mode) {
+    case TOLERANCE_EXACT:
+        FindRegion(Target, X, Y, ExactMatch{ targetColor }, Spans);
+        break;
+    case TOLERANCE_CHANNEL:
+        FindRegion(Target, X, Y, ChannelMatch{ targetColor, Tolerance.Amount }, Spans);
+        break;
+    case TOLERANCE_DISTANCE:
+        FindRegion(Target, X, Y, DistanceMatch{ targetColor, Tolerance.Amount }, Spans);
+        break;
+    }
+}
+
+PixelRect FloodFill(Canvas& Target, int X, int Y, u32 ReplacementColor, FillTolerance Tolerance) {
+    TraceScope trace("FloodFill");
+    PixelRect bounds = { 0, 0, 0, 0 };
+    if (X < 0 || X >= Target.Width || Y < 0 || Y >= Target.Height) {
+        return bounds;
+    }
+
+    u32 targetColor = GetPixel(Target, X, Y);
+    if (Tolerance.Mode == TOLERANCE_EXACT && targetColor == ReplacementColor) {
+        return bounds;
+    }
+
+    std::vector<PixelSpan> spans;
+    FindFillRegion(Target, X, Y, Tolerance, spans);
+
+    bounds = { X, Y, X + 1, Y + 1 };
+    for (const PixelSpan& span : spans) {
+        bounds = Union(bounds, { span.X0, span.Y, span.X1, span.Y + 1 });
+    }
+    FillSpans(Target, spans, ReplacementColor);
+    return bounds;
+}
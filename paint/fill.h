@@ -0,0 +1,23 @@
+#pragma once
+#include <vector>
+
+#include "canvas.h"
+#include "span.h"
+
+enum ToleranceMode {
+    TOLERANCE_EXACT,    // whole pixel value must match
+    TOLERANCE_CHANNEL,  // every colour channel within Amount
+    TOLERANCE_DISTANCE  // RGB euclidean distance within Amount
+};
+
+struct FillTolerance {
+    ToleranceMode Mode;
+    int Amount;
+};
+
+// 4-connected scanline fill starting at (X, Y). Returns the bounding box of the
+// pixels that were replaced, empty if nothing changed.
+PixelRect FloodFill(Canvas& Target, int X, int Y, u32 ReplacementColor, FillTolerance Tolerance);
+// The region FloodFill would replace, as non-overlapping spans in no
+// particular order. Nothing for a seed outside the canvas.
+void FindFillRegion(const Canvas& Target, int X, int Y, FillTolerance Tolerance, std::vector<PixelSpan>& Spans);
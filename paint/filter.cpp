@@ -0,0 +1,708 @@
+#include "filter.h"
+
+#include <math.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "blend.h"
+#include "cpu.h"
+#include "selection.h"
+#include "span.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// Row kernels, picked like the ones in span.cpp from the current span kernel.
+// Every version of a kernel gives exactly the same result.
+typedef void (*AdjustRowProc)(u32* Row, int Count, int Scale, int Offset);
+typedef void (*ThresholdRowProc)(u32* Row, int Count, int Level);
+typedef void (*BoxBlurRowProc)(u32* Dest, const u32* Source, int Count, int Radius);
+typedef void (*SlideColumnsProc)(u32* Dest, int32_t* Sums, const u32* Enter, const u32* Leave, int Count, float Scale);
+typedef void (*SharpenRowProc)(u32* Dest, const u32* Source, const u32* Blurred, int Count, int Amount);
+
+// Factors are fixed point with 1024 as one. Products are floored the way
+// _mm_mulhi_epi16 floors (Value << 6) * Factor >> 16, which keeps Value within
+// 16 bits for any channel or difference of channels.
+static inline int MulFixed(int Value, int Factor) {
+    return (Value * 64 * Factor) >> 16;
+}
+
+// Every colour channel c of a pixel with alpha a becomes c * Scale + a *
+// Offset, clamped to 0..a; the transparency byte stays. Being linear in c and
+// a, this is the same as scaling and shifting the unpremultiplied colour.
+static void AdjustRowScalar(u32* Row, int Count, int Scale, int Offset) {
+    for (int i = 0; i < Count; i++) {
+        u32 pixel = Row[i];
+        int alpha = 255 - (int)(pixel >> 24);
+        int base = MulFixed(alpha, Offset);
+        u32 result = pixel & 0xff000000;
+        for (int shift = 0; shift < 24; shift += 8) {
+            int channel = MulFixed((int)(pixel >> shift & 0xff), Scale) + base;
+            result |= (u32)std::clamp(channel, 0, alpha) << shift;
+        }
+        Row[i] = result;
+    }
+}
+
+// White, alpha in every colour channel, where the unpremultiplied luma
+// (77 R + 150 G + 29 B) / 256 is at least Level, black elsewhere. Compared
+// premultiplied, as luma * 255 against Level * alpha * 256, it stays in
+// integers.
+static void ThresholdRowScalar(u32* Row, int Count, int Level) {
+    for (int i = 0; i < Count; i++) {
+        u32 pixel = Row[i];
+        int alpha = 255 - (int)(pixel >> 24);
+        int luma = 77 * (int)(pixel >> 16 & 0xff) + 150 * (int)(pixel >> 8 & 0xff) + 29 * (int)(pixel & 0xff);
+        u32 top = pixel & 0xff000000;
+        Row[i] = luma * 255 >= Level * alpha * 256 ? top | (u32)alpha * 0x010101 : top;
+    }
+}
+
+// Dest[i] is the mean of Source[i - Radius] to Source[i + Radius], the end
+// pixels repeating past either end. The sum slides along the row, so a pixel
+// costs the same for any radius. Means are rounded as floats; sums stay well
+// inside the 24 bits a float holds exactly.
+static void BoxBlurRowScalar(u32* Dest, const u32* Source, int Count, int Radius) {
+    float scale = 1.0f / (2 * Radius + 1);
+    int last = Count - 1;
+    int sums[4] = {};
+    for (int k = -Radius; k <= Radius; k++) {
+        u32 pixel = Source[std::clamp(k, 0, last)];
+        for (int c = 0; c < 4; c++) {
+            sums[c] += (int)(pixel >> c * 8 & 0xff);
+        }
+    }
+    for (int i = 0; i < Count; i++) {
+        u32 mean = 0;
+        for (int c = 0; c < 4; c++) {
+            mean |= (u32)lrintf(sums[c] * scale) << c * 8;
+        }
+        Dest[i] = mean;
+        u32 enter = Source[std::min(i + Radius + 1, last)];
+        u32 leave = Source[std::max(i - Radius, 0)];
+        for (int c = 0; c < 4; c++) {
+            sums[c] += (int)(enter >> c * 8 & 0xff) - (int)(leave >> c * 8 & 0xff);
+        }
+    }
+}
+
+// One row of a box blur down columns: adds Enter to and takes Leave from the
+// running sums, four per pixel in channel order, then writes their means.
+static void SlideColumnsScalar(u32* Dest, int32_t* Sums, const u32* Enter, const u32* Leave, int Count, float Scale) {
+    for (int i = 0; i < Count; i++) {
+        u32 mean = 0;
+        for (int c = 0; c < 4; c++) {
+            int32_t& sum = Sums[i * 4 + c];
+            sum += (int)(Enter[i] >> c * 8 & 0xff) - (int)(Leave[i] >> c * 8 & 0xff);
+            mean |= (u32)lrintf(sum * Scale) << c * 8;
+        }
+        Dest[i] = mean;
+    }
+}
+
+// Unsharp masking: every channel, transparency included, moves away from
+// Blurred by Amount times its distance, then colour is kept within the new
+// alpha so the pixel stays premultiplied. Dest may be Blurred.
+static void SharpenRowScalar(u32* Dest, const u32* Source, const u32* Blurred, int Count, int Amount) {
+    for (int i = 0; i < Count; i++) {
+        int channels[4];
+        for (int c = 0; c < 4; c++) {
+            int value = (int)(Source[i] >> c * 8 & 0xff);
+            int blurred = (int)(Blurred[i] >> c * 8 & 0xff);
+            channels[c] = std::clamp(value + MulFixed(value - blurred, Amount), 0, 255);
+        }
+        int alpha = 255 - channels[3];
+        u32 result = (u32)channels[3] << 24;
+        for (int c = 0; c < 3; c++) {
+            result |= (u32)std::min(channels[c], alpha) << c * 8;
+        }
+        Dest[i] = result;
+    }
+}
+
+#if PAINT_SSE2
+// Each pixel's alpha, 255 minus its top byte, in all four of its bytes.
+static inline __m128i AlphaBytesSSE2(__m128i Pixels) {
+    __m128i alpha = _mm_sub_epi32(_mm_set1_epi32(255), _mm_srli_epi32(Pixels, 24));
+    alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 8));
+    return _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+}
+
+// A channel per 16-bit lane; the byte clamp comes from packing, the alpha
+// clamp from a byte minimum.
+static inline __m128i AdjustFourSSE2(__m128i Pixels, __m128i Scale, __m128i Offset) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i alpha = AlphaBytesSSE2(Pixels);
+    __m128i lo = _mm_add_epi16(_mm_mulhi_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(Pixels, zero), 6), Scale),
+        _mm_mulhi_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(alpha, zero), 6), Offset));
+    __m128i hi = _mm_add_epi16(_mm_mulhi_epi16(_mm_slli_epi16(_mm_unpackhi_epi8(Pixels, zero), 6), Scale),
+        _mm_mulhi_epi16(_mm_slli_epi16(_mm_unpackhi_epi8(alpha, zero), 6), Offset));
+    __m128i result = _mm_min_epu8(_mm_packus_epi16(lo, hi), alpha);
+    __m128i top = _mm_set1_epi32((int)0xff000000);
+    return _mm_or_si128(_mm_andnot_si128(top, result), _mm_and_si128(top, Pixels));
+}
+
+static void AdjustRowSSE2(u32* Row, int Count, int Scale, int Offset) {
+    __m128i scale = _mm_set1_epi16((short)Scale);
+    __m128i offset = _mm_set1_epi16((short)Offset);
+    int i = 0;
+    for (; i + 4 <= Count; i += 4) {
+        __m128i* pixels = (__m128i*)(Row + i);
+        _mm_storeu_si128(pixels, AdjustFourSSE2(_mm_loadu_si128(pixels), scale, offset));
+    }
+    AdjustRowScalar(Row + i, Count - i, Scale, Offset);
+}
+
+// A pixel per 32-bit lane. Every product fits the low 16 bits of its lane, so
+// 16-bit multiplies do.
+static inline __m128i ThresholdFourSSE2(__m128i Pixels, __m128i Level) {
+    __m128i low = _mm_set1_epi32(0xff);
+    __m128i top = _mm_srli_epi32(Pixels, 24);
+    __m128i alpha = _mm_sub_epi32(low, top);
+    __m128i luma = _mm_add_epi32(_mm_add_epi32(
+        _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(Pixels, 16), low), _mm_set1_epi32(77)),
+        _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(Pixels, 8), low), _mm_set1_epi32(150))),
+        _mm_mullo_epi16(_mm_and_si128(Pixels, low), _mm_set1_epi32(29)));
+    __m128i below = _mm_cmpgt_epi32(_mm_slli_epi32(_mm_mullo_epi16(alpha, Level), 8), _mm_sub_epi32(_mm_slli_epi32(luma, 8), luma));
+    __m128i white = _mm_or_si128(alpha, _mm_or_si128(_mm_slli_epi32(alpha, 8), _mm_slli_epi32(alpha, 16)));
+    return _mm_or_si128(_mm_slli_epi32(top, 24), _mm_andnot_si128(below, white));
+}
+
+static void ThresholdRowSSE2(u32* Row, int Count, int Level) {
+    __m128i level = _mm_set1_epi32(Level);
+    int i = 0;
+    for (; i + 4 <= Count; i += 4) {
+        __m128i* pixels = (__m128i*)(Row + i);
+        _mm_storeu_si128(pixels, ThresholdFourSSE2(_mm_loadu_si128(pixels), level));
+    }
+    ThresholdRowScalar(Row + i, Count - i, Level);
+}
+
+static inline __m128i UnpackPixelSSE2(u32 Pixel) {
+    __m128i zero = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)Pixel), zero), zero);
+}
+
+static inline __m128i MeansSSE2(__m128i Sums, __m128 Scale) {
+    return _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(Sums), Scale));
+}
+
+// The four sums of a pixel in one register.
+static void BoxBlurRowSSE2(u32* Dest, const u32* Source, int Count, int Radius) {
+    __m128 scale = _mm_set1_ps(1.0f / (2 * Radius + 1));
+    int last = Count - 1;
+    __m128i sum = _mm_setzero_si128();
+    for (int k = -Radius; k <= Radius; k++) {
+        sum = _mm_add_epi32(sum, UnpackPixelSSE2(Source[std::clamp(k, 0, last)]));
+    }
+    for (int i = 0; i < Count; i++) {
+        __m128i mean = MeansSSE2(sum, scale);
+        mean = _mm_packs_epi32(mean, mean);
+        Dest[i] = (u32)_mm_cvtsi128_si32(_mm_packus_epi16(mean, mean));
+        __m128i enter = UnpackPixelSSE2(Source[std::min(i + Radius + 1, last)]);
+        __m128i leave = UnpackPixelSSE2(Source[std::max(i - Radius, 0)]);
+        sum = _mm_add_epi32(sum, _mm_sub_epi32(enter, leave));
+    }
+}
+
+static void SlideColumnsSSE2(u32* Dest, int32_t* Sums, const u32* Enter, const u32* Leave, int Count, float Scale) {
+    __m128i zero = _mm_setzero_si128();
+    __m128 scale = _mm_set1_ps(Scale);
+    int i = 0;
+    for (; i + 4 <= Count; i += 4) {
+        __m128i enter = _mm_loadu_si128((const __m128i*)(Enter + i));
+        __m128i leave = _mm_loadu_si128((const __m128i*)(Leave + i));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(enter, zero), _mm_unpacklo_epi8(leave, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(enter, zero), _mm_unpackhi_epi8(leave, zero));
+        // Differences widen to 32 bits with their sign.
+        __m128i steps[4] = {
+            _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16),
+            _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16),
+            _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16),
+            _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)
+        };
+        __m128i means[4];
+        for (int p = 0; p < 4; p++) {
+            __m128i* sums = (__m128i*)(Sums + (i + p) * 4);
+            __m128i sum = _mm_add_epi32(_mm_loadu_si128(sums), steps[p]);
+            _mm_storeu_si128(sums, sum);
+            means[p] = MeansSSE2(sum, scale);
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(means[0], means[1]), _mm_packs_epi32(means[2], means[3]));
+        _mm_storeu_si128((__m128i*)(Dest + i), packed);
+    }
+    SlideColumnsScalar(Dest + i, Sums + i * 4, Enter + i, Leave + i, Count - i, Scale);
+}
+
+static inline __m128i SharpenFourSSE2(__m128i Source, __m128i Blurred, __m128i Amount) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(Source, zero);
+    __m128i hi = _mm_unpackhi_epi8(Source, zero);
+    lo = _mm_add_epi16(lo, _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(lo, _mm_unpacklo_epi8(Blurred, zero)), 6), Amount));
+    hi = _mm_add_epi16(hi, _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(hi, _mm_unpackhi_epi8(Blurred, zero)), 6), Amount));
+    __m128i result = _mm_packus_epi16(lo, hi);
+    // The transparency byte is its own limit.
+    return _mm_min_epu8(result, _mm_or_si128(AlphaBytesSSE2(result), _mm_set1_epi32((int)0xff000000)));
+}
+
+static void SharpenRowSSE2(u32* Dest, const u32* Source, const u32* Blurred, int Count, int Amount) {
+    __m128i amount = _mm_set1_epi16((short)Amount);
+    int i = 0;
+    for (; i + 4 <= Count; i += 4) {
+        __m128i source = _mm_loadu_si128((const __m128i*)(Source + i));
+        __m128i blurred = _mm_loadu_si128((const __m128i*)(Blurred + i));
+        _mm_storeu_si128((__m128i*)(Dest + i), SharpenFourSSE2(source, blurred, amount));
+    }
+    SharpenRowScalar(Dest + i, Source + i, Blurred + i, Count - i, Amount);
+}
+#endif
+
+#if PAINT_X86
+PAINT_TARGET_AVX2 static inline __m256i AlphaBytesAVX2(__m256i Pixels) {
+    __m256i alpha = _mm256_sub_epi32(_mm256_set1_epi32(255), _mm256_srli_epi32(Pixels, 24));
+    alpha = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 8));
+    return _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 16));
+}
+
+// Unpacking and packing both stay within 128-bit lanes, so pixels come back
+// where they were.
+PAINT_TARGET_AVX2 static inline __m256i AdjustEightAVX2(__m256i Pixels, __m256i Scale, __m256i Offset) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i alpha = AlphaBytesAVX2(Pixels);
+    __m256i lo = _mm256_add_epi16(_mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_unpacklo_epi8(Pixels, zero), 6), Scale),
+        _mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_unpacklo_epi8(alpha, zero), 6), Offset));
+    __m256i hi = _mm256_add_epi16(_mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_unpackhi_epi8(Pixels, zero), 6), Scale),
+        _mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_unpackhi_epi8(alpha, zero), 6), Offset));
+    __m256i result = _mm256_min_epu8(_mm256_packus_epi16(lo, hi), alpha);
+    __m256i top = _mm256_set1_epi32((int)0xff000000);
+    return _mm256_or_si256(_mm256_andnot_si256(top, result), _mm256_and_si256(top, Pixels));
+}
+
+PAINT_TARGET_AVX2 static void AdjustRowAVX2(u32* Row, int Count, int Scale, int Offset) {
+    __m256i scale = _mm256_set1_epi16((short)Scale);
+    __m256i offset = _mm256_set1_epi16((short)Offset);
+    int i = 0;
+    for (; i + 8 <= Count; i += 8) {
+        __m256i* pixels = (__m256i*)(Row + i);
+        _mm256_storeu_si256(pixels, AdjustEightAVX2(_mm256_loadu_si256(pixels), scale, offset));
+    }
+    // Masked, like BlendRowAVX2, rather than SSE code with the upper halves
+    // dirty.
+    int rest = Count - i;
+    if (rest > 0) {
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256i pixels = _mm256_maskload_epi32((const int*)(Row + i), mask);
+        _mm256_maskstore_epi32((int*)(Row + i), mask, AdjustEightAVX2(pixels, scale, offset));
+    }
+}
+
+PAINT_TARGET_AVX2 static inline __m256i ThresholdEightAVX2(__m256i Pixels, __m256i Level) {
+    __m256i low = _mm256_set1_epi32(0xff);
+    __m256i top = _mm256_srli_epi32(Pixels, 24);
+    __m256i alpha = _mm256_sub_epi32(low, top);
+    __m256i luma = _mm256_add_epi32(_mm256_add_epi32(
+        _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(Pixels, 16), low), _mm256_set1_epi32(77)),
+        _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(Pixels, 8), low), _mm256_set1_epi32(150))),
+        _mm256_mullo_epi16(_mm256_and_si256(Pixels, low), _mm256_set1_epi32(29)));
+    __m256i below = _mm256_cmpgt_epi32(_mm256_slli_epi32(_mm256_mullo_epi16(alpha, Level), 8), _mm256_sub_epi32(_mm256_slli_epi32(luma, 8), luma));
+    __m256i white = _mm256_or_si256(alpha, _mm256_or_si256(_mm256_slli_epi32(alpha, 8), _mm256_slli_epi32(alpha, 16)));
+    return _mm256_or_si256(_mm256_slli_epi32(top, 24), _mm256_andnot_si256(below, white));
+}
+
+PAINT_TARGET_AVX2 static void ThresholdRowAVX2(u32* Row, int Count, int Level) {
+    __m256i level = _mm256_set1_epi32(Level);
+    int i = 0;
+    for (; i + 8 <= Count; i += 8) {
+        __m256i* pixels = (__m256i*)(Row + i);
+        _mm256_storeu_si256(pixels, ThresholdEightAVX2(_mm256_loadu_si256(pixels), level));
+    }
+    int rest = Count - i;
+    if (rest > 0) {
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256i pixels = _mm256_maskload_epi32((const int*)(Row + i), mask);
+        _mm256_maskstore_epi32((int*)(Row + i), mask, ThresholdEightAVX2(pixels, level));
+    }
+}
+
+// Two pixels' channels, Low's in the lower 128-bit lane.
+PAINT_TARGET_AVX2 static inline __m256i UnpackPairAVX2(u32 Low, u32 High) {
+    return _mm256_cvtepu8_epi32(_mm_unpacklo_epi32(_mm_cvtsi32_si128((int)Low), _mm_cvtsi32_si128((int)High)));
+}
+
+// The running sum is a chain of dependent adds that a wider register can't
+// shorten, so instead the two 128-bit lanes slide along the two halves of the
+// row side by side. An odd last pixel is where the upper lane ends up.
+PAINT_TARGET_AVX2 static void BoxBlurRowAVX2(u32* Dest, const u32* Source, int Count, int Radius) {
+    __m256 scale = _mm256_set1_ps(1.0f / (2 * Radius + 1));
+    int half = Count / 2;
+    int last = Count - 1;
+    __m256i sum = _mm256_setzero_si256();
+    for (int k = -Radius; k <= Radius; k++) {
+        sum = _mm256_add_epi32(sum, UnpackPairAVX2(Source[std::clamp(k, 0, last)], Source[std::clamp(half + k, 0, last)]));
+    }
+    __m256i mean;
+    for (int i = 0; i < half; i++) {
+        int j = half + i;
+        mean = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(sum), scale));
+        mean = _mm256_packs_epi32(mean, mean);
+        mean = _mm256_packus_epi16(mean, mean);
+        Dest[i] = (u32)_mm_cvtsi128_si32(_mm256_castsi256_si128(mean));
+        Dest[j] = (u32)_mm_cvtsi128_si32(_mm256_extracti128_si256(mean, 1));
+        __m256i enter = UnpackPairAVX2(Source[std::min(i + Radius + 1, last)], Source[std::min(j + Radius + 1, last)]);
+        __m256i leave = UnpackPairAVX2(Source[std::max(i - Radius, 0)], Source[std::max(j - Radius, 0)]);
+        sum = _mm256_add_epi32(sum, _mm256_sub_epi32(enter, leave));
+    }
+    if (Count & 1) {
+        mean = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(sum), scale));
+        mean = _mm256_packs_epi32(mean, mean);
+        mean = _mm256_packus_epi16(mean, mean);
+        Dest[last] = (u32)_mm_cvtsi128_si32(_mm256_extracti128_si256(mean, 1));
+    }
+}
+
+// Sums are loaded two pixels at a time, in memory order. Packing works per
+// 128-bit lane and leaves the pixels in the order 0 2 4 6 1 3 5 7, which a
+// last permute sorts out.
+PAINT_TARGET_AVX2 static void SlideColumnsAVX2(u32* Dest, int32_t* Sums, const u32* Enter, const u32* Leave, int Count, float Scale) {
+    __m256 scale = _mm256_set1_ps(Scale);
+    __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for (; i + 8 <= Count; i += 8) {
+        __m256i means[4];
+        for (int p = 0; p < 4; p++) {
+            __m256i enter = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(Enter + i + p * 2)));
+            __m256i leave = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(Leave + i + p * 2)));
+            __m256i* sums = (__m256i*)(Sums + (i + p * 2) * 4);
+            __m256i sum = _mm256_add_epi32(_mm256_loadu_si256(sums), _mm256_sub_epi32(enter, leave));
+            _mm256_storeu_si256(sums, sum);
+            means[p] = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(sum), scale));
+        }
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(means[0], means[1]), _mm256_packs_epi32(means[2], means[3]));
+        _mm256_storeu_si256((__m256i*)(Dest + i), _mm256_permutevar8x32_epi32(packed, order));
+    }
+    SlideColumnsScalar(Dest + i, Sums + i * 4, Enter + i, Leave + i, Count - i, Scale);
+}
+
+PAINT_TARGET_AVX2 static inline __m256i SharpenEightAVX2(__m256i Source, __m256i Blurred, __m256i Amount) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_unpacklo_epi8(Source, zero);
+    __m256i hi = _mm256_unpackhi_epi8(Source, zero);
+    lo = _mm256_add_epi16(lo, _mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_sub_epi16(lo, _mm256_unpacklo_epi8(Blurred, zero)), 6), Amount));
+    hi = _mm256_add_epi16(hi, _mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_sub_epi16(hi, _mm256_unpackhi_epi8(Blurred, zero)), 6), Amount));
+    __m256i result = _mm256_packus_epi16(lo, hi);
+    return _mm256_min_epu8(result, _mm256_or_si256(AlphaBytesAVX2(result), _mm256_set1_epi32((int)0xff000000)));
+}
+
+PAINT_TARGET_AVX2 static void SharpenRowAVX2(u32* Dest, const u32* Source, const u32* Blurred, int Count, int Amount) {
+    __m256i amount = _mm256_set1_epi16((short)Amount);
+    int i = 0;
+    for (; i + 8 <= Count; i += 8) {
+        __m256i source = _mm256_loadu_si256((const __m256i*)(Source + i));
+        __m256i blurred = _mm256_loadu_si256((const __m256i*)(Blurred + i));
+        _mm256_storeu_si256((__m256i*)(Dest + i), SharpenEightAVX2(source, blurred, amount));
+    }
+    int rest = Count - i;
+    if (rest > 0) {
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256i source = _mm256_maskload_epi32((const int*)(Source + i), mask);
+        __m256i blurred = _mm256_maskload_epi32((const int*)(Blurred + i), mask);
+        _mm256_maskstore_epi32((int*)(Dest + i), mask, SharpenEightAVX2(source, blurred, amount));
+    }
+}
+#endif
+
+struct FilterKernels {
+    AdjustRowProc Adjust;
+    ThresholdRowProc Threshold;
+    BoxBlurRowProc BoxBlur;
+    SlideColumnsProc Slide;
+    SharpenRowProc Sharpen;
+};
+
+static FilterKernels FilterKernelsFor(SpanKernel Kernel) {
+    switch (Kernel) {
+#if PAINT_X86
+    case SPAN_KERNEL_AVX2:
+        return { AdjustRowAVX2, ThresholdRowAVX2, BoxBlurRowAVX2, SlideColumnsAVX2, SharpenRowAVX2 };
+#endif
+#if PAINT_SSE2
+    case SPAN_KERNEL_SSE2:
+        return { AdjustRowSSE2, ThresholdRowSSE2, BoxBlurRowSSE2, SlideColumnsSSE2, SharpenRowSSE2 };
+#endif
+    default:
+        return { AdjustRowScalar, ThresholdRowScalar, BoxBlurRowScalar, SlideColumnsScalar, SharpenRowScalar };
+    }
+}
+
+// Splits rows Y0 to Y1, which aren't negative, at multiples of Band and runs
+// Job(BandY0, BandY1) on each piece, over the worker pool when Parallel.
+// Bands a whole number of tiles high never share a tile.
+static void ForEachBand(int Y0, int Y1, int Band, bool Parallel, const std::function<void(int, int)>& Job) {
+    if (Y0 >= Y1) {
+        return;
+    }
+    int first = Y0 / Band;
+    int count = (Y1 - 1) / Band - first + 1;
+    auto runBand = [&](int Index) {
+        int band = first + Index;
+        Job(std::max(Y0, band * Band), std::min(Y1, (band + 1) * Band));
+    };
+    if (Parallel) {
+        ParallelFor(count, runBand);
+    }
+    else {
+        for (int i = 0; i < count; i++) {
+            runBand(i);
+        }
+    }
+}
+
+// Runs a colour filter over the part of one tile inside Rect and the
+// selection. A uniform tile the filter covers becomes another uniform tile.
+static void FilterTileColors(Canvas& Target, int Tile, const PixelRect& Rect, const std::function<void(u32*, int)>& Apply) {
+    PixelRect bounds = TileBounds(Target, Tile);
+    PixelRect part = Intersect(Rect, bounds);
+    const SelectionMask* selection = Target.Selection.get();
+    if (IsEmpty(part) || (selection && !SelectionMayTouch(*selection, part))) {
+        return;
+    }
+    bool isCovered = !selection || SelectionCovers(*selection, part);
+    const CanvasTile& current = *Target.Tiles[Tile];
+    if (current.Pixels.empty()) {
+        u32 color = current.Uniform;
+        Apply(&color, 1);
+        if (color == current.Uniform) {
+            return;
+        }
+        bool isWhole = part.X0 == bounds.X0 && part.Y0 == bounds.Y0 && part.X1 == bounds.X1 && part.Y1 == bounds.Y1;
+        if (isCovered && isWhole) {
+            SetTileUniform(Target, Tile, MakeUniformTile(Target, color));
+            return;
+        }
+    }
+
+    u32* pixels = WritableTile(Target, Tile);
+    for (int y = part.Y0; y < part.Y1; y++) {
+        u32* row = pixels + (y & TILE_MASK) * TILE_SIZE;
+        if (isCovered) {
+            Apply(row + (part.X0 & TILE_MASK), part.X1 - part.X0);
+        }
+        else {
+            ForEachSelectedRun(*selection, y, part.X0, part.X1, [&](int RunX0, int RunX1) {
+                Apply(row + (RunX0 & TILE_MASK), RunX1 - RunX0);
+            });
+        }
+    }
+}
+
+static void FilterColors(Canvas& Target, const PixelRect& Rect, const std::function<void(u32*, int)>& Apply) {
+    bool parallel = (size_t)(Rect.X1 - Rect.X0) * (Rect.Y1 - Rect.Y0) >= PARALLEL_RASTER_PIXELS;
+    ForEachBand(Rect.Y0, Rect.Y1, TILE_SIZE, parallel, [&](int Y0, int) {
+        int rowTile = (Y0 >> TILE_SHIFT) * Target.TilesX;
+        for (int tx = Rect.X0 >> TILE_SHIFT; tx <= (Rect.X1 - 1) >> TILE_SHIFT; tx++) {
+            FilterTileColors(Target, rowTile + tx, Rect, Apply);
+        }
+    });
+}
+
+// Three box blurs in a row come close to a Gaussian. Each box of width w
+// adds (w^2 - 1) / 12 to the variance; the widths are the two odd ones either
+// side of the ideal, as many of each as gets nearest Sigma^2.
+static int GaussianBoxRadii(int Sigma, int* Radii) {
+    double variance = 12.0 * Sigma * Sigma;
+    int lower = (int)sqrt(variance / 3 + 1);
+    if (lower % 2 == 0) {
+        lower--;
+    }
+    int lowerCount = std::clamp((int)lround((variance - 3.0 * lower * lower - 12.0 * lower - 9) / (-4.0 * lower - 4)), 0, 3);
+    int passes = 0;
+    for (int i = 0; i < 3; i++) {
+        int radius = (i < lowerCount ? lower : lower + 2) / 2;
+        if (radius > 0) {
+            Radii[passes++] = radius;
+        }
+    }
+    return passes;
+}
+
+// Rows of a vertical pass per job: enough that starting the sums, one slide
+// per row of the window, stays a small part of the job, but no fewer jobs
+// than workers.
+static int ColumnBand(int Radius, int Height) {
+    return std::max(TILE_SIZE, std::min(4 * (2 * Radius + 1), Height / WorkerCount()));
+}
+
+// A vertical box blur of Count columns of a buffer Height rows high, rows
+// Stride pixels apart, with its top and bottom rows repeating past the ends.
+// For each row from Y0 to Y1 the blurred pixels go to Dest(y), which Done(y)
+// is then called for.
+template <typename DestFn, typename DoneFn>
+static void BlurColumns(const FilterKernels& Kernels, const u32* Source, size_t Stride, int Height, int Count, int Radius, int Y0, int Y1, DestFn&& Dest, DoneFn&& Done) {
+    float scale = 1.0f / (2 * Radius + 1);
+    std::vector<int32_t> sums((size_t)Count * 4);
+    std::vector<u32> zero(Count);
+    std::vector<u32> discard(Count);
+    auto row = [&](int Y) {
+        return Source + (size_t)std::clamp(Y, 0, Height - 1) * Stride;
+    };
+    // The window above Y0 first, so each row is then one slide.
+    for (int y = Y0 - 1 - Radius; y < Y0 + Radius; y++) {
+        Kernels.Slide(discard.data(), sums.data(), row(y), zero.data(), Count, scale);
+    }
+    for (int y = Y0; y < Y1; y++) {
+        Kernels.Slide(Dest(y), sums.data(), row(y + Radius), row(y - Radius - 1), Count, scale);
+        Done(y);
+    }
+}
+
+static void BlurRect(Canvas& Target, const ImageFilter& Filter, const PixelRect& Rect, const FilterKernels& Kernels) {
+    int radius = std::clamp(Filter.Radius, 0, MAX_FILTER_RADIUS);
+    int radii[3];
+    int passes = 0;
+    if (Filter.Kind == FILTER_BOX_BLUR) {
+        if (radius > 0) {
+            radii[passes++] = radius;
+        }
+    }
+    else {
+        passes = GaussianBoxRadii(radius, radii);
+    }
+    if (passes == 0) {
+        return;
+    }
+    int reach = 0;
+    for (int i = 0; i < passes; i++) {
+        reach += radii[i];
+    }
+    // Everything the blur reads: Rect and as far round it as the passes reach.
+    PixelRect area = Intersect({ Rect.X0 - reach, Rect.Y0 - reach, Rect.X1 + reach, Rect.Y1 + reach }, CanvasBounds(Target));
+    u32 color;
+    if (IsRegionUniform(Target, area, color)) {
+        return;
+    }
+    int width = area.X1 - area.X0;
+    int height = area.Y1 - area.Y0;
+    bool parallel = (size_t)width * height >= PARALLEL_RASTER_PIXELS;
+
+    // Along the rows, every pass at once, a row at a time. The buffers aren't
+    // cleared first: every pixel is written before it is read, and clearing
+    // them took as long as this pass.
+    size_t pixels = (size_t)width * height;
+    std::unique_ptr<u32[]> rows(new u32[pixels]);
+    ForEachBand(0, height, 16, parallel, [&](int Y0, int Y1) {
+        std::vector<u32> scratch((size_t)width * 2);
+        for (int y = Y0; y < Y1; y++) {
+            u32* from = scratch.data();
+            u32* to = from + width;
+            ReadCanvasSpan(Target, area.Y0 + y, area.X0, area.X1, from);
+            for (int pass = 0; pass < passes; pass++) {
+                Kernels.BoxBlur(pass == passes - 1 ? &rows[(size_t)y * width] : to, from, width, radii[pass]);
+                std::swap(from, to);
+            }
+        }
+    });
+
+    // Down the columns Rect covers, a pass at a time, since each reads rows
+    // on either side of every band.
+    int left = Rect.X0 - area.X0;
+    int columns = Rect.X1 - Rect.X0;
+    std::unique_ptr<u32[]> other(passes > 1 ? new u32[pixels] : nullptr);
+    for (int pass = 0; pass < passes - 1; pass++) {
+        ForEachBand(0, height, ColumnBand(radii[pass], height), parallel, [&](int Y0, int Y1) {
+            BlurColumns(Kernels, rows.get() + left, width, height, columns, radii[pass], Y0, Y1,
+                [&](int Y) { return &other[(size_t)Y * width + left]; }, [](int) {});
+        });
+        rows.swap(other);
+    }
+
+    // Tiles that see only one colour as far as the blur reaches keep it.
+    // Worked out before the last pass starts replacing tiles.
+    int firstTileX = Rect.X0 >> TILE_SHIFT;
+    int firstTileY = Rect.Y0 >> TILE_SHIFT;
+    int tilesX = ((Rect.X1 - 1) >> TILE_SHIFT) - firstTileX + 1;
+    int tilesY = ((Rect.Y1 - 1) >> TILE_SHIFT) - firstTileY + 1;
+    std::vector<uint8_t> isKept((size_t)tilesX * tilesY);
+    for (int ty = 0; ty < tilesY; ty++) {
+        for (int tx = 0; tx < tilesX; tx++) {
+            PixelRect bounds = TileBounds(Target, (firstTileY + ty) * Target.TilesX + firstTileX + tx);
+            PixelRect seen = Intersect({ bounds.X0 - reach, bounds.Y0 - reach, bounds.X1 + reach, bounds.Y1 + reach }, area);
+            isKept[(size_t)ty * tilesX + tx] = IsRegionUniform(Target, seen, color);
+        }
+    }
+
+    // The last pass goes straight back to the canvas, in bands of whole tile
+    // rows so that no two jobs write one tile.
+    int amount = std::clamp(Filter.Amount * 1024 / 100, 0, 32767);
+    int last = radii[passes - 1];
+    int band = (ColumnBand(last, height) + TILE_MASK) & ~TILE_MASK;
+    const SelectionMask* selection = Target.Selection.get();
+    ForEachBand(Rect.Y0, Rect.Y1, band, parallel, [&](int Y0, int Y1) {
+        std::vector<u32> blurred(columns);
+        std::vector<u32> original(Filter.Kind == FILTER_UNSHARP_MASK ? columns : 0);
+        BlurColumns(Kernels, rows.get() + left, width, height, columns, last, Y0 - area.Y0, Y1 - area.Y0,
+            [&](int) { return blurred.data(); },
+            [&](int Y) {
+                int y = area.Y0 + Y;
+                if (Filter.Kind == FILTER_UNSHARP_MASK) {
+                    ReadCanvasSpan(Target, y, Rect.X0, Rect.X1, original.data());
+                    Kernels.Sharpen(blurred.data(), original.data(), blurred.data(), columns, amount);
+                }
+                const uint8_t* kept = &isKept[(size_t)((y >> TILE_SHIFT) - firstTileY) * tilesX];
+                for (int tx = 0; tx < tilesX; tx++) {
+                    int x0 = std::max(Rect.X0, (firstTileX + tx) * TILE_SIZE);
+                    int x1 = std::min(Rect.X1, (firstTileX + tx + 1) * TILE_SIZE);
+                    if (kept[tx]) {
+                        continue;
+                    }
+                    if (!selection) {
+                        WriteCanvasSpan(Target, y, x0, x1, &blurred[x0 - Rect.X0]);
+                        continue;
+                    }
+                    ForEachSelectedRun(*selection, y, x0, x1, [&](int RunX0, int RunX1) {
+                        WriteCanvasSpan(Target, y, RunX0, RunX1, &blurred[RunX0 - Rect.X0]);
+                    });
+                }
+            });
+    });
+}
+
+void ApplyFilter(Canvas& Target, const ImageFilter& Filter, const PixelRect& Rect) {
+    TraceScope trace("ApplyFilter");
+    EndBlendedStroke(Target);
+    PixelRect rect = Intersect(Rect, CanvasBounds(Target));
+    if (Target.Selection) {
+        rect = Intersect(rect, Target.Selection->Bounds);
+    }
+    if (IsEmpty(rect)) {
+        return;
+    }
+    FilterKernels kernels = FilterKernelsFor(GetSpanKernel());
+    switch (Filter.Kind) {
+    case FILTER_BOX_BLUR:
+    case FILTER_GAUSSIAN_BLUR:
+    case FILTER_UNSHARP_MASK:
+        BlurRect(Target, Filter, rect, kernels);
+        break;
+    case FILTER_INVERT:
+        FilterColors(Target, rect, [&](u32* Row, int Count) { kernels.Adjust(Row, Count, -1024, 1024); });
+        break;
+    case FILTER_BRIGHTNESS_CONTRAST: {
+        // Unpremultiplied, v becomes (v - 128) * k + 128 + Brightness, plus a
+        // half so the floors round.
+        double k = std::clamp(Filter.Contrast, 0, 3200) / 100.0;
+        int brightness = std::clamp(Filter.Brightness, -255, 255);
+        int scale = std::min((int)lround(k * 1024), 32767);
+        int offset = (int)lround((128 + brightness - 128 * k + 0.5) * 1024 / 255);
+        FilterColors(Target, rect, [&](u32* Row, int Count) { kernels.Adjust(Row, Count, scale, offset); });
+        break;
+    }
+    case FILTER_THRESHOLD: {
+        int level = std::clamp(Filter.Level, 0, 255);
+        FilterColors(Target, rect, [&](u32* Row, int Count) { kernels.Threshold(Row, Count, level); });
+        break;
+    }
+    }
+    TracePixelsWritten((int64_t)(rect.X1 - rect.X0) * (rect.Y1 - rect.Y0));
+    MarkDirty(Target, rect.X0, rect.Y0, rect.X1, rect.Y1);
+}
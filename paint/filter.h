@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+#include "canvas.h"
+
+enum FilterKind {
+    FILTER_BOX_BLUR,          // mean of the (2 Radius + 1)^2 square around each pixel
+    FILTER_GAUSSIAN_BLUR,     // standard deviation Radius, as three box blurs
+    FILTER_UNSHARP_MASK,      // adds back Amount of the difference from the Gaussian blur
+    FILTER_INVERT,
+    FILTER_BRIGHTNESS_CONTRAST,
+    FILTER_THRESHOLD          // white where the luma is at least Level, black elsewhere
+};
+
+// Blurs reach no further than this; larger radii are capped.
+constexpr int MAX_FILTER_RADIUS = 4096;
+
+struct ImageFilter {
+    FilterKind Kind = FILTER_INVERT;
+    int Radius = 1;
+    // Unsharp mask strength, in percent of the difference.
+    int Amount = 100;
+    // Added to every channel, -255 to 255, ...
+    int Brightness = 0;
+    // ... after its distance from mid grey is scaled by this percentage.
+    int Contrast = 100;
+    int Level = 128;
+};
+
+// Filters Rect of Target, clipped to the canvas and, with a selection, to its
+// pixels. Any stroke in progress ends first. Pixels stay premultiplied: the
+// colour filters work as if on the unpremultiplied colour, and blurs treat
+// transparency as a fifth channel. Blurs repeat the canvas edge and read
+// outside Rect, but only write inside it.
+//
+// Blurs are running sums, so their cost doesn't depend on the radius: each
+// box pass is a sweep along every row, then one down every column, each split
+// into bands of rows over the worker pool. Colour filters work tile by tile;
+// uniform tiles stay uniform, and so do tiles a blur only sees one colour
+// around.
+void ApplyFilter(Canvas& Target, const ImageFilter& Filter, const PixelRect& Rect);
@@ -0,0 +1,732 @@
+#include "floating.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "blend.h"
+#include "cpu.h"
+#include "selection.h"
+#include "span.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// Positions along a row for a resampling kernel, in 16.16 fixed point with
+// pixel x centred on x << 16. Each position is clamped to Min..Max first:
+// past those a filter reads nothing but the clear border, so the clamp never
+// changes a result, but it keeps every read inside the border.
+struct SampleWalk {
+    const u32* Origin;
+    ptrdiff_t Stride;
+    int32_t U;
+    int32_t V;
+    int32_t DU;
+    int32_t DV;
+    int32_t MinU;
+    int32_t MaxU;
+    int32_t MinV;
+    int32_t MaxV;
+};
+
+// Row kernels, picked like the ones in span.cpp from the current span kernel.
+// Every version of a kernel gives exactly the same result. Walks are kept to
+// a tile wide, so positions never drift far from the exact ones.
+typedef void (*ResampleRowProc)(u32* Dest, const SampleWalk& Walk, int Count);
+
+// Source pixels past its centre a filter reads, rounded up.
+static int FilterReach(ResampleFilter Filter) {
+    return Filter == RESAMPLE_LANCZOS ? 3 : 1;
+}
+
+static SampleWalk AdvanceWalk(const SampleWalk& Walk, int Count) {
+    SampleWalk walk = Walk;
+    walk.U += Count * Walk.DU;
+    walk.V += Count * Walk.DV;
+    return walk;
+}
+
+// Whether the walk steps one pixel right at a time and stays within the
+// clamp, as it does while the region is only moved: then the pixels it reads
+// lie side by side.
+static bool IsStraightWalk(const SampleWalk& Walk, int Count) {
+    return Walk.DU == 1 << 16 && Walk.DV == 0 && Walk.U >= Walk.MinU && Walk.U + (Count - 1) * Walk.DU <= Walk.MaxU
+        && Walk.V >= Walk.MinV && Walk.V <= Walk.MaxV;
+}
+
+// Rounding can leave a colour channel one above alpha; this keeps the pixel
+// premultiplied.
+static inline u32 ClampToAlpha(u32 Pixel) {
+    u32 alpha = 255 - (Pixel >> 24);
+    u32 result = Pixel & 0xff000000;
+    for (int shift = 0; shift < 24; shift += 8) {
+        result |= std::min(Pixel >> shift & 0xff, alpha) << shift;
+    }
+    return result;
+}
+
+// Lanczos weights for every 64th of a pixel, six taps from two pixels left of
+// the position to three right of it, normalized to sum to 1 << 14.
+constexpr int LANCZOS_PHASES = 64;
+constexpr int LANCZOS_TAPS = 6;
+
+struct LanczosTable {
+    int16_t Taps[LANCZOS_PHASES][LANCZOS_TAPS];
+};
+
+static double LanczosWeight(double X) {
+    if (X == 0) {
+        return 1;
+    }
+    if (fabs(X) >= 3) {
+        return 0;
+    }
+    double pi = 3.14159265358979323846 * X;
+    return 3 * sin(pi) * sin(pi / 3) / (pi * pi);
+}
+
+static const LanczosTable& Lanczos() {
+    static const LanczosTable table = [] {
+        LanczosTable result;
+        for (int phase = 0; phase < LANCZOS_PHASES; phase++) {
+            double weights[LANCZOS_TAPS];
+            double sum = 0;
+            for (int k = 0; k < LANCZOS_TAPS; k++) {
+                weights[k] = LanczosWeight((double)phase / LANCZOS_PHASES + 2 - k);
+                sum += weights[k];
+            }
+            int total = 0;
+            for (int k = 0; k < LANCZOS_TAPS; k++) {
+                result.Taps[phase][k] = (int16_t)lround(weights[k] / sum * (1 << 14));
+                total += result.Taps[phase][k];
+            }
+            // What rounding lost goes to the nearest pixel.
+            result.Taps[phase][phase < LANCZOS_PHASES / 2 ? 2 : 3] += (int16_t)((1 << 14) - total);
+        }
+        return result;
+    }();
+    return table;
+}
+
+static void NearestRowScalar(u32* Dest, const SampleWalk& Walk, int Count) {
+    if (IsStraightWalk(Walk, Count)) {
+        memcpy(Dest, Walk.Origin + ((Walk.V + 32768) >> 16) * Walk.Stride + ((Walk.U + 32768) >> 16), Count * sizeof(u32));
+        return;
+    }
+    for (int i = 0; i < Count; i++) {
+        int32_t u = std::clamp(Walk.U + i * Walk.DU, Walk.MinU, Walk.MaxU);
+        int32_t v = std::clamp(Walk.V + i * Walk.DV, Walk.MinV, Walk.MaxV);
+        Dest[i] = Walk.Origin[((v + 32768) >> 16) * Walk.Stride + ((u + 32768) >> 16)];
+    }
+}
+
+// Each channel is blended across the two columns and then the two rows, with
+// 8-bit fractions and rounding after each step.
+static void BilinearRowScalar(u32* Dest, const SampleWalk& Walk, int Count) {
+    for (int i = 0; i < Count; i++) {
+        int32_t u = std::clamp(Walk.U + i * Walk.DU, Walk.MinU, Walk.MaxU);
+        int32_t v = std::clamp(Walk.V + i * Walk.DV, Walk.MinV, Walk.MaxV);
+        int fx = u >> 8 & 0xff;
+        int fy = v >> 8 & 0xff;
+        const u32* p = Walk.Origin + (v >> 16) * Walk.Stride + (u >> 16);
+        u32 result = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            int top = ((int)(p[0] >> shift & 0xff) * (256 - fx) + (int)(p[1] >> shift & 0xff) * fx + 128) >> 8;
+            int bottom = ((int)(p[Walk.Stride] >> shift & 0xff) * (256 - fx) + (int)(p[Walk.Stride + 1] >> shift & 0xff) * fx + 128) >> 8;
+            result |= (u32)((top * (256 - fy) + bottom * fy + 128) >> 8) << shift;
+        }
+        Dest[i] = ClampToAlpha(result);
+    }
+}
+
+// Six rows of six taps each are summed and rounded to 8 fractional bits, which
+// keeps them within 16 bits for any phase, then the six row sums are summed.
+// Lobes can overshoot, so channels are clamped to 0..255 and colour to alpha.
+static void LanczosRowScalar(u32* Dest, const SampleWalk& Walk, int Count) {
+    const LanczosTable& table = Lanczos();
+    for (int i = 0; i < Count; i++) {
+        int32_t u = std::clamp(Walk.U + i * Walk.DU, Walk.MinU, Walk.MaxU);
+        int32_t v = std::clamp(Walk.V + i * Walk.DV, Walk.MinV, Walk.MaxV);
+        const int16_t* wx = table.Taps[u >> 10 & (LANCZOS_PHASES - 1)];
+        const int16_t* wy = table.Taps[v >> 10 & (LANCZOS_PHASES - 1)];
+        const u32* p = Walk.Origin + ((v >> 16) - 2) * Walk.Stride + (u >> 16) - 2;
+        int rows[LANCZOS_TAPS][4];
+        for (int r = 0; r < LANCZOS_TAPS; r++) {
+            const u32* row = p + r * Walk.Stride;
+            for (int c = 0; c < 4; c++) {
+                int sum = 0;
+                for (int k = 0; k < LANCZOS_TAPS; k++) {
+                    sum += wx[k] * (int)(row[k] >> c * 8 & 0xff);
+                }
+                rows[r][c] = (sum + 128) >> 8;
+            }
+        }
+        u32 result = 0;
+        for (int c = 0; c < 4; c++) {
+            int sum = 0;
+            for (int r = 0; r < LANCZOS_TAPS; r++) {
+                sum += wy[r] * rows[r][c];
+            }
+            result |= (u32)std::clamp((sum + (1 << 19)) >> 20, 0, 255) << c * 8;
+        }
+        Dest[i] = ClampToAlpha(result);
+    }
+}
+
+// Two neighbouring weights as one 32-bit lane, the way _mm_madd_epi16 pairs
+// them.
+static inline int32_t TapPair(const int16_t* Taps, int K) {
+    int32_t pair;
+    memcpy(&pair, Taps + 2 * K, sizeof(pair));
+    return pair;
+}
+
+#if PAINT_SSE2
+static inline __m128i ClampToAlphaSSE2(__m128i Pixels) {
+    __m128i alpha = _mm_sub_epi32(_mm_set1_epi32(255), _mm_srli_epi32(Pixels, 24));
+    alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 8));
+    alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+    return _mm_min_epu8(Pixels, _mm_or_si128(alpha, _mm_set1_epi32((int)0xff000000)));
+}
+
+// A channel per 16-bit lane. Both products and their sum stay below 65536.
+static inline __m128i LerpSSE2(__m128i A, __m128i B, __m128i Weight) {
+    __m128i inverse = _mm_sub_epi16(_mm_set1_epi16(256), Weight);
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(A, inverse), _mm_mullo_epi16(B, Weight));
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+}
+
+// Four pixels from their four neighbours, the fractions one per 32-bit lane.
+static inline __m128i BilinearFourSSE2(__m128i P00, __m128i P01, __m128i P10, __m128i P11, __m128i FX, __m128i FY) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i fx = _mm_or_si128(FX, _mm_slli_epi32(FX, 16));
+    __m128i fy = _mm_or_si128(FY, _mm_slli_epi32(FY, 16));
+    __m128i fxLo = _mm_unpacklo_epi32(fx, fx);
+    __m128i fxHi = _mm_unpackhi_epi32(fx, fx);
+    __m128i lo = LerpSSE2(
+        LerpSSE2(_mm_unpacklo_epi8(P00, zero), _mm_unpacklo_epi8(P01, zero), fxLo),
+        LerpSSE2(_mm_unpacklo_epi8(P10, zero), _mm_unpacklo_epi8(P11, zero), fxLo),
+        _mm_unpacklo_epi32(fy, fy));
+    __m128i hi = LerpSSE2(
+        LerpSSE2(_mm_unpackhi_epi8(P00, zero), _mm_unpackhi_epi8(P01, zero), fxHi),
+        LerpSSE2(_mm_unpackhi_epi8(P10, zero), _mm_unpackhi_epi8(P11, zero), fxHi),
+        _mm_unpackhi_epi32(fy, fy));
+    return ClampToAlphaSSE2(_mm_packus_epi16(lo, hi));
+}
+
+// Without a gather the addresses are worked out one pixel at a time; only the
+// blending is four wide.
+static void BilinearRowSSE2(u32* Dest, const SampleWalk& Walk, int Count) {
+    int i = 0;
+    if (IsStraightWalk(Walk, Count)) {
+        const u32* p = Walk.Origin + (Walk.V >> 16) * Walk.Stride + (Walk.U >> 16);
+        __m128i fx = _mm_set1_epi32(Walk.U >> 8 & 0xff);
+        __m128i fy = _mm_set1_epi32(Walk.V >> 8 & 0xff);
+        for (; i + 4 <= Count; i += 4) {
+            const u32* q = p + i;
+            __m128i result = BilinearFourSSE2(_mm_loadu_si128((const __m128i*)q), _mm_loadu_si128((const __m128i*)(q + 1)),
+                _mm_loadu_si128((const __m128i*)(q + Walk.Stride)), _mm_loadu_si128((const __m128i*)(q + Walk.Stride + 1)), fx, fy);
+            _mm_storeu_si128((__m128i*)(Dest + i), result);
+        }
+    }
+    for (; i + 4 <= Count; i += 4) {
+        alignas(16) u32 p00[4], p01[4], p10[4], p11[4];
+        alignas(16) int32_t fx[4], fy[4];
+        for (int j = 0; j < 4; j++) {
+            int32_t u = std::clamp(Walk.U + (i + j) * Walk.DU, Walk.MinU, Walk.MaxU);
+            int32_t v = std::clamp(Walk.V + (i + j) * Walk.DV, Walk.MinV, Walk.MaxV);
+            const u32* p = Walk.Origin + (v >> 16) * Walk.Stride + (u >> 16);
+            p00[j] = p[0];
+            p01[j] = p[1];
+            p10[j] = p[Walk.Stride];
+            p11[j] = p[Walk.Stride + 1];
+            fx[j] = u >> 8 & 0xff;
+            fy[j] = v >> 8 & 0xff;
+        }
+        __m128i result = BilinearFourSSE2(_mm_load_si128((const __m128i*)p00), _mm_load_si128((const __m128i*)p01),
+            _mm_load_si128((const __m128i*)p10), _mm_load_si128((const __m128i*)p11),
+            _mm_load_si128((const __m128i*)fx), _mm_load_si128((const __m128i*)fy));
+        _mm_storeu_si128((__m128i*)(Dest + i), result);
+    }
+    BilinearRowScalar(Dest + i, AdvanceWalk(Walk, i), Count - i);
+}
+
+// One row of six taps: three pairs of neighbours, their bytes interleaved so
+// one multiply-add weighs both. The four channel sums, rounded to 8
+// fractional bits, come back one per 32-bit lane.
+static inline __m128i LanczosTapsSSE2(const u32* Row, const int16_t* Taps) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    for (int k = 0; k < 3; k++) {
+        __m128i pair = _mm_loadl_epi64((const __m128i*)(Row + 2 * k));
+        __m128i mixed = _mm_unpacklo_epi8(_mm_unpacklo_epi8(pair, _mm_srli_si128(pair, 4)), zero);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(mixed, _mm_set1_epi32(TapPair(Taps, k))));
+    }
+    return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8);
+}
+
+static inline u32 LanczosPixelSSE2(const u32* P, ptrdiff_t Stride, const int16_t* WX, const int16_t* WY) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    for (int k = 0; k < 3; k++) {
+        __m128i rows = _mm_packs_epi32(LanczosTapsSSE2(P + 2 * k * Stride, WX), LanczosTapsSSE2(P + (2 * k + 1) * Stride, WX));
+        __m128i mixed = _mm_unpacklo_epi16(rows, _mm_srli_si128(rows, 8));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(mixed, _mm_set1_epi32(TapPair(WY, k))));
+    }
+    sum = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << 19)), 20);
+    __m128i pixel = _mm_packus_epi16(_mm_packs_epi32(sum, zero), zero);
+    return (u32)_mm_cvtsi128_si32(ClampToAlphaSSE2(pixel));
+}
+
+static void LanczosRowSSE2(u32* Dest, const SampleWalk& Walk, int Count) {
+    const LanczosTable& table = Lanczos();
+    for (int i = 0; i < Count; i++) {
+        int32_t u = std::clamp(Walk.U + i * Walk.DU, Walk.MinU, Walk.MaxU);
+        int32_t v = std::clamp(Walk.V + i * Walk.DV, Walk.MinV, Walk.MaxV);
+        const u32* p = Walk.Origin + ((v >> 16) - 2) * Walk.Stride + (u >> 16) - 2;
+        Dest[i] = LanczosPixelSSE2(p, Walk.Stride, table.Taps[u >> 10 & (LANCZOS_PHASES - 1)], table.Taps[v >> 10 & (LANCZOS_PHASES - 1)]);
+    }
+}
+#endif
+
+#if PAINT_X86
+PAINT_TARGET_AVX2 static inline __m256i ClampToAlphaAVX2(__m256i Pixels) {
+    __m256i alpha = _mm256_sub_epi32(_mm256_set1_epi32(255), _mm256_srli_epi32(Pixels, 24));
+    alpha = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 8));
+    alpha = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 16));
+    return _mm256_min_epu8(Pixels, _mm256_or_si256(alpha, _mm256_set1_epi32((int)0xff000000)));
+}
+
+PAINT_TARGET_AVX2 static inline __m256i LerpAVX2(__m256i A, __m256i B, __m256i Weight) {
+    __m256i inverse = _mm256_sub_epi16(_mm256_set1_epi16(256), Weight);
+    __m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(A, inverse), _mm256_mullo_epi16(B, Weight));
+    return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(128)), 8);
+}
+
+PAINT_TARGET_AVX2 static inline __m256i BilinearEightAVX2(__m256i P00, __m256i P01, __m256i P10, __m256i P11, __m256i FX, __m256i FY) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i fx = _mm256_or_si256(FX, _mm256_slli_epi32(FX, 16));
+    __m256i fy = _mm256_or_si256(FY, _mm256_slli_epi32(FY, 16));
+    __m256i fxLo = _mm256_unpacklo_epi32(fx, fx);
+    __m256i fxHi = _mm256_unpackhi_epi32(fx, fx);
+    __m256i lo = LerpAVX2(
+        LerpAVX2(_mm256_unpacklo_epi8(P00, zero), _mm256_unpacklo_epi8(P01, zero), fxLo),
+        LerpAVX2(_mm256_unpacklo_epi8(P10, zero), _mm256_unpacklo_epi8(P11, zero), fxLo),
+        _mm256_unpacklo_epi32(fy, fy));
+    __m256i hi = LerpAVX2(
+        LerpAVX2(_mm256_unpackhi_epi8(P00, zero), _mm256_unpackhi_epi8(P01, zero), fxHi),
+        LerpAVX2(_mm256_unpackhi_epi8(P10, zero), _mm256_unpackhi_epi8(P11, zero), fxHi),
+        _mm256_unpackhi_epi32(fy, fy));
+    return ClampToAlphaAVX2(_mm256_packus_epi16(lo, hi));
+}
+
+// Positions of eight pixels at a time, clamped and turned into offsets from
+// the origin for gathers. Lanes past Count are clamped like the rest, so they
+// read inside the border too; only their store is masked.
+struct WalkAVX2 {
+    __m256i U, V, StepU, StepV, MinU, MaxU, MinV, MaxV, Stride;
+};
+
+PAINT_TARGET_AVX2 static inline WalkAVX2 StartWalkAVX2(const SampleWalk& Walk) {
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    return {
+        _mm256_add_epi32(_mm256_set1_epi32(Walk.U), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(Walk.DU))),
+        _mm256_add_epi32(_mm256_set1_epi32(Walk.V), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(Walk.DV))),
+        _mm256_set1_epi32(Walk.DU * 8), _mm256_set1_epi32(Walk.DV * 8),
+        _mm256_set1_epi32(Walk.MinU), _mm256_set1_epi32(Walk.MaxU),
+        _mm256_set1_epi32(Walk.MinV), _mm256_set1_epi32(Walk.MaxV),
+        _mm256_set1_epi32((int)Walk.Stride)
+    };
+}
+
+PAINT_TARGET_AVX2 static inline void StoreEightAVX2(u32* Dest, int Rest, __m256i Pixels) {
+    if (Rest >= 8) {
+        _mm256_storeu_si256((__m256i*)Dest, Pixels);
+    }
+    else {
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(Rest), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        _mm256_maskstore_epi32((int*)Dest, mask, Pixels);
+    }
+}
+
+PAINT_TARGET_AVX2 static void NearestRowAVX2(u32* Dest, const SampleWalk& Walk, int Count) {
+    if (IsStraightWalk(Walk, Count)) {
+        NearestRowScalar(Dest, Walk, Count);
+        return;
+    }
+    WalkAVX2 walk = StartWalkAVX2(Walk);
+    __m256i half = _mm256_set1_epi32(32768);
+    for (int i = 0; i < Count; i += 8) {
+        __m256i u = _mm256_min_epi32(_mm256_max_epi32(walk.U, walk.MinU), walk.MaxU);
+        __m256i v = _mm256_min_epi32(_mm256_max_epi32(walk.V, walk.MinV), walk.MaxV);
+        __m256i x = _mm256_srai_epi32(_mm256_add_epi32(u, half), 16);
+        __m256i y = _mm256_srai_epi32(_mm256_add_epi32(v, half), 16);
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(y, walk.Stride), x);
+        StoreEightAVX2(Dest + i, Count - i, _mm256_i32gather_epi32((const int*)Walk.Origin, index, 4));
+        walk.U = _mm256_add_epi32(walk.U, walk.StepU);
+        walk.V = _mm256_add_epi32(walk.V, walk.StepV);
+    }
+}
+
+PAINT_TARGET_AVX2 static void BilinearStraightAVX2(u32* Dest, const SampleWalk& Walk, int Count) {
+    const u32* p = Walk.Origin + (Walk.V >> 16) * Walk.Stride + (Walk.U >> 16);
+    __m256i fx = _mm256_set1_epi32(Walk.U >> 8 & 0xff);
+    __m256i fy = _mm256_set1_epi32(Walk.V >> 8 & 0xff);
+    for (int i = 0; i < Count; i += 8) {
+        const int* q = (const int*)(p + i);
+        const int* below = q + Walk.Stride;
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(Count - i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256i result = BilinearEightAVX2(_mm256_maskload_epi32(q, mask), _mm256_maskload_epi32(q + 1, mask),
+            _mm256_maskload_epi32(below, mask), _mm256_maskload_epi32(below + 1, mask), fx, fy);
+        StoreEightAVX2(Dest + i, Count - i, result);
+    }
+}
+
+PAINT_TARGET_AVX2 static void BilinearRowAVX2(u32* Dest, const SampleWalk& Walk, int Count) {
+    if (IsStraightWalk(Walk, Count)) {
+        BilinearStraightAVX2(Dest, Walk, Count);
+        return;
+    }
+    WalkAVX2 walk = StartWalkAVX2(Walk);
+    __m256i low = _mm256_set1_epi32(0xff);
+    const int* p00 = (const int*)Walk.Origin;
+    const int* p10 = (const int*)(Walk.Origin + Walk.Stride);
+    for (int i = 0; i < Count; i += 8) {
+        __m256i u = _mm256_min_epi32(_mm256_max_epi32(walk.U, walk.MinU), walk.MaxU);
+        __m256i v = _mm256_min_epi32(_mm256_max_epi32(walk.V, walk.MinV), walk.MaxV);
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(v, 16), walk.Stride), _mm256_srai_epi32(u, 16));
+        __m256i result = BilinearEightAVX2(
+            _mm256_i32gather_epi32(p00, index, 4), _mm256_i32gather_epi32(p00 + 1, index, 4),
+            _mm256_i32gather_epi32(p10, index, 4), _mm256_i32gather_epi32(p10 + 1, index, 4),
+            _mm256_and_si256(_mm256_srli_epi32(u, 8), low), _mm256_and_si256(_mm256_srli_epi32(v, 8), low));
+        StoreEightAVX2(Dest + i, Count - i, result);
+        walk.U = _mm256_add_epi32(walk.U, walk.StepU);
+        walk.V = _mm256_add_epi32(walk.V, walk.StepV);
+    }
+}
+
+// LanczosTapsSSE2 with one pixel in each 128-bit lane.
+PAINT_TARGET_AVX2 static inline __m256i LanczosTapsAVX2(const u32* RowA, const u32* RowB, const int16_t* TapsA, const int16_t* TapsB) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sum = zero;
+    for (int k = 0; k < 3; k++) {
+        __m256i pair = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadl_epi64((const __m128i*)(RowA + 2 * k))),
+            _mm_loadl_epi64((const __m128i*)(RowB + 2 * k)), 1);
+        __m256i mixed = _mm256_unpacklo_epi8(_mm256_unpacklo_epi8(pair, _mm256_srli_si256(pair, 4)), zero);
+        __m256i taps = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi32(TapPair(TapsA, k))), _mm_set1_epi32(TapPair(TapsB, k)), 1);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(mixed, taps));
+    }
+    return _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(128)), 8);
+}
+
+// Two pixels at a time, one per lane; an odd last one is worked out twice.
+PAINT_TARGET_AVX2 static void LanczosRowAVX2(u32* Dest, const SampleWalk& Walk, int Count) {
+    const LanczosTable& table = Lanczos();
+    __m256i zero = _mm256_setzero_si256();
+    for (int i = 0; i < Count; i += 2) {
+        const u32* p[2];
+        const int16_t* wx[2];
+        const int16_t* wy[2];
+        for (int j = 0; j < 2; j++) {
+            int n = std::min(i + j, Count - 1);
+            int32_t u = std::clamp(Walk.U + n * Walk.DU, Walk.MinU, Walk.MaxU);
+            int32_t v = std::clamp(Walk.V + n * Walk.DV, Walk.MinV, Walk.MaxV);
+            p[j] = Walk.Origin + ((v >> 16) - 2) * Walk.Stride + (u >> 16) - 2;
+            wx[j] = table.Taps[u >> 10 & (LANCZOS_PHASES - 1)];
+            wy[j] = table.Taps[v >> 10 & (LANCZOS_PHASES - 1)];
+        }
+        __m256i sum = zero;
+        for (int k = 0; k < 3; k++) {
+            ptrdiff_t top = 2 * k * Walk.Stride;
+            ptrdiff_t bottom = top + Walk.Stride;
+            __m256i rows = _mm256_packs_epi32(LanczosTapsAVX2(p[0] + top, p[1] + top, wx[0], wx[1]), LanczosTapsAVX2(p[0] + bottom, p[1] + bottom, wx[0], wx[1]));
+            __m256i mixed = _mm256_unpacklo_epi16(rows, _mm256_srli_si256(rows, 8));
+            __m256i taps = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi32(TapPair(wy[0], k))), _mm_set1_epi32(TapPair(wy[1], k)), 1);
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(mixed, taps));
+        }
+        sum = _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(1 << 19)), 20);
+        __m256i pixels = ClampToAlphaAVX2(_mm256_packus_epi16(_mm256_packs_epi32(sum, zero), zero));
+        Dest[i] = (u32)_mm_cvtsi128_si32(_mm256_castsi256_si128(pixels));
+        if (i + 1 < Count) {
+            Dest[i + 1] = (u32)_mm_cvtsi128_si32(_mm256_extracti128_si256(pixels, 1));
+        }
+    }
+}
+#endif
+
+struct ResampleKernels {
+    ResampleRowProc Nearest;
+    ResampleRowProc Bilinear;
+    ResampleRowProc Lanczos;
+};
+
+// Nearest sampling is all address arithmetic and loads, which SSE2 can't
+// gather, so it shares the scalar kernel.
+static ResampleKernels ResampleKernelsFor(SpanKernel Kernel) {
+    switch (Kernel) {
+#if PAINT_X86
+    case SPAN_KERNEL_AVX2:
+        return { NearestRowAVX2, BilinearRowAVX2, LanczosRowAVX2 };
+#endif
+#if PAINT_SSE2
+    case SPAN_KERNEL_SSE2:
+        return { NearestRowScalar, BilinearRowSSE2, LanczosRowSSE2 };
+#endif
+    default:
+        return { NearestRowScalar, BilinearRowScalar, LanczosRowScalar };
+    }
+}
+
+static ResampleRowProc ResampleKernelFor(ResampleFilter Filter) {
+    ResampleKernels kernels = ResampleKernelsFor(GetSpanKernel());
+    switch (Filter) {
+    case RESAMPLE_NEAREST:
+        return kernels.Nearest;
+    case RESAMPLE_BILINEAR:
+        return kernels.Bilinear;
+    default:
+        return kernels.Lanczos;
+    }
+}
+
+// Positions far outside the region are held at 2^14 pixels out, where a
+// tile's worth of steps can't bring them back in, so fixed point never
+// overflows.
+static SampleWalk StartWalk(const FloatingRegion& Region, ResampleFilter Filter, double U, double V, double DU, double DV) {
+    const double limit = 1 << 30;
+    int reach = FilterReach(Filter);
+    return {
+        RegionOrigin(Region), (ptrdiff_t)Region.Stride,
+        (int32_t)lround(std::clamp(U * 65536, -limit, limit)),
+        (int32_t)lround(std::clamp(V * 65536, -limit, limit)),
+        (int32_t)lround(DU * 65536),
+        (int32_t)lround(DV * 65536),
+        -(reach << 16), (Region.Width - 1 + reach) << 16,
+        -(reach << 16), (Region.Height - 1 + reach) << 16
+    };
+}
+
+void ResampleRow(u32* Dest, const FloatingRegion& Region, int Count, double U, double V, double DU, double DV, ResampleFilter Filter) {
+    ResampleRowProc resample = ResampleKernelFor(Filter);
+    double limit = 1 / MIN_REGION_SCALE;
+    DU = std::clamp(DU, -limit, limit);
+    DV = std::clamp(DV, -limit, limit);
+    for (int i = 0; i < Count; i += TILE_SIZE) {
+        resample(Dest + i, StartWalk(Region, Filter, U + i * DU, V + i * DV, DU, DV), std::min(TILE_SIZE, Count - i));
+    }
+}
+
+// Narrows [X0, X1) to the x where Start + Step * x lies within Lo..Hi, give
+// or take a pixel; the kernels clamp whatever lies just outside.
+static void ClipSpan(double Start, double Step, double Lo, double Hi, int& X0, int& X1) {
+    if (fabs(Step) < 1e-9) {
+        if (Start < Lo || Start > Hi) {
+            X1 = X0;
+        }
+        return;
+    }
+    double a = (Lo - Start) / Step;
+    double b = (Hi - Start) / Step;
+    if (a > b) {
+        std::swap(a, b);
+    }
+    X0 = std::max(X0, (int)floor(std::clamp(a, X0 - 1.0, X1 + 1.0)) - 1);
+    X1 = std::min(X1, (int)ceil(std::clamp(b, X0 - 1.0, X1 + 1.0)) + 2);
+}
+
+// The opposite: narrows [X0, X1) to x that surely lie within Lo..Hi.
+static void ClipSpanInside(double Start, double Step, double Lo, double Hi, int& X0, int& X1) {
+    if (fabs(Step) < 1e-9) {
+        if (Start < Lo + 1e-6 || Start > Hi - 1e-6) {
+            X1 = X0;
+        }
+        return;
+    }
+    double a = (Lo - Start) / Step;
+    double b = (Hi - Start) / Step;
+    if (a > b) {
+        std::swap(a, b);
+    }
+    X0 = std::max(X0, (int)ceil(std::clamp(a, X0 - 1.0, X1 + 1.0)) + 1);
+    X1 = std::min(X1, (int)floor(std::clamp(b, X0 - 1.0, X1 + 1.0)));
+}
+
+bool LiftRegion(FloatingRegion& Region, Canvas& Target, const PixelRect& Rect, u32 Hole) {
+    TraceScope trace("LiftRegion");
+    EndBlendedStroke(Target);
+    PixelRect rect = Intersect(Rect, CanvasBounds(Target));
+    const SelectionMask* selection = Target.Selection.get();
+    if (selection) {
+        rect = Intersect(rect, selection->Bounds);
+    }
+    int width = rect.X1 - rect.X0;
+    int height = rect.Y1 - rect.Y0;
+    if (IsEmpty(rect) || width > MAX_REGION_SIZE || height > MAX_REGION_SIZE) {
+        return false;
+    }
+
+    Region = FloatingRegion();
+    Region.Width = width;
+    Region.Height = height;
+    Region.Stride = (size_t)width + 2 * REGION_BORDER;
+    Region.Pixels.assign(Region.Stride * (height + 2 * REGION_BORDER), LAYER_CLEAR);
+    Region.Lifted = rect;
+    Region.IsOpaque = true;
+    u32* origin = Region.Pixels.data() + REGION_BORDER * Region.Stride + REGION_BORDER;
+    for (int y = rect.Y0; y < rect.Y1; y++) {
+        u32* row = origin + (y - rect.Y0) * Region.Stride;
+        ReadCanvasSpan(Target, y, rect.X0, rect.X1, row);
+        if (selection) {
+            for (int x = NextUnselected(*selection, y, rect.X0, rect.X1); x < rect.X1;) {
+                int end = NextSelected(*selection, y, x, rect.X1);
+                std::fill(row + (x - rect.X0), row + (end - rect.X0), LAYER_CLEAR);
+                x = NextUnselected(*selection, y, end, rect.X1);
+            }
+        }
+        // An upper layer has clear pixels of its own, selection or not.
+        for (int x = 0; x < width && Region.IsOpaque; x++) {
+            Region.IsOpaque = row[x] < 0x01000000;
+        }
+    }
+
+    // FillRect keeps to the selection, and tiles under the whole hole come out
+    // uniform.
+    Region.Original = Target.Tiles;
+    FillRect(Target, rect.X0, rect.Y0, rect.X1, rect.Y1, Hole);
+    Region.Base = Target.Tiles;
+    RegionPlacement placement;
+    placement.CenterX = rect.X0 + width * 0.5f;
+    placement.CenterY = rect.Y0 + height * 0.5f;
+    PlaceRegion(Region, Target, placement, RESAMPLE_NEAREST);
+    return true;
+}
+
+void PlaceRegion(FloatingRegion& Region, Canvas& Target, const RegionPlacement& Placement, ResampleFilter Filter) {
+    TraceScope trace("PlaceRegion");
+    if (Region.Pixels.empty() || Target.Tiles.size() != Region.Base.size()) {
+        return;
+    }
+    EndBlendedStroke(Target);
+    RegionPlacement place = Placement;
+    place.ScaleX = std::clamp(place.ScaleX, MIN_REGION_SCALE, MAX_REGION_SCALE);
+    place.ScaleY = std::clamp(place.ScaleY, MIN_REGION_SCALE, MAX_REGION_SCALE);
+
+    // Only the tiles the last placement drew over differ from the hole.
+    PixelRect drawn = Region.Drawn;
+    if (!IsEmpty(drawn)) {
+        for (int ty = drawn.Y0 >> TILE_SHIFT; ty <= (drawn.Y1 - 1) >> TILE_SHIFT; ty++) {
+            for (int tx = drawn.X0 >> TILE_SHIFT; tx <= (drawn.X1 - 1) >> TILE_SHIFT; tx++) {
+                int tile = ty * Target.TilesX + tx;
+                Target.Tiles[tile] = Region.Base[tile];
+            }
+        }
+        MarkDirty(Target, drawn.X0, drawn.Y0, drawn.X1, drawn.Y1);
+    }
+
+    // Canvas pixel (x, y), centred on (x + 0.5, y + 0.5), is rotated back and
+    // scaled down about the centre into the region, where it lands at
+    // u0 + x * dux + y * duy, v0 + x * dvx + y * dvy.
+    double c = cos((double)place.Angle);
+    double s = sin((double)place.Angle);
+    double dux = c / place.ScaleX;
+    double duy = s / place.ScaleX;
+    double dvx = -s / place.ScaleY;
+    double dvy = c / place.ScaleY;
+    double u0 = Region.Width * 0.5 - 0.5 + dux * (0.5 - place.CenterX) + duy * (0.5 - place.CenterY);
+    double v0 = Region.Height * 0.5 - 0.5 + dvx * (0.5 - place.CenterX) + dvy * (0.5 - place.CenterY);
+
+    // The rotated rectangle's bounds, grown by how far the filter reaches.
+    double halfWidth = Region.Width * 0.5 * place.ScaleX;
+    double halfHeight = Region.Height * 0.5 * place.ScaleY;
+    double reach = FilterReach(Filter) * std::max(place.ScaleX, place.ScaleY) + 1;
+    double extentX = fabs(c) * halfWidth + fabs(s) * halfHeight + reach;
+    double extentY = fabs(s) * halfWidth + fabs(c) * halfHeight + reach;
+    PixelRect covered = Intersect({
+        (int)floor(std::clamp(place.CenterX - extentX, -1.0, Target.Width + 1.0)),
+        (int)floor(std::clamp(place.CenterY - extentY, -1.0, Target.Height + 1.0)),
+        (int)ceil(std::clamp(place.CenterX + extentX, -1.0, Target.Width + 1.0)),
+        (int)ceil(std::clamp(place.CenterY + extentY, -1.0, Target.Height + 1.0)) }, CanvasBounds(Target));
+    Region.Placement = place;
+    Region.Drawn = covered;
+    if (IsEmpty(covered)) {
+        return;
+    }
+
+    ResampleRowProc resample = ResampleKernelFor(Filter);
+    int fringe = FilterReach(Filter);
+    double minU = -fringe;
+    double maxU = Region.Width - 1 + fringe;
+    double minV = -fringe;
+    double maxV = Region.Height - 1 + fringe;
+    // Where every tap lies inside an opaque region, samples are opaque and
+    // replace the hole instead of being laid over it.
+    double innerLo = Filter == RESAMPLE_LANCZOS ? 2 : 0;
+    double innerHi = Filter == RESAMPLE_LANCZOS ? 3 : 0;
+    int firstRow = covered.Y0 >> TILE_SHIFT;
+    int rows = ((covered.Y1 - 1) >> TILE_SHIFT) - firstRow + 1;
+    auto placeRow = [&](int Row) {
+        u32 samples[TILE_SIZE];
+        int rowTile = (firstRow + Row) * Target.TilesX;
+        for (int tx = covered.X0 >> TILE_SHIFT; tx <= (covered.X1 - 1) >> TILE_SHIFT; tx++) {
+            PixelRect part = Intersect(covered, TileBounds(Target, rowTile + tx));
+            // Tiles the region misses stay shared with the hole.
+            u32* pixels = nullptr;
+            for (int y = part.Y0; y < part.Y1; y++) {
+                double rowU = u0 + duy * y;
+                double rowV = v0 + dvy * y;
+                int x0 = part.X0;
+                int x1 = part.X1;
+                ClipSpan(rowU, dux, minU, maxU, x0, x1);
+                ClipSpan(rowV, dvx, minV, maxV, x0, x1);
+                if (x0 >= x1) {
+                    continue;
+                }
+                if (!pixels) {
+                    pixels = WritableTile(Target, rowTile + tx);
+                }
+                u32* row = pixels + (y & TILE_MASK) * TILE_SIZE - (part.X0 & ~TILE_MASK);
+                int opaqueX0 = x0;
+                int opaqueX1 = x0;
+                if (Region.IsOpaque) {
+                    opaqueX1 = x1;
+                    ClipSpanInside(rowU, dux, innerLo, Region.Width - 1 - innerHi, opaqueX0, opaqueX1);
+                    ClipSpanInside(rowV, dvx, innerLo, Region.Height - 1 - innerHi, opaqueX0, opaqueX1);
+                    if (opaqueX0 >= opaqueX1) {
+                        opaqueX0 = opaqueX1 = x0;
+                    }
+                }
+                auto sample = [&](u32* Dest, int X0, int X1) {
+                    resample(Dest, StartWalk(Region, Filter, rowU + dux * X0, rowV + dvx * X0, dux, dvx), X1 - X0);
+                };
+                if (opaqueX0 > x0) {
+                    sample(samples, x0, opaqueX0);
+                    CompositeRow(row + x0, samples, opaqueX0 - x0, 255);
+                }
+                sample(row + opaqueX0, opaqueX0, opaqueX1);
+                if (x1 > opaqueX1) {
+                    sample(samples, opaqueX1, x1);
+                    CompositeRow(row + opaqueX1, samples, x1 - opaqueX1, 255);
+                }
+            }
+        }
+    };
+    // Each job writes only its own row of tiles.
+    if ((size_t)(covered.X1 - covered.X0) * (covered.Y1 - covered.Y0) >= PARALLEL_RASTER_PIXELS) {
+        ParallelFor(rows, placeRow);
+    }
+    else {
+        for (int row = 0; row < rows; row++) {
+            placeRow(row);
+        }
+    }
+    MarkDirty(Target, covered.X0, covered.Y0, covered.X1, covered.Y1);
+}
+
+void CancelRegion(FloatingRegion& Region, Canvas& Target) {
+    if (!Region.Pixels.empty() && Target.Tiles.size() == Region.Original.size()) {
+        EndBlendedStroke(Target);
+        Target.Tiles = Region.Original;
+        PixelRect changed = Union(Region.Lifted, Region.Drawn);
+        MarkDirty(Target, changed.X0, changed.Y0, changed.X1, changed.Y1);
+    }
+    Region = FloatingRegion();
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+#include "canvas.h"
+
+enum ResampleFilter {
+    RESAMPLE_NEAREST,
+    RESAMPLE_BILINEAR,
+    RESAMPLE_LANCZOS  // three lobes, 6 x 6 taps
+};
+
+// Clear pixels kept around a region's pixels, wider than any filter reaches,
+// so the kernels never test bounds.
+constexpr int REGION_BORDER = 8;
+// Regions are at most this wide and high, which keeps source positions in
+// 16.16 fixed point within 32 bits.
+constexpr int MAX_REGION_SIZE = 8192;
+// Scales outside this range are clamped.
+constexpr float MIN_REGION_SCALE = 1.0f / 64;
+constexpr float MAX_REGION_SCALE = 64.0f;
+
+// Where a floating region is drawn: its centre on the canvas, its scale along
+// its own axes and its clockwise rotation about the centre, in radians.
+struct RegionPlacement {
+    float CenterX = 0;
+    float CenterY = 0;
+    float ScaleX = 1;
+    float ScaleY = 1;
+    float Angle = 0;
+};
+
+// Pixels lifted off a canvas to be moved, scaled and rotated over what was
+// left behind. The canvas shows the region where it was last placed, so
+// dropping the FloatingRegion is all it takes to keep it there.
+struct FloatingRegion {
+    int Width = 0;
+    int Height = 0;
+    size_t Stride = 0;
+    std::vector<u32> Pixels;        // Width x Height inside REGION_BORDER clear pixels
+    bool IsOpaque = false;          // every one of the Width x Height is
+    PixelRect Lifted = { 0, 0, 0, 0 };
+    std::vector<TileRef> Original;  // the canvas before lifting
+    std::vector<TileRef> Base;      // and after, with the hole
+    RegionPlacement Placement;
+    PixelRect Drawn = { 0, 0, 0, 0 }; // what the placement may have drawn over
+};
+
+// The region's top-left pixel.
+inline const u32* RegionOrigin(const FloatingRegion& Region) {
+    return Region.Pixels.data() + REGION_BORDER * Region.Stride + REGION_BORDER;
+}
+
+// Lifts Rect of Target, clipped to the canvas and, with a selection, to its
+// pixels, and fills the hole with Hole. The region is placed where it was, so
+// the canvas looks the same unless the region has transparent pixels. Returns
+// false when there is nothing to lift or it is too large.
+bool LiftRegion(FloatingRegion& Region, Canvas& Target, const PixelRect& Rect, u32 Hole);
+
+// Draws the region over the hole at Placement, first putting back the tiles
+// the last placement drew over. Every destination pixel is mapped back into
+// the region and sampled with Filter, then laid over the canvas, one row of
+// tiles per job on the worker pool. A canvas resized since lifting is left
+// alone.
+void PlaceRegion(FloatingRegion& Region, Canvas& Target, const RegionPlacement& Placement, ResampleFilter Filter);
+
+// Puts Target back the way it was before lifting and empties the region.
+void CancelRegion(FloatingRegion& Region, Canvas& Target);
+
+// Samples Count pixels along a line through the region, the first at (U, V)
+// and each next one (DU, DV) further, with pixel (x, y) centred on (x, y).
+// Outside the region everything is clear. Exposed for the benchmarks.
+void ResampleRow(u32* Dest, const FloatingRegion& Region, int Count, double U, double V, double DU, double DV, ResampleFilter Filter);
@@ -0,0 +1,218 @@
+#include "gradient.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "blend.h"
+#include "selection.h"
+#include "span.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+constexpr int32_t GRADIENT_ONE = 1 << 16;
+
+// HSV at full saturation and value: one channel rises from 0 to 254 or falls
+// from 255 to 1 over each sixth, so neighbouring sixths meet without a
+// repeated colour.
+static constexpr u32 HueTableColor(int Step) {
+    int sector = Step >> 8;
+    int rising = (Step & 255) * 255 / 256;
+    int falling = 255 - rising;
+    int r = 0, g = 0, b = 0;
+    switch (sector) {
+    case 0: r = 255; g = rising; b = 0; break;
+    case 1: r = falling; g = 255; b = 0; break;
+    case 2: r = 0; g = 255; b = rising; break;
+    case 3: r = 0; g = falling; b = 255; break;
+    case 4: r = rising; g = 0; b = 255; break;
+    default: r = 255; g = 0; b = falling; break;
+    }
+    return (u32)(r << 16 | g << 8 | b);
+}
+
+struct HueTable {
+    u32 Colors[HUE_STEPS];
+
+    constexpr HueTable() : Colors() {
+        for (int i = 0; i < HUE_STEPS; i++) {
+            Colors[i] = HueTableColor(i);
+        }
+    }
+};
+
+static constexpr HueTable HUE_TABLE;
+
+u32 HueColor(float Hue) {
+    int step = (int)((Hue - floorf(Hue)) * HUE_STEPS);
+    // Just below a whole turn can round up to it.
+    return HUE_TABLE.Colors[step < HUE_STEPS ? step : 0];
+}
+
+// The 4x4 Bayer matrix, scaled to thresholds below GRADIENT_ONE centred in
+// each step.
+static const uint8_t BAYER_4X4[4][4] = {
+    { 0, 8, 2, 10 },
+    { 12, 4, 14, 6 },
+    { 3, 11, 1, 9 },
+    { 15, 7, 13, 5 }
+};
+
+static void RowThresholds(const GradientFill& Fill, int X, int Y, int32_t* Thresholds) {
+    for (int i = 0; i < 4; i++) {
+        Thresholds[i] = Fill.Dither ? BAYER_4X4[Y & 3][(X + i) & 3] * 4096 + 2048 : GRADIENT_ONE / 2;
+    }
+}
+
+struct GradientGeometry {
+    // Linear: position per pixel along x and y. Radial: position per pixel of
+    // distance.
+    double StepX;
+    double StepY;
+    float Scale;
+};
+
+// Positions far enough past either end that adding a tile row of steps can't
+// bring them back, and small enough that it can't overflow.
+constexpr double GRADIENT_GUARD = 1 << 24;
+
+// The range of positions over a tile, before clamping.
+static void TilePositionRange(const GradientFill& Fill, const GradientGeometry& Geometry, const PixelRect& Bounds, double& Min, double& Max) {
+    double dx0 = Bounds.X0 - Fill.X0;
+    double dx1 = Bounds.X1 - 1 - Fill.X0;
+    double dy0 = Bounds.Y0 - Fill.Y0;
+    double dy1 = Bounds.Y1 - 1 - Fill.Y0;
+    if (Fill.Shape == GRADIENT_LINEAR) {
+        // Linear in x and y, so the corners bound it.
+        double x0 = dx0 * Geometry.StepX, x1 = dx1 * Geometry.StepX;
+        double y0 = dy0 * Geometry.StepY, y1 = dy1 * Geometry.StepY;
+        Min = std::min(x0, x1) + std::min(y0, y1);
+        Max = std::max(x0, x1) + std::max(y0, y1);
+        return;
+    }
+    double nearX = dx0 > 0 ? dx0 : dx1 < 0 ? dx1 : 0;
+    double nearY = dy0 > 0 ? dy0 : dy1 < 0 ? dy1 : 0;
+    double farX = std::max(fabs(dx0), fabs(dx1));
+    double farY = std::max(fabs(dy0), fabs(dy1));
+    Min = sqrt(nearX * nearX + nearY * nearY) * Geometry.Scale;
+    Max = sqrt(farX * farX + farY * farY) * Geometry.Scale;
+}
+
+static void FillGradientTile(Canvas& Target, const GradientFill& Fill, const GradientGeometry& Geometry, int Tile, const TileRef& FromTile, const TileRef& ToTile) {
+    PixelRect bounds = TileBounds(Target, Tile);
+    const SelectionMask* selection = Target.Selection.get();
+    if (selection && !SelectionMayTouch(*selection, bounds)) {
+        return;
+    }
+    // A tile the selection only partly covers is written run by run.
+    bool isCovered = !selection || SelectionCovers(*selection, bounds);
+    double low, high;
+    TilePositionRange(Fill, Geometry, bounds, low, high);
+    if (isCovered && (high <= 0 || low >= GRADIENT_ONE)) {
+        const TileRef& end = high <= 0 ? FromTile : ToTile;
+        const CanvasTile& current = *Target.Tiles[Tile];
+        if (Fill.Opacity == 255) {
+            SetTileUniform(Target, Tile, end);
+            return;
+        }
+        if (current.Pixels.empty()) {
+            u32 color = current.Uniform;
+            CompositeRow(&color, &end->Uniform, 1, Fill.Opacity);
+            SetTileUniform(Target, Tile, MakeUniformTile(Target, color));
+            return;
+        }
+    }
+
+    u32* pixels = WritableTile(Target, Tile);
+    int width = bounds.X1 - bounds.X0;
+    int32_t positions[TILE_SIZE];
+    int32_t thresholds[4];
+    u32 row[TILE_SIZE];
+    // Along a row the linear position steps by a constant. Rounding it to
+    // whole 16.16 units drifts by at most half a unit per pixel, 32 units of
+    // 65536 across a tile, and each row starts exactly. Linear positions are
+    // worked out for the whole tile width, past the canvas edge too, since
+    // loops of a fixed count vectorize.
+    int32_t stepX = (int32_t)lround(Geometry.StepX);
+    for (int y = bounds.Y0; y < bounds.Y1; y++) {
+        int dy = y - Fill.Y0;
+        if (Fill.Shape == GRADIENT_LINEAR) {
+            double exact = (bounds.X0 - Fill.X0) * Geometry.StepX + dy * Geometry.StepY;
+            int32_t start = (int32_t)(std::clamp(exact, -GRADIENT_GUARD, GRADIENT_GUARD) + 0.5);
+            int32_t end = start + (TILE_SIZE - 1) * stepX;
+            if (std::min(start, end) >= 0 && std::max(start, end) <= GRADIENT_ONE) {
+                for (int i = 0; i < TILE_SIZE; i++) {
+                    positions[i] = start + i * stepX;
+                }
+            }
+            else {
+                for (int i = 0; i < TILE_SIZE; i++) {
+                    positions[i] = std::clamp(start + i * stepX, 0, GRADIENT_ONE);
+                }
+            }
+        }
+        else {
+            RadialPositions(positions, width, (float)(bounds.X0 - Fill.X0), (float)dy * dy, Geometry.Scale);
+        }
+        RowThresholds(Fill, bounds.X0, y, thresholds);
+        u32* dest = pixels + (y & TILE_MASK) * TILE_SIZE;
+        if (isCovered && Fill.Opacity == 255) {
+            GradientRow(dest, positions, width, Fill.From, Fill.To, thresholds);
+        }
+        else if (isCovered) {
+            GradientRow(row, positions, width, Fill.From, Fill.To, thresholds);
+            CompositeRow(dest, row, width, Fill.Opacity);
+        }
+        else {
+            GradientRow(row, positions, width, Fill.From, Fill.To, thresholds);
+            ForEachSelectedRun(*selection, y, bounds.X0, bounds.X1, [&](int RunX0, int RunX1) {
+                int offset = RunX0 - bounds.X0;
+                if (Fill.Opacity == 255) {
+                    memcpy(dest + offset, row + offset, (RunX1 - RunX0) * sizeof(u32));
+                }
+                else {
+                    CompositeRow(dest + offset, row + offset, RunX1 - RunX0, Fill.Opacity);
+                }
+            });
+        }
+    }
+}
+
+void FillGradient(Canvas& Target, const GradientFill& Fill) {
+    TraceScope trace("FillGradient");
+    EndBlendedStroke(Target);
+    double dx = Fill.X1 - Fill.X0;
+    double dy = Fill.Y1 - Fill.Y0;
+    double length2 = dx * dx + dy * dy;
+    if (length2 == 0 || Target.Tiles.empty()) {
+        return;
+    }
+    GradientGeometry geometry = {};
+    if (Fill.Shape == GRADIENT_LINEAR) {
+        geometry.StepX = dx * GRADIENT_ONE / length2;
+        geometry.StepY = dy * GRADIENT_ONE / length2;
+    }
+    else {
+        geometry.Scale = (float)(GRADIENT_ONE / sqrt(length2));
+    }
+
+    // Shared by every tile past either end; made up front so the jobs only
+    // ever read them.
+    TileRef fromTile = MakeUniformTile(Target, Fill.From);
+    TileRef toTile = MakeUniformTile(Target, Fill.To);
+    auto fillRow = [&](int Row) {
+        for (int tile = Row * Target.TilesX; tile < (Row + 1) * Target.TilesX; tile++) {
+            FillGradientTile(Target, Fill, geometry, tile, fromTile, toTile);
+        }
+    };
+    if ((size_t)Target.Width * Target.Height >= PARALLEL_RASTER_PIXELS) {
+        ParallelFor(Target.TilesY, fillRow);
+    }
+    else {
+        for (int row = 0; row < Target.TilesY; row++) {
+            fillRow(row);
+        }
+    }
+    TracePixelsWritten((int64_t)Target.Width * Target.Height);
+    MarkDirty(Target, 0, 0, Target.Width, Target.Height);
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+
+#include "canvas.h"
+
+// Steps round the colour wheel in the hue table: 256 per sixth, so no channel
+// moves by more than one level from one step to the next.
+constexpr int HUE_STEPS = 1536;
+
+// The fully saturated, full-value colour at Hue turns round the wheel, red at
+// 0, as a canvas pixel. Any Hue wraps round; it comes from a table built
+// once, so this costs a multiply and a load.
+u32 HueColor(float Hue);
+
+enum GradientShape {
+    GRADIENT_LINEAR, // From at (X0, Y0), To at (X1, Y1) and beyond, banded across the line
+    GRADIENT_RADIAL  // From at the centre (X0, Y0), To at the distance of (X1, Y1) and beyond
+};
+
+struct GradientFill {
+    GradientShape Shape = GRADIENT_LINEAR;
+    int X0 = 0;
+    int Y0 = 0;
+    int X1 = 0;
+    int Y1 = 0;
+    u32 From = 0;
+    u32 To = 0;
+    // Ordered 4x4 dithering instead of rounding, which breaks up the bands a
+    // long gradient between close colours shows.
+    bool Dither = false;
+    uint8_t Opacity = 255;
+};
+
+// Covers the whole canvas, or its selection, with the gradient, laid over
+// what is there by Opacity. Any stroke in progress ends first. Tiles that lie wholly past
+// either end become uniform tiles; the rest are interpolated in 16.16 fixed
+// point a row at a time, split by row of tiles over the worker pool when the
+// canvas is large. Nothing happens when both points are the same.
+void FillGradient(Canvas& Target, const GradientFill& Fill);
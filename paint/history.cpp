@@ -0,0 +1,176 @@
+#include "history.h"
+
+#include <string.h>
+
+#include "trace.h"
+
+static bool SameTile(const Canvas& Target, int Tile, const CanvasTile& A, const CanvasTile& B) {
+    if (A.Pixels.empty() && B.Pixels.empty()) {
+        return A.Uniform == B.Uniform;
+    }
+
+    // Only the part of an edge tile inside the canvas counts.
+    PixelRect bounds = TileBounds(Target, Tile);
+    int width = bounds.X1 - bounds.X0;
+    for (int y = 0; y < bounds.Y1 - bounds.Y0; y++) {
+        if (A.Pixels.empty() || B.Pixels.empty()) {
+            const CanvasTile& full = A.Pixels.empty() ? B : A;
+            u32 color = A.Pixels.empty() ? A.Uniform : B.Uniform;
+            const u32* row = &full.Pixels[y * TILE_SIZE];
+            for (int x = 0; x < width; x++) {
+                if (row[x] != color) {
+                    return false;
+                }
+            }
+        }
+        else if (memcmp(&A.Pixels[y * TILE_SIZE], &B.Pixels[y * TILE_SIZE], width * sizeof(u32)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void RestoreTile(Canvas& Target, int Tile, const TileRef& Source) {
+    Target.Tiles[Tile] = Source;
+    PixelRect bounds = TileBounds(Target, Tile);
+    MarkDirty(Target, bounds.X0, bounds.Y0, bounds.X1, bounds.Y1);
+}
+
+static void EnforceBudget(DrawingHistory& History) {
+    // The live canvas is the floor. Redo steps go first, newest first, as the
+    // least likely to be wanted; then undo steps, oldest first.
+    while (*History.LiveBytes > History.Budget && History.Entries.size() > History.Index) {
+        History.Entries.pop_back();
+    }
+    while (*History.LiveBytes > History.Budget && History.Index > 0) {
+        History.Entries.pop_front();
+        History.Index--;
+    }
+}
+
+void InitDrawingHistory(DrawingHistory& History, const Canvas& Target, size_t Budget) {
+    History.Entries.clear();
+    History.Width = Target.Width;
+    History.Height = Target.Height;
+    History.Committed = Target.Tiles;
+    History.Budget = Budget;
+    History.Index = 0;
+    History.LiveBytes = Target.LiveBytes;
+}
+
+void SetHistoryBudget(DrawingHistory& History, size_t Budget) {
+    History.Budget = Budget;
+    EnforceBudget(History);
+}
+
+static void PushEntry(DrawingHistory& History, HistoryEntry&& Entry) {
+    History.Entries.resize(History.Index);
+    History.Entries.push_back(std::move(Entry));
+    History.Index = History.Entries.size();
+    EnforceBudget(History);
+}
+
+// Puts back a whole grid recorded by a resizing entry.
+static void RestoreGrid(DrawingHistory& History, Canvas& Target, int Width, int Height, const std::vector<TileRef>& Tiles) {
+    PixelRect before = CanvasBounds(Target);
+    SetCanvasTiles(Target, Width, Height, Tiles);
+    History.Width = Width;
+    History.Height = Height;
+    History.Committed = Tiles;
+    PixelRect damage = Union(before, CanvasBounds(Target));
+    MarkDirty(Target, damage.X0, damage.Y0, damage.X1, damage.Y1);
+}
+
+bool SaveDrawingState(DrawingHistory& History, Canvas& Target) {
+    TraceScope trace("SaveDrawingState");
+    HistoryEntry entry;
+    if (Target.Width != History.Width || Target.Height != History.Height) {
+        entry.BeforeWidth = History.Width;
+        entry.BeforeHeight = History.Height;
+        entry.BeforeTiles = std::move(History.Committed);
+        entry.AfterWidth = Target.Width;
+        entry.AfterHeight = Target.Height;
+        entry.AfterTiles = Target.Tiles;
+        History.Width = Target.Width;
+        History.Height = Target.Height;
+        History.Committed = Target.Tiles;
+        PushEntry(History, std::move(entry));
+        return true;
+    }
+
+    for (int tile = 0; tile < (int)Target.Tiles.size(); tile++) {
+        TileRef& current = Target.Tiles[tile];
+        TileRef& committed = History.Committed[tile];
+        if (current == committed) {
+            continue;
+        }
+        // Written but ended up the same, e.g. a stroke over its own colour:
+        // keep the committed tile and let the copy go.
+        if (SameTile(Target, tile, *current, *committed)) {
+            current = committed;
+            continue;
+        }
+        entry.Changes.push_back({ tile, committed, current });
+        committed = current;
+    }
+
+    if (entry.Changes.empty()) {
+        return false;
+    }
+    PushEntry(History, std::move(entry));
+    return true;
+}
+
+bool UndoDrawing(DrawingHistory& History, Canvas& Target) {
+    TraceScope trace("UndoDrawing");
+    // An operation still in progress becomes its own step so undo reverts it.
+    SaveDrawingState(History, Target);
+
+    if (History.Index == 0) {
+        return false;
+    }
+
+    History.Index--;
+    const HistoryEntry& entry = History.Entries[History.Index];
+    if (!entry.BeforeTiles.empty()) {
+        RestoreGrid(History, Target, entry.BeforeWidth, entry.BeforeHeight, entry.BeforeTiles);
+    }
+    for (const HistoryChange& change : entry.Changes) {
+        RestoreTile(Target, change.Tile, change.Before);
+        History.Committed[change.Tile] = change.Before;
+    }
+    return true;
+}
+
+bool RedoDrawing(DrawingHistory& History, Canvas& Target) {
+    TraceScope trace("RedoDrawing");
+    SaveDrawingState(History, Target);
+
+    if (History.Index >= History.Entries.size()) {
+        return false;
+    }
+
+    const HistoryEntry& entry = History.Entries[History.Index];
+    if (!entry.AfterTiles.empty()) {
+        RestoreGrid(History, Target, entry.AfterWidth, entry.AfterHeight, entry.AfterTiles);
+    }
+    for (const HistoryChange& change : entry.Changes) {
+        RestoreTile(Target, change.Tile, change.After);
+        History.Committed[change.Tile] = change.After;
+    }
+    History.Index++;
+    return true;
+}
+
+bool DropOldestEntry(DrawingHistory& History) {
+    if (History.Index == 0) {
+        return false;
+    }
+    History.Entries.pop_front();
+    History.Index--;
+    return true;
+}
+
+size_t HistoryBytes(const DrawingHistory& History) {
+    return History.LiveBytes ? History.LiveBytes->load() : 0;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "canvas.h"
+
+constexpr size_t DEFAULT_HISTORY_BUDGET = 256ull * 1024 * 1024;
+
+// The canvas tiles an undo step replaced. Tiles are shared with the canvas and
+// between entries by pointer, so a tile that didn't change between two
+// snapshots is stored once no matter how many entries reference it.
+struct HistoryChange {
+    int Tile;
+    TileRef Before;
+    TileRef After;
+};
+
+struct HistoryEntry {
+    std::vector<HistoryChange> Changes;
+
+    // Set instead of Changes when the operation changed the canvas size: the
+    // whole tile grid on either side.
+    int BeforeWidth = 0;
+    int BeforeHeight = 0;
+    int AfterWidth = 0;
+    int AfterHeight = 0;
+    std::vector<TileRef> BeforeTiles;
+    std::vector<TileRef> AfterTiles;
+};
+
+struct DrawingHistory {
+    size_t Budget = DEFAULT_HISTORY_BUDGET;
+
+    // Canvas tiles as of the last SaveDrawingState. Canvas writes never modify
+    // a shared tile, so any tile whose pointer differs from this has changed.
+    int Width = 0;
+    int Height = 0;
+    std::vector<TileRef> Committed;
+
+    std::deque<HistoryEntry> Entries;
+    size_t Index = 0;
+
+    std::shared_ptr<std::atomic<size_t>> LiveBytes;
+};
+
+void InitDrawingHistory(DrawingHistory& History, const Canvas& Target, size_t Budget);
+// Drops steps until the canvas and its history fit in Budget: redo steps
+// first, then the oldest undo steps.
+void SetHistoryBudget(DrawingHistory& History, size_t Budget);
+
+// Closes the current operation: every tile replaced since the last call
+// becomes part of one undo step. Returns false when nothing actually changed.
+bool SaveDrawingState(DrawingHistory& History, Canvas& Target);
+bool UndoDrawing(DrawingHistory& History, Canvas& Target);
+bool RedoDrawing(DrawingHistory& History, Canvas& Target);
+
+// Forgets the oldest undo step, for histories budgeted by their owner. Returns
+// false when there is none left to undo.
+bool DropOldestEntry(DrawingHistory& History);
+
+// Bytes held by the canvas and its undo steps together.
+size_t HistoryBytes(const DrawingHistory& History);
@@ -0,0 +1,161 @@
+#include "input.h"
+
+#include <math.h>
+#include <algorithm>
+
+// Points recorded in the same millisecond are taken to be this far apart, the
+// interval of the fastest mice.
+constexpr float MIN_INPUT_SECONDS = 1.0f / 8000;
+// Control points closer than this to the previous one are dropped: mouse
+// positions come in whole pixels, so nearer ones are rounding, and the
+// spline's knots need the points apart.
+constexpr float MIN_CONTROL_DISTANCE = 1.0f;
+// The curve is walked in straight pieces about this long.
+constexpr float CURVE_STEP = 2.0f;
+
+static float Distance(const InputPoint& A, const InputPoint& B) {
+    return hypotf(B.X - A.X, B.Y - A.Y);
+}
+
+static InputPoint Lerp(const InputPoint& A, const InputPoint& B, float T) {
+    return { A.X + (B.X - A.X) * T, A.Y + (B.Y - A.Y) * T, A.Time + (B.Time - A.Time) * T };
+}
+
+// The point mirroring B about A, to stand in for the control point before the
+// first one or after the last.
+static InputPoint Reflect(const InputPoint& A, const InputPoint& B) {
+    return { 2 * A.X - B.X, 2 * A.Y - B.Y, A.Time };
+}
+
+// How far a low-pass filter with Cutoff moves towards a new sample Seconds
+// after the last.
+static float SmoothingFactor(float Cutoff, float Seconds) {
+    const float pi = 3.14159265f;
+    float tau = 1.0f / (2 * pi * Cutoff);
+    return 1.0f / (1.0f + tau / Seconds);
+}
+
+// Lays a point on the curve every Spacing pixels from P1 to P2, carrying the
+// distance since the last one over from the piece before.
+static void PlaceAlong(StrokeSmoother& Smoother, const InputPoint& P0, const InputPoint& P1, const InputPoint& P2, const InputPoint& P3, std::vector<InputPoint>& Out) {
+    // Centripetal knots: each step of t is the square root of the distance.
+    float t1 = sqrtf(Distance(P0, P1));
+    float t2 = t1 + sqrtf(Distance(P1, P2));
+    float t3 = t2 + sqrtf(Distance(P2, P3));
+
+    int steps = std::clamp((int)ceilf(Distance(P1, P2) / CURVE_STEP), 1, 256);
+    InputPoint from = P1;
+    for (int i = 1; i <= steps; i++) {
+        float f = (float)i / steps;
+        float t = t1 + (t2 - t1) * f;
+        // Barry and Goldman's pyramid of interpolations.
+        InputPoint a1 = Lerp(P0, P1, t / t1);
+        InputPoint a2 = Lerp(P1, P2, (t - t1) / (t2 - t1));
+        InputPoint a3 = Lerp(P2, P3, (t - t2) / (t3 - t2));
+        InputPoint b1 = Lerp(a1, a2, t / t2);
+        InputPoint b2 = Lerp(a2, a3, (t - t1) / (t3 - t1));
+        InputPoint to = Lerp(b1, b2, (t - t1) / (t2 - t1));
+        to.Time = P1.Time + (P2.Time - P1.Time) * f;
+
+        float length = Distance(from, to);
+        while (Smoother.Distance + length >= Smoother.Spacing) {
+            float needed = Smoother.Spacing - Smoother.Distance;
+            from = Lerp(from, to, needed / length);
+            Out.push_back(from);
+            length -= needed;
+            Smoother.Distance = 0;
+        }
+        Smoother.Distance += length;
+        from = to;
+    }
+}
+
+// Adds a control point and places points along whatever piece of the curve
+// it completes, keeping the last four.
+static void AddControl(StrokeSmoother& Smoother, const InputPoint& Point, std::vector<InputPoint>& Out) {
+    InputPoint* c = Smoother.Control;
+    if (Distance(c[Smoother.ControlCount - 1], Point) < MIN_CONTROL_DISTANCE) {
+        return;
+    }
+    c[Smoother.ControlCount++] = Point;
+    if (Smoother.ControlCount == 3) {
+        // Only at the start: later the count drops back to 3 after a piece.
+        PlaceAlong(Smoother, Reflect(c[0], c[1]), c[0], c[1], c[2], Out);
+    }
+    else if (Smoother.ControlCount == 4) {
+        PlaceAlong(Smoother, c[0], c[1], c[2], c[3], Out);
+        std::copy(c + 1, c + 4, c);
+        Smoother.ControlCount = 3;
+    }
+}
+
+void BeginSmoothStroke(StrokeSmoother& Smoother, InputPoint Start, float Spacing, std::vector<InputPoint>& Out) {
+    Smoother.Spacing = Spacing;
+    Smoother.FilteredX = Start.X;
+    Smoother.FilteredY = Start.Y;
+    Smoother.SpeedX = 0;
+    Smoother.SpeedY = 0;
+    Smoother.LastTime = Start.Time;
+    Smoother.Control[0] = Start;
+    Smoother.ControlCount = 1;
+    Smoother.Last = Start;
+    Smoother.Distance = 0;
+    Out.push_back(Start);
+}
+
+void SmoothStroke(StrokeSmoother& Smoother, const InputPoint* Points, size_t Count, std::vector<InputPoint>& Out) {
+    if (Smoother.ControlCount == 0) {
+        return;
+    }
+    for (size_t i = 0; i < Count; i++) {
+        InputPoint point = Points[i];
+        float seconds = std::max((float)(point.Time - Smoother.LastTime) / 1000, MIN_INPUT_SECONDS);
+        point.Time = Smoother.LastTime + seconds * 1000;
+        Smoother.LastTime = point.Time;
+        Smoother.Last = point;
+
+        // The speed is filtered too, and is measured from the filtered
+        // position so that jitter doesn't read as speed.
+        float speedFactor = SmoothingFactor(Smoother.DerivativeCutoff, seconds);
+        Smoother.SpeedX += speedFactor * ((point.X - Smoother.FilteredX) / seconds - Smoother.SpeedX);
+        Smoother.SpeedY += speedFactor * ((point.Y - Smoother.FilteredY) / seconds - Smoother.SpeedY);
+        float speed = hypotf(Smoother.SpeedX, Smoother.SpeedY);
+        float factor = SmoothingFactor(Smoother.MinCutoff + Smoother.Beta * speed, seconds);
+        Smoother.FilteredX += factor * (point.X - Smoother.FilteredX);
+        Smoother.FilteredY += factor * (point.Y - Smoother.FilteredY);
+
+        AddControl(Smoother, { Smoother.FilteredX, Smoother.FilteredY, point.Time }, Out);
+    }
+}
+
+void EndSmoothStroke(StrokeSmoother& Smoother, std::vector<InputPoint>& Out) {
+    if (Smoother.ControlCount == 0) {
+        return;
+    }
+    InputPoint* c = Smoother.Control;
+    const InputPoint& last = Smoother.Last;
+    if (Distance(c[Smoother.ControlCount - 1], last) >= MIN_CONTROL_DISTANCE) {
+        AddControl(Smoother, last, Out);
+    }
+    else if (Smoother.ControlCount > 1 && Distance(c[Smoother.ControlCount - 2], last) >= MIN_CONTROL_DISTANCE) {
+        // Not yet part of any piece placed, so it can still move.
+        c[Smoother.ControlCount - 1] = last;
+    }
+
+    // The piece into the last control point, with nothing after it.
+    if (Smoother.ControlCount == 2) {
+        PlaceAlong(Smoother, Reflect(c[0], c[1]), c[0], c[1], Reflect(c[1], c[0]), Out);
+    }
+    else if (Smoother.ControlCount == 3) {
+        PlaceAlong(Smoother, c[0], c[1], c[2], Reflect(c[2], c[1]), Out);
+    }
+    if (Smoother.ControlCount > 1 && Smoother.Distance > 0) {
+        Out.push_back(c[Smoother.ControlCount - 1]);
+    }
+    Smoother.ControlCount = 0;
+    Smoother.Distance = 0;
+}
+
+float StrokeSpacing(int LineWidth) {
+    return std::max(2.0f, LineWidth * 0.5f);
+}
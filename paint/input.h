@@ -0,0 +1,63 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+
+// A pointer position and when it was read, in milliseconds on any clock that
+// only moves forward.
+struct InputPoint {
+    float X, Y;
+    double Time;
+};
+
+// Smooths a stroke's pointer positions into a curve and places points along
+// it a fixed distance apart, for drawing the stroke as line segments.
+//
+// Positions first go through a one-euro filter: a low-pass filter whose
+// cutoff rises with speed, which steadies slow, careful movement without
+// making fast strokes lag. The filtered positions are the control points of a
+// centripetal Catmull-Rom spline, which passes through every one of them
+// without the loops and overshoots of the uniform kind. A piece of the curve
+// is only known once the control point after it has arrived, so the output
+// trails the input by one point until the stroke ends.
+//
+// Nothing here depends on where the points come from, so any number of them
+// can be handed over at once: a window queues the moves it is sent and
+// passes them on once per frame.
+struct StrokeSmoother {
+    // Filter settings: cutoff in Hz when still, and how much it rises per
+    // pixel per second of speed.
+    float MinCutoff = 3.0f;
+    float Beta = 0.02f;
+    float DerivativeCutoff = 1.0f;
+
+    float Spacing = 1.0f;
+
+    // The filter's state per axis.
+    float FilteredX = 0, FilteredY = 0;
+    float SpeedX = 0, SpeedY = 0;
+    double LastTime = 0;
+
+    // The last four control points, oldest first.
+    InputPoint Control[4] = {};
+    int ControlCount = 0;
+    InputPoint Last = {}; // the last point added, unfiltered
+
+    float Distance = 0; // along the curve since the last point placed
+};
+
+// Starts a stroke at Start, placing a point there. Points are placed Spacing
+// pixels apart along the curve.
+void BeginSmoothStroke(StrokeSmoother& Smoother, InputPoint Start, float Spacing, std::vector<InputPoint>& Out);
+// Adds Count pointer positions, in order, and places the points the curve up
+// to them allows. Points whose times are not after the last are still used,
+// as if they came a moment later.
+void SmoothStroke(StrokeSmoother& Smoother, const InputPoint* Points, size_t Count, std::vector<InputPoint>& Out);
+// Finishes the curve at the last position added, unfiltered, so the stroke
+// ends where the pointer did, and places a point there. Until the next
+// BeginSmoothStroke, points added are ignored.
+void EndSmoothStroke(StrokeSmoother& Smoother, std::vector<InputPoint>& Out);
+
+// The spacing for a brush LineWidth wide. Wider brushes take longer segments:
+// their edges hide more of the gap between a segment and the curve, and each
+// segment redraws less of the one before it.
+float StrokeSpacing(int LineWidth);
@@ -0,0 +1,452 @@
+#include "layers.h"
+
+#include <algorithm>
+
+#include "span.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "transform.h"
+
+// What is out of date in a tile.
+constexpr uint8_t STALE_BELOW = 1;
+constexpr uint8_t STALE_ABOVE = 2;
+constexpr uint8_t STALE_COMPOSITE = 4;
+
+// Below this many tiles an update isn't worth waking the workers for.
+constexpr int PARALLEL_COMPOSITE_TILES = 16;
+
+static void InitLayer(LayerStack& Stack, Layer& Target, int Width, int Height, u32 Color) {
+    Target.Pixels.LiveBytes = Stack.LiveBytes;
+    InitCanvas(Target.Pixels, Width, Height, Color);
+    InitDamageTracker(Target.Changed, Width, Height);
+    Target.Pixels.Damage = &Target.Changed;
+    // The stack budgets every layer's history together, see EnforceBudget.
+    InitDrawingHistory(Target.History, Target.Pixels, (size_t)-1);
+    Target.Id = Stack.NextId++;
+}
+
+static void MarkTileStale(LayerStack& Stack, int Tile, uint8_t Bits, const PixelRect& Rect) {
+    Stack.Stale[Tile] |= Bits;
+    Stack.StaleRects[Tile] = Union(Stack.StaleRects[Tile], Rect);
+}
+
+static void MarkStale(LayerStack& Stack, uint8_t Bits) {
+    for (int tile = 0; tile < (int)Stack.Stale.size(); tile++) {
+        MarkTileStale(Stack, tile, Bits, TileBounds(Stack.Composite, tile));
+    }
+}
+
+// A layer's tiles only matter to the cache it is flattened into.
+static uint8_t StaleBitsFor(const LayerStack& Stack, int Index) {
+    if (Index < Stack.Active) {
+        return STALE_BELOW | STALE_COMPOSITE;
+    }
+    if (Index > Stack.Active) {
+        return STALE_ABOVE | STALE_COMPOSITE;
+    }
+    return STALE_COMPOSITE;
+}
+
+void InitLayerStack(LayerStack& Stack, int Width, int Height, u32 Color, size_t HistoryBudget) {
+    Stack.Layers.clear();
+    Stack.Steps.clear();
+    Stack.StepIndex = 0;
+    Stack.HistoryBudget = HistoryBudget;
+    Stack.LiveBytes = std::make_shared<std::atomic<size_t>>(0);
+    Stack.Backdrop = Color;
+    Stack.Layers.push_back(std::make_unique<Layer>());
+    InitLayer(Stack, *Stack.Layers[0], Width, Height, Color);
+    Stack.Active = 0;
+    // Composite is sized on the first update.
+    Stack.Composite = Canvas();
+}
+
+bool AddLayer(LayerStack& Stack) {
+    if ((int)Stack.Layers.size() >= MAX_LAYERS) {
+        return false;
+    }
+    const Canvas& below = ActiveLayer(Stack).Pixels;
+    auto layer = std::make_unique<Layer>();
+    InitLayer(Stack, *layer, below.Width, below.Height, LAYER_CLEAR);
+    Stack.Layers.insert(Stack.Layers.begin() + Stack.Active + 1, std::move(layer));
+    // The old active layer joins Below; Above holds the same layers as before.
+    Stack.Active++;
+    MarkStale(Stack, STALE_BELOW | STALE_COMPOSITE);
+    return true;
+}
+
+bool RemoveLayer(LayerStack& Stack) {
+    if (Stack.Layers.size() <= 1) {
+        return false;
+    }
+    // Its undo steps go with it; steps left empty are dropped.
+    int id = ActiveLayer(Stack).Id;
+    size_t kept = 0;
+    size_t index = 0;
+    for (size_t i = 0; i < Stack.Steps.size(); i++) {
+        std::vector<int>& step = Stack.Steps[i];
+        step.erase(std::remove(step.begin(), step.end(), id), step.end());
+        if (i < Stack.StepIndex && !step.empty()) {
+            index++;
+        }
+        if (!step.empty()) {
+            Stack.Steps[kept++] = std::move(step);
+        }
+    }
+    Stack.Steps.resize(kept);
+    Stack.StepIndex = index;
+
+    Stack.Layers.erase(Stack.Layers.begin() + Stack.Active);
+    Stack.Active = std::max(Stack.Active - 1, 0);
+    MarkStale(Stack, STALE_BELOW | STALE_ABOVE | STALE_COMPOSITE);
+    return true;
+}
+
+void SetActiveLayer(LayerStack& Stack, int Index) {
+    Index = std::clamp(Index, 0, (int)Stack.Layers.size() - 1);
+    if (Index != Stack.Active) {
+        Stack.Active = Index;
+        MarkStale(Stack, STALE_BELOW | STALE_ABOVE | STALE_COMPOSITE);
+    }
+}
+
+bool MoveLayer(LayerStack& Stack, int By) {
+    int to = Stack.Active + By;
+    if (By == 0 || to < 0 || to >= (int)Stack.Layers.size()) {
+        return false;
+    }
+    std::unique_ptr<Layer> layer = std::move(Stack.Layers[Stack.Active]);
+    Stack.Layers.erase(Stack.Layers.begin() + Stack.Active);
+    Stack.Layers.insert(Stack.Layers.begin() + to, std::move(layer));
+    Stack.Active = to;
+    MarkStale(Stack, STALE_BELOW | STALE_ABOVE | STALE_COMPOSITE);
+    return true;
+}
+
+// Only tiles the layer has something in can look different.
+static void MarkLayerStale(LayerStack& Stack, int Index) {
+    const Layer& layer = *Stack.Layers[Index];
+    uint8_t bits = StaleBitsFor(Stack, Index);
+    for (size_t tile = 0; tile < Stack.Stale.size() && tile < layer.Pixels.Tiles.size(); tile++) {
+        const CanvasTile& current = *layer.Pixels.Tiles[tile];
+        if (!current.Pixels.empty() || current.Uniform != LAYER_CLEAR) {
+            MarkTileStale(Stack, (int)tile, bits, TileBounds(Stack.Composite, (int)tile));
+        }
+    }
+}
+
+void SetLayerOpacity(LayerStack& Stack, int Index, uint8_t Opacity) {
+    Layer& layer = *Stack.Layers[Index];
+    if (layer.Opacity != Opacity) {
+        layer.Opacity = Opacity;
+        MarkLayerStale(Stack, Index);
+    }
+}
+
+void SetLayerVisible(LayerStack& Stack, int Index, bool Visible) {
+    Layer& layer = *Stack.Layers[Index];
+    if (layer.Visible != Visible) {
+        layer.Visible = Visible;
+        MarkLayerStale(Stack, Index);
+    }
+}
+
+void InvalidateLayers(LayerStack& Stack) {
+    MarkStale(Stack, STALE_BELOW | STALE_ABOVE | STALE_COMPOSITE);
+}
+
+bool HasLayerChanges(const LayerStack& Stack) {
+    const Canvas& bottom = Stack.Layers[0]->Pixels;
+    if (Stack.Composite.Width != bottom.Width || Stack.Composite.Height != bottom.Height) {
+        return true;
+    }
+    for (const auto& layer : Stack.Layers) {
+        if (HasDamage(layer->Changed)) {
+            return true;
+        }
+    }
+    return std::any_of(Stack.Stale.begin(), Stack.Stale.end(), [](uint8_t Bits) { return Bits != 0; });
+}
+
+struct CompositeInput {
+    const TileRef* Tile;
+    uint8_t Opacity;
+    bool IsOpaque; // every pixel, as with Below
+};
+
+// Flattens Inputs, bottom first, over Base into Rect of one tile of Dest; the
+// rest of the tile is already up to date. Whatever sits under an opaque input
+// at full opacity is skipped, uniform inputs stay uniform, and a tile that
+// would come out as a copy of one input shares it.
+static void CompositeTile(Canvas& Dest, int Tile, const PixelRect& Rect, u32 Base, std::vector<CompositeInput>& Inputs, std::vector<u32>& Row) {
+    size_t first = 0;
+    for (size_t i = 0; i < Inputs.size(); i++) {
+        const CanvasTile& tile = **Inputs[i].Tile;
+        bool isOpaque = Inputs[i].IsOpaque || (tile.Pixels.empty() && (tile.Uniform & LAYER_CLEAR) == 0);
+        if (Inputs[i].Opacity == 255 && isOpaque) {
+            first = i;
+            Base = LAYER_CLEAR;
+        }
+    }
+    Inputs.erase(Inputs.begin(), Inputs.begin() + first);
+    Inputs.erase(std::remove_if(Inputs.begin(), Inputs.end(), [](const CompositeInput& Input) {
+        const CanvasTile& tile = **Input.Tile;
+        return Input.Opacity == 0 || (tile.Pixels.empty() && tile.Uniform == LAYER_CLEAR);
+    }), Inputs.end());
+
+    TileRef& slot = Dest.Tiles[Tile];
+    // Anything over a clear base at full opacity comes out unchanged.
+    if (Inputs.size() == 1 && Inputs[0].Opacity == 255 && Base == LAYER_CLEAR) {
+        slot = *Inputs[0].Tile;
+        return;
+    }
+
+    bool isUniform = std::all_of(Inputs.begin(), Inputs.end(), [](const CompositeInput& Input) {
+        return (*Input.Tile)->Pixels.empty();
+    });
+    if (isUniform) {
+        u32 color = Base;
+        for (const CompositeInput& input : Inputs) {
+            CompositeRow(&color, &(*input.Tile)->Uniform, 1, input.Opacity);
+        }
+        if (!slot->Pixels.empty() || slot->Uniform != color) {
+            slot = MakeUniformTile(Dest, color);
+        }
+        return;
+    }
+
+    // A tile that isn't ours to write in place is rebuilt whole; copying it
+    // first would cost as much.
+    PixelRect bounds = TileBounds(Dest, Tile);
+    int x0 = Rect.X0 - bounds.X0, x1 = Rect.X1 - bounds.X0;
+    int y0 = Rect.Y0 - bounds.Y0, y1 = Rect.Y1 - bounds.Y0;
+    if (slot.use_count() != 1 || slot->Pixels.empty()) {
+        slot = MakePixelTile(Dest);
+        x0 = y0 = 0;
+        x1 = y1 = TILE_SIZE;
+    }
+    u32* pixels = slot->Pixels.data();
+    if (x0 == 0 && x1 == TILE_SIZE) {
+        // Whole rows are contiguous: one call per input.
+        u32* start = pixels + y0 * TILE_SIZE;
+        int count = (y1 - y0) * TILE_SIZE;
+        std::fill(start, start + count, Base);
+        for (const CompositeInput& input : Inputs) {
+            const CanvasTile& tile = **input.Tile;
+            if (!tile.Pixels.empty()) {
+                CompositeRow(start, tile.Pixels.data() + y0 * TILE_SIZE, count, input.Opacity);
+                continue;
+            }
+            Row.assign(TILE_SIZE, tile.Uniform);
+            for (int y = y0; y < y1; y++) {
+                CompositeRow(pixels + y * TILE_SIZE, Row.data(), TILE_SIZE, input.Opacity);
+            }
+        }
+        return;
+    }
+    for (int y = y0; y < y1; y++) {
+        std::fill(pixels + y * TILE_SIZE + x0, pixels + y * TILE_SIZE + x1, Base);
+    }
+    for (const CompositeInput& input : Inputs) {
+        const CanvasTile& tile = **input.Tile;
+        if (tile.Pixels.empty()) {
+            Row.assign(TILE_SIZE, tile.Uniform);
+        }
+        for (int y = y0; y < y1; y++) {
+            const u32* source = tile.Pixels.empty() ? Row.data() : tile.Pixels.data() + y * TILE_SIZE + x0;
+            CompositeRow(pixels + y * TILE_SIZE + x0, source, x1 - x0, input.Opacity);
+        }
+    }
+}
+
+static void UpdateTile(LayerStack& Stack, int Tile, std::vector<CompositeInput>& Inputs, std::vector<u32>& Row) {
+    uint8_t stale = Stack.Stale[Tile];
+    const PixelRect& rect = Stack.StaleRects[Tile];
+    int active = Stack.Active;
+    if (stale & STALE_BELOW) {
+        Inputs.clear();
+        for (int i = 0; i < active; i++) {
+            const Layer& layer = *Stack.Layers[i];
+            if (layer.Visible) {
+                Inputs.push_back({ &layer.Pixels.Tiles[Tile], layer.Opacity, false });
+            }
+        }
+        CompositeTile(Stack.Below, Tile, rect, Stack.Backdrop, Inputs, Row);
+    }
+    if (stale & STALE_ABOVE) {
+        Inputs.clear();
+        for (int i = active + 1; i < (int)Stack.Layers.size(); i++) {
+            const Layer& layer = *Stack.Layers[i];
+            if (layer.Visible) {
+                Inputs.push_back({ &layer.Pixels.Tiles[Tile], layer.Opacity, false });
+            }
+        }
+        CompositeTile(Stack.Above, Tile, rect, LAYER_CLEAR, Inputs, Row);
+    }
+    Inputs.clear();
+    Inputs.push_back({ &Stack.Below.Tiles[Tile], 255, true });
+    const Layer& layer = *Stack.Layers[active];
+    if (layer.Visible) {
+        Inputs.push_back({ &layer.Pixels.Tiles[Tile], layer.Opacity, false });
+    }
+    Inputs.push_back({ &Stack.Above.Tiles[Tile], 255, false });
+    CompositeTile(Stack.Composite, Tile, rect, Stack.Backdrop, Inputs, Row);
+}
+
+void UpdateComposite(LayerStack& Stack) {
+    TraceScope trace("UpdateComposite");
+    const Canvas& bottom = Stack.Layers[0]->Pixels;
+    if (Stack.Composite.Width != bottom.Width || Stack.Composite.Height != bottom.Height) {
+        PixelRect before = CanvasBounds(Stack.Composite);
+        InitCanvas(Stack.Below, bottom.Width, bottom.Height, Stack.Backdrop);
+        InitCanvas(Stack.Above, bottom.Width, bottom.Height, LAYER_CLEAR);
+        InitCanvas(Stack.Composite, bottom.Width, bottom.Height, Stack.Backdrop);
+        Stack.Stale.assign(Stack.Composite.Tiles.size(), 0);
+        Stack.StaleRects.assign(Stack.Composite.Tiles.size(), { 0, 0, 0, 0 });
+        MarkStale(Stack, STALE_BELOW | STALE_ABOVE | STALE_COMPOSITE);
+        for (auto& layer : Stack.Layers) {
+            InitDamageTracker(layer->Changed, bottom.Width, bottom.Height);
+        }
+        if (Stack.Damage) {
+            AddDamage(*Stack.Damage, Union(before, CanvasBounds(Stack.Composite)));
+        }
+    }
+
+    for (int i = 0; i < (int)Stack.Layers.size(); i++) {
+        uint8_t bits = StaleBitsFor(Stack, i);
+        for (const PixelRect& rect : TakeDamage(Stack.Layers[i]->Changed)) {
+            for (int ty = rect.Y0 >> TILE_SHIFT; ty <= (rect.Y1 - 1) >> TILE_SHIFT; ty++) {
+                for (int tx = rect.X0 >> TILE_SHIFT; tx <= (rect.X1 - 1) >> TILE_SHIFT; tx++) {
+                    int tile = ty * Stack.Composite.TilesX + tx;
+                    MarkTileStale(Stack, tile, bits, Intersect(rect, TileBounds(Stack.Composite, tile)));
+                }
+            }
+        }
+    }
+
+    std::vector<int> tiles;
+    for (int tile = 0; tile < (int)Stack.Stale.size(); tile++) {
+        if (Stack.Stale[tile]) {
+            tiles.push_back(tile);
+        }
+    }
+    if ((int)tiles.size() >= PARALLEL_COMPOSITE_TILES) {
+        // Each job reads layer tiles and writes its own tile of each cache.
+        ParallelFor((int)tiles.size(), [&](int Job) {
+            std::vector<CompositeInput> inputs;
+            std::vector<u32> row;
+            UpdateTile(Stack, tiles[Job], inputs, row);
+        });
+    }
+    else {
+        std::vector<CompositeInput> inputs;
+        std::vector<u32> row;
+        for (int tile : tiles) {
+            UpdateTile(Stack, tile, inputs, row);
+        }
+    }
+
+    for (int tile : tiles) {
+        if (Stack.Damage) {
+            AddDamage(*Stack.Damage, Stack.StaleRects[tile]);
+        }
+        Stack.Stale[tile] = 0;
+        Stack.StaleRects[tile] = { 0, 0, 0, 0 };
+    }
+}
+
+void ResizeLayers(LayerStack& Stack, int Width, int Height) {
+    TraceScope trace("ResizeLayers");
+    // With nothing stale the caches can be resized like the layers.
+    UpdateComposite(Stack);
+    for (size_t i = 0; i < Stack.Layers.size(); i++) {
+        Layer& layer = *Stack.Layers[i];
+        InitDamageTracker(layer.Changed, Width, Height);
+        ResizeCanvas(layer.Pixels, Width, Height, i == 0 ? Stack.Backdrop : LAYER_CLEAR);
+    }
+    PixelRect before = CanvasBounds(Stack.Composite);
+    ResizeCanvas(Stack.Below, Width, Height, Stack.Backdrop);
+    ResizeCanvas(Stack.Above, Width, Height, LAYER_CLEAR);
+    ResizeCanvas(Stack.Composite, Width, Height, Stack.Backdrop);
+    Stack.Stale.assign(Stack.Composite.Tiles.size(), 0);
+    Stack.StaleRects.assign(Stack.Composite.Tiles.size(), { 0, 0, 0, 0 });
+    // The new area arrives as layer damage; what was cut off is gone now.
+    if (Stack.Damage) {
+        AddDamage(*Stack.Damage, { Width, 0, before.X1, before.Y1 });
+        AddDamage(*Stack.Damage, { 0, Height, before.X1, before.Y1 });
+    }
+}
+
+static Layer* FindLayer(LayerStack& Stack, int Id) {
+    for (auto& layer : Stack.Layers) {
+        if (layer->Id == Id) {
+            return layer.get();
+        }
+    }
+    return nullptr;
+}
+
+// Drops whole steps, oldest first, so every layer's history keeps lining up
+// with Steps however little of the memory a layer holds. The live layers are
+// the floor.
+static void EnforceBudget(LayerStack& Stack) {
+    while (*Stack.LiveBytes > Stack.HistoryBudget && Stack.StepIndex > 0) {
+        for (int id : Stack.Steps.front()) {
+            if (Layer* layer = FindLayer(Stack, id)) {
+                DropOldestEntry(layer->History);
+            }
+        }
+        Stack.Steps.pop_front();
+        Stack.StepIndex--;
+    }
+}
+
+bool SaveLayerState(LayerStack& Stack) {
+    TraceScope trace("SaveLayerState");
+    std::vector<int> changed;
+    for (auto& layer : Stack.Layers) {
+        if (SaveDrawingState(layer->History, layer->Pixels)) {
+            changed.push_back(layer->Id);
+        }
+    }
+    if (changed.empty()) {
+        return false;
+    }
+    Stack.Steps.resize(Stack.StepIndex);
+    Stack.Steps.push_back(std::move(changed));
+    Stack.StepIndex = Stack.Steps.size();
+    EnforceBudget(Stack);
+    return true;
+}
+
+// Each layer keeps its own steps in the same order as the stack's, so undoing
+// a stack step undoes the latest step of each layer in it.
+bool UndoLayers(LayerStack& Stack) {
+    TraceScope trace("UndoLayers");
+    SaveLayerState(Stack);
+    if (Stack.StepIndex == 0) {
+        return false;
+    }
+    Stack.StepIndex--;
+    for (int id : Stack.Steps[Stack.StepIndex]) {
+        if (Layer* layer = FindLayer(Stack, id)) {
+            UndoDrawing(layer->History, layer->Pixels);
+        }
+    }
+    return true;
+}
+
+bool RedoLayers(LayerStack& Stack) {
+    TraceScope trace("RedoLayers");
+    SaveLayerState(Stack);
+    if (Stack.StepIndex >= Stack.Steps.size()) {
+        return false;
+    }
+    for (int id : Stack.Steps[Stack.StepIndex]) {
+        if (Layer* layer = FindLayer(Stack, id)) {
+            RedoDrawing(layer->History, layer->Pixels);
+        }
+    }
+    Stack.StepIndex++;
+    return true;
+}
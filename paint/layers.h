@@ -0,0 +1,94 @@
+#pragma once
+#include <stdint.h>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "canvas.h"
+#include "damage.h"
+#include "history.h"
+
+constexpr int MAX_LAYERS = 64;
+
+struct Layer {
+    Canvas Pixels;
+    DamageTracker Changed;  // written since the last UpdateComposite
+    DrawingHistory History;
+    uint8_t Opacity = 255;
+    bool Visible = true;
+    int Id = 0;             // stays with the layer when it moves
+};
+
+// Layers bottom to top over an opaque Backdrop, flattened into Composite.
+// Presenting and saving only ever read Composite, so they cost the same with
+// any number of layers.
+//
+// Composite is kept as Below + active layer + Above: Below holds the layers
+// under the active one flattened onto the backdrop, Above the ones over it
+// flattened on their own. Drawing on the active layer recomposites three
+// layers in the tiles it touched, however deep the stack is. Rounding makes
+// the grouping visible in the last bit of a channel at most.
+//
+// Layers point their canvases' damage at themselves, so they live behind
+// pointers and the stack must not be copied.
+struct LayerStack {
+    std::vector<std::unique_ptr<Layer>> Layers;
+    int Active = 0;
+    u32 Backdrop = 0;
+    int NextId = 1;
+
+    Canvas Below;
+    Canvas Above;
+    Canvas Composite;
+    // Tiles whose caches are out of date: Below, Above, and Composite itself,
+    // and the part of each tile that is.
+    std::vector<uint8_t> Stale;
+    std::vector<PixelRect> StaleRects;
+
+    // Told about every change to Composite, e.g. the window's damage.
+    DamageTracker* Damage = nullptr;
+
+    // Undo steps in order, each listing the layers it changed.
+    std::deque<std::vector<int>> Steps;
+    size_t StepIndex = 0;
+    size_t HistoryBudget = DEFAULT_HISTORY_BUDGET;
+    std::shared_ptr<std::atomic<size_t>> LiveBytes; // shared by every layer
+};
+
+// A single opaque layer of Color.
+void InitLayerStack(LayerStack& Stack, int Width, int Height, u32 Color, size_t HistoryBudget);
+
+inline Layer& ActiveLayer(LayerStack& Stack) {
+    return *Stack.Layers[Stack.Active];
+}
+
+// Inserts a clear layer above the active one and makes it active. Returns
+// false when the stack is full.
+bool AddLayer(LayerStack& Stack);
+// Removes the active layer, along with its undo steps; the last one stays.
+bool RemoveLayer(LayerStack& Stack);
+void SetActiveLayer(LayerStack& Stack, int Index);
+// Moves the active layer By places up (positive) or down the stack.
+bool MoveLayer(LayerStack& Stack, int By);
+void SetLayerOpacity(LayerStack& Stack, int Index, uint8_t Opacity);
+void SetLayerVisible(LayerStack& Stack, int Index, bool Visible);
+
+// Brings Composite up to date with whatever changed since the last call and
+// reports what it rewrote to Damage. A stack whose layers were resized, e.g.
+// by a rotation, is rebuilt whole.
+void UpdateComposite(LayerStack& Stack);
+// True when UpdateComposite has anything to do.
+bool HasLayerChanges(const LayerStack& Stack);
+// Resizes every layer and the caches, keeping what they hold in place; new
+// area is clear, over the backdrop on the bottom layer. Costs the same however
+// much is drawn, and the next update composites only the new area. Close it
+// with SaveLayerState to make it an undo step.
+void ResizeLayers(LayerStack& Stack, int Width, int Height);
+// Marks everything out of date, as after changing Backdrop.
+void InvalidateLayers(LayerStack& Stack);
+
+// Closes the current operation on every layer; the layers that changed form
+// one undo step. Undo and redo replay a step's layers together.
+bool SaveLayerState(LayerStack& Stack);
+bool UndoLayers(LayerStack& Stack);
+bool RedoLayers(LayerStack& Stack);
@@ -5,10 +5,16 @@
 #include <windowsx.h>
 #include <vector>
 #include <commdlg.h>
-#include <stack>
 #include <fstream>
 
 #include "main.h"
+#include "bmp.h"
+#include "input.h"
+#include "layers.h"
+#include "reserved_memory.h"
+#include "trace.h"
+#include "validate.h"
+#include "viewport.h"
 
 #define Assert(Expression) if (!(Expression)) { *(int *)0 = 0; }
 
@@ -19,408 +25,438 @@ typedef uint32_t u32;
 
 int ClientWidth;
 int ClientHeight;
-void* Memory;
+// What was last presented, ClientWidth pixels a row. Address space for the
+// largest window is reserved up front, so resizing only commits pages.
+ReservedMemory Memory;
+// Inside the modal loop of a window being dragged to a new size.
+bool IsSizing = false;
 
 bool IsShiftPressed = false;
 
 HMENU hSubMenuPencilType;
 
-std::deque<std::vector<u32>> drawingHistory;
-size_t historyIndex = 0;
-
-void FlipScreenHorizontal() {
-    u32* pixels = (u32*)Memory;
-    std::vector<u32> tempRow(ClientWidth);
-
-    for (int y = 0; y < ClientHeight; ++y) {
-        int left = 0;
-        int right = ClientWidth - 1;
-
-        while (left < right) {
-            // Swap pixels horizontally
-            std::swap(tempRow[left], pixels[y * ClientWidth + left]);
-            std::swap(pixels[y * ClientWidth + left], pixels[y * ClientWidth + right]);
-            std::swap(tempRow[left], pixels[y * ClientWidth + right]);
-
-            ++left;
-            --right;
-        }
-    }
+DamageTracker Damage;
+LayerStack Layers;
+RasterValidator Validator;
+
+// The window shows the composite through View; zoomed out, through Mips.
+// Drawing reports changes in canvas coordinates to CanvasDamage, and each
+// frame passes them on to Mips and, mapped through View, to Damage, which is
+// in window coordinates.
+DamageTracker CanvasDamage;
+Viewport View;
+MipPyramid Mips;
+bool IsPanning = false;
+int PanX, PanY; // where the mouse was when the view last moved with it
+
+// Tools draw on the active layer; the window shows Layers.Composite.
+Canvas& ActiveCanvas() {
+    return ActiveLayer(Layers).Pixels;
 }
 
-void FlipScreenVertical() {
-    u32* pixels = (u32*)Memory;
-    std::vector<u32> tempColumn(ClientHeight);
-
-    for (int x = 0; x < ClientWidth; ++x) {
-        int top = 0;
-        int bottom = ClientHeight - 1;
+// Drawing stays inside this while there is one. It belongs to no layer, so
+// it is only attached to the active one while drawing.
+std::shared_ptr<const SelectionMask> Selection;
 
-        while (top < bottom) {
-            // Swap pixels vertically
-            std::swap(tempColumn[top], pixels[top * ClientWidth + x]);
-            std::swap(pixels[top * ClientWidth + x], pixels[bottom * ClientWidth + x]);
-            std::swap(tempColumn[top], pixels[bottom * ClientWidth + x]);
-
-            ++top;
-            --bottom;
-        }
+// Replaces the selection, redrawing where the old and new outlines were.
+void SetSelection(std::shared_ptr<const SelectionMask> NewSelection) {
+    if (Selection) {
+        AddDamage(Damage, CanvasToScreen(View, Selection->Bounds));
+    }
+    Selection = std::move(NewSelection);
+    if (Selection) {
+        AddDamage(Damage, CanvasToScreen(View, Selection->Bounds));
     }
 }
 
-void SaveDrawingState() {
-    u32* pixels = (u32*)Memory;
-    drawingHistory.resize(historyIndex);
-    drawingHistory.push_back(std::vector<u32>(pixels, pixels + ClientWidth * ClientHeight));
-    historyIndex = drawingHistory.size();
+// Every drawing operation goes through here so that, with validation on, it
+// is also drawn by the reference rasterizer and compared.
+void Draw(const RasterOp& Op) {
+    Canvas& Target = ActiveCanvas();
+    Target.Selection = Selection;
+    bool Matched = RunRasterOp(Validator, Target, Op);
+    Target.Selection.reset();
+    if (Matched) {
+        return;
+    }
+    const ValidationFailure& Failure = Validator.Failure;
+    wchar_t Message[1024];
+    swprintf(Message, 1024, L"%hs\nfirst differs at (%d, %d): expected 0x%06x, got 0x%06x\ndiff image: %ls",
+        DescribeRasterOp(Failure.Op).c_str(), Failure.X, Failure.Y, Failure.Expected, Failure.Actual,
+        Failure.DiffImage.empty() ? L"not written" : Failure.DiffImage.wstring().c_str());
+    MessageBox(NULL, Message, L"Validation mismatch", MB_OK | MB_ICONERROR);
+    // Reported; the next mismatch gets a dialog of its own.
+    Validator.HasFailure = false;
 }
 
-void RestoreDrawingState() {
-    u32* pixels = (u32*)Memory;
-    std::vector<u32> currentState = drawingHistory[historyIndex - 1];
-    std::copy(currentState.begin(), currentState.end(), pixels);
+// Each press of a mouse button starts one stroke; saving the state ends it,
+// so every stroke is an undo step of its own.
+void BeginStroke() {
+    Draw({ .Kind = RASTER_BEGIN_STROKE, .Opacity = BrushOpacity, .Blend = CurrentBlendMode });
 }
 
-void UndoDrawing() {
-    if (historyIndex != 0) {
-        RestoreDrawingState();
-        historyIndex--;
-    }
+void SaveDrawingState() {
+    Draw({ .Kind = RASTER_END_STROKE });
+    SaveLayerState(Layers);
 }
 
-void RedoDrawing() { // HORK IN HALF
-    if (historyIndex < drawingHistory.size()) {
-        historyIndex++;
-        RestoreDrawingState();
+// A region lifted off the active layer, drawn on it wherever it was last
+// placed. Dragging redraws it once a frame from PendingPlacement. Anything
+// else that changes the layers commits it first.
+FloatingRegion Floating;
+bool IsFloating = false;
+bool IsFloatDragging = false;
+RegionPlacement FloatStart; // the placement when the drag began
+float FloatDragX, FloatDragY; // and the canvas point it began at
+RegionPlacement PendingPlacement;
+bool IsPlacementPending = false;
+
+// Keeps the region where it is; lifting and placing it make one undo step.
+void CommitFloating() {
+    if (!IsFloating) {
+        return;
     }
+    IsFloating = false;
+    IsFloatDragging = false;
+    IsPlacementPending = false;
+    AddDamage(Damage, CanvasToScreen(View, Floating.Drawn));
+    Floating = FloatingRegion();
+    SyncValidator(Validator, ActiveCanvas());
+    SaveDrawingState();
 }
 
-COLORREF HSVToRGB(float hue, float saturation, float value) {
-    int hi = static_cast<int>(hue * 6.0f) % 6;
-    float f = hue * 6.0f - hi;
-    float p = value * (1.0f - saturation);
-    float q = value * (1.0f - f * saturation);
-    float t = value * (1.0f - (1.0f - f) * saturation);
-
-    switch (hi) {
-    case 0:
-        return RGB(value * 255, t * 255, p * 255);
-    case 1:
-        return RGB(q * 255, value * 255, p * 255);
-    case 2:
-        return RGB(p * 255, value * 255, t * 255);
-    case 3:
-        return RGB(p * 255, q * 255, value * 255);
-    case 4:
-        return RGB(t * 255, p * 255, value * 255);
-    default:
-        return RGB(value * 255, p * 255, q * 255);
+// Puts the layer back the way it was before lifting.
+void CancelFloating() {
+    if (!IsFloating) {
+        return;
     }
+    IsFloating = false;
+    IsFloatDragging = false;
+    IsPlacementPending = false;
+    AddDamage(Damage, CanvasToScreen(View, Floating.Drawn));
+    CancelRegion(Floating, ActiveCanvas());
+    SyncValidator(Validator, ActiveCanvas());
 }
 
-void DrawPixel(int X, int Y, u32 Color) {
-    if (X >= 0 && X < ClientWidth && Y >= 0 && Y < ClientHeight) {
-        u32* Pixel = (u32*)Memory;
-        Pixel[Y * ClientWidth + X] = Color;
+// Lifts the selection, or the whole layer without one, off the active layer.
+// The hole is cleared the way Clear Layer clears.
+void FloatSelection() {
+    CommitFloating();
+    Canvas& Target = ActiveCanvas();
+    u32 Hole = Layers.Active == 0 ? BackgroundColor : LAYER_CLEAR;
+    Target.Selection = Selection;
+    IsFloating = LiftRegion(Floating, Target, CanvasBounds(Target), Hole);
+    Target.Selection.reset();
+    if (!IsFloating) {
+        MessageBox(NULL, L"The selection is empty or too large to float", L"Error", MB_OK | MB_ICONERROR);
+        return;
     }
+    SetSelection(nullptr);
 }
 
-void DrawRectangle(int X, int Y, int Width, int Height, u32 Color, int LineWidth, bool isFilled) {
-    int startX, endX, startY, endY;
-
-    if (Width >= 0) {
-        startX = X;
-        endX = X + Width;
-    }
-    else {
-        startX = X + Width;
-        endX = X;
+// Dragging moves the region; with Shift it scales and with Ctrl it turns,
+// both about its centre.
+RegionPlacement DraggedPlacement(float X, float Y, WPARAM Keys) {
+    RegionPlacement Placement = FloatStart;
+    float StartX = FloatDragX - FloatStart.CenterX;
+    float StartY = FloatDragY - FloatStart.CenterY;
+    float EndX = X - FloatStart.CenterX;
+    float EndY = Y - FloatStart.CenterY;
+    if (Keys & MK_CONTROL) {
+        Placement.Angle = FloatStart.Angle + atan2f(EndY, EndX) - atan2f(StartY, StartX);
     }
-
-    if (Height >= 0) {
-        startY = Y;
-        endY = Y + Height;
+    else if (Keys & MK_SHIFT) {
+        float StartDistance = sqrtf(StartX * StartX + StartY * StartY);
+        if (StartDistance >= 1) {
+            float Factor = sqrtf(EndX * EndX + EndY * EndY) / StartDistance;
+            Placement.ScaleX = FloatStart.ScaleX * Factor;
+            Placement.ScaleY = FloatStart.ScaleY * Factor;
+        }
     }
     else {
-        startY = Y + Height;
-        endY = Y;
+        Placement.CenterX += X - FloatDragX;
+        Placement.CenterY += Y - FloatDragY;
     }
+    return Placement;
+}
 
-    // Draw filled rectangle
-    if (isFilled) {
-        for (int i = startY; i < endY; i++) {
-            for (int j = startX; j < endX; j++) {
-                DrawPixel(j, i, Color);
-            }
-        }
+// Undoing while a region floats just drops it back.
+void UndoDrawing() {
+    if (IsFloating) {
+        CancelFloating();
+        return;
     }
-    else {
-        // Draw horizontal lines
-        for (int i = startY; i < startY + LineWidth; i++) {
-            for (int j = startX; j < endX; j++) {
-                DrawPixel(j, i, Color);
-            }
-        }
-
-        for (int i = endY - LineWidth; i < endY; i++) {
-            for (int j = startX; j < endX; j++) {
-                DrawPixel(j, i, Color);
-            }
-        }
+    UndoLayers(Layers);
+    SyncValidator(Validator, ActiveCanvas());
+}
 
-        // Draw vertical lines
-        for (int i = startX; i < startX + LineWidth; i++) {
-            for (int j = startY + LineWidth; j < endY - LineWidth; j++) {
-                DrawPixel(i, j, Color);
-            }
-        }
+void RedoDrawing() {
+    CommitFloating();
+    RedoLayers(Layers);
+    SyncValidator(Validator, ActiveCanvas());
+}
 
-        for (int i = endX - LineWidth; i < endX; i++) {
-            for (int j = startY + LineWidth; j < endY - LineWidth; j++) {
-                DrawPixel(i, j, Color);
-            }
-        }
+// Rotations change the canvas size, so every layer turns with it.
+void TransformLayers(CanvasTransform Transform) {
+    SetSelection(nullptr);
+    for (auto& layer : Layers.Layers) {
+        TransformCanvas(layer->Pixels, Transform);
     }
+    SyncValidator(Validator, ActiveCanvas());
     SaveDrawingState();
 }
 
-
-void DrawCircle(int X, int Y, int Radius, u32 Color, int LineWidth, int isFilled) {
-    int x = Radius;
-    int y = 0;
-    int err = 0;
-
-    while (x >= y) {
-        // Draw the filled circle by connecting the upper and lower parts with horizontal lines
-        if (isFilled) {
-            for (int i = -x; i <= x; i++) {
-                DrawPixel(X + i, Y + y, Color);
-                DrawPixel(X + i, Y - y, Color);
-            }
-            for (int i = -y; i <= y; i++) {
-                DrawPixel(X + i, Y + x, Color);
-                DrawPixel(X + i, Y - x, Color);
-            }
-        }
-        else {
-            // Draw the circle outline
-            for (int i = -LineWidth / 2; i <= LineWidth / 2; i++) {
-                for (int j = -LineWidth / 2; j <= LineWidth / 2; j++) {
-                    DrawPixel(X + x + i, Y + y + j, Color);
-                    DrawPixel(X + y + i, Y + x + j, Color);
-                    DrawPixel(X - y + i, Y + x + j, Color);
-                    DrawPixel(X - x + i, Y + y + j, Color);
-                    DrawPixel(X - x + i, Y - y + j, Color);
-                    DrawPixel(X - y + i, Y - x + j, Color);
-                    DrawPixel(X + y + i, Y - x + j, Color);
-                    DrawPixel(X + x + i, Y - y + j, Color);
-                }
-            }
-        }
-
-        if (err <= 0) {
-            y += 1;
-            err += 2 * y + 1;
-        }
-
-        if (err > 0) {
-            x -= 1;
-            err -= 2 * x + 1;
-        }
-    }
+// Filters work on the active layer, inside the selection if there is one.
+// Like gradients they aren't reference-rasterized; the validator just takes
+// the result.
+void FilterLayer(const ImageFilter& Filter) {
+    Canvas& Target = ActiveCanvas();
+    Target.Selection = Selection;
+    ApplyFilter(Target, Filter, CanvasBounds(Target));
+    Target.Selection.reset();
+    SyncValidator(Validator, Target);
+    SaveDrawingState();
 }
 
-void FloodFill(int x, int y, u32 replacementColor) {
-    std::stack<std::pair<int, int>> stack;
-    u32* pixels = (u32*)Memory;
-    int canvasWidth = ClientWidth;
-    int canvasHeight = ClientHeight;
-
-    // Get the target color from the pixel at the starting coordinates (x, y).
-    u32 targetColor = pixels[y * canvasWidth + x];
-
-    if (targetColor == replacementColor) {
+// The canvas grows to cover the window but never shrinks with it, so making
+// the window smaller and then larger again loses nothing. Growing is an undo
+// step of its own.
+void GrowCanvasToWindow() {
+    const Canvas& Bottom = Layers.Layers[0]->Pixels;
+    int Width = Bottom.Width < ClientWidth ? ClientWidth : Bottom.Width;
+    int Height = Bottom.Height < ClientHeight ? ClientHeight : Bottom.Height;
+    if (Width == Bottom.Width && Height == Bottom.Height) {
         return;
     }
+    CommitFloating();
+    SaveDrawingState();
+    SetSelection(nullptr);
+    ResizeLayers(Layers, Width, Height);
+    SyncValidator(Validator, ActiveCanvas());
+    SaveDrawingState();
+}
 
-    std::vector<std::pair<int, int>> visited; // Keep track of visited pixels to avoid revisiting them.
-
-    stack.push(std::make_pair(x, y));
-
-    int dx[] = { 0, 0, -1, 1 };
-    int dy[] = { -1, 1, 0, 0 };
-
-    while (!stack.empty()) {
-        std::pair<int, int> current = stack.top();
-        stack.pop();
-        x = current.first;
-        y = current.second;
+// Commits Memory for the client area, reserving more address space if the
+// window outgrew it.
+bool FitFramebuffer() {
+    size_t Bytes = (size_t)ClientWidth * ClientHeight * sizeof(u32);
+    if (Bytes > Memory.Reserved && !ReserveMemory(Memory, Bytes)) {
+        return false;
+    }
+    return CommitMemory(Memory, Bytes);
+}
 
-        if (pixels[y * canvasWidth + x] == targetColor) {
-            pixels[y * canvasWidth + x] = replacementColor;
+// Zooming and panning change every pixel of the window.
+void SetView(const Viewport& NewView) {
+    View = NewView;
+    AddDamage(Damage, { 0, 0, ClientWidth, ClientHeight });
+}
 
-            for (int i = 0; i < 4; i++) {
-                int newX = x + dx[i];
-                int newY = y + dy[i];
+void ZoomView(int Zoom, int AnchorX, int AnchorY) {
+    Viewport NewView = View;
+    ZoomViewport(NewView, Zoom, AnchorX, AnchorY);
+    SetView(NewView);
+}
 
-                if (newX >= 0 && newX < canvasWidth && newY >= 0 && newY < canvasHeight) {
-                    if (pixels[newY * canvasWidth + newX] == targetColor) {
-                        stack.push(std::make_pair(newX, newY));
-                    }
-                }
-            }
-        }
-    }
+// The canvas pixel under a mouse message's point.
+int CanvasMouseX(LPARAM LParam) {
+    float X, Y;
+    ScreenToCanvas(View, (float)GET_X_LPARAM(LParam), (float)GET_Y_LPARAM(LParam), X, Y);
+    return (int)lroundf(X);
 }
 
-bool SaveImage(const char* fileName) {
-    BITMAPFILEHEADER bmfh{};
-    BITMAPINFOHEADER bmih{};
-
-    // Initialize the BITMAPFILEHEADER
-    bmfh.bfType = 0x4D42;  // 'BM' for Bitmap
-    bmfh.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + static_cast<uint32_t>(ClientWidth) * ClientHeight * sizeof(uint32_t);
-    bmfh.bfReserved1 = 0;
-    bmfh.bfReserved2 = 0;
-    bmfh.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
-
-    // Initialize the BITMAPINFOHEADER
-    bmih.biSize = sizeof(BITMAPINFOHEADER);
-    bmih.biWidth = ClientWidth;
-    bmih.biHeight = ClientHeight;  // Keep the height as it is
-    bmih.biPlanes = 1;
-    bmih.biBitCount = 32;
-    bmih.biCompression = BI_RGB;
-    bmih.biSizeImage = 0;
-    bmih.biXPelsPerMeter = 0;
-    bmih.biYPelsPerMeter = 0;
-    bmih.biClrUsed = 0;
-    bmih.biClrImportant = 0;
-
-    std::ofstream file(fileName, std::ios::out | std::ios::binary);
-
-    if (file.is_open()) {
-        file.write(reinterpret_cast<char*>(&bmfh), sizeof(BITMAPFILEHEADER));
-        file.write(reinterpret_cast<char*>(&bmih), sizeof(BITMAPINFOHEADER));
-        for (int y = 0; y < ClientHeight; y++) {
-            for (int x = 0; x < ClientWidth; x++) {
-                u32* pixel = (u32*)Memory + (ClientHeight - 1 - y) * ClientWidth + x;
-                file.write(reinterpret_cast<char*>(pixel), sizeof(u32));
-            }
-        }
-        file.close();
-        return true;
-    }
-    return false;
+int CanvasMouseY(LPARAM LParam) {
+    float X, Y;
+    ScreenToCanvas(View, (float)GET_X_LPARAM(LParam), (float)GET_Y_LPARAM(LParam), X, Y);
+    return (int)lroundf(Y);
 }
 
-void DrawLine(int X1, int Y1, int X2, int Y2, u32 Color, int LineWidth) {
-    int dx = abs(X2 - X1);
-    int dy = abs(Y2 - Y1);
-    int sx = (X1 < X2) ? 1 : -1;
-    int sy = (Y1 < Y2) ? 1 : -1;
-    int err = dx - dy;
-    int err2;
+void SelectLayer(int Index) {
+    SaveDrawingState();
+    SetActiveLayer(Layers, Index);
+    SyncValidator(Validator, ActiveCanvas());
+}
 
-    for (;;) {
-        int BrushSize = LineWidth / 2;
-        for (int i = -BrushSize; i <= BrushSize; i++) {
-            for (int j = -BrushSize; j <= BrushSize; j++) {
-                int distance = (i * i) + (j * j);
-                if (CurrentBrushShape == ROUND_BRUSH) {
-                    // Draw in a circular pattern if CurrentBrushShape is ROUND_BRUSH
-                    if (distance <= (BrushSize * BrushSize)) {
-                        DrawPixel(X1 + i, Y1 + j, Color);
-                    }
-                }
-                else {
-                    // Draw in a square pattern if CurrentBrushShape is not ROUND_BRUSH
-                    DrawPixel(X1 + i, Y1 + j, Color);
-                }
-            }
-        }
+// Freehand strokes don't draw as the mouse moves: the moves are queued and
+// drawn once per frame along a smoothed curve, so a fast mouse can't flood
+// the message loop with segments.
+StrokeSmoother Smoother;
+bool IsSmoothing = false;
+std::vector<InputPoint> PendingInput;
+std::vector<InputPoint> StrokePoints;
+DWORD StrokeStartTime;
+MOUSEMOVEPOINT LastMouseMove;
+int StrokeX, StrokeY; // where the last segment drawn ends
+
+// The mouse's history is kept in screen coordinates, cut to 16 bits; strokes
+// are smoothed in canvas coordinates.
+MOUSEMOVEPOINT CurrentMouseMove(HWND Window, int X, int Y) {
+    POINT Screen = { X, Y };
+    ClientToScreen(Window, &Screen);
+    return { .x = (int)(Screen.x & 0xffff), .y = (int)(Screen.y & 0xffff), .time = (DWORD)GetMessageTime() };
+}
 
-        if (X1 == X2 && Y1 == Y2) {
-            break;
-        }
+void BeginSmoothInput(HWND Window, int X, int Y) {
+    LastMouseMove = CurrentMouseMove(Window, X, Y);
+    StrokeStartTime = LastMouseMove.time;
+    float CanvasX, CanvasY;
+    ScreenToCanvas(View, (float)X, (float)Y, CanvasX, CanvasY);
+    StrokeX = (int)lroundf(CanvasX);
+    StrokeY = (int)lroundf(CanvasY);
+    PendingInput.clear();
+    BeginSmoothStroke(Smoother, { CanvasX, CanvasY, 0 }, StrokeSpacing(LineWidth), StrokePoints);
+    StrokePoints.clear();
+    IsSmoothing = true;
+}
 
-        err2 = 2 * err;
+// Windows sends one WM_MOUSEMOVE for however many moves there were since the
+// last one was handled. The mouse's recent positions, newest first, still have
+// the rest: queue the ones after the last move queued, then this one.
+void QueueMouseMove(HWND Window, int X, int Y) {
+    MOUSEMOVEPOINT Current = CurrentMouseMove(Window, X, Y);
+    MOUSEMOVEPOINT Recent[64];
+    int Count = GetMouseMovePointsEx(sizeof(MOUSEMOVEPOINT), &Current, Recent, 64, GMMP_USE_DISPLAY_POINTS);
+    int Newer = 1; // Recent[0] is Current
+    while (Newer < Count && (int)(Recent[Newer].time - LastMouseMove.time) >= 0
+        && !(Recent[Newer].x == LastMouseMove.x && Recent[Newer].y == LastMouseMove.y && Recent[Newer].time == LastMouseMove.time)) {
+        Newer++;
+    }
+    for (int i = Newer - 1; i >= 1; i--) {
+        // Left of or above the main display they wrap round.
+        POINT Point = { Recent[i].x > 32767 ? Recent[i].x - 65536 : Recent[i].x, Recent[i].y > 32767 ? Recent[i].y - 65536 : Recent[i].y };
+        ScreenToClient(Window, &Point);
+        float CanvasX, CanvasY;
+        ScreenToCanvas(View, (float)Point.x, (float)Point.y, CanvasX, CanvasY);
+        PendingInput.push_back({ CanvasX, CanvasY, (double)(Recent[i].time - StrokeStartTime) });
+    }
+    float CanvasX, CanvasY;
+    ScreenToCanvas(View, (float)X, (float)Y, CanvasX, CanvasY);
+    PendingInput.push_back({ CanvasX, CanvasY, (double)(Current.time - StrokeStartTime) });
+    LastMouseMove = Current;
+}
 
-        if (err2 > -dy) {
-            err -= dy;
-            X1 += sx;
+// Draws the stroke as far as the queued moves take it, or to its end.
+void DrawQueuedInput(bool isEnd) {
+    SmoothStroke(Smoother, PendingInput.data(), PendingInput.size(), StrokePoints);
+    PendingInput.clear();
+    if (isEnd) {
+        EndSmoothStroke(Smoother, StrokePoints);
+        IsSmoothing = false;
+    }
+    for (const InputPoint& Point : StrokePoints) {
+        int X = (int)lroundf(Point.X);
+        int Y = (int)lroundf(Point.Y);
+        if (X == StrokeX && Y == StrokeY) {
+            continue;
         }
-
-        if (err2 < dx) {
-            err += dx;
-            Y1 += sy;
+        u32 SegmentColor = color;
+        if (Pencil == RAINBOW) {
+            rainbowHue += RAINBOW_HUE_PER_PIXEL * hypotf((float)(X - StrokeX), (float)(Y - StrokeY));
+            rainbowHue -= floorf(rainbowHue);
+            SegmentColor = HueColor(rainbowHue);
         }
+        Draw({ .Kind = RASTER_LINE, .X = StrokeX, .Y = StrokeY, .X2 = X, .Y2 = Y, .Color = SegmentColor, .LineWidth = LineWidth, .Brush = CurrentBrushShape, .AntiAlias = AntiAliasing });
+        StrokeX = X;
+        StrokeY = Y;
     }
+    StrokePoints.clear();
 }
 
-void DrawStraightLine(int X1, int Y1, int X2, int Y2, u32 Color, int LineWidth) {
-    int dx = abs(X2 - X1);
-    int dy = abs(Y2 - Y1);
-    int sx = (X1 < X2) ? 1 : -1;
-    int sy = (Y1 < Y2) ? 1 : -1;
-    int err = dx - dy;
-    int err2;
+// Sent from the export thread; WParam is the percentage written, LParam is 1
+// for success on completion.
+constexpr UINT WM_EXPORT_PROGRESS = WM_APP + 1;
+constexpr UINT WM_EXPORT_DONE = WM_APP + 2;
 
-    for (;;) {
-        int BrushSize = LineWidth / 2;
-        for (int i = -BrushSize; i <= BrushSize; i++) {
-            for (int j = -BrushSize; j <= BrushSize; j++) {
-                int distance = (i * i) + (j * j);
-                if (CurrentBrushShape == ROUND_BRUSH) {
-                    // Draw in a circular pattern if CurrentBrushShape is ROUND_BRUSH
-                    if (distance <= (BrushSize * BrushSize)) {
-                        DrawPixel(X1 + i, Y1 + j, Color);
-                    }
-                }
-                else {
-                    // Draw in a square pattern if CurrentBrushShape is not ROUND_BRUSH
-                    DrawPixel(X1 + i, Y1 + j, Color);
-                }
-            }
-        }
+ExportJob Export;
 
-        if (X1 == X2 && Y1 == Y2) {
-            break;
-        }
+void SaveImage(HWND Window) {
+    if (IsExportRunning(Export)) {
+        MessageBox(NULL, L"The previous image is still being saved", L"Info", MB_OK);
+        return;
+    }
 
-        err2 = 2 * err;
+    wchar_t fileName[MAX_PATH] = L"saved_image.bmp";
+    OPENFILENAMEW ofn = {};
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner = Window;
+    ofn.lpstrFilter = L"24-bit Bitmap (*.bmp)\0*.bmp\0" L"32-bit Bitmap (*.bmp)\0*.bmp\0";
+    ofn.nFilterIndex = 1;
+    ofn.lpstrFile = fileName;
+    ofn.nMaxFile = MAX_PATH;
+    ofn.lpstrDefExt = L"bmp";
+    ofn.Flags = OFN_OVERWRITEPROMPT | OFN_PATHMUSTEXIST;
+    if (!GetSaveFileNameW(&ofn)) {
+        return;
+    }
 
-        if (err2 > -dy) {
-            err -= dy;
-            X1 += sx;
+    BmpFormat format = ofn.nFilterIndex == 2 ? BMP_32_BIT : BMP_24_BIT;
+    UpdateComposite(Layers);
+    StartExport(Export, Layers.Composite, fileName, format, [Window](int RowsDone, int RowCount, bool Finished, bool Succeeded) {
+        if (Finished) {
+            PostMessage(Window, WM_EXPORT_DONE, 0, Succeeded);
         }
-
-        if (err2 < dx) {
-            err += dx;
-            Y1 += sy;
+        else {
+            PostMessage(Window, WM_EXPORT_PROGRESS, (WPARAM)((int64_t)RowsDone * 100 / RowCount), 0);
         }
-    }
+    });
+    SetWindowTextW(Window, L"Drawing Pixels - Saving 0%");
 }
 
+void OpenImage(HWND Window) {
+    wchar_t fileName[MAX_PATH] = L"";
+    OPENFILENAMEW ofn = {};
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner = Window;
+    ofn.lpstrFilter = L"Bitmap (*.bmp)\0*.bmp\0";
+    ofn.lpstrFile = fileName;
+    ofn.nMaxFile = MAX_PATH;
+    ofn.Flags = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST;
+    if (!GetOpenFileNameW(&ofn)) {
+        return;
+    }
 
-void ClearScreen(u32 Color) {
-    u32* Pixel = (u32*)Memory;
-    for (int Index = 0; Index < ClientWidth * ClientHeight; ++Index) {
-        Pixel[Index] = Color;
+    // Loading replaces the active layer, size included, as one undo step. With
+    // more than one layer the size has to stay what the others have.
+    Canvas loaded;
+    loaded.LiveBytes = Layers.LiveBytes;
+    if (!LoadBmp(loaded, fileName)) {
+        MessageBox(NULL, L"Only uncompressed 24 and 32-bit bitmaps can be opened", L"Error", MB_OK | MB_ICONERROR);
+        return;
     }
+    Canvas& target = ActiveCanvas();
+    if (Layers.Layers.size() > 1 && (loaded.Width != target.Width || loaded.Height != target.Height)) {
+        MessageBox(NULL, L"The image has to be the size of the canvas to open it into a layer", L"Error", MB_OK | MB_ICONERROR);
+        return;
+    }
+    SaveDrawingState();
+    PixelRect before = CanvasBounds(target);
+    SetCanvasTiles(target, loaded.Width, loaded.Height, std::move(loaded.Tiles));
+    PixelRect after = Union(before, CanvasBounds(target));
+    MarkDirty(target, after.X0, after.Y0, after.X1, after.Y1);
+    SyncValidator(Validator, target);
+    SaveDrawingState();
 }
 
 LRESULT CALLBACK WindowProc(HWND Window, UINT Message, WPARAM WParam, LPARAM LParam) {
     static int IsDrawing = false;
     static int PrevX, PrevY;
 
+    if ((Message >= WM_MOUSEFIRST && Message <= WM_MOUSELAST) || Message == WM_KEYDOWN) {
+        TraceInput();
+    }
+
     switch (Message) {
         case WM_CREATE: {
             HMENU hMenu = CreateMenu();
             HMENU hSubMenuPencil = CreatePopupMenu();
             HMENU hSubMenuPencilType = CreatePopupMenu();
             HMENU hSubMenuBrush = CreatePopupMenu();
+            HMENU hSubMenuFill = CreatePopupMenu();
             HMENU hSubMenuCanva = CreatePopupMenu();
+            HMENU hSubMenuLayers = CreatePopupMenu();
+            HMENU hSubMenuSelect = CreatePopupMenu();
+            HMENU hSubMenuView = CreatePopupMenu();
+            HMENU hSubMenuFilters = CreatePopupMenu();
 
             AppendMenuW(hSubMenuPencil, MF_STRING, LINE_WIDTH_PLUS, L"Plus");
             AppendMenuW(hSubMenuPencil, MF_STRING, LINE_WIDTH_MINUS, L"Minus");
@@ -435,21 +471,101 @@ LRESULT CALLBACK WindowProc(HWND Window, UINT Message, WPARAM WParam, LPARAM LPa
             AppendMenuW(hSubMenuPencilType, MF_STRING, MODE_RECTANGLE_FILLED, L"Filled Rectangle");
             AppendMenuW(hSubMenuPencilType, MF_STRING, MODE_CIRCLE, L"Circle");
             AppendMenuW(hSubMenuPencilType, MF_STRING, MODE_CIRCLE_FILLED, L"Filled Circle");
+            AppendMenuW(hSubMenuPencilType, MF_STRING, MODE_ELLIPSE, L"Ellipse");
+            AppendMenuW(hSubMenuPencilType, MF_STRING, MODE_ELLIPSE_FILLED, L"Filled Ellipse");
             AppendMenuW(hSubMenuPencilType, MF_STRING, MODE_STRAIGHT_LINE, L"Straight Line");
+            AppendMenuW(hSubMenuPencilType, MF_STRING, MODE_GRADIENT_LINEAR, L"Linear Gradient");
+            AppendMenuW(hSubMenuPencilType, MF_STRING, MODE_GRADIENT_RADIAL, L"Radial Gradient");
+            AppendMenuW(hSubMenuPencilType, MF_STRING | (GradientDither ? MF_CHECKED : MF_UNCHECKED), GRADIENT_DITHER, L"Dither Gradients");
 
             AppendMenuW(hMenu, MF_POPUP, (UINT_PTR)hSubMenuPencilType, L"Pencil Type");
 
+            AppendMenuW(hSubMenuFill, MF_STRING, FILL_TOLERANCE_EXACT, L"Exact");
+            AppendMenuW(hSubMenuFill, MF_STRING, FILL_TOLERANCE_CHANNEL, L"Per Channel");
+            AppendMenuW(hSubMenuFill, MF_STRING, FILL_TOLERANCE_DISTANCE, L"Color Distance");
+
+            AppendMenuW(hMenu, MF_POPUP, (UINT_PTR)hSubMenuFill, L"Fill Tolerance");
+
             AppendMenuW(hSubMenuBrush, MF_STRING, MODE_BRUSH_ROUND, L"Round Brush");
             AppendMenuW(hSubMenuBrush, MF_STRING, MODE_BRUSH_SQUARE, L"Square Brush");
+            AppendMenuW(hSubMenuBrush, MF_STRING | (AntiAliasing ? MF_CHECKED : MF_UNCHECKED), ANTI_ALIASING, L"Anti-aliasing");
+            AppendMenuW(hSubMenuBrush, MF_SEPARATOR, 0, NULL);
+            AppendMenuW(hSubMenuBrush, MF_STRING, BRUSH_OPACITY_100, L"Opacity 100%");
+            AppendMenuW(hSubMenuBrush, MF_STRING, BRUSH_OPACITY_75, L"Opacity 75%");
+            AppendMenuW(hSubMenuBrush, MF_STRING, BRUSH_OPACITY_50, L"Opacity 50%");
+            AppendMenuW(hSubMenuBrush, MF_STRING, BRUSH_OPACITY_25, L"Opacity 25%");
+            AppendMenuW(hSubMenuBrush, MF_SEPARATOR, 0, NULL);
+            AppendMenuW(hSubMenuBrush, MF_STRING, MODE_BLEND_NORMAL, L"Normal");
+            AppendMenuW(hSubMenuBrush, MF_STRING, MODE_BLEND_MULTIPLY, L"Multiply");
+            AppendMenuW(hSubMenuBrush, MF_STRING, MODE_BLEND_SCREEN, L"Screen");
+            AppendMenuW(hSubMenuBrush, MF_STRING, MODE_BLEND_ADD, L"Add");
+            CheckMenuRadioItem(hSubMenuBrush, BRUSH_OPACITY_100, BRUSH_OPACITY_25, BRUSH_OPACITY_100, MF_BYCOMMAND);
+            CheckMenuRadioItem(hSubMenuBrush, MODE_BLEND_NORMAL, MODE_BLEND_ADD, MODE_BLEND_NORMAL, MF_BYCOMMAND);
 
             AppendMenuW(hMenu, MF_POPUP, (UINT_PTR)hSubMenuBrush, L"Brush Type");
 
             AppendMenuW(hSubMenuCanva, MF_STRING, FLIP_SCREEN_HORIZONTAL, L"Flip Horizontal");
             AppendMenuW(hSubMenuCanva, MF_STRING, FLIP_SCREEN_VERTICAL, L"Flip Vertical");
+            AppendMenuW(hSubMenuCanva, MF_STRING, ROTATE_SCREEN_90, L"Rotate 90");
+            AppendMenuW(hSubMenuCanva, MF_STRING, ROTATE_SCREEN_180, L"Rotate 180");
+            AppendMenuW(hSubMenuCanva, MF_STRING, ROTATE_SCREEN_270, L"Rotate 270");
+            AppendMenuW(hSubMenuCanva, MF_STRING, TRANSPOSE_SCREEN, L"Transpose");
+            AppendMenuW(hSubMenuCanva, MF_STRING | (Validator.Enabled ? MF_CHECKED : MF_UNCHECKED), VALIDATE_DRAWING, L"Validate Drawing");
+            AppendMenuW(hSubMenuCanva, MF_STRING | (IsTracing() ? MF_CHECKED : MF_UNCHECKED), RECORD_TRACE, L"Record Trace");
 
             AppendMenuW(hMenu, MF_POPUP, (UINT_PTR)hSubMenuCanva, L"Canva options");
 
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_ADD, L"Add Layer");
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_REMOVE, L"Remove Layer");
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_SELECT_ABOVE, L"Select Layer Above");
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_SELECT_BELOW, L"Select Layer Below");
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_MOVE_UP, L"Move Layer Up");
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_MOVE_DOWN, L"Move Layer Down");
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_TOGGLE_VISIBLE, L"Show/Hide Layer");
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_OPACITY_100, L"Opacity 100%");
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_OPACITY_75, L"Opacity 75%");
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_OPACITY_50, L"Opacity 50%");
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_OPACITY_25, L"Opacity 25%");
+            AppendMenuW(hSubMenuLayers, MF_STRING, LAYER_CLEAR_CONTENT, L"Clear Layer");
+
+            AppendMenuW(hMenu, MF_POPUP, (UINT_PTR)hSubMenuLayers, L"Layers");
+
+            AppendMenuW(hSubMenuSelect, MF_STRING, MODE_SELECT_RECTANGLE, L"Rectangle Select");
+            AppendMenuW(hSubMenuSelect, MF_STRING, MODE_SELECT_ELLIPSE, L"Ellipse Select");
+            AppendMenuW(hSubMenuSelect, MF_STRING, MODE_MAGIC_WAND, L"Magic Wand");
+            AppendMenuW(hSubMenuSelect, MF_SEPARATOR, 0, NULL);
+            AppendMenuW(hSubMenuSelect, MF_STRING, SELECT_ALL, L"Select All");
+            AppendMenuW(hSubMenuSelect, MF_SEPARATOR, 0, NULL);
+            AppendMenuW(hSubMenuSelect, MF_STRING, FLOAT_SELECTION, L"Float Selection");
+            AppendMenuW(hSubMenuSelect, MF_STRING, FLOAT_COMMIT, L"Commit Float");
+            AppendMenuW(hSubMenuSelect, MF_STRING, FLOAT_CANCEL, L"Cancel Float");
+            AppendMenuW(hSubMenuSelect, MF_STRING | (FloatFilter == RESAMPLE_NEAREST ? MF_CHECKED : MF_UNCHECKED), MODE_RESAMPLE_NEAREST, L"Nearest Resampling");
+            AppendMenuW(hSubMenuSelect, MF_STRING | (FloatFilter == RESAMPLE_BILINEAR ? MF_CHECKED : MF_UNCHECKED), MODE_RESAMPLE_BILINEAR, L"Bilinear Resampling");
+            AppendMenuW(hSubMenuSelect, MF_STRING | (FloatFilter == RESAMPLE_LANCZOS ? MF_CHECKED : MF_UNCHECKED), MODE_RESAMPLE_LANCZOS, L"Lanczos Resampling");
+
+            AppendMenuW(hMenu, MF_POPUP, (UINT_PTR)hSubMenuSelect, L"Select");
+
+            AppendMenuW(hSubMenuView, MF_STRING, ZOOM_IN, L"Zoom In");
+            AppendMenuW(hSubMenuView, MF_STRING, ZOOM_OUT, L"Zoom Out");
+            AppendMenuW(hSubMenuView, MF_STRING, ZOOM_ACTUAL_SIZE, L"Actual Size");
+
+            AppendMenuW(hMenu, MF_POPUP, (UINT_PTR)hSubMenuView, L"View");
+
+            AppendMenuW(hSubMenuFilters, MF_STRING, APPLY_BOX_BLUR, L"Box Blur");
+            AppendMenuW(hSubMenuFilters, MF_STRING, APPLY_GAUSSIAN_BLUR, L"Gaussian Blur");
+            AppendMenuW(hSubMenuFilters, MF_STRING, APPLY_SHARPEN, L"Sharpen");
+            AppendMenuW(hSubMenuFilters, MF_SEPARATOR, 0, NULL);
+            AppendMenuW(hSubMenuFilters, MF_STRING, APPLY_INVERT, L"Invert Colors");
+            AppendMenuW(hSubMenuFilters, MF_STRING, APPLY_BRIGHTEN, L"Brighten");
+            AppendMenuW(hSubMenuFilters, MF_STRING, APPLY_DARKEN, L"Darken");
+            AppendMenuW(hSubMenuFilters, MF_STRING, APPLY_MORE_CONTRAST, L"More Contrast");
+            AppendMenuW(hSubMenuFilters, MF_STRING, APPLY_LESS_CONTRAST, L"Less Contrast");
+            AppendMenuW(hSubMenuFilters, MF_STRING, APPLY_THRESHOLD, L"Threshold");
+
+            AppendMenuW(hMenu, MF_POPUP, (UINT_PTR)hSubMenuFilters, L"Filters");
+
             AppendMenuW(hMenu, MF_STRING, COLOR_WEEL, L"Color Weel");
+            AppendMenuW(hMenu, MF_STRING, OPEN_IMAGE, L"Open Image");
             AppendMenuW(hMenu, MF_STRING, SAVE_IMAGE, L"Save Image");
 
             SetMenu(Window, hMenu);
@@ -480,6 +596,12 @@ LRESULT CALLBACK WindowProc(HWND Window, UINT Message, WPARAM WParam, LPARAM LPa
             break;
         }
         case WM_COMMAND: {
+            // Other than the view and the float's own commands, everything
+            // puts a floating region down first.
+            if ((int)WParam != FLOAT_CANCEL && ((int)WParam < MODE_RESAMPLE_NEAREST || (int)WParam > MODE_RESAMPLE_LANCZOS)
+                && (int)WParam != ZOOM_IN && (int)WParam != ZOOM_OUT && (int)WParam != ZOOM_ACTUAL_SIZE) {
+                CommitFloating();
+            }
             switch (WParam) {
             case LINE_WIDTH_PLUS: {
                 if (LineWidth >= 50) {
@@ -527,10 +649,95 @@ LRESULT CALLBACK WindowProc(HWND Window, UINT Message, WPARAM WParam, LPARAM LPa
                 Pencil = CIRCLE_FILLED;
                 break;
             }
+            case MODE_ELLIPSE: {
+                Pencil = ELLIPSE;
+                break;
+            }
+            case MODE_ELLIPSE_FILLED: {
+                Pencil = ELLIPSE_FILLED;
+                break;
+            }
             case MODE_STRAIGHT_LINE: {
                 Pencil = STRAIGHT_LINE;
 			    break;
             }
+            case MODE_GRADIENT_LINEAR: {
+                Pencil = LINEAR_GRADIENT;
+                break;
+            }
+            case MODE_GRADIENT_RADIAL: {
+                Pencil = RADIAL_GRADIENT;
+                break;
+            }
+            case MODE_SELECT_RECTANGLE: {
+                Pencil = SELECT_RECTANGLE;
+                break;
+            }
+            case MODE_SELECT_ELLIPSE: {
+                Pencil = SELECT_ELLIPSE;
+                break;
+            }
+            case MODE_MAGIC_WAND: {
+                Pencil = MAGIC_WAND;
+                break;
+            }
+            case SELECT_ALL: {
+                SetSelection(nullptr);
+                break;
+            }
+            case FLOAT_SELECTION: {
+                FloatSelection();
+                break;
+            }
+            case FLOAT_COMMIT: {
+                CommitFloating();
+                break;
+            }
+            case FLOAT_CANCEL: {
+                CancelFloating();
+                break;
+            }
+            case MODE_RESAMPLE_NEAREST:
+            case MODE_RESAMPLE_BILINEAR:
+            case MODE_RESAMPLE_LANCZOS: {
+                FloatFilter = (ResampleFilter)((int)WParam - MODE_RESAMPLE_NEAREST);
+                for (int Item = MODE_RESAMPLE_NEAREST; Item <= MODE_RESAMPLE_LANCZOS; Item++) {
+                    CheckMenuItem(GetMenu(Window), Item, MF_BYCOMMAND | (Item == (int)WParam ? MF_CHECKED : MF_UNCHECKED));
+                }
+                if (IsFloating) {
+                    PlaceRegion(Floating, ActiveCanvas(), Floating.Placement, FloatFilter);
+                }
+                break;
+            }
+            case ZOOM_IN: {
+                ZoomView(View.Zoom + 1, ClientWidth / 2, ClientHeight / 2);
+                break;
+            }
+            case ZOOM_OUT: {
+                ZoomView(View.Zoom - 1, ClientWidth / 2, ClientHeight / 2);
+                break;
+            }
+            case ZOOM_ACTUAL_SIZE: {
+                SetView({});
+                break;
+            }
+            case GRADIENT_DITHER: {
+                GradientDither = !GradientDither;
+                CheckMenuItem(GetMenu(Window), GRADIENT_DITHER, MF_BYCOMMAND | (GradientDither ? MF_CHECKED : MF_UNCHECKED));
+                break;
+            }
+            case FILL_TOLERANCE_EXACT: {
+                FillToleranceSetting = { TOLERANCE_EXACT, 0 };
+                break;
+            }
+            case FILL_TOLERANCE_CHANNEL: {
+                FillToleranceSetting = { TOLERANCE_CHANNEL, FILL_CHANNEL_TOLERANCE };
+                break;
+            }
+            case FILL_TOLERANCE_DISTANCE: {
+                FillToleranceSetting = { TOLERANCE_DISTANCE, FILL_DISTANCE_TOLERANCE };
+                break;
+            }
             case MODE_BRUSH_ROUND: {
                 CurrentBrushShape = ROUND_BRUSH;
                 break;
@@ -539,12 +746,102 @@ LRESULT CALLBACK WindowProc(HWND Window, UINT Message, WPARAM WParam, LPARAM LPa
                 CurrentBrushShape = SQUARE_BRUSH;
                 break;
             }
+            case ANTI_ALIASING: {
+                AntiAliasing = !AntiAliasing;
+                CheckMenuItem(GetMenu(Window), ANTI_ALIASING, MF_BYCOMMAND | (AntiAliasing ? MF_CHECKED : MF_UNCHECKED));
+                break;
+            }
+            case BRUSH_OPACITY_100:
+            case BRUSH_OPACITY_75:
+            case BRUSH_OPACITY_50:
+            case BRUSH_OPACITY_25: {
+                int Percent = 100 - 25 * ((int)WParam - BRUSH_OPACITY_100);
+                BrushOpacity = (uint8_t)(Percent * 255 / 100);
+                CheckMenuRadioItem(GetMenu(Window), BRUSH_OPACITY_100, BRUSH_OPACITY_25, (UINT)WParam, MF_BYCOMMAND);
+                break;
+            }
+            case MODE_BLEND_NORMAL:
+            case MODE_BLEND_MULTIPLY:
+            case MODE_BLEND_SCREEN:
+            case MODE_BLEND_ADD: {
+                CurrentBlendMode = (BlendMode)((int)WParam - MODE_BLEND_NORMAL);
+                CheckMenuRadioItem(GetMenu(Window), MODE_BLEND_NORMAL, MODE_BLEND_ADD, (UINT)WParam, MF_BYCOMMAND);
+                break;
+            }
             case FLIP_SCREEN_HORIZONTAL: {
-			    FlipScreenHorizontal();
+			    Draw({ .Kind = RASTER_FLIP_HORIZONTAL });
+			    SaveDrawingState();
 			    break;
 		    }
             case FLIP_SCREEN_VERTICAL: {
-                FlipScreenVertical();
+                Draw({ .Kind = RASTER_FLIP_VERTICAL });
+                SaveDrawingState();
+                break;
+            }
+            case ROTATE_SCREEN_90: {
+                TransformLayers(TRANSFORM_ROTATE_90);
+                break;
+            }
+            case ROTATE_SCREEN_180: {
+                TransformLayers(TRANSFORM_ROTATE_180);
+                break;
+            }
+            case ROTATE_SCREEN_270: {
+                TransformLayers(TRANSFORM_ROTATE_270);
+                break;
+            }
+            case TRANSPOSE_SCREEN: {
+                TransformLayers(TRANSFORM_TRANSPOSE);
+                break;
+            }
+            case APPLY_BOX_BLUR: {
+                FilterLayer({ .Kind = FILTER_BOX_BLUR, .Radius = 4 });
+                break;
+            }
+            case APPLY_GAUSSIAN_BLUR: {
+                FilterLayer({ .Kind = FILTER_GAUSSIAN_BLUR, .Radius = 4 });
+                break;
+            }
+            case APPLY_SHARPEN: {
+                FilterLayer({ .Kind = FILTER_UNSHARP_MASK, .Radius = 2, .Amount = 100 });
+                break;
+            }
+            case APPLY_INVERT: {
+                FilterLayer({ .Kind = FILTER_INVERT });
+                break;
+            }
+            case APPLY_BRIGHTEN:
+            case APPLY_DARKEN: {
+                FilterLayer({ .Kind = FILTER_BRIGHTNESS_CONTRAST, .Brightness = (int)WParam == APPLY_BRIGHTEN ? 20 : -20 });
+                break;
+            }
+            case APPLY_MORE_CONTRAST:
+            case APPLY_LESS_CONTRAST: {
+                FilterLayer({ .Kind = FILTER_BRIGHTNESS_CONTRAST, .Contrast = (int)WParam == APPLY_MORE_CONTRAST ? 125 : 80 });
+                break;
+            }
+            case APPLY_THRESHOLD: {
+                FilterLayer({ .Kind = FILTER_THRESHOLD, .Level = 128 });
+                break;
+            }
+            case VALIDATE_DRAWING: {
+                SetValidation(Validator, ActiveCanvas(), !Validator.Enabled);
+                CheckMenuItem(GetMenu(Window), VALIDATE_DRAWING, MF_BYCOMMAND | (Validator.Enabled ? MF_CHECKED : MF_UNCHECKED));
+                break;
+            }
+            case RECORD_TRACE: {
+                // Recording starts afresh; stopping writes what was recorded.
+                if (!IsTracing()) {
+                    ResetTrace();
+                    SetTracing(true);
+                }
+                else {
+                    SetTracing(false);
+                    bool Written = WriteTraceJson("paint_trace.json") && WriteTraceSummary("paint_trace.csv");
+                    MessageBox(NULL, Written ? L"Trace written to paint_trace.json, summary to paint_trace.csv" : L"Could not write the trace",
+                        L"Info", MB_OK | (Written ? MB_ICONINFORMATION : MB_ICONERROR));
+                }
+                CheckMenuItem(GetMenu(Window), RECORD_TRACE, MF_BYCOMMAND | (IsTracing() ? MF_CHECKED : MF_UNCHECKED));
                 break;
             }
             case LINE_WIDTH_CHECK: {
@@ -571,14 +868,67 @@ LRESULT CALLBACK WindowProc(HWND Window, UINT Message, WPARAM WParam, LPARAM LPa
                     int red = GetRValue(colorRGB);
                     int green = GetGValue(colorRGB);
                     int blue = GetBValue(colorRGB);
-                    color = (static_cast<unsigned long long>((DWORD)red) << 16) | (static_cast<size_t>((DWORD)green) << 8) | blue;
+                    color = ((u32)red << 16) | ((u32)green << 8) | (u32)blue;
                 }
                 break;
             }
+            case OPEN_IMAGE: {
+                OpenImage(Window);
+                break;
+            }
             case SAVE_IMAGE: {
-                if (SaveImage("saved_image.bmp")) {
-                    MessageBox(NULL, L"Image saved", L"Info", MB_OK);
+                SaveImage(Window);
+                break;
+            }
+            case LAYER_ADD: {
+                SaveDrawingState();
+                if (!AddLayer(Layers)) {
+                    MessageBox(NULL, L"Can't add more layers", L"Error", MB_OK | MB_ICONERROR);
                 }
+                SyncValidator(Validator, ActiveCanvas());
+                break;
+            }
+            case LAYER_REMOVE: {
+                SaveDrawingState();
+                if (!RemoveLayer(Layers)) {
+                    MessageBox(NULL, L"The last layer can't be removed", L"Error", MB_OK | MB_ICONERROR);
+                }
+                SyncValidator(Validator, ActiveCanvas());
+                break;
+            }
+            case LAYER_SELECT_ABOVE: {
+                SelectLayer(Layers.Active + 1);
+                break;
+            }
+            case LAYER_SELECT_BELOW: {
+                SelectLayer(Layers.Active - 1);
+                break;
+            }
+            case LAYER_MOVE_UP: {
+                MoveLayer(Layers, 1);
+                break;
+            }
+            case LAYER_MOVE_DOWN: {
+                MoveLayer(Layers, -1);
+                break;
+            }
+            case LAYER_TOGGLE_VISIBLE: {
+                SetLayerVisible(Layers, Layers.Active, !ActiveLayer(Layers).Visible);
+                break;
+            }
+            case LAYER_OPACITY_100:
+            case LAYER_OPACITY_75:
+            case LAYER_OPACITY_50:
+            case LAYER_OPACITY_25: {
+                int Percent = 100 - 25 * ((int)WParam - LAYER_OPACITY_100);
+                SetLayerOpacity(Layers, Layers.Active, (uint8_t)(Percent * 255 / 100));
+                break;
+            }
+            case LAYER_CLEAR_CONTENT: {
+                // The bottom layer clears to the background, the rest to nothing.
+                u32 Clear = Layers.Active == 0 ? BackgroundColor : LAYER_CLEAR;
+                Draw({ .Kind = RASTER_CLEAR, .Color = Clear });
+                SaveDrawingState();
                 break;
             }
             }
@@ -588,12 +938,76 @@ LRESULT CALLBACK WindowProc(HWND Window, UINT Message, WPARAM WParam, LPARAM LPa
         PostQuitMessage(0);
     }
                    break;
+    case WM_EXPORT_PROGRESS: {
+        wchar_t title[64];
+        swprintf(title, 64, L"Drawing Pixels - Saving %d%%", (int)WParam);
+        SetWindowTextW(Window, title);
+        break;
+    }
+    case WM_EXPORT_DONE: {
+        FinishExport(Export);
+        SetWindowTextW(Window, L"Drawing Pixels");
+        if (LParam) {
+            MessageBox(NULL, L"Image saved", L"Info", MB_OK);
+        }
+        else {
+            MessageBox(NULL, L"Image could not be saved", L"Error", MB_OK | MB_ICONERROR);
+        }
+        break;
+    }
+    case WM_SIZE: {
+        // Sizes arrive while the window is created, before there is anything
+        // to resize, and minimizing reports a size of zero.
+        if (!Memory.Data || WParam == SIZE_MINIMIZED) {
+            break;
+        }
+        ClientWidth = LOWORD(LParam);
+        ClientHeight = HIWORD(LParam);
+        if (!FitFramebuffer()) {
+            MessageBox(NULL, L"Not enough memory for the window", L"Error", MB_OK | MB_ICONERROR);
+            PostQuitMessage(1);
+            break;
+        }
+        InitDamageTracker(Damage, ClientWidth, ClientHeight);
+        AddDamage(Damage, { 0, 0, ClientWidth, ClientHeight });
+        // While dragging, the canvas only grows once the drag ends.
+        if (!IsSizing) {
+            GrowCanvasToWindow();
+        }
+        break;
+    }
+    case WM_ENTERSIZEMOVE: {
+        IsSizing = true;
+        break;
+    }
+    case WM_EXITSIZEMOVE: {
+        IsSizing = false;
+        GrowCanvasToWindow();
+        break;
+    }
+    case WM_PAINT: {
+        // Whatever the system invalidated gets presented with the next frame.
+        PAINTSTRUCT Paint;
+        BeginPaint(Window, &Paint);
+        AddDamage(Damage, { Paint.rcPaint.left, Paint.rcPaint.top, Paint.rcPaint.right, Paint.rcPaint.bottom });
+        EndPaint(Window, &Paint);
+        break;
+    }
     case WM_KEYDOWN: {
         static bool isF2Pressed = false;
         switch (WParam) {
         case VK_ESCAPE: {
+            // With a region floating, Escape only drops it back.
+            if (IsFloating) {
+                CancelFloating();
+                break;
+            }
             DestroyWindow(Window);
         }
+        case VK_RETURN: {
+            CommitFloating();
+            break;
+        }
         case VK_OEM_PLUS: {
             if (LineWidth >= 50) {
                 MessageBox(NULL, L"Line width can't be more than 50", L"Error", MB_OK | MB_ICONERROR);
@@ -625,7 +1039,8 @@ LRESULT CALLBACK WindowProc(HWND Window, UINT Message, WPARAM WParam, LPARAM LPa
             break;
         }
         case VK_F4: { // TEST FUNC
-            DrawStraightLine(300, 100, 500, 700, color, LineWidth);
+            Draw({ .Kind = RASTER_LINE, .X = 300, .Y = 100, .X2 = 500, .Y2 = 700, .Color = color, .LineWidth = LineWidth, .Brush = CurrentBrushShape, .AntiAlias = AntiAliasing });
+            SaveDrawingState();
             break;
         }
         break;
@@ -641,19 +1056,31 @@ LRESULT CALLBACK WindowProc(HWND Window, UINT Message, WPARAM WParam, LPARAM LPa
         break;
     }
     case WM_LBUTTONDOWN: {
-        SaveDrawingState();
+        if (IsFloating) {
+            IsFloatDragging = true;
+            FloatStart = Floating.Placement;
+            ScreenToCanvas(View, (float)GET_X_LPARAM(LParam), (float)GET_Y_LPARAM(LParam), FloatDragX, FloatDragY);
+            SetCapture(Window);
+            break;
+        }
+        BeginStroke();
         if (Pencil == FILL) {
-            int X = LOWORD(LParam);
-            int Y = HIWORD(LParam);
-            FloodFill(X, Y, color);
+            int X = CanvasMouseX(LParam);
+            int Y = CanvasMouseY(LParam);
+            Draw({ .Kind = RASTER_FLOOD_FILL, .X = X, .Y = Y, .Color = color, .Tolerance = FillToleranceSetting });
         }
-        if (Pencil == RECTANGLE || Pencil == CIRCLE || Pencil == RECTANGLE_FILLED || Pencil == CIRCLE_FILLED) {
-            int PrevX = LOWORD(LParam);
-            int PrevY = HIWORD(LParam);
+        if (Pencil == MAGIC_WAND) {
+            int X = CanvasMouseX(LParam);
+            int Y = CanvasMouseY(LParam);
+            SetSelection(std::make_shared<const SelectionMask>(SelectSimilar(ActiveCanvas(), X, Y, FillToleranceSetting)));
+        }
+        if (Pencil == RECTANGLE || Pencil == CIRCLE || Pencil == RECTANGLE_FILLED || Pencil == CIRCLE_FILLED || Pencil == ELLIPSE || Pencil == ELLIPSE_FILLED) {
+            int PrevX = CanvasMouseX(LParam);
+            int PrevY = CanvasMouseY(LParam);
         }
         if (Pencil == DRAW) {
-            int X = LOWORD(LParam);
-            int Y = HIWORD(LParam);
+            int X = CanvasMouseX(LParam);
+            int Y = CanvasMouseY(LParam);
 
             if (IsShiftPressed) {
                 PrevX = X;
@@ -661,23 +1088,28 @@ LRESULT CALLBACK WindowProc(HWND Window, UINT Message, WPARAM WParam, LPARAM LPa
             }
         }
         IsDrawing = true;
-        PrevX = LOWORD(LParam);
-        PrevY = HIWORD(LParam);
+        PrevX = CanvasMouseX(LParam);
+        PrevY = CanvasMouseY(LParam);
+        if ((Pencil == DRAW && !IsShiftPressed) || Pencil == RAINBOW) {
+            BeginSmoothInput(Window, GET_X_LPARAM(LParam), GET_Y_LPARAM(LParam));
+        }
     }
     break;
     case WM_RBUTTONUP: {
+        int X = CanvasMouseX(LParam);
+        int Y = CanvasMouseY(LParam);
+
+        Draw({ .Kind = RASTER_LINE, .X = PrevX, .Y = PrevY, .X2 = X, .Y2 = Y, .Color = color, .LineWidth = LineWidth, .Brush = CurrentBrushShape, .AntiAlias = AntiAliasing });
         SaveDrawingState();
-        int X = LOWORD(LParam);
-        int Y = HIWORD(LParam);
 
-        DrawStraightLine(PrevX, PrevY, X, Y, color, LineWidth);
-    
         IsDrawing = false;
     }
     break;
     case WM_RBUTTONDOWN: {
-        int X = LOWORD(LParam);
-        int Y = HIWORD(LParam);
+        CommitFloating();
+        BeginStroke();
+        int X = CanvasMouseX(LParam);
+        int Y = CanvasMouseY(LParam);
 
         PrevX = X;
         PrevY = Y;
@@ -685,52 +1117,123 @@ LRESULT CALLBACK WindowProc(HWND Window, UINT Message, WPARAM WParam, LPARAM LPa
     break;
 
     case WM_LBUTTONUP: {
-        if (Pencil == RECTANGLE || Pencil == RECTANGLE_FILLED || Pencil == CIRCLE || Pencil == CIRCLE_FILLED) {
-            int X = LOWORD(LParam);
-            int Y = HIWORD(LParam);
+        // The drag ends with the region drawn with the filter it was chosen.
+        if (IsFloatDragging) {
+            float X, Y;
+            ScreenToCanvas(View, (float)GET_X_LPARAM(LParam), (float)GET_Y_LPARAM(LParam), X, Y);
+            IsFloatDragging = false;
+            IsPlacementPending = false;
+            ReleaseCapture();
+            PlaceRegion(Floating, ActiveCanvas(), DraggedPlacement(X, Y, WParam), FloatFilter);
+            break;
+        }
+        if (IsSmoothing) {
+            DrawQueuedInput(true);
+            PrevX = StrokeX;
+            PrevY = StrokeY;
+        }
+        if (Pencil == RECTANGLE || Pencil == RECTANGLE_FILLED || Pencil == CIRCLE || Pencil == CIRCLE_FILLED || Pencil == ELLIPSE || Pencil == ELLIPSE_FILLED) {
+            int X = CanvasMouseX(LParam);
+            int Y = CanvasMouseY(LParam);
 
             if (Pencil == RECTANGLE) {
-                DrawRectangle(PrevX, PrevY, X - PrevX, Y - PrevY, color, LineWidth, false);
+                Draw({ .Kind = RASTER_RECTANGLE, .X = PrevX, .Y = PrevY, .Width = X - PrevX, .Height = Y - PrevY, .Color = color, .LineWidth = LineWidth, .Filled = false });
             }
             else if (Pencil == RECTANGLE_FILLED) {
-                DrawRectangle(PrevX, PrevY, X - PrevX, Y - PrevY, color, LineWidth, true);
+                Draw({ .Kind = RASTER_RECTANGLE, .X = PrevX, .Y = PrevY, .Width = X - PrevX, .Height = Y - PrevY, .Color = color, .LineWidth = LineWidth, .Filled = true });
             }
             else if (Pencil == CIRCLE) {
                 int Radius = static_cast<int>(sqrt(pow(X - PrevX, 2) + pow(Y - PrevY, 2)));
-                DrawCircle(PrevX, PrevY, Radius, color, LineWidth, false);
+                Draw({ .Kind = RASTER_CIRCLE, .X = PrevX, .Y = PrevY, .Radius = Radius, .Color = color, .LineWidth = LineWidth, .Filled = false, .AntiAlias = AntiAliasing });
             }
             else if (Pencil == CIRCLE_FILLED) {
                 int Radius = static_cast<int>(sqrt(pow(X - PrevX, 2) + pow(Y - PrevY, 2)));
-                DrawCircle(PrevX, PrevY, Radius, color, LineWidth, true);
+                Draw({ .Kind = RASTER_CIRCLE, .X = PrevX, .Y = PrevY, .Radius = Radius, .Color = color, .LineWidth = LineWidth, .Filled = true, .AntiAlias = AntiAliasing });
+            }
+            else if (Pencil == ELLIPSE) {
+                Draw({ .Kind = RASTER_ELLIPSE, .X = PrevX, .Y = PrevY, .Width = X - PrevX, .Height = Y - PrevY, .Color = color, .LineWidth = LineWidth, .Filled = false });
+            }
+            else if (Pencil == ELLIPSE_FILLED) {
+                Draw({ .Kind = RASTER_ELLIPSE, .X = PrevX, .Y = PrevY, .Width = X - PrevX, .Height = Y - PrevY, .Color = color, .LineWidth = LineWidth, .Filled = true });
             }
         } else if (Pencil == DRAW && IsShiftPressed) {
-            int X = LOWORD(LParam);
-            int Y = HIWORD(LParam);
+            int X = CanvasMouseX(LParam);
+            int Y = CanvasMouseY(LParam);
 
-            DrawStraightLine(PrevX, PrevY, X, Y, color, LineWidth);
+            Draw({ .Kind = RASTER_LINE, .X = PrevX, .Y = PrevY, .X2 = X, .Y2 = Y, .Color = color, .LineWidth = LineWidth, .Brush = CurrentBrushShape, .AntiAlias = AntiAliasing });
+        }
+        else if (Pencil == LINEAR_GRADIENT || Pencil == RADIAL_GRADIENT) {
+            int X = CanvasMouseX(LParam);
+            int Y = CanvasMouseY(LParam);
+
+            // Like the transforms, gradients aren't reference-rasterized; the
+            // validator just takes the result.
+            GradientShape Shape = Pencil == LINEAR_GRADIENT ? GRADIENT_LINEAR : GRADIENT_RADIAL;
+            Canvas& Target = ActiveCanvas();
+            Target.Selection = Selection;
+            FillGradient(Target, { Shape, PrevX, PrevY, X, Y, color, BackgroundColor, GradientDither, BrushOpacity });
+            Target.Selection.reset();
+            SyncValidator(Validator, Target);
         }
+        else if (Pencil == SELECT_RECTANGLE || Pencil == SELECT_ELLIPSE) {
+            int X = CanvasMouseX(LParam);
+            int Y = CanvasMouseY(LParam);
+            const Canvas& Target = ActiveCanvas();
+
+            // A click without a drag selects nothing, which lets drawing go
+            // anywhere again.
+            if (X == PrevX || Y == PrevY) {
+                SetSelection(nullptr);
+            }
+            else if (Pencil == SELECT_RECTANGLE) {
+                PixelRect Rect = { PrevX < X ? PrevX : X, PrevY < Y ? PrevY : Y, PrevX < X ? X : PrevX, PrevY < Y ? Y : PrevY };
+                SetSelection(std::make_shared<const SelectionMask>(SelectRectangle(Target.Width, Target.Height, Rect)));
+            }
+            else {
+                SetSelection(std::make_shared<const SelectionMask>(SelectEllipse(Target.Width, Target.Height, PrevX, PrevY, X - PrevX, Y - PrevY)));
+            }
+        }
+        SaveDrawingState();
         IsDrawing = false;
     }
     break;
+    case WM_MBUTTONDOWN: {
+        // Dragging with the middle button pans.
+        IsPanning = true;
+        PanX = GET_X_LPARAM(LParam);
+        PanY = GET_Y_LPARAM(LParam);
+        SetCapture(Window);
+        break;
+    }
+    case WM_MBUTTONUP: {
+        IsPanning = false;
+        ReleaseCapture();
+        break;
+    }
+    case WM_MOUSEWHEEL: {
+        // Each notch is one zoom step about the point under the mouse, which
+        // comes in screen coordinates.
+        POINT Point = { GET_X_LPARAM(LParam), GET_Y_LPARAM(LParam) };
+        ScreenToClient(Window, &Point);
+        ZoomView(View.Zoom + (GET_WHEEL_DELTA_WPARAM(WParam) > 0 ? 1 : -1), Point.x, Point.y);
+        break;
+    }
     case WM_MOUSEMOVE: {
-        if (IsDrawing && Pencil == DRAW && !IsShiftPressed) {
-            int X = LOWORD(LParam);
-            int Y = HIWORD(LParam);
-            DrawLine(PrevX, PrevY, X, Y, color, LineWidth);
-            PrevX = X;
-            PrevY = Y;
-        }
-        if (IsDrawing && Pencil == RAINBOW) {
-            int X = LOWORD(LParam);
-            int Y = HIWORD(LParam);
-            rainbowHue += 0.01f;
-            if (rainbowHue > 1.0f) {
-                rainbowHue = 0.0f;
-            }
-            COLORREF rainbowColor = HSVToRGB(rainbowHue, 1.0f, 1.0f);
-            DrawLine(PrevX, PrevY, X, Y, rainbowColor, LineWidth);
-            PrevX = X;
-            PrevY = Y;
+        if (IsPanning) {
+            int X = GET_X_LPARAM(LParam);
+            int Y = GET_Y_LPARAM(LParam);
+            SetView({ View.Zoom, View.OffsetX + X - PanX, View.OffsetY + Y - PanY });
+            PanX = X;
+            PanY = Y;
+        }
+        if (IsFloatDragging) {
+            float X, Y;
+            ScreenToCanvas(View, (float)GET_X_LPARAM(LParam), (float)GET_Y_LPARAM(LParam), X, Y);
+            PendingPlacement = DraggedPlacement(X, Y, WParam);
+            IsPlacementPending = true;
+        }
+        if (IsDrawing && IsSmoothing && !(Pencil == DRAW && IsShiftPressed)) {
+            QueueMouseMove(Window, GET_X_LPARAM(LParam), GET_Y_LPARAM(LParam));
         }
     }
     break;
@@ -763,13 +1266,17 @@ int WINAPI WinMain(HINSTANCE Instance, HINSTANCE PrevInstance, LPSTR Cmd, int Cm
     }
 
     ShowWindow(Window, CmdShow);
+    SetTraceThreadName("main");
 
     RECT Rect;
     GetClientRect(Window, &Rect);
     ClientWidth = Rect.right - Rect.left;
     ClientHeight = Rect.bottom - Rect.top;
 
-    Memory = VirtualAlloc(0, static_cast<unsigned long long>(ClientWidth) * ClientHeight * sizeof(u32), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    size_t MaxWindowBytes = (size_t)GetSystemMetrics(SM_CXMAXTRACK) * GetSystemMetrics(SM_CYMAXTRACK) * sizeof(u32);
+    if (!ReserveMemory(Memory, MaxWindowBytes) || !FitFramebuffer()) {
+        return 1;
+    }
 
     BITMAPINFO BitmapInfo;
     BitmapInfo.bmiHeader.biSize = sizeof(BitmapInfo.bmiHeader);
@@ -781,19 +1288,101 @@ int WINAPI WinMain(HINSTANCE Instance, HINSTANCE PrevInstance, LPSTR Cmd, int Cm
 
     HDC DeviceContext = GetDC(Window);
 
-    ClearScreen(BackgroundColor);
+    // The canvas lives in tiles; Memory only holds what was last presented.
+    InitDamageTracker(Damage, ClientWidth, ClientHeight);
+    InitDamageTracker(CanvasDamage, BMP_MAX_SIDE, BMP_MAX_SIDE);
+    InitLayerStack(Layers, ClientWidth, ClientHeight, BackgroundColor, HISTORY_BUDGET_MB * 1024 * 1024);
+    Layers.Damage = &CanvasDamage;
+
+    // Frames are paced to the display refresh rate and only presented when
+    // something changed; otherwise the loop sleeps until the next message.
+    int RefreshRate = GetDeviceCaps(DeviceContext, VREFRESH);
+    if (RefreshRate <= 1) {
+        RefreshRate = 60;
+    }
+    LARGE_INTEGER Frequency, LastPresent, Now;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&LastPresent);
+    LONGLONG FrameTicks = Frequency.QuadPart / RefreshRate;
+
     for (;;) {
         MSG Message;
         if (PeekMessage(&Message, NULL, 0, 0, PM_REMOVE)) {
-            if (Message.message == WM_QUIT)
+            if (Message.message == WM_QUIT) {
+                FinishExport(Export);
                 break;
+            }
             TranslateMessage(&Message);
             DispatchMessage(&Message);
             continue;
         }
 
-        // Render the drawing from the current state
-        StretchDIBits(DeviceContext, 0, 0, ClientWidth, ClientHeight, 0, 0, ClientWidth, ClientHeight, Memory, &BitmapInfo, DIB_RGB_COLORS, SRCCOPY);
+        if (!HasDamage(Damage) && !HasDamage(CanvasDamage) && !HasLayerChanges(Layers) && PendingInput.empty() && !IsPlacementPending) {
+            // Whatever input there was drew nothing.
+            ForgetTraceInput();
+            WaitMessage();
+            continue;
+        }
+
+        QueryPerformanceCounter(&Now);
+        LONGLONG Remaining = LastPresent.QuadPart + FrameTicks - Now.QuadPart;
+        if (Remaining > 0) {
+            // Keep handling input until the frame is due; more damage may
+            // still be merged into it.
+            DWORD WaitMs = (DWORD)(Remaining * 1000 / Frequency.QuadPart);
+            MsgWaitForMultipleObjects(0, NULL, FALSE, WaitMs, QS_ALLINPUT);
+            continue;
+        }
+        LastPresent = Now;
+
+        TraceScope FrameTrace("Frame");
+        DrawQueuedInput(false);
+        // Lanczos can't keep up with a drag; bilinear stands in for it until
+        // the button is let go.
+        if (IsPlacementPending) {
+            IsPlacementPending = false;
+            PlaceRegion(Floating, ActiveCanvas(), PendingPlacement, FloatFilter == RESAMPLE_LANCZOS ? RESAMPLE_BILINEAR : FloatFilter);
+        }
+
+        // Layer changes reach CanvasDamage as the composite tiles they
+        // rewrote. The pyramid only catches up with them while it is shown.
+        UpdateComposite(Layers);
+        std::vector<PixelRect> Changed = TakeDamage(CanvasDamage);
+        MarkMipsStale(Mips, Changed);
+        for (const PixelRect& Rect : Changed) {
+            AddDamage(Damage, CanvasToScreen(View, Rect));
+        }
+        if (View.Zoom < 0) {
+            UpdateMipPyramid(Mips, Layers.Composite, -View.Zoom);
+        }
+
+        // Present only the damaged rectangles. Each one is resolved from the
+        // tiles into Memory and handed to GDI as a bitmap of just its rows so
+        // nothing outside it is converted.
+        TraceScope PresentTrace("Present");
+        int64_t Presented = 0;
+        for (const PixelRect& Rect : TakeDamage(Damage)) {
+            int Width = Rect.X1 - Rect.X0;
+            int Height = Rect.Y1 - Rect.Y0;
+            Presented += (int64_t)Width * Height;
+            u32* Rows = (u32*)Memory.Data + (size_t)Rect.Y0 * ClientWidth;
+            PresentViewport(View, Layers.Composite, Mips, Rect, Rows + Rect.X0, ClientWidth, BackgroundColor);
+            BitmapInfo.bmiHeader.biWidth = ClientWidth;
+            BitmapInfo.bmiHeader.biHeight = -Height;
+            StretchDIBits(DeviceContext, Rect.X0, Rect.Y0, Width, Height, Rect.X0, 0, Width, Height, Rows, &BitmapInfo, DIB_RGB_COLORS, SRCCOPY);
+        }
+        // The selection's bounds, drawn over whatever was just presented.
+        if (Selection && Presented > 0) {
+            PixelRect Bounds = CanvasToScreen(View, Selection->Bounds);
+            RECT Outline = { Bounds.X0, Bounds.Y0, Bounds.X1, Bounds.Y1 };
+            FrameRect(DeviceContext, &Outline, (HBRUSH)GetStockObject(GRAY_BRUSH));
+        }
+        if (IsFloating && Presented > 0) {
+            PixelRect Bounds = CanvasToScreen(View, Floating.Drawn);
+            RECT Outline = { Bounds.X0, Bounds.Y0, Bounds.X1, Bounds.Y1 };
+            FrameRect(DeviceContext, &Outline, (HBRUSH)GetStockObject(WHITE_BRUSH));
+        }
+        TraceFrame(Presented);
     }
     return 0;
 }
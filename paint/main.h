@@ -1,4 +1,13 @@
 #pragma once
+#include "blend.h"
+#include "fill.h"
+#include "filter.h"
+#include "floating.h"
+#include "gradient.h"
+#include "raster.h"
+#include "selection.h"
+#include "transform.h"
+
 constexpr auto LINE_WIDTH_PLUS = 0;
 constexpr auto LINE_WIDTH_MINUS = 1;
 constexpr auto LINE_WIDTH_CHECK = 2;
@@ -22,6 +31,84 @@ constexpr auto COLOR_WEEL = 15;
 
 constexpr auto SAVE_IMAGE = 16;
 
+constexpr auto FILL_TOLERANCE_EXACT = 17;
+constexpr auto FILL_TOLERANCE_CHANNEL = 18;
+constexpr auto FILL_TOLERANCE_DISTANCE = 19;
+
+constexpr auto ROTATE_SCREEN_90 = 20;
+constexpr auto ROTATE_SCREEN_180 = 21;
+constexpr auto ROTATE_SCREEN_270 = 22;
+constexpr auto TRANSPOSE_SCREEN = 23;
+
+constexpr auto OPEN_IMAGE = 24;
+
+constexpr auto VALIDATE_DRAWING = 25;
+
+constexpr auto ANTI_ALIASING = 26;
+
+constexpr auto MODE_ELLIPSE = 27;
+constexpr auto MODE_ELLIPSE_FILLED = 28;
+
+constexpr auto LAYER_ADD = 29;
+constexpr auto LAYER_REMOVE = 30;
+constexpr auto LAYER_SELECT_ABOVE = 31;
+constexpr auto LAYER_SELECT_BELOW = 32;
+constexpr auto LAYER_MOVE_UP = 33;
+constexpr auto LAYER_MOVE_DOWN = 34;
+constexpr auto LAYER_TOGGLE_VISIBLE = 35;
+constexpr auto LAYER_OPACITY_100 = 36;
+constexpr auto LAYER_OPACITY_75 = 37;
+constexpr auto LAYER_OPACITY_50 = 38;
+constexpr auto LAYER_OPACITY_25 = 39;
+constexpr auto LAYER_CLEAR_CONTENT = 40;
+
+constexpr auto BRUSH_OPACITY_100 = 41;
+constexpr auto BRUSH_OPACITY_75 = 42;
+constexpr auto BRUSH_OPACITY_50 = 43;
+constexpr auto BRUSH_OPACITY_25 = 44;
+constexpr auto MODE_BLEND_NORMAL = 45;
+constexpr auto MODE_BLEND_MULTIPLY = 46;
+constexpr auto MODE_BLEND_SCREEN = 47;
+constexpr auto MODE_BLEND_ADD = 48;
+
+constexpr auto RECORD_TRACE = 49;
+
+constexpr auto MODE_GRADIENT_LINEAR = 50;
+constexpr auto MODE_GRADIENT_RADIAL = 51;
+constexpr auto GRADIENT_DITHER = 52;
+
+constexpr auto MODE_SELECT_RECTANGLE = 53;
+constexpr auto MODE_SELECT_ELLIPSE = 54;
+constexpr auto MODE_MAGIC_WAND = 55;
+constexpr auto SELECT_ALL = 56;
+
+constexpr auto ZOOM_IN = 57;
+constexpr auto ZOOM_OUT = 58;
+constexpr auto ZOOM_ACTUAL_SIZE = 59;
+
+constexpr auto APPLY_BOX_BLUR = 60;
+constexpr auto APPLY_GAUSSIAN_BLUR = 61;
+constexpr auto APPLY_SHARPEN = 62;
+constexpr auto APPLY_INVERT = 63;
+constexpr auto APPLY_BRIGHTEN = 64;
+constexpr auto APPLY_DARKEN = 65;
+constexpr auto APPLY_MORE_CONTRAST = 66;
+constexpr auto APPLY_LESS_CONTRAST = 67;
+constexpr auto APPLY_THRESHOLD = 68;
+
+constexpr auto FLOAT_SELECTION = 69;
+constexpr auto FLOAT_COMMIT = 70;
+constexpr auto FLOAT_CANCEL = 71;
+constexpr auto MODE_RESAMPLE_NEAREST = 72;
+constexpr auto MODE_RESAMPLE_BILINEAR = 73;
+constexpr auto MODE_RESAMPLE_LANCZOS = 74;
+
+constexpr int FILL_CHANNEL_TOLERANCE = 24;
+constexpr int FILL_DISTANCE_TOLERANCE = 40;
+
+// Undo steps beyond this are dropped oldest-first.
+constexpr size_t HISTORY_BUDGET_MB = 256;
+
 int LineWidth = 2;
 
 enum PencilState {
@@ -33,12 +120,14 @@ enum PencilState {
     RECTANGLE_FILLED,
     CIRCLE,
     CIRCLE_FILLED,
-    STRAIGHT_LINE
-};
-
-enum BrushShape {
-    ROUND_BRUSH,
-    SQUARE_BRUSH
+    STRAIGHT_LINE,
+    ELLIPSE,
+    ELLIPSE_FILLED,
+    LINEAR_GRADIENT,
+    RADIAL_GRADIENT,
+    SELECT_RECTANGLE,
+    SELECT_ELLIPSE,
+    MAGIC_WAND
 };
 
 enum LineStyle {
@@ -54,11 +143,30 @@ struct RGBColor {
 };
 
 float rainbowHue = 0.0f;
+// The rainbow pencil goes once round the colour wheel every 500 pixels.
+constexpr float RAINBOW_HUE_PER_PIXEL = 0.002f;
 
-size_t BackgroundColor = 0x222222;
-size_t color = 0xffffff;
+u32 BackgroundColor = 0x222222;
+u32 color = 0xffffff;
 
 PencilState Pencil = DRAW;
 
 BrushShape CurrentBrushShape = ROUND_BRUSH;
 
+// Lines and circles get smooth edges; rectangles are always pixel-aligned.
+bool AntiAliasing = false;
+
+// Every stroke is blended with these, fills included.
+uint8_t BrushOpacity = 255;
+BlendMode CurrentBlendMode = BLEND_NORMAL;
+
+FillTolerance FillToleranceSetting = { TOLERANCE_EXACT, 0 };
+
+// Gradients run from the pencil colour where the drag starts to the
+// background colour where it ends.
+bool GradientDither = true;
+
+// How a floating region is resampled once it is put down. While it is being
+// dragged, Lanczos is previewed as bilinear.
+ResampleFilter FloatFilter = RESAMPLE_BILINEAR;
+
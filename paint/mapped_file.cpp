@@ -0,0 +1,92 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+bool MapFile(MappedFile& Mapped, const std::filesystem::path& Path) {
+    UnmapFile(Mapped);
+    HANDLE file = CreateFileW(Path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) {
+        CloseHandle(file);
+        return false;
+    }
+    const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    Mapped.Data = (const uint8_t*)data;
+    Mapped.Size = (size_t)size.QuadPart;
+    Mapped.File = file;
+    Mapped.Mapping = mapping;
+    return true;
+}
+
+void UnmapFile(MappedFile& Mapped) {
+    if (Mapped.Data) {
+        UnmapViewOfFile(Mapped.Data);
+    }
+    if (Mapped.Mapping) {
+        CloseHandle(Mapped.Mapping);
+    }
+    if (Mapped.File) {
+        CloseHandle(Mapped.File);
+    }
+    Mapped = MappedFile();
+}
+
+#else
+
+bool MapFile(MappedFile& Mapped, const std::filesystem::path& Path) {
+    UnmapFile(Mapped);
+    int file = open(Path.c_str(), O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size == 0) {
+        close(file);
+        return false;
+    }
+    void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (data == MAP_FAILED) {
+        close(file);
+        return false;
+    }
+    madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+    Mapped.Data = (const uint8_t*)data;
+    Mapped.Size = (size_t)info.st_size;
+    Mapped.File = file;
+    return true;
+}
+
+void UnmapFile(MappedFile& Mapped) {
+    if (Mapped.Data) {
+        munmap((void*)Mapped.Data, Mapped.Size);
+    }
+    if (Mapped.File >= 0) {
+        close(Mapped.File);
+    }
+    Mapped = MappedFile();
+}
+
+#endif
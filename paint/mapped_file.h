@@ -0,0 +1,20 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <filesystem>
+
+// A read-only view of a whole file. Pages are read in by the OS as they are
+// first touched, so opening costs nothing up front.
+struct MappedFile {
+    const uint8_t* Data = nullptr;
+    size_t Size = 0;
+#ifdef _WIN32
+    void* File = nullptr;
+    void* Mapping = nullptr;
+#else
+    int File = -1;
+#endif
+};
+
+bool MapFile(MappedFile& Mapped, const std::filesystem::path& Path);
+void UnmapFile(MappedFile& Mapped);
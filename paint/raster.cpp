@@ -0,0 +1,189 @@
+#include "raster.h"
+
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "ellipse.h"
+#include "selection.h"
+#include "span.h"
+#include "stroke.h"
+#include "trace.h"
+#include "transform.h"
+
+void FlipScreenHorizontal(Canvas& Target) {
+    TransformCanvas(Target, TRANSFORM_FLIP_HORIZONTAL);
+}
+
+void FlipScreenVertical(Canvas& Target) {
+    TransformCanvas(Target, TRANSFORM_FLIP_VERTICAL);
+}
+
+void DrawPixel(Canvas& Target, int X, int Y, u32 Color) {
+    TraceScope trace("DrawPixel");
+    if (Target.Selection && !IsSelected(*Target.Selection, X, Y)) {
+        return;
+    }
+    if (Target.Blend) {
+        FillSpan(Target, Y, X, X + 1, Color);
+        return;
+    }
+    if (X >= 0 && X < Target.Width && Y >= 0 && Y < Target.Height) {
+        int tile = TileIndex(Target, X, Y);
+        const CanvasTile& current = *Target.Tiles[tile];
+        if (current.Pixels.empty() && current.Uniform == Color) {
+            return;
+        }
+        WritableTile(Target, tile)[(Y & TILE_MASK) * TILE_SIZE + (X & TILE_MASK)] = Color;
+        TracePixelsWritten(1);
+        MarkDirty(Target, X, Y, X + 1, Y + 1);
+    }
+}
+
+void DrawRectangle(Canvas& Target, int X, int Y, int Width, int Height, u32 Color, int LineWidth, bool isFilled) {
+    TraceScope trace("DrawRectangle");
+    int startX, endX, startY, endY;
+
+    if (Width >= 0) {
+        startX = X;
+        endX = X + Width;
+    }
+    else {
+        startX = X + Width;
+        endX = X;
+    }
+
+    if (Height >= 0) {
+        startY = Y;
+        endY = Y + Height;
+    }
+    else {
+        startY = Y + Height;
+        endY = Y;
+    }
+
+    if (isFilled) {
+        FillRect(Target, startX, startY, endX, endY, Color);
+        return;
+    }
+
+    // The four edges as disjoint bands: full-width top and bottom, sides in
+    // between. A line width past half the size just fills the rectangle.
+    int topEnd = std::min(startY + LineWidth, endY);
+    int bottomStart = std::max(endY - LineWidth, topEnd);
+    int leftEnd = std::min(startX + LineWidth, endX);
+    int rightStart = std::max(endX - LineWidth, leftEnd);
+
+    FillRect(Target, startX, startY, endX, topEnd, Color);
+    FillRect(Target, startX, bottomStart, endX, endY, Color);
+    FillRect(Target, startX, topEnd, leftEnd, bottomStart, Color);
+    FillRect(Target, rightStart, topEnd, endX, bottomStart, Color);
+}
+
+// Each pixel is written once: every row is one span, or two either side of
+// the hole. Large shapes go through FillSpans; an ellipse covers about 3/4 of
+// its box.
+static void FillEllipse(Canvas& Target, const Ellipse& E, u32 Color) {
+    bool isLarge = (size_t)(E.Width * E.Height - E.HoleWidth * E.HoleHeight) / 4 * 3 >= PARALLEL_RASTER_PIXELS;
+    std::vector<PixelSpan> spans;
+    int startY = std::max(E.Y0, 0);
+    int endY = std::min(E.Y1, Target.Height);
+    for (int y = startY; y < endY; y++) {
+        int x0, x1, hole0, hole1;
+        if (!EllipseRowSpan(E, y, x0, x1, hole0, hole1)) {
+            continue;
+        }
+        if (isLarge) {
+            AddSpan(Target, spans, y, x0, hole0);
+            AddSpan(Target, spans, y, hole1, x1);
+        }
+        else {
+            FillSpan(Target, y, x0, hole0, Color);
+            FillSpan(Target, y, hole1, x1, Color);
+        }
+    }
+    if (isLarge) {
+        FillSpans(Target, spans, Color);
+    }
+}
+
+void DrawCircle(Canvas& Target, int X, int Y, int Radius, u32 Color, int LineWidth, int isFilled) {
+    TraceScope trace("DrawCircle");
+    FillEllipse(Target, MakeCircle(X, Y, Radius, LineWidth, isFilled), Color);
+}
+
+void DrawEllipse(Canvas& Target, int X, int Y, int Width, int Height, u32 Color, int LineWidth, bool isFilled) {
+    TraceScope trace("DrawEllipse");
+    FillEllipse(Target, MakeEllipse(X, Y, Width, Height, LineWidth, isFilled), Color);
+}
+
+void DrawLine(Canvas& Target, int X1, int Y1, int X2, int Y2, u32 Color, int LineWidth, BrushShape Brush) {
+    TraceScope trace("DrawLine");
+    if (LineWidth / 2 > 0) {
+        Stroke stroke = MakeStroke(X1, Y1, X2, Y2, LineWidth, Brush);
+        int startY = std::max(stroke.Y0, 0);
+        int endY = std::min(stroke.Y1, Target.Height);
+        bool isLarge = (size_t)std::max(endY - startY, 0) * (2 * stroke.Radius + 1) >= PARALLEL_RASTER_PIXELS;
+        std::vector<PixelSpan> spans;
+        for (int y = startY; y < endY; y++) {
+            int x0, x1;
+            if (!StrokeRowSpan(stroke, y, x0, x1)) {
+                continue;
+            }
+            if (isLarge) {
+                AddSpan(Target, spans, y, x0, x1);
+            }
+            else {
+                FillSpan(Target, y, x0, x1, Color);
+            }
+        }
+        if (isLarge) {
+            FillSpans(Target, spans, Color);
+        }
+        return;
+    }
+
+    // One pixel wide: plain Bresenham, flushing each row's run as one span.
+    int dx = abs(X2 - X1);
+    int dy = abs(Y2 - Y1);
+    int sx = (X1 < X2) ? 1 : -1;
+    int sy = (Y1 < Y2) ? 1 : -1;
+    int err = dx - dy;
+    int err2;
+    int runY = Y1;
+    int runMin = X1;
+    int runMax = X1;
+
+    for (;;) {
+        if (Y1 != runY) {
+            FillSpan(Target, runY, runMin, runMax + 1, Color);
+            runY = Y1;
+            runMin = X1;
+            runMax = X1;
+        }
+        runMin = std::min(runMin, X1);
+        runMax = std::max(runMax, X1);
+
+        if (X1 == X2 && Y1 == Y2) {
+            break;
+        }
+
+        err2 = 2 * err;
+
+        if (err2 > -dy) {
+            err -= dy;
+            X1 += sx;
+        }
+
+        if (err2 < dx) {
+            err += dx;
+            Y1 += sy;
+        }
+    }
+    FillSpan(Target, runY, runMin, runMax + 1, Color);
+}
+
+void ClearScreen(Canvas& Target, u32 Color) {
+    TraceScope trace("ClearScreen");
+    FillRect(Target, 0, 0, Target.Width, Target.Height, Color);
+}
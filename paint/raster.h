@@ -0,0 +1,22 @@
+#pragma once
+#include "canvas.h"
+
+enum BrushShape {
+    ROUND_BRUSH,
+    SQUARE_BRUSH
+};
+
+void DrawPixel(Canvas& Target, int X, int Y, u32 Color);
+void DrawRectangle(Canvas& Target, int X, int Y, int Width, int Height, u32 Color, int LineWidth, bool isFilled);
+// Every pixel whose distance from (X, Y) rounds to at most Radius, or for an
+// outline to within LineWidth / 2 of it.
+void DrawCircle(Canvas& Target, int X, int Y, int Radius, u32 Color, int LineWidth, int isFilled);
+// The ellipse inscribed in the rectangle DrawRectangle would draw; the outline
+// is LineWidth thick at the ends of the axes.
+void DrawEllipse(Canvas& Target, int X, int Y, int Width, int Height, u32 Color, int LineWidth, bool isFilled);
+// Fills the area Brush sweeps from (X1, Y1) to (X2, Y2), each pixel once.
+void DrawLine(Canvas& Target, int X1, int Y1, int X2, int Y2, u32 Color, int LineWidth, BrushShape Brush);
+void ClearScreen(Canvas& Target, u32 Color);
+
+void FlipScreenHorizontal(Canvas& Target);
+void FlipScreenVertical(Canvas& Target);
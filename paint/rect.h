@@ -0,0 +1,28 @@
+#pragma once
+#include <algorithm>
+
+// Half-open pixel rectangle: covers X0 <= x < X1, Y0 <= y < Y1.
+struct PixelRect {
+    int X0;
+    int Y0;
+    int X1;
+    int Y1;
+};
+
+inline bool IsEmpty(const PixelRect& R) {
+    return R.X0 >= R.X1 || R.Y0 >= R.Y1;
+}
+
+inline PixelRect Intersect(const PixelRect& A, const PixelRect& B) {
+    return { std::max(A.X0, B.X0), std::max(A.Y0, B.Y0), std::min(A.X1, B.X1), std::min(A.Y1, B.Y1) };
+}
+
+inline PixelRect Union(const PixelRect& A, const PixelRect& B) {
+    if (IsEmpty(A)) {
+        return B;
+    }
+    if (IsEmpty(B)) {
+        return A;
+    }
+    return { std::min(A.X0, B.X0), std::min(A.Y0, B.Y0), std::max(A.X1, B.X1), std::max(A.Y1, B.Y1) };
+}
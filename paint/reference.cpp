@@ -0,0 +1,442 @@
+#include "reference.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <utility>
+
+#include "antialias.h"
+#include "ellipse.h"
+#include "stroke.h"
+
+void InitReferenceImage(ReferenceImage& Image, int Width, int Height, u32 Color) {
+    Image.Width = Width;
+    Image.Height = Height;
+    Image.Pixels.assign((size_t)Width * Height, Color);
+}
+
+void CopyCanvasToReference(const Canvas& Source, ReferenceImage& Image) {
+    Image.Width = Source.Width;
+    Image.Height = Source.Height;
+    Image.Pixels.resize((size_t)Source.Width * Source.Height);
+    ResolveCanvas(Source, CanvasBounds(Source), Image.Pixels.data(), Source.Width);
+    Image.Selection = Source.Selection;
+
+    ReferenceEndStroke(Image);
+    if (!Source.Blend) {
+        return;
+    }
+    const BlendedStroke& stroke = *Source.Blend;
+    ReferenceBeginStroke(Image, stroke.Opacity, stroke.Mode);
+    for (int y = 0; y < Image.Height; y++) {
+        for (int x = 0; x < Image.Width; x++) {
+            int tile = TileIndex(Source, x, y);
+            if (!stroke.Before[tile]) {
+                continue;
+            }
+            size_t index = (size_t)y * Image.Width + x;
+            const CanvasTile& before = *stroke.Before[tile];
+            int offset = (y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK);
+            Image.StrokeBefore[index] = before.Pixels.empty() ? before.Uniform : before.Pixels[offset];
+            Image.StrokeCoverage[index] = stroke.Coverage[tile][offset];
+        }
+    }
+}
+
+void ReferenceBeginStroke(ReferenceImage& Image, uint8_t Opacity, BlendMode Mode) {
+    ReferenceEndStroke(Image);
+    if (Opacity == 255 && Mode == BLEND_NORMAL) {
+        return;
+    }
+    Image.IsStroking = true;
+    Image.StrokeOpacity = Opacity;
+    Image.StrokeMode = Mode;
+    Image.StrokeBefore = Image.Pixels;
+    Image.StrokeCoverage.assign(Image.Pixels.size(), 0);
+}
+
+void ReferenceEndStroke(ReferenceImage& Image) {
+    Image.IsStroking = false;
+    Image.StrokeBefore.clear();
+    Image.StrokeCoverage.clear();
+}
+
+static PixelRect ImageBounds(const ReferenceImage& Image) {
+    return { 0, 0, Image.Width, Image.Height };
+}
+
+// X / 255 to the nearest integer; it is never exactly halfway.
+static u32 RoundedDiv255(u32 X) {
+    return (2 * X + 255) / 510;
+}
+
+// The stroke's pixel at the highest coverage it has had, worked out from the
+// pixel before the stroke one channel at a time.
+static void StrokePixel(ReferenceImage& Image, int X, int Y, u32 Color, int Coverage) {
+    size_t index = (size_t)Y * Image.Width + X;
+    uint8_t& highest = Image.StrokeCoverage[index];
+    highest = std::max<uint8_t>(highest, Coverage);
+    u32 before = Image.StrokeBefore[index];
+    u32 a = RoundedDiv255(highest * Image.StrokeOpacity);
+    a += a >> 7;
+    u32 result = 0;
+    for (int channel = 0; channel < 4; channel++) {
+        u32 dest = (before >> (channel * 8)) & 0xff;
+        u32 source = (Color >> (channel * 8)) & 0xff;
+        u32 blended = source;
+        if (channel < 3 && Image.StrokeMode == BLEND_MULTIPLY) {
+            blended = RoundedDiv255(source * dest);
+        }
+        else if (channel < 3 && Image.StrokeMode == BLEND_SCREEN) {
+            blended = source + dest - RoundedDiv255(source * dest);
+        }
+        else if (channel < 3 && Image.StrokeMode == BLEND_ADD) {
+            blended = std::min<u32>(source + dest, 255);
+        }
+        result |= ((blended * a + dest * (256 - a)) >> 8) << (channel * 8);
+    }
+    Image.Pixels[index] = result;
+}
+
+static bool IsWritable(const ReferenceImage& Image, int X, int Y) {
+    if (X < 0 || X >= Image.Width || Y < 0 || Y >= Image.Height) {
+        return false;
+    }
+    return !Image.Selection || IsSelected(*Image.Selection, X, Y);
+}
+
+static void SetPixel(ReferenceImage& Image, int X, int Y, u32 Color) {
+    if (!IsWritable(Image, X, Y)) {
+        return;
+    }
+    if (Image.IsStroking) {
+        StrokePixel(Image, X, Y, Color, 255);
+    }
+    else {
+        Image.Pixels[(size_t)Y * Image.Width + X] = Color;
+    }
+}
+
+PixelRect ReferencePixel(ReferenceImage& Image, int X, int Y, u32 Color) {
+    SetPixel(Image, X, Y, Color);
+    return Intersect({ X, Y, X + 1, Y + 1 }, ImageBounds(Image));
+}
+
+PixelRect ReferenceRectangle(ReferenceImage& Image, int X, int Y, int Width, int Height, u32 Color, int LineWidth, bool isFilled) {
+    int startX = std::min(X, X + Width);
+    int endX = std::max(X, X + Width);
+    int startY = std::min(Y, Y + Height);
+    int endY = std::max(Y, Y + Height);
+
+    // A pixel of the outline is within LineWidth of one of the edges.
+    PixelRect bounds = Intersect({ startX, startY, endX, endY }, ImageBounds(Image));
+    for (int y = bounds.Y0; y < bounds.Y1; y++) {
+        for (int x = bounds.X0; x < bounds.X1; x++) {
+            bool onEdge = x < startX + LineWidth || x >= endX - LineWidth || y < startY + LineWidth || y >= endY - LineWidth;
+            if (isFilled || onEdge) {
+                SetPixel(Image, x, y, Color);
+            }
+        }
+    }
+    return bounds;
+}
+
+// A circle's pixels are those whose distance from the centre, rounded, is
+// Inner to Outer; Inner <= 0 leaves no hole. Rounding never ties: 4 d^2 is
+// even and (2 n + 1)^2 odd.
+static bool InRing(int64_t DX, int64_t DY, int Inner, int Outer) {
+    int64_t distance4 = 4 * (DX * DX + DY * DY);
+    int64_t outer = 2 * (int64_t)Outer + 1;
+    int64_t inner = 2 * (int64_t)Inner - 1;
+    return Outer >= 0 && distance4 < outer * outer && (Inner <= 0 || distance4 > inner * inner);
+}
+
+PixelRect ReferenceCircle(ReferenceImage& Image, int X, int Y, int Radius, u32 Color, int LineWidth, bool isFilled) {
+    int inner, outer;
+    RingBounds(Radius, LineWidth, isFilled, inner, outer);
+    if (outer < 0) {
+        return { 0, 0, 0, 0 };
+    }
+    PixelRect bounds = Intersect({ X - outer, Y - outer, X + outer + 1, Y + outer + 1 }, ImageBounds(Image));
+    for (int y = bounds.Y0; y < bounds.Y1; y++) {
+        for (int x = bounds.X0; x < bounds.X1; x++) {
+            if (InRing(x - X, y - Y, inner, outer)) {
+                SetPixel(Image, x, y, Color);
+            }
+        }
+    }
+    return bounds;
+}
+
+// Inside the ellipse inscribed in a W x H box whose edges sum to SumX and
+// SumY: (PX / W)^2 + (PY / H)^2 <= 1, with PX and PY the pixel centre's
+// offset from the box centre in half pixels.
+static bool InEllipse(int X, int Y, int64_t SumX, int64_t SumY, int64_t W, int64_t H) {
+    if (W <= 0 || H <= 0) {
+        return false;
+    }
+    int64_t px = 2 * (int64_t)X + 1 - SumX;
+    int64_t py = 2 * (int64_t)Y + 1 - SumY;
+    return px * px * H * H + py * py * W * W <= W * W * H * H;
+}
+
+PixelRect ReferenceEllipse(ReferenceImage& Image, int X, int Y, int Width, int Height, u32 Color, int LineWidth, bool isFilled) {
+    int startX = std::min(X, X + Width);
+    int startY = std::min(Y, Y + Height);
+    int64_t w = abs(Width);
+    int64_t h = abs(Height);
+    int64_t sumX = 2 * (int64_t)startX + w;
+    int64_t sumY = 2 * (int64_t)startY + h;
+    // The outline's hole is the ellipse of the box LineWidth in on every side.
+    int64_t holeW = isFilled ? 0 : w - 2 * (int64_t)LineWidth;
+    int64_t holeH = isFilled ? 0 : h - 2 * (int64_t)LineWidth;
+
+    PixelRect bounds = Intersect({ startX, startY, startX + (int)w, startY + (int)h }, ImageBounds(Image));
+    for (int y = bounds.Y0; y < bounds.Y1; y++) {
+        for (int x = bounds.X0; x < bounds.X1; x++) {
+            if (InEllipse(x, y, sumX, sumY, w, h) && !InEllipse(x, y, sumX, sumY, holeW, holeH)) {
+                SetPixel(Image, x, y, Color);
+            }
+        }
+    }
+    return bounds;
+}
+
+// Within Radius of the segment: inside one of the end caps, or beside the
+// segment (projection within it) no further than Radius from its line.
+static bool InRoundStroke(int64_t U, int64_t V, int64_t DX, int64_t DY, int64_t Radius, int64_t CrossLimit) {
+    int64_t r2 = Radius * Radius;
+    if (U * U + V * V <= r2 || (U - DX) * (U - DX) + (V - DY) * (V - DY) <= r2) {
+        return true;
+    }
+    int64_t lengthSquared = DX * DX + DY * DY;
+    int64_t cross = DX * V - DY * U;
+    int64_t dot = DX * U + DY * V;
+    return lengthSquared > 0 && llabs(cross) <= CrossLimit && dot >= 0 && dot <= lengthSquared;
+}
+
+// Inside the square of half-size Radius centred somewhere on the segment:
+// the parameters t in [0, 1] that satisfy each axis form intervals, kept as
+// fractions, and the pixel is covered when they overlap.
+static bool InSquareStroke(int64_t U, int64_t V, int64_t DX, int64_t DY, int64_t Radius) {
+    int64_t loNum = 0, loDen = 1, hiNum = 1, hiDen = 1;
+    int64_t offsets[2] = { U, V };
+    int64_t deltas[2] = { DX, DY };
+    for (int axis = 0; axis < 2; axis++) {
+        int64_t w = offsets[axis];
+        int64_t d = deltas[axis];
+        if (d == 0) {
+            if (llabs(w) > Radius) {
+                return false;
+            }
+            continue;
+        }
+        int64_t a = w - Radius, b = w + Radius;
+        if (d < 0) {
+            a = -(w + Radius);
+            b = -(w - Radius);
+            d = -d;
+        }
+        if (a * loDen > loNum * d) {
+            loNum = a;
+            loDen = d;
+        }
+        if (b * hiDen < hiNum * d) {
+            hiNum = b;
+            hiDen = d;
+        }
+    }
+    return loNum * hiDen <= hiNum * loDen;
+}
+
+PixelRect ReferenceLine(ReferenceImage& Image, int X1, int Y1, int X2, int Y2, u32 Color, int LineWidth, BrushShape Brush) {
+    int radius = LineWidth / 2;
+    if (radius <= 0) {
+        PixelRect bounds = Intersect({ std::min(X1, X2), std::min(Y1, Y2), std::max(X1, X2) + 1, std::max(Y1, Y2) + 1 }, ImageBounds(Image));
+        int dx = abs(X2 - X1);
+        int dy = abs(Y2 - Y1);
+        int sx = (X1 < X2) ? 1 : -1;
+        int sy = (Y1 < Y2) ? 1 : -1;
+        int err = dx - dy;
+        for (;;) {
+            SetPixel(Image, X1, Y1, Color);
+            if (X1 == X2 && Y1 == Y2) {
+                break;
+            }
+            int err2 = 2 * err;
+            if (err2 > -dy) {
+                err -= dy;
+                X1 += sx;
+            }
+            if (err2 < dx) {
+                err += dx;
+                Y1 += sy;
+            }
+        }
+        return bounds;
+    }
+
+    int64_t dx = (int64_t)X2 - X1;
+    int64_t dy = (int64_t)Y2 - Y1;
+    int64_t crossLimit = IntSqrt((int64_t)radius * radius * (dx * dx + dy * dy));
+    PixelRect bounds = Intersect({ std::min(X1, X2) - radius, std::min(Y1, Y2) - radius, std::max(X1, X2) + radius + 1, std::max(Y1, Y2) + radius + 1 }, ImageBounds(Image));
+    for (int y = bounds.Y0; y < bounds.Y1; y++) {
+        for (int x = bounds.X0; x < bounds.X1; x++) {
+            int64_t u = (int64_t)x - X1;
+            int64_t v = (int64_t)y - Y1;
+            bool covered = Brush == ROUND_BRUSH ? InRoundStroke(u, v, dx, dy, radius, crossLimit) : InSquareStroke(u, v, dx, dy, radius);
+            if (covered) {
+                SetPixel(Image, x, y, Color);
+            }
+        }
+    }
+    return bounds;
+}
+
+static void BlendPixel(ReferenceImage& Image, int X, int Y, u32 Color, int Coverage) {
+    if (Coverage == 0 || !IsWritable(Image, X, Y)) {
+        return;
+    }
+    if (Image.IsStroking) {
+        StrokePixel(Image, X, Y, Color, Coverage);
+        return;
+    }
+    u32& pixel = Image.Pixels[(size_t)Y * Image.Width + X];
+    int a = Coverage + (Coverage >> 7);
+    u32 result = 0;
+    for (int channel = 0; channel < 4; channel++) {
+        u32 from = (pixel >> (channel * 8)) & 0xff;
+        u32 to = (Color >> (channel * 8)) & 0xff;
+        result |= ((to * a + from * (256 - a)) >> 8) << (channel * 8);
+    }
+    pixel = result;
+}
+
+PixelRect ReferenceLineAA(ReferenceImage& Image, int X1, int Y1, int X2, int Y2, u32 Color, int LineWidth, BrushShape Brush) {
+    CoverageStroke stroke = MakeCoverageStroke(X1, Y1, X2, Y2, LineWidth, Brush);
+    int radius = stroke.Inner.Radius;
+    int64_t dx = (int64_t)X2 - X1;
+    int64_t dy = (int64_t)Y2 - Y1;
+    int64_t crossLimit = IntSqrt((int64_t)radius * radius * (dx * dx + dy * dy));
+    int reach = radius + 1;
+    PixelRect bounds = Intersect({ std::min(X1, X2) - reach, std::min(Y1, Y2) - reach, std::max(X1, X2) + reach + 1, std::max(Y1, Y2) + reach + 1 }, ImageBounds(Image));
+    for (int y = bounds.Y0; y < bounds.Y1; y++) {
+        for (int x = bounds.X0; x < bounds.X1; x++) {
+            int64_t u = (int64_t)x - X1;
+            int64_t v = (int64_t)y - Y1;
+            bool covered = Brush == ROUND_BRUSH ? InRoundStroke(u, v, dx, dy, radius, crossLimit) : InSquareStroke(u, v, dx, dy, radius);
+            if (covered) {
+                SetPixel(Image, x, y, Color);
+            }
+            else {
+                BlendPixel(Image, x, y, Color, StrokeCoverage(stroke, x, y));
+            }
+        }
+    }
+    return bounds;
+}
+
+PixelRect ReferenceCircleAA(ReferenceImage& Image, int X, int Y, int Radius, u32 Color, int LineWidth, bool isFilled) {
+    int inner, outer;
+    RingBounds(Radius, LineWidth, isFilled, inner, outer);
+    if (outer < 0) {
+        return { 0, 0, 0, 0 };
+    }
+    int reach = outer + 1;
+    PixelRect bounds = Intersect({ X - reach, Y - reach, X + reach + 1, Y + reach + 1 }, ImageBounds(Image));
+    for (int y = bounds.Y0; y < bounds.Y1; y++) {
+        for (int x = bounds.X0; x < bounds.X1; x++) {
+            if (InRing(x - X, y - Y, inner, outer)) {
+                SetPixel(Image, x, y, Color);
+            }
+            else {
+                BlendPixel(Image, x, y, Color, RingCoverage(x - X, y - Y, inner, outer));
+            }
+        }
+    }
+    return bounds;
+}
+
+static bool WithinTolerance(u32 Pixel, u32 Target, FillTolerance Tolerance) {
+    if (Tolerance.Mode == TOLERANCE_EXACT) {
+        return Pixel == Target;
+    }
+    int diff[3];
+    for (int channel = 0; channel < 3; channel++) {
+        diff[channel] = (int)((Pixel >> (channel * 8)) & 0xff) - (int)((Target >> (channel * 8)) & 0xff);
+    }
+    if (Tolerance.Mode == TOLERANCE_CHANNEL) {
+        return abs(diff[0]) <= Tolerance.Amount && abs(diff[1]) <= Tolerance.Amount && abs(diff[2]) <= Tolerance.Amount;
+    }
+    return diff[0] * diff[0] + diff[1] * diff[1] + diff[2] * diff[2] <= Tolerance.Amount * Tolerance.Amount;
+}
+
+// Breadth-first over 4-connected neighbours, one pixel at a time; the region
+// is found completely before any of it is recoloured.
+PixelRect ReferenceFloodFill(ReferenceImage& Image, int X, int Y, u32 ReplacementColor, FillTolerance Tolerance) {
+    PixelRect bounds = { 0, 0, 0, 0 };
+    if (X < 0 || X >= Image.Width || Y < 0 || Y >= Image.Height) {
+        return bounds;
+    }
+    u32 target = Image.Pixels[(size_t)Y * Image.Width + X];
+    if (Tolerance.Mode == TOLERANCE_EXACT && target == ReplacementColor) {
+        return bounds;
+    }
+
+    std::vector<bool> visited(Image.Pixels.size(), false);
+    std::vector<std::pair<int, int>> region = { { X, Y } };
+    visited[(size_t)Y * Image.Width + X] = true;
+    bounds = { X, Y, X + 1, Y + 1 };
+    for (size_t next = 0; next < region.size(); next++) {
+        auto [x, y] = region[next];
+        bounds = Union(bounds, { x, y, x + 1, y + 1 });
+        const int dx[] = { 1, -1, 0, 0 };
+        const int dy[] = { 0, 0, 1, -1 };
+        for (int i = 0; i < 4; i++) {
+            int nx = x + dx[i];
+            int ny = y + dy[i];
+            if (nx < 0 || nx >= Image.Width || ny < 0 || ny >= Image.Height) {
+                continue;
+            }
+            size_t index = (size_t)ny * Image.Width + nx;
+            if (!visited[index] && WithinTolerance(Image.Pixels[index], target, Tolerance)) {
+                visited[index] = true;
+                region.push_back({ nx, ny });
+            }
+        }
+    }
+    for (auto [x, y] : region) {
+        SetPixel(Image, x, y, ReplacementColor);
+    }
+    return bounds;
+}
+
+PixelRect ReferenceClear(ReferenceImage& Image, u32 Color) {
+    for (int y = 0; y < Image.Height; y++) {
+        for (int x = 0; x < Image.Width; x++) {
+            SetPixel(Image, x, y, Color);
+        }
+    }
+    return ImageBounds(Image);
+}
+
+PixelRect ReferenceFlipHorizontal(ReferenceImage& Image) {
+    // Flipping replaces the canvas's tiles, which ends a stroke.
+    ReferenceEndStroke(Image);
+    for (int y = 0; y < Image.Height; y++) {
+        for (int x = 0; x < Image.Width / 2; x++) {
+            std::swap(Image.Pixels[(size_t)y * Image.Width + x], Image.Pixels[(size_t)y * Image.Width + Image.Width - 1 - x]);
+        }
+    }
+    return ImageBounds(Image);
+}
+
+PixelRect ReferenceFlipVertical(ReferenceImage& Image) {
+    ReferenceEndStroke(Image);
+    for (int y = 0; y < Image.Height / 2; y++) {
+        for (int x = 0; x < Image.Width; x++) {
+            std::swap(Image.Pixels[(size_t)y * Image.Width + x], Image.Pixels[(size_t)(Image.Height - 1 - y) * Image.Width + x]);
+        }
+    }
+    return ImageBounds(Image);
+}
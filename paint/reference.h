@@ -0,0 +1,54 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+#include "blend.h"
+#include "canvas.h"
+#include "fill.h"
+#include "raster.h"
+#include "selection.h"
+
+// A linear image drawn one pixel at a time. Every primitive here is written
+// from its definition, not from the fast path, so the two can be checked
+// against each other; none of it is meant to be quick.
+struct ReferenceImage {
+    int Width = 0;
+    int Height = 0;
+    std::vector<u32> Pixels;
+
+    // A stroke in progress, as BlendedStroke: every pixel as it was when the
+    // stroke began and the highest coverage it has had since.
+    bool IsStroking = false;
+    uint8_t StrokeOpacity = 255;
+    BlendMode StrokeMode = BLEND_NORMAL;
+    std::vector<u32> StrokeBefore;
+    std::vector<uint8_t> StrokeCoverage;
+
+    // Pixels outside it are never written, as with Canvas::Selection.
+    std::shared_ptr<const SelectionMask> Selection;
+};
+
+void InitReferenceImage(ReferenceImage& Image, int Width, int Height, u32 Color);
+// Copies the whole canvas, resizing Image to match, along with the stroke it
+// has in progress and its selection.
+void CopyCanvasToReference(const Canvas& Source, ReferenceImage& Image);
+
+// As BeginBlendedStroke and EndBlendedStroke.
+void ReferenceBeginStroke(ReferenceImage& Image, uint8_t Opacity, BlendMode Mode);
+void ReferenceEndStroke(ReferenceImage& Image);
+
+// Each returns the bounding box of the pixels it may have written, clipped
+// to the image.
+PixelRect ReferencePixel(ReferenceImage& Image, int X, int Y, u32 Color);
+PixelRect ReferenceRectangle(ReferenceImage& Image, int X, int Y, int Width, int Height, u32 Color, int LineWidth, bool isFilled);
+PixelRect ReferenceCircle(ReferenceImage& Image, int X, int Y, int Radius, u32 Color, int LineWidth, bool isFilled);
+PixelRect ReferenceEllipse(ReferenceImage& Image, int X, int Y, int Width, int Height, u32 Color, int LineWidth, bool isFilled);
+PixelRect ReferenceLine(ReferenceImage& Image, int X1, int Y1, int X2, int Y2, u32 Color, int LineWidth, BrushShape Brush);
+// Anti-aliased: pixels of the aliased shape are set, the others get the
+// coverage antialias.h defines, blended one channel at a time.
+PixelRect ReferenceLineAA(ReferenceImage& Image, int X1, int Y1, int X2, int Y2, u32 Color, int LineWidth, BrushShape Brush);
+PixelRect ReferenceCircleAA(ReferenceImage& Image, int X, int Y, int Radius, u32 Color, int LineWidth, bool isFilled);
+PixelRect ReferenceFloodFill(ReferenceImage& Image, int X, int Y, u32 ReplacementColor, FillTolerance Tolerance);
+PixelRect ReferenceClear(ReferenceImage& Image, u32 Color);
+PixelRect ReferenceFlipHorizontal(ReferenceImage& Image);
+PixelRect ReferenceFlipVertical(ReferenceImage& Image);
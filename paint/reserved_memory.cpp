@@ -0,0 +1,98 @@
+#include "reserved_memory.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static size_t PageSize() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static size_t RoundToPages(size_t Bytes) {
+    size_t page = PageSize();
+    return (Bytes + page - 1) / page * page;
+}
+
+#ifdef _WIN32
+
+bool ReserveMemory(ReservedMemory& Memory, size_t Bytes) {
+    ReleaseMemory(Memory);
+    size_t size = RoundToPages(Bytes);
+    void* data = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+    if (!data) {
+        return false;
+    }
+    Memory.Data = (uint8_t*)data;
+    Memory.Reserved = size;
+    return true;
+}
+
+bool CommitMemory(ReservedMemory& Memory, size_t Bytes) {
+    if (Bytes <= Memory.Committed) {
+        return true;
+    }
+    size_t size = RoundToPages(Bytes);
+    if (size > Memory.Reserved) {
+        return false;
+    }
+    if (!VirtualAlloc(Memory.Data + Memory.Committed, size - Memory.Committed, MEM_COMMIT, PAGE_READWRITE)) {
+        return false;
+    }
+    Memory.Committed = size;
+    return true;
+}
+
+void ReleaseMemory(ReservedMemory& Memory) {
+    if (Memory.Data) {
+        VirtualFree(Memory.Data, 0, MEM_RELEASE);
+    }
+    Memory = ReservedMemory();
+}
+
+#else
+
+bool ReserveMemory(ReservedMemory& Memory, size_t Bytes) {
+    ReleaseMemory(Memory);
+    size_t size = RoundToPages(Bytes);
+    void* data = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    Memory.Data = (uint8_t*)data;
+    Memory.Reserved = size;
+    return true;
+}
+
+bool CommitMemory(ReservedMemory& Memory, size_t Bytes) {
+    if (Bytes <= Memory.Committed) {
+        return true;
+    }
+    size_t size = RoundToPages(Bytes);
+    if (size > Memory.Reserved) {
+        return false;
+    }
+    if (mprotect(Memory.Data + Memory.Committed, size - Memory.Committed, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    Memory.Committed = size;
+    return true;
+}
+
+void ReleaseMemory(ReservedMemory& Memory) {
+    if (Memory.Data) {
+        munmap(Memory.Data, Memory.Reserved);
+    }
+    Memory = ReservedMemory();
+}
+
+#endif
@@ -0,0 +1,19 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory that grows in place. Address space for the most it will ever need is
+// set aside up front, costing no memory, and pages are committed as it grows,
+// so what it holds never moves and growing never copies.
+struct ReservedMemory {
+    uint8_t* Data = nullptr;
+    size_t Reserved = 0;
+    size_t Committed = 0;
+};
+
+// Reserves Bytes of address space, rounded up to whole pages, committing none.
+bool ReserveMemory(ReservedMemory& Memory, size_t Bytes);
+// Makes the first Bytes usable, committing the pages past those that already
+// are; they read as zero at first. False past the reservation.
+bool CommitMemory(ReservedMemory& Memory, size_t Bytes);
+void ReleaseMemory(ReservedMemory& Memory);
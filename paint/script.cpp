@@ -0,0 +1,507 @@
+#include "script.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "mapped_file.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+struct ScriptKeyword {
+    const char* Name;
+    int Value;
+};
+
+static const ScriptKeyword BrushKeywords[] = { { "round", ROUND_BRUSH }, { "square", SQUARE_BRUSH }, { nullptr, 0 } };
+static const ScriptKeyword SwitchKeywords[] = { { "on", 1 }, { "off", 0 }, { nullptr, 0 } };
+static const ScriptKeyword ToleranceKeywords[] = {
+    { "exact", TOLERANCE_EXACT }, { "channel", TOLERANCE_CHANNEL }, { "distance", TOLERANCE_DISTANCE }, { nullptr, 0 }
+};
+static const ScriptKeyword BlendKeywords[] = {
+    { "normal", BLEND_NORMAL }, { "multiply", BLEND_MULTIPLY }, { "screen", BLEND_SCREEN }, { "add", BLEND_ADD }, { nullptr, 0 }
+};
+static const ScriptKeyword FilledKeywords[] = { { "filled", 1 }, { nullptr, 0 } };
+static const ScriptKeyword FlipKeywords[] = { { "horizontal", 0 }, { "vertical", 1 }, { nullptr, 0 } };
+
+struct ScriptCommand {
+    const char* Name;
+    int Args;
+    int RequiredArgs;             // in text the rest may be left out, as 0
+    int KeywordArg;               // the argument written as a word, or -1
+    const ScriptKeyword* Keywords;
+};
+
+// Indexed by ScriptOpcode.
+static const ScriptCommand Commands[SCRIPT_OPCODE_COUNT] = {
+    { "canvas", 3, 3, -1, nullptr },
+    { "color", 1, 1, -1, nullptr },
+    { "width", 1, 1, -1, nullptr },
+    { "brush", 1, 1, 0, BrushKeywords },
+    { "antialias", 1, 1, 0, SwitchKeywords },
+    { "tolerance", 2, 1, 0, ToleranceKeywords },
+    { "opacity", 1, 1, -1, nullptr },
+    { "blend", 1, 1, 0, BlendKeywords },
+    { "stroke", 0, 0, -1, nullptr },
+    { "pixel", 2, 2, -1, nullptr },
+    { "line", 4, 4, -1, nullptr },
+    { "rect", 5, 4, 4, FilledKeywords },
+    { "circle", 4, 3, 3, FilledKeywords },
+    { "ellipse", 5, 4, 4, FilledKeywords },
+    { "fill", 2, 2, -1, nullptr },
+    { "clear", 0, 0, -1, nullptr },
+    { "flip", 1, 1, 0, FlipKeywords },
+};
+
+constexpr int SCRIPT_MAX_ARGS = 5;
+constexpr int64_t MAX_COLOR = 0xffffff;
+constexpr int64_t MAX_TOLERANCE = 1024;
+
+// What the commands so far have set up.
+struct ScriptState {
+    DrawingScript& Script;
+    RasterOp Pen;                  // the brush settings, carried into each op
+    bool HasCanvas = false;
+    bool IsStrokePending = false;  // a stroke starts before the next drawing
+};
+
+static bool AreInRange(const int64_t* Args, int Count, int64_t Min, int64_t Max) {
+    for (int i = 0; i < Count; i++) {
+        if (Args[i] < Min || Args[i] > Max) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool AreCoordinates(const int64_t* Args, int Count) {
+    return AreInRange(Args, Count, -SCRIPT_MAX_COORDINATE, SCRIPT_MAX_COORDINATE);
+}
+
+// Adds a drawing op with the current brush, starting a stroke first if one is
+// due.
+static void AddDrawing(ScriptState& State, RasterOpKind Kind, const int64_t* Args) {
+    std::vector<RasterOp>& ops = State.Script.Ops;
+    if (State.IsStrokePending) {
+        RasterOp begin = State.Pen;
+        begin.Kind = RASTER_BEGIN_STROKE;
+        ops.push_back(begin);
+        State.IsStrokePending = false;
+    }
+    RasterOp op = State.Pen;
+    op.Kind = Kind;
+    switch (Kind) {
+    case RASTER_PIXEL:
+    case RASTER_FLOOD_FILL:
+        op.X = (int)Args[0];
+        op.Y = (int)Args[1];
+        break;
+    case RASTER_LINE:
+        op.X = (int)Args[0];
+        op.Y = (int)Args[1];
+        op.X2 = (int)Args[2];
+        op.Y2 = (int)Args[3];
+        break;
+    case RASTER_RECTANGLE:
+    case RASTER_ELLIPSE:
+        op.X = (int)Args[0];
+        op.Y = (int)Args[1];
+        op.Width = (int)Args[2];
+        op.Height = (int)Args[3];
+        op.Filled = Args[4] != 0;
+        break;
+    case RASTER_CIRCLE:
+        op.X = (int)Args[0];
+        op.Y = (int)Args[1];
+        op.Radius = (int)Args[2];
+        op.Filled = Args[3] != 0;
+        break;
+    default:
+        break;
+    }
+    ops.push_back(op);
+}
+
+// Checks one command's arguments and applies it. Args holds all of the
+// command's arguments.
+static bool RunCommand(ScriptState& State, ScriptOpcode Opcode, const int64_t* Args, std::string& Error) {
+    RasterOp& pen = State.Pen;
+    if (Opcode == SCRIPT_CANVAS) {
+        if (State.HasCanvas) {
+            Error = "canvas given twice";
+            return false;
+        }
+        if (!AreInRange(Args, 2, 1, BMP_MAX_SIDE) || !AreInRange(Args + 2, 1, 0, MAX_COLOR)) {
+            Error = "canvas size or background out of range";
+            return false;
+        }
+        State.Script.Width = (int)Args[0];
+        State.Script.Height = (int)Args[1];
+        State.Script.Background = (u32)Args[2];
+        State.HasCanvas = true;
+        return true;
+    }
+    if (!State.HasCanvas) {
+        Error = "the script has to start with canvas";
+        return false;
+    }
+
+    bool isValid = true;
+    switch (Opcode) {
+    case SCRIPT_COLOR:
+        if ((isValid = AreInRange(Args, 1, 0, MAX_COLOR))) {
+            pen.Color = (u32)Args[0];
+        }
+        break;
+    case SCRIPT_WIDTH:
+        if ((isValid = AreInRange(Args, 1, 1, SCRIPT_MAX_LINE_WIDTH))) {
+            pen.LineWidth = (int)Args[0];
+        }
+        break;
+    case SCRIPT_BRUSH:
+        if ((isValid = AreInRange(Args, 1, ROUND_BRUSH, SQUARE_BRUSH))) {
+            pen.Brush = (BrushShape)Args[0];
+        }
+        break;
+    case SCRIPT_ANTIALIAS:
+        if ((isValid = AreInRange(Args, 1, 0, 1))) {
+            pen.AntiAlias = Args[0] != 0;
+        }
+        break;
+    case SCRIPT_TOLERANCE:
+        if ((isValid = AreInRange(Args, 1, TOLERANCE_EXACT, TOLERANCE_DISTANCE) && AreInRange(Args + 1, 1, 0, MAX_TOLERANCE))) {
+            pen.Tolerance = { (ToleranceMode)Args[0], (int)Args[1] };
+        }
+        break;
+    case SCRIPT_OPACITY:
+        if ((isValid = AreInRange(Args, 1, 0, 255))) {
+            pen.Opacity = (uint8_t)Args[0];
+            State.IsStrokePending = true;
+        }
+        break;
+    case SCRIPT_BLEND:
+        if ((isValid = AreInRange(Args, 1, BLEND_NORMAL, BLEND_ADD))) {
+            pen.Blend = (BlendMode)Args[0];
+            State.IsStrokePending = true;
+        }
+        break;
+    case SCRIPT_STROKE:
+        State.IsStrokePending = true;
+        break;
+    case SCRIPT_PIXEL:
+        if ((isValid = AreCoordinates(Args, 2))) {
+            AddDrawing(State, RASTER_PIXEL, Args);
+        }
+        break;
+    case SCRIPT_LINE:
+        if ((isValid = AreCoordinates(Args, 4))) {
+            AddDrawing(State, RASTER_LINE, Args);
+        }
+        break;
+    case SCRIPT_RECTANGLE:
+    case SCRIPT_ELLIPSE:
+        if ((isValid = AreCoordinates(Args, 4) && AreInRange(Args + 4, 1, 0, 1))) {
+            AddDrawing(State, Opcode == SCRIPT_RECTANGLE ? RASTER_RECTANGLE : RASTER_ELLIPSE, Args);
+        }
+        break;
+    case SCRIPT_CIRCLE:
+        if ((isValid = AreCoordinates(Args, 2) && AreInRange(Args + 2, 1, 0, SCRIPT_MAX_COORDINATE) && AreInRange(Args + 3, 1, 0, 1))) {
+            AddDrawing(State, RASTER_CIRCLE, Args);
+        }
+        break;
+    case SCRIPT_FILL:
+        if ((isValid = AreCoordinates(Args, 2))) {
+            AddDrawing(State, RASTER_FLOOD_FILL, Args);
+        }
+        break;
+    case SCRIPT_CLEAR:
+        AddDrawing(State, RASTER_CLEAR, Args);
+        break;
+    case SCRIPT_FLIP:
+        if ((isValid = AreInRange(Args, 1, 0, 1))) {
+            AddDrawing(State, Args[0] ? RASTER_FLIP_VERTICAL : RASTER_FLIP_HORIZONTAL, Args);
+        }
+        break;
+    default:
+        break;
+    }
+    if (!isValid) {
+        Error = std::string(Commands[Opcode].Name) + ": argument out of range";
+    }
+    return isValid;
+}
+
+static bool IsSpace(char C) {
+    return C == ' ' || C == '\t' || C == '\r';
+}
+
+// Reads a number or, at KeywordArg, one of the command's words.
+static bool ParseArgument(const std::string& Token, const ScriptCommand& Command, int Index, int64_t& Value) {
+    if (Command.Keywords && Index == Command.KeywordArg) {
+        for (const ScriptKeyword* keyword = Command.Keywords; keyword->Name; keyword++) {
+            if (Token == keyword->Name) {
+                Value = keyword->Value;
+                return true;
+            }
+        }
+        return false;
+    }
+    // Hex only with 0x: zero-padded decimals mustn't read as octal.
+    size_t digits = Token[0] == '-' || Token[0] == '+' ? 1 : 0;
+    bool isHex = Token.size() > digits + 2 && Token[digits] == '0' && (Token[digits + 1] == 'x' || Token[digits + 1] == 'X');
+    char* end = nullptr;
+    Value = strtoll(Token.c_str(), &end, isHex ? 16 : 10);
+    return !Token.empty() && *end == '\0';
+}
+
+static bool ParseTextScript(const char* Text, size_t Size, ScriptState& State, std::string& Error) {
+    const char* end = Text + Size;
+    std::vector<std::string> tokens;
+    int lineNumber = 0;
+    for (const char* line = Text; line < end;) {
+        lineNumber++;
+        const char* lineEnd = std::find(line, end, '\n');
+        const char* comment = std::find(line, lineEnd, '#');
+        tokens.clear();
+        for (const char* c = line; c < comment;) {
+            if (IsSpace(*c)) {
+                c++;
+                continue;
+            }
+            const char* tokenEnd = c;
+            while (tokenEnd < comment && !IsSpace(*tokenEnd)) {
+                tokenEnd++;
+            }
+            tokens.emplace_back(c, tokenEnd);
+            c = tokenEnd;
+        }
+        line = lineEnd + (lineEnd < end);
+        if (tokens.empty()) {
+            continue;
+        }
+
+        auto prefix = [&] { return "line " + std::to_string(lineNumber) + ": "; };
+        int opcode = 0;
+        while (opcode < SCRIPT_OPCODE_COUNT && tokens[0] != Commands[opcode].Name) {
+            opcode++;
+        }
+        if (opcode == SCRIPT_OPCODE_COUNT) {
+            Error = prefix() + "unknown command " + tokens[0];
+            return false;
+        }
+        const ScriptCommand& command = Commands[opcode];
+        int count = (int)tokens.size() - 1;
+        bool isPolyline = opcode == SCRIPT_LINE;
+        if (isPolyline ? count < 4 || count % 2 != 0 : count < command.RequiredArgs || count > command.Args) {
+            Error = prefix() + "wrong number of arguments to " + command.Name;
+            return false;
+        }
+
+        std::vector<int64_t> args(std::max(count, SCRIPT_MAX_ARGS), 0);
+        for (int i = 0; i < count; i++) {
+            if (!ParseArgument(tokens[i + 1], command, i, args[i])) {
+                Error = prefix() + "can't read " + tokens[i + 1];
+                return false;
+            }
+        }
+        // A polyline is one command per segment.
+        int segments = isPolyline ? count / 2 - 1 : 1;
+        for (int i = 0; i < segments; i++) {
+            if (!RunCommand(State, (ScriptOpcode)opcode, args.data() + 2 * i, Error)) {
+                Error = prefix() + Error;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// A zigzag LEB128 varint: small numbers of either sign take few bytes.
+static bool ReadVarint(const uint8_t*& Data, const uint8_t* End, int64_t& Value) {
+    uint64_t bits = 0;
+    for (int shift = 0; shift < 64 && Data < End; shift += 7) {
+        uint8_t byte = *Data++;
+        bits |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            Value = (int64_t)(bits >> 1) ^ -(int64_t)(bits & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void WriteVarint(std::vector<uint8_t>& Out, int64_t Value) {
+    uint64_t bits = ((uint64_t)Value << 1) ^ (uint64_t)(Value >> 63);
+    while (bits >= 0x80) {
+        Out.push_back((uint8_t)(bits | 0x80));
+        bits >>= 7;
+    }
+    Out.push_back((uint8_t)bits);
+}
+
+static bool ParseBinaryScript(const uint8_t* Data, size_t Size, ScriptState& State, std::string& Error) {
+    const uint8_t* start = Data;
+    const uint8_t* end = Data + Size;
+    const uint8_t* p = Data + sizeof(SCRIPT_MAGIC);
+    int64_t args[SCRIPT_MAX_ARGS];
+    while (p < end) {
+        size_t offset = p - start;
+        auto prefix = [&] { return "offset " + std::to_string(offset) + ": "; };
+        uint8_t opcode = *p++;
+        if (opcode >= SCRIPT_OPCODE_COUNT) {
+            Error = prefix() + "unknown opcode " + std::to_string(opcode);
+            return false;
+        }
+        for (int i = 0; i < Commands[opcode].Args; i++) {
+            if (!ReadVarint(p, end, args[i])) {
+                Error = prefix() + "truncated " + Commands[opcode].Name;
+                return false;
+            }
+        }
+        if (!RunCommand(State, (ScriptOpcode)opcode, args, Error)) {
+            Error = prefix() + Error;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ParseScript(const uint8_t* Data, size_t Size, DrawingScript& Script, std::string& Error) {
+    TraceScope trace("ParseScript");
+    Script = DrawingScript();
+    ScriptState state = { Script, RasterOp() };
+    bool isBinary = Size >= sizeof(SCRIPT_MAGIC) && memcmp(Data, SCRIPT_MAGIC, sizeof(SCRIPT_MAGIC)) == 0;
+    bool isParsed = isBinary ? ParseBinaryScript(Data, Size, state, Error) : ParseTextScript((const char*)Data, Size, state, Error);
+    if (isParsed && !state.HasCanvas) {
+        Error = "no canvas";
+        return false;
+    }
+    return isParsed;
+}
+
+bool LoadScript(const std::filesystem::path& Path, DrawingScript& Script, std::string& Error) {
+    MappedFile file;
+    if (!MapFile(file, Path)) {
+        Error = "can't read " + Path.string();
+        return false;
+    }
+    bool isParsed = ParseScript(file.Data, file.Size, Script, Error);
+    UnmapFile(file);
+    return isParsed;
+}
+
+static void WriteCommand(std::vector<uint8_t>& Out, ScriptOpcode Opcode, std::initializer_list<int64_t> Args) {
+    Out.push_back(Opcode);
+    for (int64_t arg : Args) {
+        WriteVarint(Out, arg);
+    }
+}
+
+std::vector<uint8_t> EncodeScript(const DrawingScript& Script) {
+    std::vector<uint8_t> out(SCRIPT_MAGIC, SCRIPT_MAGIC + sizeof(SCRIPT_MAGIC));
+    WriteCommand(out, SCRIPT_CANVAS, { Script.Width, Script.Height, Script.Background });
+    RasterOp pen;
+    auto setStroke = [&](uint8_t Opacity, BlendMode Blend) {
+        if (Opacity != pen.Opacity) {
+            WriteCommand(out, SCRIPT_OPACITY, { Opacity });
+            pen.Opacity = Opacity;
+        }
+        if (Blend != pen.Blend) {
+            WriteCommand(out, SCRIPT_BLEND, { Blend });
+            pen.Blend = Blend;
+        }
+        WriteCommand(out, SCRIPT_STROKE, {});
+    };
+
+    for (const RasterOp& op : Script.Ops) {
+        if (op.Kind == RASTER_BEGIN_STROKE) {
+            setStroke(op.Opacity, op.Blend);
+            continue;
+        }
+        if (op.Kind == RASTER_END_STROKE) {
+            setStroke(255, BLEND_NORMAL);
+            continue;
+        }
+        if (op.Kind == RASTER_FLIP_HORIZONTAL || op.Kind == RASTER_FLIP_VERTICAL) {
+            WriteCommand(out, SCRIPT_FLIP, { op.Kind == RASTER_FLIP_VERTICAL });
+            continue;
+        }
+
+        // Only what this kind of op uses.
+        bool usesWidth = op.Kind == RASTER_LINE || op.Kind == RASTER_RECTANGLE || op.Kind == RASTER_CIRCLE || op.Kind == RASTER_ELLIPSE;
+        if (op.Color != pen.Color) {
+            WriteCommand(out, SCRIPT_COLOR, { op.Color });
+            pen.Color = op.Color;
+        }
+        if (usesWidth && op.LineWidth != pen.LineWidth) {
+            WriteCommand(out, SCRIPT_WIDTH, { op.LineWidth });
+            pen.LineWidth = op.LineWidth;
+        }
+        if (op.Kind == RASTER_LINE && op.Brush != pen.Brush) {
+            WriteCommand(out, SCRIPT_BRUSH, { op.Brush });
+            pen.Brush = op.Brush;
+        }
+        if ((op.Kind == RASTER_LINE || op.Kind == RASTER_CIRCLE) && op.AntiAlias != pen.AntiAlias) {
+            WriteCommand(out, SCRIPT_ANTIALIAS, { op.AntiAlias });
+            pen.AntiAlias = op.AntiAlias;
+        }
+        if (op.Kind == RASTER_FLOOD_FILL && (op.Tolerance.Mode != pen.Tolerance.Mode || op.Tolerance.Amount != pen.Tolerance.Amount)) {
+            WriteCommand(out, SCRIPT_TOLERANCE, { op.Tolerance.Mode, op.Tolerance.Amount });
+            pen.Tolerance = op.Tolerance;
+        }
+
+        switch (op.Kind) {
+        case RASTER_PIXEL:
+            WriteCommand(out, SCRIPT_PIXEL, { op.X, op.Y });
+            break;
+        case RASTER_LINE:
+            WriteCommand(out, SCRIPT_LINE, { op.X, op.Y, op.X2, op.Y2 });
+            break;
+        case RASTER_RECTANGLE:
+            WriteCommand(out, SCRIPT_RECTANGLE, { op.X, op.Y, op.Width, op.Height, op.Filled });
+            break;
+        case RASTER_CIRCLE:
+            WriteCommand(out, SCRIPT_CIRCLE, { op.X, op.Y, op.Radius, op.Filled });
+            break;
+        case RASTER_ELLIPSE:
+            WriteCommand(out, SCRIPT_ELLIPSE, { op.X, op.Y, op.Width, op.Height, op.Filled });
+            break;
+        case RASTER_FLOOD_FILL:
+            WriteCommand(out, SCRIPT_FILL, { op.X, op.Y });
+            break;
+        case RASTER_CLEAR:
+            WriteCommand(out, SCRIPT_CLEAR, {});
+            break;
+        default:
+            break;
+        }
+    }
+    return out;
+}
+
+void RenderScript(const DrawingScript& Script, Canvas& Target) {
+    TraceScope trace("RenderScript");
+    InitCanvas(Target, Script.Width, Script.Height, Script.Background);
+    for (const RasterOp& op : Script.Ops) {
+        ApplyRasterOp(Target, op);
+    }
+    EndBlendedStroke(Target);
+}
+
+void RunScriptJobs(std::vector<ScriptJob>& Jobs, BmpFormat Format) {
+    // Jobs share nothing: each has its own script and canvas.
+    ParallelFor((int)Jobs.size(), [&](int Index) {
+        ScriptJob& job = Jobs[Index];
+        DrawingScript script;
+        job.Succeeded = false;
+        if (!LoadScript(job.Input, script, job.Error)) {
+            return;
+        }
+        Canvas canvas;
+        RenderScript(script, canvas);
+        job.Succeeded = WriteBmp(canvas, job.Output, Format);
+        if (!job.Succeeded) {
+            job.Error = "can't write " + job.Output.string();
+        }
+    });
+}
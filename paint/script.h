@@ -0,0 +1,101 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "bmp.h"
+#include "validate.h"
+
+// Drawing scripts, for rendering without a window: a canvas size and
+// background, then drawing commands in order. Everything a script needs lives
+// in the script and the canvas it is rendered into, so any number can be
+// rendered at once.
+//
+// The text form is one command per line, numbers in decimal or 0x hex, and
+// anything after # ignored:
+//
+//   canvas W H COLOR          first and only once; COLOR is the background
+//   color COLOR               0xRRGGBB
+//   width N
+//   brush round|square
+//   antialias on|off          lines and circles
+//   tolerance exact|channel|distance [N]
+//   opacity N                 0 to 255
+//   blend normal|multiply|screen|add
+//   stroke                    starts a new stroke
+//   pixel X Y
+//   line X0 Y0 X1 Y1 ...      a polyline through every point
+//   rect X Y W H [filled]
+//   circle X Y R [filled]
+//   ellipse X Y W H [filled]
+//   fill X Y
+//   clear
+//   flip horizontal|vertical
+//
+// Drawing with opacity or a blend mode happens in strokes, as in the editor:
+// within one, overlaps don't build up. Changing either starts a new one.
+//
+// The binary form is SCRIPT_MAGIC, then per command its ScriptOpcode byte and
+// its arguments as zigzag LEB128 varints, keywords as their enum values and
+// on, off and filled as 1 and 0; a line takes one segment. Most arguments fit
+// in one or two bytes.
+
+constexpr char SCRIPT_MAGIC[4] = { 'P', 'D', 'S', '1' };
+
+enum ScriptOpcode : uint8_t {
+    SCRIPT_CANVAS,
+    SCRIPT_COLOR,
+    SCRIPT_WIDTH,
+    SCRIPT_BRUSH,
+    SCRIPT_ANTIALIAS,
+    SCRIPT_TOLERANCE,
+    SCRIPT_OPACITY,
+    SCRIPT_BLEND,
+    SCRIPT_STROKE,
+    SCRIPT_PIXEL,
+    SCRIPT_LINE,
+    SCRIPT_RECTANGLE,
+    SCRIPT_CIRCLE,
+    SCRIPT_ELLIPSE,
+    SCRIPT_FILL,
+    SCRIPT_CLEAR,
+    SCRIPT_FLIP,
+    SCRIPT_OPCODE_COUNT
+};
+
+// Scripts come from anywhere, so every operation is kept to a cost bounded by
+// the canvas size: coordinates and radii within this of the origin, ...
+constexpr int SCRIPT_MAX_COORDINATE = 1 << 18;
+// ... and brushes no wider than this.
+constexpr int SCRIPT_MAX_LINE_WIDTH = 1 << 12;
+
+struct DrawingScript {
+    int Width = 0;
+    int Height = 0;
+    u32 Background = 0;
+    std::vector<RasterOp> Ops;
+};
+
+// Reads either form, telling them apart by the magic. Returns false with the
+// line or byte offset of the first problem in Error.
+bool ParseScript(const uint8_t* Data, size_t Size, DrawingScript& Script, std::string& Error);
+bool LoadScript(const std::filesystem::path& Path, DrawingScript& Script, std::string& Error);
+// The binary form, with brush settings written only where they change.
+std::vector<uint8_t> EncodeScript(const DrawingScript& Script);
+
+// Replaces Target with the rendered script.
+void RenderScript(const DrawingScript& Script, Canvas& Target);
+
+struct ScriptJob {
+    std::filesystem::path Input;
+    std::filesystem::path Output;
+    bool Succeeded = false;
+    std::string Error;
+};
+
+// Loads, renders and writes every job's script as a BMP, one job at a time
+// per worker thread. Each job's drawing runs on its own thread, which
+// outpaces splitting a small canvas between threads.
+void RunScriptJobs(std::vector<ScriptJob>& Jobs, BmpFormat Format);
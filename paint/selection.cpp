@@ -0,0 +1,144 @@
+#include "selection.h"
+
+#include <algorithm>
+#include <bit>
+
+#include "ellipse.h"
+#include "trace.h"
+
+void InitSelection(SelectionMask& Mask, int Width, int Height) {
+    Mask.Width = Width;
+    Mask.Height = Height;
+    Mask.RowWords = (Width + 63) / 64;
+    Mask.Bits.assign(Mask.RowWords * Height, 0);
+    Mask.Rows.assign(Height, { 0, 0, false });
+    Mask.Bounds = { 0, 0, 0, 0 };
+}
+
+void AddSelectionSpan(SelectionMask& Mask, int Y, int X0, int X1) {
+    X0 = std::max(X0, 0);
+    X1 = std::min(X1, Mask.Width);
+    if (Y < 0 || Y >= Mask.Height || X0 >= X1) {
+        return;
+    }
+    uint64_t* row = &Mask.Bits[(size_t)Y * Mask.RowWords];
+    for (int x = X0; x < X1;) {
+        int bit = x & 63;
+        int count = std::min(64 - bit, X1 - x);
+        row[x >> 6] |= (count == 64 ? ~0ull : ((1ull << count) - 1)) << bit;
+        x += count;
+    }
+}
+
+void FinishSelection(SelectionMask& Mask) {
+    Mask.Bounds = { 0, 0, 0, 0 };
+    for (int y = 0; y < Mask.Height; y++) {
+        const uint64_t* row = &Mask.Bits[(size_t)y * Mask.RowWords];
+        SelectionRow& summary = Mask.Rows[y];
+        summary = { 0, 0, false };
+        size_t first = 0;
+        while (first < Mask.RowWords && !row[first]) {
+            first++;
+        }
+        if (first == Mask.RowWords) {
+            continue;
+        }
+        size_t last = Mask.RowWords - 1;
+        while (!row[last]) {
+            last--;
+        }
+        summary.X0 = (int)first * 64 + std::countr_zero(row[first]);
+        summary.X1 = (int)last * 64 + 64 - std::countl_zero(row[last]);
+        summary.IsSolid = NextUnselected(Mask, y, summary.X0, summary.X1) == summary.X1;
+        Mask.Bounds = Union(Mask.Bounds, { summary.X0, y, summary.X1, y + 1 });
+    }
+}
+
+SelectionMask SelectRectangle(int Width, int Height, const PixelRect& Rect) {
+    SelectionMask mask;
+    InitSelection(mask, Width, Height);
+    for (int y = std::max(Rect.Y0, 0); y < std::min(Rect.Y1, Height); y++) {
+        AddSelectionSpan(mask, y, Rect.X0, Rect.X1);
+    }
+    FinishSelection(mask);
+    return mask;
+}
+
+SelectionMask SelectEllipse(int Width, int Height, int X, int Y, int EllipseWidth, int EllipseHeight) {
+    SelectionMask mask;
+    InitSelection(mask, Width, Height);
+    Ellipse ellipse = MakeEllipse(X, Y, EllipseWidth, EllipseHeight, 1, true);
+    for (int y = std::max(ellipse.Y0, 0); y < std::min(ellipse.Y1, Height); y++) {
+        int x0, x1, hole0, hole1;
+        if (EllipseRowSpan(ellipse, y, x0, x1, hole0, hole1)) {
+            AddSelectionSpan(mask, y, x0, x1);
+        }
+    }
+    FinishSelection(mask);
+    return mask;
+}
+
+SelectionMask SelectSimilar(const Canvas& Source, int X, int Y, FillTolerance Tolerance) {
+    TraceScope trace("SelectSimilar");
+    SelectionMask mask;
+    InitSelection(mask, Source.Width, Source.Height);
+    std::vector<PixelSpan> spans;
+    FindFillRegion(Source, X, Y, Tolerance, spans);
+    for (const PixelSpan& span : spans) {
+        AddSelectionSpan(mask, span.Y, span.X0, span.X1);
+    }
+    FinishSelection(mask);
+    return mask;
+}
+
+bool SelectionCovers(const SelectionMask& Mask, const PixelRect& Rect) {
+    if (IsEmpty(Rect)) {
+        return true;
+    }
+    if (Rect.Y0 < 0 || Rect.Y1 > Mask.Height) {
+        return false;
+    }
+    for (int y = Rect.Y0; y < Rect.Y1; y++) {
+        const SelectionRow& row = Mask.Rows[y];
+        if (!row.IsSolid || row.X0 > Rect.X0 || row.X1 < Rect.X1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SelectionMayTouch(const SelectionMask& Mask, const PixelRect& Rect) {
+    PixelRect rect = Intersect(Rect, Mask.Bounds);
+    for (int y = rect.Y0; y < rect.Y1; y++) {
+        const SelectionRow& row = Mask.Rows[y];
+        if (row.X0 < rect.X1 && row.X1 > rect.X0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Scans a row a word at a time; Invert finds unselected pixels instead.
+static int NextBit(const SelectionMask& Mask, int Y, int X, int End, uint64_t Invert) {
+    if (X >= End) {
+        return End;
+    }
+    const uint64_t* row = &Mask.Bits[(size_t)Y * Mask.RowWords];
+    size_t word = X >> 6;
+    uint64_t bits = (row[word] ^ Invert) & (~0ull << (X & 63));
+    while (!bits) {
+        if (++word >= Mask.RowWords || (int)(word * 64) >= End) {
+            return End;
+        }
+        bits = row[word] ^ Invert;
+    }
+    return std::min((int)(word * 64) + std::countr_zero(bits), End);
+}
+
+int NextSelected(const SelectionMask& Mask, int Y, int X, int End) {
+    return NextBit(Mask, Y, X, End, 0);
+}
+
+int NextUnselected(const SelectionMask& Mask, int Y, int X, int End) {
+    return NextBit(Mask, Y, X, End, ~0ull);
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+#include "canvas.h"
+#include "fill.h"
+
+// The pixels drawing may touch. One bit per pixel, 64 to a word and each row
+// starting on a new word, plus a summary per row so the common cases never
+// look at the bits: a row with nothing selected, and a row selected as one
+// solid run.
+struct SelectionRow {
+    int X0; // every selected pixel of the row lies in [X0, X1); empty when X0 >= X1
+    int X1;
+    bool IsSolid; // every pixel in [X0, X1) is selected
+};
+
+struct SelectionMask {
+    int Width = 0;
+    int Height = 0;
+    size_t RowWords = 0;
+    std::vector<uint64_t> Bits;
+    std::vector<SelectionRow> Rows; // kept up to date by FinishSelection
+    PixelRect Bounds = { 0, 0, 0, 0 };
+};
+
+// An empty selection of a Width x Height canvas. Add spans to it, then call
+// FinishSelection before using it.
+void InitSelection(SelectionMask& Mask, int Width, int Height);
+// Selects [X0, X1) of row Y, clipped to the mask.
+void AddSelectionSpan(SelectionMask& Mask, int Y, int X0, int X1);
+void FinishSelection(SelectionMask& Mask);
+
+SelectionMask SelectRectangle(int Width, int Height, const PixelRect& Rect);
+// The filled ellipse DrawEllipse would draw for the same corner and size.
+SelectionMask SelectEllipse(int Width, int Height, int X, int Y, int EllipseWidth, int EllipseHeight);
+// Magic wand: the region FloodFill would fill from (X, Y).
+SelectionMask SelectSimilar(const Canvas& Source, int X, int Y, FillTolerance Tolerance);
+
+inline bool IsSelected(const SelectionMask& Mask, int X, int Y) {
+    if (X < 0 || X >= Mask.Width || Y < 0 || Y >= Mask.Height) {
+        return false;
+    }
+    return (Mask.Bits[(size_t)Y * Mask.RowWords + (X >> 6)] >> (X & 63)) & 1;
+}
+
+// Whether every pixel of Rect is selected, and whether Rect may hold any
+// selected pixel. Both only read the row summaries.
+bool SelectionCovers(const SelectionMask& Mask, const PixelRect& Rect);
+bool SelectionMayTouch(const SelectionMask& Mask, const PixelRect& Rect);
+
+// First x in [X, End) of row Y that is selected, or unselected, or End.
+int NextSelected(const SelectionMask& Mask, int Y, int X, int End);
+int NextUnselected(const SelectionMask& Mask, int Y, int X, int End);
+
+// Calls Run(RunX0, RunX1) for each run of selected pixels in [X0, X1) of row
+// Y, left to right. Rows outside the mask have none.
+template <typename RunFn>
+inline void ForEachSelectedRun(const SelectionMask& Mask, int Y, int X0, int X1, RunFn&& Run) {
+    if (Y < 0 || Y >= Mask.Height) {
+        return;
+    }
+    const SelectionRow& row = Mask.Rows[Y];
+    X0 = std::max(X0, row.X0);
+    X1 = std::min(X1, row.X1);
+    if (X0 >= X1) {
+        return;
+    }
+    if (row.IsSolid) {
+        Run(X0, X1);
+        return;
+    }
+    for (int x = NextSelected(Mask, Y, X0, X1); x < X1;) {
+        int end = NextUnselected(Mask, Y, x, X1);
+        Run(x, end);
+        x = NextSelected(Mask, Y, end, X1);
+    }
+}
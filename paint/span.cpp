@@ -0,0 +1,1142 @@
+#include "span.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "cpu.h"
+#include "selection.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+typedef void (*FillRowProc)(u32* Row, int Count, u32 Color);
+typedef void (*BlendRowProc)(u32* Row, const uint8_t* Coverage, int Count, u32 Color);
+typedef void (*CompositeRowProc)(u32* Dest, const u32* Source, int Count, uint8_t Opacity);
+typedef void (*StrokeRowProc)(u32* Dest, const u32* Before, const uint8_t* Coverage, int Count, u32 Color, uint8_t Opacity);
+typedef void (*GradientRowProc)(u32* Row, const int32_t* Positions, int Count, u32 From, u32 To, const int32_t* Thresholds);
+typedef void (*RadialPositionsProc)(int32_t* Positions, int Count, float DX, float DY2, float Scale);
+typedef void (*DownsampleRowProc)(u32* Dest, const u32* Top, const u32* Bottom, int Count);
+
+static void FillRowScalar(u32* Row, int Count, u32 Color) {
+    for (int i = 0; i < Count; i++) {
+        Row[i] = Color;
+    }
+}
+
+#if PAINT_SSE2
+static void FillRowSSE2(u32* Row, int Count, u32 Color) {
+    // Scalar head up to a 16 byte boundary, aligned stores, scalar tail.
+    while (Count > 0 && ((uintptr_t)Row & 15)) {
+        *Row++ = Color;
+        Count--;
+    }
+    __m128i color = _mm_set1_epi32((int)Color);
+    while (Count >= 8) {
+        _mm_store_si128((__m128i*)Row, color);
+        _mm_store_si128((__m128i*)(Row + 4), color);
+        Row += 8;
+        Count -= 8;
+    }
+    if (Count >= 4) {
+        _mm_store_si128((__m128i*)Row, color);
+        Row += 4;
+        Count -= 4;
+    }
+    FillRowScalar(Row, Count, Color);
+}
+#endif
+
+#if PAINT_X86
+PAINT_TARGET_AVX2 static void FillRowAVX2(u32* Row, int Count, u32 Color) {
+    if (Count < 8) {
+        FillRowScalar(Row, Count, Color);
+        return;
+    }
+    // One unaligned store covers the head, then aligned stores from the next
+    // 32 byte boundary; the tail is another unaligned store ending at Row + Count.
+    __m256i color = _mm256_set1_epi32((int)Color);
+    _mm256_storeu_si256((__m256i*)Row, color);
+    u32* end = Row + Count;
+    u32* p = (u32*)(((uintptr_t)Row + 32) & ~(uintptr_t)31);
+    while (p + 16 <= end) {
+        _mm256_store_si256((__m256i*)p, color);
+        _mm256_store_si256((__m256i*)(p + 8), color);
+        p += 16;
+    }
+    if (p + 8 <= end) {
+        _mm256_store_si256((__m256i*)p, color);
+    }
+    _mm256_storeu_si256((__m256i*)(end - 8), color);
+}
+#endif
+
+static void BlendRowScalar(u32* Row, const uint8_t* Coverage, int Count, u32 Color) {
+    // Two channels per multiply, 16 bits apart; neither sum can carry into
+    // the next.
+    for (int i = 0; i < Count; i++) {
+        u32 a = Coverage[i] + (Coverage[i] >> 7);
+        u32 pixel = Row[i];
+        u32 redBlue = ((Color & 0xff00ff) * a + (pixel & 0xff00ff) * (256 - a)) >> 8;
+        u32 alphaGreen = ((Color >> 8) & 0xff00ff) * a + ((pixel >> 8) & 0xff00ff) * (256 - a);
+        Row[i] = (redBlue & 0xff00ff) | (alphaGreen & 0xff00ff00);
+    }
+}
+
+#if PAINT_SSE2
+// Four pixels: channels widened to 16 bits, two pixels per half. Both products
+// fit, as Color * a + Pixel * (256 - a) is at most 255 * 256.
+static inline __m128i BlendFourSSE2(__m128i Pixels, const uint8_t* Coverage, __m128i Color) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i full = _mm_set1_epi16(256);
+    int coverage;
+    memcpy(&coverage, Coverage, 4);
+    __m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(coverage), zero);
+    a = _mm_add_epi16(a, _mm_srli_epi16(a, 7));
+    a = _mm_unpacklo_epi16(a, a);
+    __m128i aLo = _mm_unpacklo_epi32(a, a);
+    __m128i aHi = _mm_unpackhi_epi32(a, a);
+
+    __m128i lo = _mm_unpacklo_epi8(Pixels, zero);
+    __m128i hi = _mm_unpackhi_epi8(Pixels, zero);
+    lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(Color, aLo), _mm_mullo_epi16(lo, _mm_sub_epi16(full, aLo))), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(Color, aHi), _mm_mullo_epi16(hi, _mm_sub_epi16(full, aHi))), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+static void BlendRowSSE2(u32* Row, const uint8_t* Coverage, int Count, u32 Color) {
+    __m128i color = _mm_unpacklo_epi8(_mm_set1_epi32((int)Color), _mm_setzero_si128());
+    int i = 0;
+    for (; i + 4 <= Count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(Row + i));
+        _mm_storeu_si128((__m128i*)(Row + i), BlendFourSSE2(pixels, Coverage + i, color));
+    }
+    BlendRowScalar(Row + i, Coverage + i, Count - i, Color);
+}
+#endif
+
+#if PAINT_X86
+// As BlendFourSSE2, eight pixels at a time. Unpacking works within each
+// 128-bit lane, so the coverage is spread to match: pixels 0, 1, 4, 5 in the
+// low halves and 2, 3, 6, 7 in the high ones.
+PAINT_TARGET_AVX2 static inline __m256i BlendEightAVX2(__m256i Pixels, const uint8_t* Coverage, __m256i Color) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i full = _mm256_set1_epi16(256);
+    __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)Coverage), _mm_setzero_si128());
+    a = _mm_add_epi16(a, _mm_srli_epi16(a, 7));
+    __m256i pairs = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(a, a)), _mm_unpackhi_epi16(a, a), 1);
+    __m256i aLo = _mm256_unpacklo_epi32(pairs, pairs);
+    __m256i aHi = _mm256_unpackhi_epi32(pairs, pairs);
+
+    __m256i lo = _mm256_unpacklo_epi8(Pixels, zero);
+    __m256i hi = _mm256_unpackhi_epi8(Pixels, zero);
+    lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(Color, aLo), _mm256_mullo_epi16(lo, _mm256_sub_epi16(full, aLo))), 8);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(Color, aHi), _mm256_mullo_epi16(hi, _mm256_sub_epi16(full, aHi))), 8);
+    return _mm256_packus_epi16(lo, hi);
+}
+
+PAINT_TARGET_AVX2 static void BlendRowAVX2(u32* Row, const uint8_t* Coverage, int Count, u32 Color) {
+    __m256i color = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)Color), _mm256_setzero_si256());
+    int i = 0;
+    for (; i + 8 <= Count; i += 8) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i*)(Row + i));
+        _mm256_storeu_si256((__m256i*)(Row + i), BlendEightAVX2(pixels, Coverage + i, color));
+    }
+    // Edge runs are mostly a few pixels long, so the rest goes through the
+    // same path with masked loads and stores. The scalar kernel would also run
+    // SSE code with the upper halves still dirty.
+    int rest = Count - i;
+    if (rest > 0) {
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        uint8_t coverage[8] = {};
+        for (int k = 0; k < rest; k++) {
+            coverage[k] = Coverage[i + k];
+        }
+        __m256i pixels = _mm256_maskload_epi32((const int*)(Row + i), mask);
+        _mm256_maskstore_epi32((int*)(Row + i), mask, BlendEightAVX2(pixels, coverage, color));
+    }
+}
+#endif
+
+// X / 255 rounded to nearest, exact for X up to 255 * 255.
+static inline u32 Div255(u32 X) {
+    X += 128;
+    return (X + (X >> 8)) >> 8;
+}
+
+static void CompositeRowScalar(u32* Dest, const u32* Source, int Count, uint8_t Opacity) {
+    for (int i = 0; i < Count; i++) {
+        // Flipping the top byte turns transparency into alpha, and back.
+        u32 source = Source[i] ^ LAYER_CLEAR;
+        u32 dest = Dest[i] ^ LAYER_CLEAR;
+        u32 remaining = 255 - Div255((source >> 24) * Opacity);
+        u32 result = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            u32 channel = Div255(((source >> shift) & 0xff) * Opacity) + Div255(((dest >> shift) & 0xff) * remaining);
+            result |= std::min<u32>(channel, 255) << shift;
+        }
+        Dest[i] = result ^ LAYER_CLEAR;
+    }
+}
+
+#if PAINT_SSE2
+static inline __m128i Div255SSE2(__m128i X) {
+    X = _mm_add_epi16(X, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(X, _mm_srli_epi16(X, 8)), 8);
+}
+
+// Two pixels widened to 16 bits per channel. Each pixel's alpha is spread over
+// its four channels to scale what is underneath.
+static inline __m128i CompositeTwoSSE2(__m128i Dest, __m128i Source, __m128i Opacity) {
+    Source = Div255SSE2(_mm_mullo_epi16(Source, Opacity));
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(Source, 0xff), 0xff);
+    __m128i remaining = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    return _mm_add_epi16(Source, Div255SSE2(_mm_mullo_epi16(Dest, remaining)));
+}
+
+static void CompositeRowSSE2(u32* Dest, const u32* Source, int Count, uint8_t Opacity) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i flip = _mm_set1_epi32((int)LAYER_CLEAR);
+    __m128i opacity = _mm_set1_epi16(Opacity);
+    int i = 0;
+    for (; i + 4 <= Count; i += 4) {
+        __m128i source = _mm_loadu_si128((const __m128i*)(Source + i));
+        // Clear runs are common in upper layers and leave Dest as it is.
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(source, flip)) == 0xffff) {
+            continue;
+        }
+        source = _mm_xor_si128(source, flip);
+        __m128i dest = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(Dest + i)), flip);
+        __m128i lo = CompositeTwoSSE2(_mm_unpacklo_epi8(dest, zero), _mm_unpacklo_epi8(source, zero), opacity);
+        __m128i hi = CompositeTwoSSE2(_mm_unpackhi_epi8(dest, zero), _mm_unpackhi_epi8(source, zero), opacity);
+        _mm_storeu_si128((__m128i*)(Dest + i), _mm_xor_si128(_mm_packus_epi16(lo, hi), flip));
+    }
+    CompositeRowScalar(Dest + i, Source + i, Count - i, Opacity);
+}
+#endif
+
+#if PAINT_X86
+PAINT_TARGET_AVX2 static inline __m256i Div255AVX2(__m256i X) {
+    X = _mm256_add_epi16(X, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(X, _mm256_srli_epi16(X, 8)), 8);
+}
+
+// As CompositeTwoSSE2, two pixels in each 128-bit lane.
+PAINT_TARGET_AVX2 static inline __m256i CompositeFourAVX2(__m256i Dest, __m256i Source, __m256i Opacity) {
+    Source = Div255AVX2(_mm256_mullo_epi16(Source, Opacity));
+    __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(Source, 0xff), 0xff);
+    __m256i remaining = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+    return _mm256_add_epi16(Source, Div255AVX2(_mm256_mullo_epi16(Dest, remaining)));
+}
+
+PAINT_TARGET_AVX2 static inline __m256i CompositeEightAVX2(__m256i Dest, __m256i Source, __m256i Opacity) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i flip = _mm256_set1_epi32((int)LAYER_CLEAR);
+    Source = _mm256_xor_si256(Source, flip);
+    Dest = _mm256_xor_si256(Dest, flip);
+    __m256i lo = CompositeFourAVX2(_mm256_unpacklo_epi8(Dest, zero), _mm256_unpacklo_epi8(Source, zero), Opacity);
+    __m256i hi = CompositeFourAVX2(_mm256_unpackhi_epi8(Dest, zero), _mm256_unpackhi_epi8(Source, zero), Opacity);
+    return _mm256_xor_si256(_mm256_packus_epi16(lo, hi), flip);
+}
+
+PAINT_TARGET_AVX2 static void CompositeRowAVX2(u32* Dest, const u32* Source, int Count, uint8_t Opacity) {
+    __m256i flip = _mm256_set1_epi32((int)LAYER_CLEAR);
+    __m256i opacity = _mm256_set1_epi16(Opacity);
+    int i = 0;
+    for (; i + 8 <= Count; i += 8) {
+        __m256i source = _mm256_loadu_si256((const __m256i*)(Source + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(source, flip)) == -1) {
+            continue;
+        }
+        __m256i dest = _mm256_loadu_si256((const __m256i*)(Dest + i));
+        _mm256_storeu_si256((__m256i*)(Dest + i), CompositeEightAVX2(dest, source, opacity));
+    }
+    // Masked like BlendRowAVX2, so no SSE code runs with the upper halves dirty.
+    int rest = Count - i;
+    if (rest > 0) {
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256i source = _mm256_maskload_epi32((const int*)(Source + i), mask);
+        __m256i dest = _mm256_maskload_epi32((const int*)(Dest + i), mask);
+        _mm256_maskstore_epi32((int*)(Dest + i), mask, CompositeEightAVX2(dest, source, opacity));
+    }
+}
+#endif
+
+// The blend modes of blend.h for one pixel, before it is mixed by coverage.
+template <BlendMode Mode>
+static inline u32 BlendModeScalar(u32 Pixel, u32 Color) {
+    if (Mode == BLEND_NORMAL) {
+        return Color;
+    }
+    u32 result = Color & 0xff000000;
+    for (int shift = 0; shift < 24; shift += 8) {
+        u32 source = (Color >> shift) & 0xff;
+        u32 dest = (Pixel >> shift) & 0xff;
+        u32 channel;
+        if (Mode == BLEND_MULTIPLY) {
+            channel = Div255(source * dest);
+        }
+        else if (Mode == BLEND_SCREEN) {
+            channel = source + dest - Div255(source * dest);
+        }
+        else {
+            channel = std::min<u32>(source + dest, 255);
+        }
+        result |= channel << shift;
+    }
+    return result;
+}
+
+template <BlendMode Mode>
+static void StrokeRowScalar(u32* Dest, const u32* Before, const uint8_t* Coverage, int Count, u32 Color, uint8_t Opacity) {
+    // Mixed as in BlendRowScalar, two channels per multiply.
+    for (int i = 0; i < Count; i++) {
+        u32 a = Div255(Coverage[i] * Opacity);
+        a += a >> 7;
+        u32 pixel = Before[i];
+        u32 color = BlendModeScalar<Mode>(pixel, Color);
+        u32 redBlue = ((color & 0xff00ff) * a + (pixel & 0xff00ff) * (256 - a)) >> 8;
+        u32 alphaGreen = ((color >> 8) & 0xff00ff) * a + ((pixel >> 8) & 0xff00ff) * (256 - a);
+        Dest[i] = (redBlue & 0xff00ff) | (alphaGreen & 0xff00ff00);
+    }
+}
+
+#if PAINT_SSE2
+template <BlendMode Mode>
+static inline __m128i BlendModeSSE2(__m128i Pixels, __m128i Color) {
+    if (Mode == BLEND_NORMAL) {
+        return Color;
+    }
+    __m128i blended;
+    if (Mode == BLEND_ADD) {
+        blended = _mm_adds_epu8(Pixels, Color);
+    }
+    else {
+        __m128i zero = _mm_setzero_si128();
+        __m128i pixelsLo = _mm_unpacklo_epi8(Pixels, zero);
+        __m128i pixelsHi = _mm_unpackhi_epi8(Pixels, zero);
+        __m128i colorLo = _mm_unpacklo_epi8(Color, zero);
+        __m128i lo = Div255SSE2(_mm_mullo_epi16(pixelsLo, colorLo));
+        __m128i hi = Div255SSE2(_mm_mullo_epi16(pixelsHi, colorLo));
+        if (Mode == BLEND_SCREEN) {
+            lo = _mm_sub_epi16(_mm_add_epi16(pixelsLo, colorLo), lo);
+            hi = _mm_sub_epi16(_mm_add_epi16(pixelsHi, colorLo), hi);
+        }
+        blended = _mm_packus_epi16(lo, hi);
+    }
+    // Transparency is always the stroke's.
+    __m128i top = _mm_set1_epi32((int)0xff000000);
+    return _mm_or_si128(_mm_andnot_si128(top, blended), _mm_and_si128(top, Color));
+}
+
+// As BlendFourSSE2, with a colour per pixel and coverage scaled by opacity.
+template <BlendMode Mode>
+static inline __m128i StrokeFourSSE2(__m128i Pixels, const uint8_t* Coverage, __m128i Color, __m128i Opacity) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i full = _mm_set1_epi16(256);
+    int coverage;
+    memcpy(&coverage, Coverage, 4);
+    __m128i a = Div255SSE2(_mm_mullo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(coverage), zero), Opacity));
+    a = _mm_add_epi16(a, _mm_srli_epi16(a, 7));
+    a = _mm_unpacklo_epi16(a, a);
+    __m128i aLo = _mm_unpacklo_epi32(a, a);
+    __m128i aHi = _mm_unpackhi_epi32(a, a);
+
+    __m128i color = BlendModeSSE2<Mode>(Pixels, Color);
+    __m128i lo = _mm_unpacklo_epi8(Pixels, zero);
+    __m128i hi = _mm_unpackhi_epi8(Pixels, zero);
+    lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(color, zero), aLo), _mm_mullo_epi16(lo, _mm_sub_epi16(full, aLo))), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(color, zero), aHi), _mm_mullo_epi16(hi, _mm_sub_epi16(full, aHi))), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+template <BlendMode Mode>
+static void StrokeRowSSE2(u32* Dest, const u32* Before, const uint8_t* Coverage, int Count, u32 Color, uint8_t Opacity) {
+    __m128i color = _mm_set1_epi32((int)Color);
+    __m128i opacity = _mm_set1_epi16(Opacity);
+    int i = 0;
+    for (; i + 4 <= Count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(Before + i));
+        _mm_storeu_si128((__m128i*)(Dest + i), StrokeFourSSE2<Mode>(pixels, Coverage + i, color, opacity));
+    }
+    StrokeRowScalar<Mode>(Dest + i, Before + i, Coverage + i, Count - i, Color, Opacity);
+}
+#endif
+
+#if PAINT_X86
+template <BlendMode Mode>
+PAINT_TARGET_AVX2 static inline __m256i BlendModeAVX2(__m256i Pixels, __m256i Color) {
+    if (Mode == BLEND_NORMAL) {
+        return Color;
+    }
+    __m256i blended;
+    if (Mode == BLEND_ADD) {
+        blended = _mm256_adds_epu8(Pixels, Color);
+    }
+    else {
+        __m256i zero = _mm256_setzero_si256();
+        __m256i pixelsLo = _mm256_unpacklo_epi8(Pixels, zero);
+        __m256i pixelsHi = _mm256_unpackhi_epi8(Pixels, zero);
+        __m256i colorLo = _mm256_unpacklo_epi8(Color, zero);
+        __m256i lo = Div255AVX2(_mm256_mullo_epi16(pixelsLo, colorLo));
+        __m256i hi = Div255AVX2(_mm256_mullo_epi16(pixelsHi, colorLo));
+        if (Mode == BLEND_SCREEN) {
+            lo = _mm256_sub_epi16(_mm256_add_epi16(pixelsLo, colorLo), lo);
+            hi = _mm256_sub_epi16(_mm256_add_epi16(pixelsHi, colorLo), hi);
+        }
+        blended = _mm256_packus_epi16(lo, hi);
+    }
+    __m256i top = _mm256_set1_epi32((int)0xff000000);
+    return _mm256_or_si256(_mm256_andnot_si256(top, blended), _mm256_and_si256(top, Color));
+}
+
+// As BlendEightAVX2, with a colour per pixel and coverage scaled by opacity.
+template <BlendMode Mode>
+PAINT_TARGET_AVX2 static inline __m256i StrokeEightAVX2(__m256i Pixels, const uint8_t* Coverage, __m256i Color, __m128i Opacity) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i full = _mm256_set1_epi16(256);
+    __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)Coverage), _mm_setzero_si128());
+    a = Div255SSE2(_mm_mullo_epi16(a, Opacity));
+    a = _mm_add_epi16(a, _mm_srli_epi16(a, 7));
+    __m256i pairs = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(a, a)), _mm_unpackhi_epi16(a, a), 1);
+    __m256i aLo = _mm256_unpacklo_epi32(pairs, pairs);
+    __m256i aHi = _mm256_unpackhi_epi32(pairs, pairs);
+
+    __m256i color = BlendModeAVX2<Mode>(Pixels, Color);
+    __m256i lo = _mm256_unpacklo_epi8(Pixels, zero);
+    __m256i hi = _mm256_unpackhi_epi8(Pixels, zero);
+    lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(color, zero), aLo), _mm256_mullo_epi16(lo, _mm256_sub_epi16(full, aLo))), 8);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(color, zero), aHi), _mm256_mullo_epi16(hi, _mm256_sub_epi16(full, aHi))), 8);
+    return _mm256_packus_epi16(lo, hi);
+}
+
+template <BlendMode Mode>
+PAINT_TARGET_AVX2 static void StrokeRowAVX2(u32* Dest, const u32* Before, const uint8_t* Coverage, int Count, u32 Color, uint8_t Opacity) {
+    __m256i color = _mm256_set1_epi32((int)Color);
+    __m128i opacity = _mm_set1_epi16(Opacity);
+    int i = 0;
+    for (; i + 8 <= Count; i += 8) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i*)(Before + i));
+        _mm256_storeu_si256((__m256i*)(Dest + i), StrokeEightAVX2<Mode>(pixels, Coverage + i, color, opacity));
+    }
+    int rest = Count - i;
+    if (rest > 0) {
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        uint8_t coverage[8] = {};
+        for (int k = 0; k < rest; k++) {
+            coverage[k] = Coverage[i + k];
+        }
+        __m256i pixels = _mm256_maskload_epi32((const int*)(Before + i), mask);
+        _mm256_maskstore_epi32((int*)(Dest + i), mask, StrokeEightAVX2<Mode>(pixels, coverage, color, opacity));
+    }
+}
+#endif
+
+static void GradientRowScalar(u32* Row, const int32_t* Positions, int Count, u32 From, u32 To, const int32_t* Thresholds) {
+    int32_t fromR = From >> 16 & 0xff, fromG = From >> 8 & 0xff, fromB = From & 0xff;
+    int32_t deltaR = (int32_t)(To >> 16 & 0xff) - fromR;
+    int32_t deltaG = (int32_t)(To >> 8 & 0xff) - fromG;
+    int32_t deltaB = (int32_t)(To & 0xff) - fromB;
+    for (int i = 0; i < Count; i++) {
+        int32_t position = Positions[i];
+        int32_t threshold = Thresholds[i & 3];
+        u32 r = ((fromR << 16) + deltaR * position + threshold) >> 16;
+        u32 g = ((fromG << 16) + deltaG * position + threshold) >> 16;
+        u32 b = ((fromB << 16) + deltaB * position + threshold) >> 16;
+        Row[i] = r << 16 | g << 8 | b;
+    }
+}
+
+#if PAINT_SSE2
+// The low 32 bits of each lane's product; SSE2 only multiplies even lanes.
+static inline __m128i MulLo32SSE2(__m128i A, __m128i B) {
+    __m128i even = _mm_mul_epu32(A, B);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(A, 32), _mm_srli_epi64(B, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// One channel of four pixels, in place: From plus its threshold, both in
+// 16.16, and the difference to To.
+static inline __m128i GradientChannelSSE2(__m128i Positions, __m128i Base, __m128i Delta, int Shift) {
+    __m128i channel = _mm_add_epi32(Base, MulLo32SSE2(Positions, Delta));
+    return _mm_slli_epi32(_mm_srli_epi32(channel, 16), Shift);
+}
+
+static void GradientRowSSE2(u32* Row, const int32_t* Positions, int Count, u32 From, u32 To, const int32_t* Thresholds) {
+    // Four lanes keep the threshold pattern in step with i.
+    __m128i thresholds = _mm_loadu_si128((const __m128i*)Thresholds);
+    __m128i baseR = _mm_add_epi32(_mm_set1_epi32((int32_t)(From >> 16 & 0xff) << 16), thresholds);
+    __m128i baseG = _mm_add_epi32(_mm_set1_epi32((int32_t)(From >> 8 & 0xff) << 16), thresholds);
+    __m128i baseB = _mm_add_epi32(_mm_set1_epi32((int32_t)(From & 0xff) << 16), thresholds);
+    __m128i deltaR = _mm_set1_epi32((int32_t)(To >> 16 & 0xff) - (int32_t)(From >> 16 & 0xff));
+    __m128i deltaG = _mm_set1_epi32((int32_t)(To >> 8 & 0xff) - (int32_t)(From >> 8 & 0xff));
+    __m128i deltaB = _mm_set1_epi32((int32_t)(To & 0xff) - (int32_t)(From & 0xff));
+    int i = 0;
+    for (; i + 4 <= Count; i += 4) {
+        __m128i positions = _mm_loadu_si128((const __m128i*)(Positions + i));
+        __m128i pixels = _mm_or_si128(_mm_or_si128(GradientChannelSSE2(positions, baseR, deltaR, 16),
+            GradientChannelSSE2(positions, baseG, deltaG, 8)), GradientChannelSSE2(positions, baseB, deltaB, 0));
+        _mm_storeu_si128((__m128i*)(Row + i), pixels);
+    }
+    GradientRowScalar(Row + i, Positions + i, Count - i, From, To, Thresholds);
+}
+#endif
+
+#if PAINT_X86
+PAINT_TARGET_AVX2 static inline __m256i GradientChannelAVX2(__m256i Positions, __m256i Base, __m256i Delta, int Shift) {
+    __m256i channel = _mm256_add_epi32(Base, _mm256_mullo_epi32(Positions, Delta));
+    return _mm256_slli_epi32(_mm256_srli_epi32(channel, 16), Shift);
+}
+
+PAINT_TARGET_AVX2 static void GradientRowAVX2(u32* Row, const int32_t* Positions, int Count, u32 From, u32 To, const int32_t* Thresholds) {
+    __m128i pattern = _mm_loadu_si128((const __m128i*)Thresholds);
+    __m256i thresholds = _mm256_inserti128_si256(_mm256_castsi128_si256(pattern), pattern, 1);
+    __m256i baseR = _mm256_add_epi32(_mm256_set1_epi32((int32_t)(From >> 16 & 0xff) << 16), thresholds);
+    __m256i baseG = _mm256_add_epi32(_mm256_set1_epi32((int32_t)(From >> 8 & 0xff) << 16), thresholds);
+    __m256i baseB = _mm256_add_epi32(_mm256_set1_epi32((int32_t)(From & 0xff) << 16), thresholds);
+    __m256i deltaR = _mm256_set1_epi32((int32_t)(To >> 16 & 0xff) - (int32_t)(From >> 16 & 0xff));
+    __m256i deltaG = _mm256_set1_epi32((int32_t)(To >> 8 & 0xff) - (int32_t)(From >> 8 & 0xff));
+    __m256i deltaB = _mm256_set1_epi32((int32_t)(To & 0xff) - (int32_t)(From & 0xff));
+    int i = 0;
+    for (; i + 8 <= Count; i += 8) {
+        __m256i positions = _mm256_loadu_si256((const __m256i*)(Positions + i));
+        __m256i pixels = _mm256_or_si256(_mm256_or_si256(GradientChannelAVX2(positions, baseR, deltaR, 16),
+            GradientChannelAVX2(positions, baseG, deltaG, 8)), GradientChannelAVX2(positions, baseB, deltaB, 0));
+        _mm256_storeu_si256((__m256i*)(Row + i), pixels);
+    }
+    // Masked, like BlendRowAVX2, rather than SSE code with the upper halves
+    // dirty.
+    int rest = Count - i;
+    if (rest > 0) {
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256i positions = _mm256_maskload_epi32((const int*)(Positions + i), mask);
+        __m256i pixels = _mm256_or_si256(_mm256_or_si256(GradientChannelAVX2(positions, baseR, deltaR, 16),
+            GradientChannelAVX2(positions, baseG, deltaG, 8)), GradientChannelAVX2(positions, baseB, deltaB, 0));
+        _mm256_maskstore_epi32((int*)(Row + i), mask, pixels);
+    }
+}
+#endif
+
+// Every kernel does the same float operations in the same order, so they
+// agree exactly.
+static void RadialPositionsScalar(int32_t* Positions, int Count, float DX, float DY2, float Scale) {
+    for (int i = 0; i < Count; i++) {
+        float dx = DX + (float)i;
+        Positions[i] = (int32_t)std::min(sqrtf(dx * dx + DY2) * Scale, 65536.0f);
+    }
+}
+
+#if PAINT_SSE2
+static void RadialPositionsSSE2(int32_t* Positions, int Count, float DX, float DY2, float Scale) {
+    __m128 dx = _mm_add_ps(_mm_set1_ps(DX), _mm_setr_ps(0, 1, 2, 3));
+    __m128 dy2 = _mm_set1_ps(DY2);
+    __m128 scale = _mm_set1_ps(Scale);
+    __m128 one = _mm_set1_ps(65536.0f);
+    int i = 0;
+    for (; i + 4 <= Count; i += 4) {
+        __m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), dy2));
+        _mm_storeu_si128((__m128i*)(Positions + i), _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(distance, scale), one)));
+        dx = _mm_add_ps(dx, _mm_set1_ps(4.0f));
+    }
+    RadialPositionsScalar(Positions + i, Count - i, DX + (float)i, DY2, Scale);
+}
+#endif
+
+#if PAINT_X86
+PAINT_TARGET_AVX2 static void RadialPositionsAVX2(int32_t* Positions, int Count, float DX, float DY2, float Scale) {
+    __m256 dx = _mm256_add_ps(_mm256_set1_ps(DX), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256 dy2 = _mm256_set1_ps(DY2);
+    __m256 scale = _mm256_set1_ps(Scale);
+    __m256 one = _mm256_set1_ps(65536.0f);
+    int i = 0;
+    for (; i < Count; i += 8) {
+        __m256 distance = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), dy2));
+        __m256i positions = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(distance, scale), one));
+        if (i + 8 <= Count) {
+            _mm256_storeu_si256((__m256i*)(Positions + i), positions);
+        }
+        else {
+            __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(Count - i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+            _mm256_maskstore_epi32((int*)(Positions + i), mask, positions);
+        }
+        dx = _mm256_add_ps(dx, _mm256_set1_ps(8.0f));
+    }
+}
+#endif
+
+// Two channels at a time in the even and odd bytes; four 8-bit values add up
+// to no more than 10 bits, so neither spills into the next.
+static void DownsampleRowScalar(u32* Dest, const u32* Top, const u32* Bottom, int Count) {
+    for (int i = 0; i < Count; i++) {
+        u32 a = Top[i * 2], b = Top[i * 2 + 1], c = Bottom[i * 2], d = Bottom[i * 2 + 1];
+        u32 even = (a & 0x00ff00ff) + (b & 0x00ff00ff) + (c & 0x00ff00ff) + (d & 0x00ff00ff) + 0x00020002;
+        u32 odd = (a >> 8 & 0x00ff00ff) + (b >> 8 & 0x00ff00ff) + (c >> 8 & 0x00ff00ff) + (d >> 8 & 0x00ff00ff) + 0x00020002;
+        Dest[i] = (even >> 2 & 0x00ff00ff) | (odd >> 2 & 0x00ff00ff) << 8;
+    }
+}
+
+#if PAINT_SSE2
+// The four pixels Dest[0..3] come from: even and odd pixels of both rows are
+// split apart, then added up a channel per 16-bit lane.
+static inline __m128i DownsampleFourSSE2(const u32* Top, const u32* Bottom) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i sumLo = _mm_set1_epi16(2);
+    __m128i sumHi = sumLo;
+    for (const u32* row : { Top, Bottom }) {
+        __m128i a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)row), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(row + 4)), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i even = _mm_unpacklo_epi64(a, b);
+        __m128i odd = _mm_unpackhi_epi64(a, b);
+        sumLo = _mm_add_epi16(sumLo, _mm_add_epi16(_mm_unpacklo_epi8(even, zero), _mm_unpacklo_epi8(odd, zero)));
+        sumHi = _mm_add_epi16(sumHi, _mm_add_epi16(_mm_unpackhi_epi8(even, zero), _mm_unpackhi_epi8(odd, zero)));
+    }
+    return _mm_packus_epi16(_mm_srli_epi16(sumLo, 2), _mm_srli_epi16(sumHi, 2));
+}
+
+static void DownsampleRowSSE2(u32* Dest, const u32* Top, const u32* Bottom, int Count) {
+    int i = 0;
+    for (; i + 4 <= Count; i += 4) {
+        _mm_storeu_si128((__m128i*)(Dest + i), DownsampleFourSSE2(Top + i * 2, Bottom + i * 2));
+    }
+    DownsampleRowScalar(Dest + i, Top + i * 2, Bottom + i * 2, Count - i);
+}
+#endif
+
+#if PAINT_X86
+// As DownsampleFourSSE2, eight at a time. The shuffles stay within 128-bit
+// lanes, so the results come out in the order 0 1 4 5 2 3 6 7 and a last
+// permute puts them back.
+PAINT_TARGET_AVX2 static inline __m256i DownsampleEightAVX2(__m256i TopA, __m256i TopB, __m256i BottomA, __m256i BottomB) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sumLo = _mm256_set1_epi16(2);
+    __m256i sumHi = sumLo;
+    __m256i rows[2][2] = { { TopA, TopB }, { BottomA, BottomB } };
+    for (auto& row : rows) {
+        __m256i a = _mm256_shuffle_epi32(row[0], _MM_SHUFFLE(3, 1, 2, 0));
+        __m256i b = _mm256_shuffle_epi32(row[1], _MM_SHUFFLE(3, 1, 2, 0));
+        __m256i even = _mm256_unpacklo_epi64(a, b);
+        __m256i odd = _mm256_unpackhi_epi64(a, b);
+        sumLo = _mm256_add_epi16(sumLo, _mm256_add_epi16(_mm256_unpacklo_epi8(even, zero), _mm256_unpacklo_epi8(odd, zero)));
+        sumHi = _mm256_add_epi16(sumHi, _mm256_add_epi16(_mm256_unpackhi_epi8(even, zero), _mm256_unpackhi_epi8(odd, zero)));
+    }
+    __m256i packed = _mm256_packus_epi16(_mm256_srli_epi16(sumLo, 2), _mm256_srli_epi16(sumHi, 2));
+    return _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+PAINT_TARGET_AVX2 static void DownsampleRowAVX2(u32* Dest, const u32* Top, const u32* Bottom, int Count) {
+    int i = 0;
+    for (; i + 8 <= Count; i += 8) {
+        __m256i topA = _mm256_loadu_si256((const __m256i*)(Top + i * 2));
+        __m256i topB = _mm256_loadu_si256((const __m256i*)(Top + i * 2 + 8));
+        __m256i bottomA = _mm256_loadu_si256((const __m256i*)(Bottom + i * 2));
+        __m256i bottomB = _mm256_loadu_si256((const __m256i*)(Bottom + i * 2 + 8));
+        _mm256_storeu_si256((__m256i*)(Dest + i), DownsampleEightAVX2(topA, topB, bottomA, bottomB));
+    }
+    // Masked, like BlendRowAVX2, rather than SSE code with the upper halves
+    // dirty.
+    int rest = Count - i;
+    if (rest > 0) {
+        __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i maskA = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest * 2), lanes);
+        __m256i maskB = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest * 2 - 8), lanes);
+        __m256i topA = _mm256_maskload_epi32((const int*)(Top + i * 2), maskA);
+        __m256i topB = _mm256_maskload_epi32((const int*)(Top + i * 2 + 8), maskB);
+        __m256i bottomA = _mm256_maskload_epi32((const int*)(Bottom + i * 2), maskA);
+        __m256i bottomB = _mm256_maskload_epi32((const int*)(Bottom + i * 2 + 8), maskB);
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), lanes);
+        _mm256_maskstore_epi32((int*)(Dest + i), mask, DownsampleEightAVX2(topA, topB, bottomA, bottomB));
+    }
+}
+#endif
+
+static SpanKernel SupportedKernel(SpanKernel Kernel) {
+    const CpuFeatures& cpu = GetCpuFeatures();
+#if PAINT_X86
+    if (Kernel == SPAN_KERNEL_AVX2 && cpu.AVX2) {
+        return SPAN_KERNEL_AVX2;
+    }
+#endif
+#if PAINT_SSE2
+    if (Kernel >= SPAN_KERNEL_SSE2 && cpu.SSE2) {
+        return SPAN_KERNEL_SSE2;
+    }
+#endif
+    (void)cpu;
+    return SPAN_KERNEL_SCALAR;
+}
+
+static FillRowProc KernelProc(SpanKernel Kernel) {
+    switch (Kernel) {
+#if PAINT_X86
+    case SPAN_KERNEL_AVX2:
+        return FillRowAVX2;
+#endif
+#if PAINT_SSE2
+    case SPAN_KERNEL_SSE2:
+        return FillRowSSE2;
+#endif
+    default:
+        return FillRowScalar;
+    }
+}
+
+static BlendRowProc BlendKernelProc(SpanKernel Kernel) {
+    switch (Kernel) {
+#if PAINT_X86
+    case SPAN_KERNEL_AVX2:
+        return BlendRowAVX2;
+#endif
+#if PAINT_SSE2
+    case SPAN_KERNEL_SSE2:
+        return BlendRowSSE2;
+#endif
+    default:
+        return BlendRowScalar;
+    }
+}
+
+static CompositeRowProc CompositeKernelProc(SpanKernel Kernel) {
+    switch (Kernel) {
+#if PAINT_X86
+    case SPAN_KERNEL_AVX2:
+        return CompositeRowAVX2;
+#endif
+#if PAINT_SSE2
+    case SPAN_KERNEL_SSE2:
+        return CompositeRowSSE2;
+#endif
+    default:
+        return CompositeRowScalar;
+    }
+}
+
+template <BlendMode Mode>
+static StrokeRowProc StrokeKernelProc(SpanKernel Kernel) {
+    switch (Kernel) {
+#if PAINT_X86
+    case SPAN_KERNEL_AVX2:
+        return StrokeRowAVX2<Mode>;
+#endif
+#if PAINT_SSE2
+    case SPAN_KERNEL_SSE2:
+        return StrokeRowSSE2<Mode>;
+#endif
+    default:
+        return StrokeRowScalar<Mode>;
+    }
+}
+
+static GradientRowProc GradientKernelProc(SpanKernel Kernel) {
+    switch (Kernel) {
+#if PAINT_X86
+    case SPAN_KERNEL_AVX2:
+        return GradientRowAVX2;
+#endif
+#if PAINT_SSE2
+    case SPAN_KERNEL_SSE2:
+        return GradientRowSSE2;
+#endif
+    default:
+        return GradientRowScalar;
+    }
+}
+
+static RadialPositionsProc RadialKernelProc(SpanKernel Kernel) {
+    switch (Kernel) {
+#if PAINT_X86
+    case SPAN_KERNEL_AVX2:
+        return RadialPositionsAVX2;
+#endif
+#if PAINT_SSE2
+    case SPAN_KERNEL_SSE2:
+        return RadialPositionsSSE2;
+#endif
+    default:
+        return RadialPositionsScalar;
+    }
+}
+
+static DownsampleRowProc DownsampleKernelProc(SpanKernel Kernel) {
+    switch (Kernel) {
+#if PAINT_X86
+    case SPAN_KERNEL_AVX2:
+        return DownsampleRowAVX2;
+#endif
+#if PAINT_SSE2
+    case SPAN_KERNEL_SSE2:
+        return DownsampleRowSSE2;
+#endif
+    default:
+        return DownsampleRowScalar;
+    }
+}
+
+static void StrokeKernelProcs(SpanKernel Kernel, StrokeRowProc* Procs) {
+    Procs[BLEND_NORMAL] = StrokeKernelProc<BLEND_NORMAL>(Kernel);
+    Procs[BLEND_MULTIPLY] = StrokeKernelProc<BLEND_MULTIPLY>(Kernel);
+    Procs[BLEND_SCREEN] = StrokeKernelProc<BLEND_SCREEN>(Kernel);
+    Procs[BLEND_ADD] = StrokeKernelProc<BLEND_ADD>(Kernel);
+}
+
+static SpanKernel CurrentKernel = SupportedKernel(SPAN_KERNEL_AVX2);
+static FillRowProc FillRowKernel = KernelProc(CurrentKernel);
+static BlendRowProc BlendRowKernel = BlendKernelProc(CurrentKernel);
+static CompositeRowProc CompositeRowKernel = CompositeKernelProc(CurrentKernel);
+static GradientRowProc GradientRowKernel = GradientKernelProc(CurrentKernel);
+static RadialPositionsProc RadialPositionsKernel = RadialKernelProc(CurrentKernel);
+static DownsampleRowProc DownsampleRowKernel = DownsampleKernelProc(CurrentKernel);
+static StrokeRowProc StrokeRowKernels[BLEND_MODE_COUNT] = {
+    StrokeKernelProc<BLEND_NORMAL>(CurrentKernel),
+    StrokeKernelProc<BLEND_MULTIPLY>(CurrentKernel),
+    StrokeKernelProc<BLEND_SCREEN>(CurrentKernel),
+    StrokeKernelProc<BLEND_ADD>(CurrentKernel)
+};
+
+void SetSpanKernel(SpanKernel Kernel) {
+    CurrentKernel = SupportedKernel(Kernel);
+    FillRowKernel = KernelProc(CurrentKernel);
+    BlendRowKernel = BlendKernelProc(CurrentKernel);
+    CompositeRowKernel = CompositeKernelProc(CurrentKernel);
+    GradientRowKernel = GradientKernelProc(CurrentKernel);
+    RadialPositionsKernel = RadialKernelProc(CurrentKernel);
+    DownsampleRowKernel = DownsampleKernelProc(CurrentKernel);
+    StrokeKernelProcs(CurrentKernel, StrokeRowKernels);
+}
+
+SpanKernel GetSpanKernel() {
+    return CurrentKernel;
+}
+
+const char* SpanKernelName(SpanKernel Kernel) {
+    switch (Kernel) {
+    case SPAN_KERNEL_AVX2:
+        return "avx2";
+    case SPAN_KERNEL_SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+void FillRow(u32* Row, int Count, u32 Color) {
+    FillRowKernel(Row, Count, Color);
+}
+
+void BlendRow(u32* Row, const uint8_t* Coverage, int Count, u32 Color) {
+    BlendRowKernel(Row, Coverage, Count, Color);
+}
+
+void CompositeRow(u32* Dest, const u32* Source, int Count, uint8_t Opacity) {
+    CompositeRowKernel(Dest, Source, Count, Opacity);
+}
+
+void StrokeRow(u32* Dest, const u32* Before, const uint8_t* Coverage, int Count, u32 Color, uint8_t Opacity, BlendMode Mode) {
+    StrokeRowKernels[Mode](Dest, Before, Coverage, Count, Color, Opacity);
+}
+
+void GradientRow(u32* Row, const int32_t* Positions, int Count, u32 From, u32 To, const int32_t* Thresholds) {
+    GradientRowKernel(Row, Positions, Count, From, To, Thresholds);
+}
+
+void RadialPositions(int32_t* Positions, int Count, float DX, float DY2, float Scale) {
+    RadialPositionsKernel(Positions, Count, DX, DY2, Scale);
+}
+
+void DownsampleRow(u32* Dest, const u32* Top, const u32* Bottom, int Count) {
+    DownsampleRowKernel(Dest, Top, Bottom, Count);
+}
+
+// Fills the part of Rect (already clipped) in one row of tiles. Tiles the
+// rectangle covers completely become Uniform, created on first use, and tiles
+// that are already uniform in Color are left alone.
+static void FillTileRow(Canvas& Target, const PixelRect& Rect, int TileRow, u32 Color, TileRef& Uniform) {
+    for (int tx = Rect.X0 >> TILE_SHIFT; tx <= (Rect.X1 - 1) >> TILE_SHIFT; tx++) {
+        int tile = TileRow * Target.TilesX + tx;
+        const CanvasTile& current = *Target.Tiles[tile];
+        if (current.Pixels.empty() && current.Uniform == Color) {
+            continue;
+        }
+
+        PixelRect bounds = TileBounds(Target, tile);
+        PixelRect part = Intersect(Rect, bounds);
+        if (part.X0 == bounds.X0 && part.Y0 == bounds.Y0 && part.X1 == bounds.X1 && part.Y1 == bounds.Y1) {
+            if (!Uniform) {
+                Uniform = MakeUniformTile(Target, Color);
+            }
+            SetTileUniform(Target, tile, Uniform);
+            continue;
+        }
+
+        u32* pixels = WritableTile(Target, tile);
+        for (int y = part.Y0; y < part.Y1; y++) {
+            FillRowKernel(pixels + (y & TILE_MASK) * TILE_SIZE + (part.X0 & TILE_MASK), part.X1 - part.X0, Color);
+        }
+    }
+}
+
+static void FillSpanUnmasked(Canvas& Target, int Y, int X0, int X1, u32 Color) {
+    // Single rows are the bulk of stroke and shape rasterization, so they skip
+    // the whole-tile checks FillRect makes.
+    if (Target.Blend) {
+        BlendStrokeSpan(Target, Y, X0, nullptr, X1 - X0, Color);
+        return;
+    }
+    if (Y < 0 || Y >= Target.Height) {
+        return;
+    }
+    X0 = std::max(X0, 0);
+    X1 = std::min(X1, Target.Width);
+    if (X0 >= X1) {
+        return;
+    }
+    TracePixelsWritten(X1 - X0);
+    int rowOffset = (Y & TILE_MASK) * TILE_SIZE;
+    for (int x = X0; x < X1;) {
+        int end = std::min(X1, (x | TILE_MASK) + 1);
+        int tile = TileIndex(Target, x, Y);
+        const CanvasTile& current = *Target.Tiles[tile];
+        if (!current.Pixels.empty() || current.Uniform != Color) {
+            FillRowKernel(WritableTile(Target, tile) + rowOffset + (x & TILE_MASK), end - x, Color);
+        }
+        x = end;
+    }
+    MarkDirty(Target, X0, Y, X1, Y + 1);
+}
+
+void FillSpan(Canvas& Target, int Y, int X0, int X1, u32 Color) {
+    if (Target.Selection) {
+        ForEachSelectedRun(*Target.Selection, Y, X0, X1, [&](int RunX0, int RunX1) {
+            FillSpanUnmasked(Target, Y, RunX0, RunX1, Color);
+        });
+        return;
+    }
+    FillSpanUnmasked(Target, Y, X0, X1, Color);
+}
+
+static void BlendSpanUnmasked(Canvas& Target, int Y, int X0, const uint8_t* Coverage, int Count, u32 Color) {
+    if (Target.Blend) {
+        BlendStrokeSpan(Target, Y, X0, Coverage, Count, Color);
+        return;
+    }
+    if (Y < 0 || Y >= Target.Height) {
+        return;
+    }
+    int x0 = std::max(X0, 0);
+    int x1 = std::min(X0 + Count, Target.Width);
+    if (x0 >= x1) {
+        return;
+    }
+    TracePixelsWritten(x1 - x0);
+    Coverage += x0 - X0;
+    int rowOffset = (Y & TILE_MASK) * TILE_SIZE;
+    for (int x = x0; x < x1;) {
+        int end = std::min(x1, (x | TILE_MASK) + 1);
+        int tile = TileIndex(Target, x, Y);
+        const CanvasTile& current = *Target.Tiles[tile];
+        // Blending a colour into itself changes nothing.
+        if (!current.Pixels.empty() || current.Uniform != Color) {
+            BlendRowKernel(WritableTile(Target, tile) + rowOffset + (x & TILE_MASK), Coverage, end - x, Color);
+        }
+        Coverage += end - x;
+        x = end;
+    }
+    MarkDirty(Target, x0, Y, x1, Y + 1);
+}
+
+void BlendSpan(Canvas& Target, int Y, int X0, const uint8_t* Coverage, int Count, u32 Color) {
+    if (Target.Selection) {
+        ForEachSelectedRun(*Target.Selection, Y, X0, X0 + Count, [&](int RunX0, int RunX1) {
+            BlendSpanUnmasked(Target, Y, RunX0, Coverage + (RunX0 - X0), RunX1 - RunX0, Color);
+        });
+        return;
+    }
+    BlendSpanUnmasked(Target, Y, X0, Coverage, Count, Color);
+}
+
+// FillTileRow for a stroke in progress: every pixel is blended, whole tiles
+// included.
+static void BlendTileRow(Canvas& Target, const PixelRect& Rect, int TileRow, u32 Color) {
+    int y0 = std::max(Rect.Y0, TileRow * TILE_SIZE);
+    int y1 = std::min(Rect.Y1, (TileRow + 1) * TILE_SIZE);
+    for (int tx = Rect.X0 >> TILE_SHIFT; tx <= (Rect.X1 - 1) >> TILE_SHIFT; tx++) {
+        int x0 = std::max(Rect.X0, tx * TILE_SIZE);
+        int x1 = std::min(Rect.X1, (tx + 1) * TILE_SIZE);
+        for (int y = y0; y < y1; y++) {
+            BlendStrokeRun(Target, TileRow * Target.TilesX + tx, y, x0, nullptr, x1 - x0, Color);
+        }
+    }
+}
+
+static void FillSpansUnmasked(Canvas& Target, const std::vector<PixelSpan>& Spans, u32 Color);
+
+void FillRect(Canvas& Target, int X0, int Y0, int X1, int Y1, u32 Color) {
+    PixelRect rect = Intersect({ X0, Y0, X1, Y1 }, CanvasBounds(Target));
+    if (IsEmpty(rect)) {
+        return;
+    }
+    // Whatever the selection cuts out of the rectangle is left to FillSpans,
+    // which still makes whole tiles uniform.
+    if (Target.Selection && !SelectionCovers(*Target.Selection, rect)) {
+        std::vector<PixelSpan> spans;
+        for (int y = rect.Y0; y < rect.Y1; y++) {
+            ForEachSelectedRun(*Target.Selection, y, rect.X0, rect.X1, [&](int RunX0, int RunX1) {
+                spans.push_back({ y, RunX0, RunX1 });
+            });
+        }
+        FillSpansUnmasked(Target, spans, Color);
+        return;
+    }
+    TracePixelsWritten((int64_t)(rect.X1 - rect.X0) * (rect.Y1 - rect.Y0));
+    int firstRow = rect.Y0 >> TILE_SHIFT;
+    int rows = ((rect.Y1 - 1) >> TILE_SHIFT) - firstRow + 1;
+    bool isLarge = (size_t)(rect.X1 - rect.X0) * (rect.Y1 - rect.Y0) >= PARALLEL_RASTER_PIXELS;
+    if (Target.Blend) {
+        if (isLarge) {
+            ParallelFor(rows, [&](int Row) {
+                BlendTileRow(Target, rect, firstRow + Row, Color);
+            });
+        }
+        else {
+            for (int row = 0; row < rows; row++) {
+                BlendTileRow(Target, rect, firstRow + row, Color);
+            }
+        }
+        MarkDirty(Target, rect.X0, rect.Y0, rect.X1, rect.Y1);
+        return;
+    }
+    TileRef uniform;
+    if (isLarge) {
+        // Created up front so the jobs only ever read it.
+        uniform = MakeUniformTile(Target, Color);
+        ParallelFor(rows, [&](int Row) {
+            TileRef shared = uniform;
+            FillTileRow(Target, rect, firstRow + Row, Color, shared);
+        });
+    }
+    else {
+        for (int row = 0; row < rows; row++) {
+            FillTileRow(Target, rect, firstRow + row, Color, uniform);
+        }
+    }
+    MarkDirty(Target, rect.X0, rect.Y0, rect.X1, rect.Y1);
+}
+
+void AddSpan(const Canvas& Target, std::vector<PixelSpan>& Spans, int Y, int X0, int X1) {
+    X0 = std::max(X0, 0);
+    X1 = std::min(X1, Target.Width);
+    if (Y >= 0 && Y < Target.Height && X0 < X1) {
+        Spans.push_back({ Y, X0, X1 });
+    }
+}
+
+// Writes the spans of one row of tiles. Spans never overlap, so a tile whose
+// spans add up to its whole area is covered and just becomes Uniform, unless
+// they are blended into a stroke.
+static void FillSpanBin(Canvas& Target, const PixelSpan* Spans, size_t Count, u32 Color, const TileRef& Uniform, std::vector<int>& Covered) {
+    if (Target.Blend) {
+        for (size_t i = 0; i < Count; i++) {
+            const PixelSpan& span = Spans[i];
+            for (int x = span.X0; x < span.X1;) {
+                int end = std::min(span.X1, (x | TILE_MASK) + 1);
+                BlendStrokeRun(Target, TileIndex(Target, x, span.Y), span.Y, x, nullptr, end - x, Color);
+                x = end;
+            }
+        }
+        return;
+    }
+    Covered.assign(Target.TilesX, 0);
+    for (size_t i = 0; i < Count; i++) {
+        for (int tx = Spans[i].X0 >> TILE_SHIFT; tx <= (Spans[i].X1 - 1) >> TILE_SHIFT; tx++) {
+            Covered[tx] += std::min(Spans[i].X1, (tx + 1) * TILE_SIZE) - std::max(Spans[i].X0, tx * TILE_SIZE);
+        }
+    }
+
+    int rowTile = (Spans[0].Y >> TILE_SHIFT) * Target.TilesX;
+    for (int tx = 0; tx < Target.TilesX; tx++) {
+        PixelRect bounds = TileBounds(Target, rowTile + tx);
+        if (Covered[tx] == (bounds.X1 - bounds.X0) * (bounds.Y1 - bounds.Y0)) {
+            SetTileUniform(Target, rowTile + tx, Uniform);
+        }
+    }
+
+    for (size_t i = 0; i < Count; i++) {
+        const PixelSpan& span = Spans[i];
+        int rowOffset = (span.Y & TILE_MASK) * TILE_SIZE;
+        for (int x = span.X0; x < span.X1;) {
+            int end = std::min(span.X1, (x | TILE_MASK) + 1);
+            int tile = TileIndex(Target, x, span.Y);
+            const CanvasTile& current = *Target.Tiles[tile];
+            if (!current.Pixels.empty() || current.Uniform != Color) {
+                FillRowKernel(WritableTile(Target, tile) + rowOffset + (x & TILE_MASK), end - x, Color);
+            }
+            x = end;
+        }
+    }
+}
+
+static void FillSpansUnmasked(Canvas& Target, const std::vector<PixelSpan>& Spans, u32 Color) {
+    // Counting sort by row of tiles; each bin touches only its own tiles.
+    std::vector<size_t> binStart(Target.TilesY + 1, 0);
+    size_t pixelCount = 0;
+    for (const PixelSpan& span : Spans) {
+        pixelCount += span.X1 - span.X0;
+        binStart[(span.Y >> TILE_SHIFT) + 1]++;
+    }
+    if (pixelCount == 0) {
+        return;
+    }
+    TracePixelsWritten(pixelCount);
+    for (int ty = 0; ty < Target.TilesY; ty++) {
+        binStart[ty + 1] += binStart[ty];
+    }
+    std::vector<PixelSpan> binned(Spans.size());
+    std::vector<size_t> next(binStart.begin(), binStart.end() - 1);
+    for (const PixelSpan& span : Spans) {
+        binned[next[span.Y >> TILE_SHIFT]++] = span;
+    }
+
+    TileRef uniform = MakeUniformTile(Target, Color);
+    auto fillBins = [&](int First, int Last) {
+        std::vector<int> covered;
+        for (int ty = First; ty < Last; ty++) {
+            if (binStart[ty + 1] > binStart[ty]) {
+                FillSpanBin(Target, &binned[binStart[ty]], binStart[ty + 1] - binStart[ty], Color, uniform, covered);
+            }
+        }
+    };
+    if (pixelCount >= PARALLEL_RASTER_PIXELS) {
+        ParallelFor(Target.TilesY, [&](int Row) {
+            fillBins(Row, Row + 1);
+        });
+    }
+    else {
+        fillBins(0, Target.TilesY);
+    }
+
+    // Damage is reported afterwards, one box per row of tiles, since the
+    // tracker isn't shared between threads.
+    for (int ty = 0; ty < Target.TilesY; ty++) {
+        if (binStart[ty + 1] == binStart[ty]) {
+            continue;
+        }
+        PixelRect box = { Target.Width, Target.Height, 0, 0 };
+        for (size_t i = binStart[ty]; i < binStart[ty + 1]; i++) {
+            box = { std::min(box.X0, binned[i].X0), std::min(box.Y0, binned[i].Y), std::max(box.X1, binned[i].X1), std::max(box.Y1, binned[i].Y + 1) };
+        }
+        MarkDirty(Target, box.X0, box.Y0, box.X1, box.Y1);
+    }
+}
+
+void FillSpans(Canvas& Target, const std::vector<PixelSpan>& Spans, u32 Color) {
+    if (!Target.Selection) {
+        FillSpansUnmasked(Target, Spans, Color);
+        return;
+    }
+    std::vector<PixelSpan> clipped;
+    clipped.reserve(Spans.size());
+    for (const PixelSpan& span : Spans) {
+        ForEachSelectedRun(*Target.Selection, span.Y, span.X0, span.X1, [&](int RunX0, int RunX1) {
+            clipped.push_back({ span.Y, RunX0, RunX1 });
+        });
+    }
+    FillSpansUnmasked(Target, clipped, Color);
+}
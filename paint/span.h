@@ -0,0 +1,79 @@
+#pragma once
+#include <vector>
+
+#include "blend.h"
+#include "canvas.h"
+
+enum SpanKernel {
+    SPAN_KERNEL_SCALAR,
+    SPAN_KERNEL_SSE2,
+    SPAN_KERNEL_AVX2
+};
+
+// The widest kernel the CPU supports is picked on first use. Asking for one the
+// CPU lacks falls back to the next narrower kernel.
+void SetSpanKernel(SpanKernel Kernel);
+SpanKernel GetSpanKernel();
+const char* SpanKernelName(SpanKernel Kernel);
+
+// Writes Count pixels starting at Row. No clipping.
+void FillRow(u32* Row, int Count, u32 Color);
+
+// Mixes Color into Count pixels, each by its own 8-bit coverage: 0 leaves the
+// pixel alone, 255 replaces it. Every channel, alpha included, becomes
+// (Color * a + Pixel * (256 - a)) >> 8 with a = Coverage + (Coverage >> 7).
+void BlendRow(u32* Row, const uint8_t* Coverage, int Count, u32 Color);
+
+// Lays Source over Dest, Source first scaled by Opacity. Both are pixels as
+// canvas.h describes them, premultiplied with transparency in the top byte.
+// Products are divided by 255 exactly, so opacity 255 and opaque pixels lose
+// nothing.
+void CompositeRow(u32* Dest, const u32* Source, int Count, uint8_t Opacity);
+
+// One row of a blended stroke: each pixel of Before is blended with Color in
+// Mode by its Coverage times Opacity, as blend.h defines, into Dest.
+void StrokeRow(u32* Dest, const u32* Before, const uint8_t* Coverage, int Count, u32 Color, uint8_t Opacity, BlendMode Mode);
+
+// One row of a gradient from From to To, both opaque. Positions are where
+// each pixel lies between them in 16.16 fixed point, 0 to 65536. Each channel
+// is From + (To - From) * Position, plus Thresholds[i & 3] below 65536 before
+// the fraction is dropped: 32768 everywhere rounds, a threshold pattern
+// dithers.
+void GradientRow(u32* Row, const int32_t* Positions, int Count, u32 From, u32 To, const int32_t* Thresholds);
+// Positions for a radial gradient: the distance of each pixel from the centre
+// times Scale, capped at 65536. DX is the first pixel's x offset from the
+// centre and DY2 the square of the row's y offset.
+void RadialPositions(int32_t* Positions, int Count, float DX, float DY2, float Scale);
+
+// Halves two rows into one: Dest[i] is the mean of Top[2i], Top[2i + 1],
+// Bottom[2i] and Bottom[2i + 1], every channel rounded to nearest. Reads
+// 2 * Count pixels of each row.
+void DownsampleRow(u32* Dest, const u32* Top, const u32* Bottom, int Count);
+
+// Clipped fills over half-open ranges: X0 <= x < X1, Y0 <= y < Y1. While the
+// canvas has a stroke in progress, these blend into it instead. With a
+// selection, every span is cut down to its selected runs first; rows the
+// selection covers solidly cost a compare.
+void FillSpan(Canvas& Target, int Y, int X0, int X1, u32 Color);
+void FillRect(Canvas& Target, int X0, int Y0, int X1, int Y1, u32 Color);
+// BlendRow over pixels X0 <= x < X0 + Count of row Y; Coverage[0] is for X0.
+void BlendSpan(Canvas& Target, int Y, int X0, const uint8_t* Coverage, int Count, u32 Color);
+
+// Fills of at least this many pixels are split by row of tiles over the worker
+// pool. Every tile is written by exactly one job, so no pixel write is locked
+// and the result doesn't depend on the number of workers.
+constexpr size_t PARALLEL_RASTER_PIXELS = 1 << 17;
+
+struct PixelSpan {
+    int Y;
+    int X0;
+    int X1;
+};
+
+// Appends the part of row Y from X0 to X1 that lies inside the canvas, if any.
+void AddSpan(const Canvas& Target, std::vector<PixelSpan>& Spans, int Y, int X0, int X1);
+
+// Fills spans that lie inside the canvas and don't overlap, like the rows of a
+// shape or a flood fill region. They are binned by row of tiles; tiles the
+// spans cover completely become uniform, as with FillRect.
+void FillSpans(Canvas& Target, const std::vector<PixelSpan>& Spans, u32 Color);
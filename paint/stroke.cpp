@@ -0,0 +1,148 @@
+#include "stroke.h"
+
+#include <math.h>
+#include <algorithm>
+
+int64_t IntSqrt(int64_t Value) {
+    if (Value <= 0) {
+        return 0;
+    }
+    int64_t root = (int64_t)sqrt((double)Value);
+    while (root * root > Value) {
+        root--;
+    }
+    while ((root + 1) * (root + 1) <= Value) {
+        root++;
+    }
+    return root;
+}
+
+static int64_t FloorDiv(int64_t A, int64_t B) {
+    int64_t q = A / B;
+    if ((A % B != 0) && ((A < 0) != (B < 0))) {
+        q--;
+    }
+    return q;
+}
+
+static int64_t CeilDiv(int64_t A, int64_t B) {
+    return -FloorDiv(-A, B);
+}
+
+// Narrows [Min, Max] to the u with Lo <= A * u <= Hi.
+static void ClampLinear(int64_t A, int64_t Lo, int64_t Hi, int64_t& Min, int64_t& Max) {
+    if (A == 0) {
+        if (Lo > 0 || Hi < 0) {
+            Min = 1;
+            Max = 0;
+        }
+        return;
+    }
+    if (A < 0) {
+        A = -A;
+        std::swap(Lo, Hi);
+        Lo = -Lo;
+        Hi = -Hi;
+    }
+    Min = std::max(Min, CeilDiv(Lo, A));
+    Max = std::min(Max, FloorDiv(Hi, A));
+}
+
+Stroke MakeStroke(int X1, int Y1, int X2, int Y2, int LineWidth, BrushShape Brush) {
+    Stroke s;
+    s.AX = X1;
+    s.AY = Y1;
+    s.BX = X2;
+    s.BY = Y2;
+    s.Radius = std::max(LineWidth / 2, 0);
+    s.Brush = Brush;
+    s.DX = (int64_t)X2 - X1;
+    s.DY = (int64_t)Y2 - Y1;
+    s.LengthSquared = s.DX * s.DX + s.DY * s.DY;
+    s.CrossLimit = IntSqrt((int64_t)s.Radius * s.Radius * s.LengthSquared);
+    s.Y0 = std::min(Y1, Y2) - s.Radius;
+    s.Y1 = std::max(Y1, Y2) + s.Radius + 1;
+    return s;
+}
+
+static bool RoundRowSpan(const Stroke& S, int Y, int64_t& Min, int64_t& Max) {
+    Min = INT64_MAX;
+    Max = INT64_MIN;
+    int64_t r2 = (int64_t)S.Radius * S.Radius;
+
+    // End caps.
+    for (int end = 0; end < 2; end++) {
+        int64_t cx = end ? S.BX : S.AX;
+        int64_t dy = Y - (int64_t)(end ? S.BY : S.AY);
+        if (dy * dy <= r2) {
+            int64_t half = IntSqrt(r2 - dy * dy);
+            Min = std::min(Min, cx - half);
+            Max = std::max(Max, cx + half);
+        }
+    }
+
+    // Body: perpendicular distance within the radius and the projection onto
+    // the segment inside [A, B], both linear in u = x - AX.
+    if (S.LengthSquared > 0) {
+        int64_t v = Y - (int64_t)S.AY;
+        int64_t lo = INT64_MIN / 4;
+        int64_t hi = INT64_MAX / 4;
+        ClampLinear(S.DY, S.DX * v - S.CrossLimit, S.DX * v + S.CrossLimit, lo, hi);
+        ClampLinear(S.DX, -S.DY * v, S.LengthSquared - S.DY * v, lo, hi);
+        if (lo <= hi) {
+            Min = std::min(Min, S.AX + lo);
+            Max = std::max(Max, S.AX + hi);
+        }
+    }
+    return Min <= Max;
+}
+
+static bool SquareRowSpan(const Stroke& S, int Y, int64_t& Min, int64_t& Max) {
+    int64_t v = Y - (int64_t)S.AY;
+    int64_t r = S.Radius;
+
+    // Positions along the segment, as t = n / d, where the square still
+    // reaches row Y.
+    int64_t d = S.DY < 0 ? -S.DY : S.DY;
+    int64_t n0, n1;
+    if (d == 0) {
+        if (v < -r || v > r) {
+            return false;
+        }
+        d = 1;
+        n0 = 0;
+        n1 = 1;
+    }
+    else {
+        n0 = S.DY > 0 ? v - r : -(v + r);
+        n1 = S.DY > 0 ? v + r : -(v - r);
+        n0 = std::max<int64_t>(n0, 0);
+        n1 = std::min<int64_t>(n1, d);
+        if (n0 > n1) {
+            return false;
+        }
+    }
+
+    int64_t a = n0 * S.DX;
+    int64_t b = n1 * S.DX;
+    Min = S.AX + CeilDiv(std::min(a, b), d) - r;
+    Max = S.AX + FloorDiv(std::max(a, b), d) + r;
+    return true;
+}
+
+bool StrokeRowSpan(const Stroke& S, int Y, int& X0, int& X1) {
+    if (Y < S.Y0 || Y >= S.Y1) {
+        return false;
+    }
+
+    int64_t min, max;
+    bool covered = S.Brush == ROUND_BRUSH ? RoundRowSpan(S, Y, min, max) : SquareRowSpan(S, Y, min, max);
+    if (!covered) {
+        return false;
+    }
+
+    // Spans are clipped later anyway; this only keeps them inside int.
+    X0 = (int)std::clamp<int64_t>(min, INT32_MIN / 2, INT32_MAX / 2);
+    X1 = (int)std::clamp<int64_t>(max + 1, INT32_MIN / 2, INT32_MAX / 2);
+    return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <stdint.h>
+
+#include "raster.h"
+
+// The area a brush sweeps moving in a straight line from A to B. A round brush
+// of radius R covers every pixel within R of the segment (a capsule), a square
+// brush covers the segment's Minkowski sum with a (2R+1)^2 square. Both are
+// convex, so each row is a single span and can be computed directly.
+struct Stroke {
+    int AX, AY;
+    int BX, BY;
+    int Radius;
+    BrushShape Brush;
+
+    int64_t DX, DY;
+    int64_t LengthSquared;
+    int64_t CrossLimit; // floor(Radius * |B - A|)
+
+    int Y0; // rows Y0 <= y < Y1 may be covered
+    int Y1;
+};
+
+Stroke MakeStroke(int X1, int Y1, int X2, int Y2, int LineWidth, BrushShape Brush);
+
+// Half-open span [X0, X1) the stroke covers on row Y, false if none. The
+// aliased one pixel line is a plain Bresenham walk instead; with Radius 0 this
+// gives only the pixels exactly on the segment.
+bool StrokeRowSpan(const Stroke& S, int Y, int& X0, int& X1);
+
+int64_t IntSqrt(int64_t Value);
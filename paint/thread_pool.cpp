@@ -0,0 +1,182 @@
+#include "thread_pool.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+
+// The indices one thread has left, [Begin, End) packed into one word so the
+// owner taking from the front and thieves taking from the back can both
+// update it with a single compare-and-swap.
+struct alignas(64) WorkQueue {
+    std::atomic<uint64_t> Range{ 0 };
+};
+
+static uint64_t PackRange(uint32_t Begin, uint32_t End) {
+    return (uint64_t)End << 32 | Begin;
+}
+
+struct ThreadPool {
+    std::vector<std::thread> Threads;
+    std::unique_ptr<WorkQueue[]> Queues; // one per thread, the caller's first
+    std::mutex Lock;
+    std::condition_variable WorkReady;
+    std::condition_variable WorkDone;
+    std::atomic<int> Limit{ 0 };
+
+    // The batch currently being run. Only one ParallelFor runs at a time.
+    std::mutex BatchLock;
+    const std::function<void(int)>* Job = nullptr;
+    std::atomic<int> Participants{ 0 };
+    int Busy = 0;
+    unsigned Generation = 0;
+};
+
+// Set while a thread runs jobs of a ParallelFor, so a job calling ParallelFor
+// again runs it itself instead of waiting on the batch it is part of.
+static thread_local bool IsRunningJobs = false;
+
+static int PopFront(WorkQueue& Queue) {
+    uint64_t range = Queue.Range.load();
+    for (;;) {
+        uint32_t begin = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+        if (begin >= end) {
+            return -1;
+        }
+        if (Queue.Range.compare_exchange_weak(range, PackRange(begin + 1, end))) {
+            return (int)begin;
+        }
+    }
+}
+
+// Moves the upper half of some other thread's remaining range into Self's
+// queue. False once every queue is empty.
+static bool Steal(ThreadPool& Pool, int Self) {
+    int participants = Pool.Participants.load();
+    for (;;) {
+        bool contended = false;
+        for (int i = 1; i < participants; i++) {
+            WorkQueue& victim = Pool.Queues[(Self + i) % participants];
+            uint64_t range = victim.Range.load();
+            uint32_t begin = (uint32_t)range;
+            uint32_t end = (uint32_t)(range >> 32);
+            if (begin >= end) {
+                continue;
+            }
+            uint32_t middle = begin + (end - begin) / 2;
+            if (victim.Range.compare_exchange_strong(range, PackRange(begin, middle))) {
+                Pool.Queues[Self].Range.store(PackRange(middle, end));
+                return true;
+            }
+            contended = true;
+        }
+        if (!contended) {
+            return false;
+        }
+    }
+}
+
+static void RunJobs(ThreadPool& Pool, int Self) {
+    TraceScope trace("ParallelFor");
+    IsRunningJobs = true;
+    for (;;) {
+        int index = PopFront(Pool.Queues[Self]);
+        if (index < 0) {
+            if (!Steal(Pool, Self)) {
+                break;
+            }
+            continue;
+        }
+        (*Pool.Job)(index);
+    }
+    IsRunningJobs = false;
+}
+
+static void WorkerMain(ThreadPool* Pool, int Self) {
+    SetTraceThreadName(("worker " + std::to_string(Self)).c_str());
+    unsigned seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(Pool->Lock);
+            Pool->WorkReady.wait(lock, [&] { return Pool->Generation != seen; });
+            seen = Pool->Generation;
+            if (Self >= Pool->Participants) {
+                continue;
+            }
+            Pool->Busy++;
+        }
+
+        RunJobs(*Pool, Self);
+
+        std::lock_guard<std::mutex> lock(Pool->Lock);
+        if (--Pool->Busy == 0) {
+            Pool->WorkDone.notify_all();
+        }
+    }
+}
+
+static ThreadPool& GetThreadPool() {
+    static ThreadPool* pool = [] {
+        ThreadPool* result = new ThreadPool;
+        int extra = (int)std::max(1u, std::thread::hardware_concurrency()) - 1;
+        result->Queues.reset(new WorkQueue[extra + 1]);
+        for (int i = 0; i < extra; i++) {
+            result->Threads.emplace_back(WorkerMain, result, i + 1);
+            result->Threads.back().detach();
+        }
+        return result;
+    }();
+    return *pool;
+}
+
+int WorkerCount() {
+    ThreadPool& pool = GetThreadPool();
+    int count = (int)pool.Threads.size() + 1;
+    int limit = pool.Limit.load();
+    return limit > 0 ? std::min(limit, count) : count;
+}
+
+void SetWorkerLimit(int Limit) {
+    GetThreadPool().Limit = std::max(Limit, 0);
+}
+
+void ParallelFor(int Count, const std::function<void(int)>& Job) {
+    ThreadPool& pool = GetThreadPool();
+    if (Count <= 0) {
+        return;
+    }
+    int participants = std::min(WorkerCount(), Count);
+    if (participants == 1 || IsRunningJobs) {
+        for (int i = 0; i < Count; i++) {
+            Job(i);
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> batch(pool.BatchLock);
+    {
+        std::lock_guard<std::mutex> lock(pool.Lock);
+        pool.Job = &Job;
+        pool.Participants = participants;
+        for (int i = 0; i < participants; i++) {
+            pool.Queues[i].Range = PackRange((uint32_t)((int64_t)Count * i / participants), (uint32_t)((int64_t)Count * (i + 1) / participants));
+        }
+        pool.Generation++;
+    }
+    pool.WorkReady.notify_all();
+
+    RunJobs(pool, 0);
+
+    // Every queue was empty when the caller ran out, so anything left is
+    // being run by a worker that is still counted as busy.
+    std::unique_lock<std::mutex> lock(pool.Lock);
+    pool.WorkDone.wait(lock, [&] { return pool.Busy == 0; });
+}
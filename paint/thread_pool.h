@@ -0,0 +1,24 @@
+#pragma once
+#include <functional>
+
+// Number of threads ParallelFor spreads work over, including the caller.
+int WorkerCount();
+
+// Caps WorkerCount at Limit, at least one; 0 lifts the cap. For measuring
+// how the parallel paths scale.
+void SetWorkerLimit(int Limit);
+
+// Runs Job(0) .. Job(Count - 1) across the shared worker threads and returns
+// once all of them finished. The calling thread takes jobs too, so this is
+// safe to call with a pool of one.
+//
+// Each thread starts on its own contiguous share of the indices, in order,
+// and steals the upper half of another thread's remaining share when it runs
+// out, so uneven jobs still balance. Which thread runs a job is not fixed;
+// jobs must only write state of their own.
+//
+// Only one call uses the workers at a time; others wait for it. A job that
+// calls ParallelFor runs that call's jobs itself, in order, so independent
+// tasks can each be a job and still use functions that parallelize on their
+// own.
+void ParallelFor(int Count, const std::function<void(int)>& Job);
@@ -0,0 +1,286 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+std::atomic<bool> TraceEnabled{ false };
+
+// Frames kept for the counters and latency, the latest ones.
+constexpr size_t TRACE_MAX_FRAMES = 1 << 16;
+
+struct TraceEvent {
+    const char* Name;
+    int64_t Start;
+    int64_t End;
+};
+
+// One thread's scopes. Only that thread writes Events and Written; readers
+// copy what they want, then drop anything the thread may have overwritten
+// meanwhile.
+struct TraceBuffer {
+    std::string Name;
+    int Id = 0;
+    std::unique_ptr<TraceEvent[]> Events; // allocated by the first scope
+    std::atomic<uint64_t> Written{ 0 };
+    std::atomic<uint64_t> Cleared{ 0 }; // the ones before this were reset
+    std::atomic<int64_t> Pixels{ 0 };   // written in total
+};
+
+struct FrameSample {
+    int64_t Time;
+    int64_t Written;
+    int64_t Presented;
+    double LatencyMs; // negative when no input was waiting
+};
+
+struct TraceState {
+    std::mutex Lock;
+    std::vector<std::unique_ptr<TraceBuffer>> Buffers;
+    int64_t Origin = 0;
+
+    // Only touched by the thread presenting frames.
+    std::deque<FrameSample> Frames;
+    int64_t PixelsBefore = 0; // total written at the last frame or reset
+    int64_t PendingInput = 0;
+};
+
+// Never destroyed: detached worker threads may still record on exit.
+static TraceState& GetTraceState() {
+    static TraceState* state = new TraceState;
+    return *state;
+}
+
+static thread_local TraceBuffer* CurrentBuffer = nullptr;
+
+static TraceBuffer& ThreadBuffer() {
+    if (!CurrentBuffer) {
+        TraceState& state = GetTraceState();
+        std::lock_guard<std::mutex> lock(state.Lock);
+        auto buffer = std::make_unique<TraceBuffer>();
+        buffer->Id = (int)state.Buffers.size() + 1;
+        buffer->Name = "thread " + std::to_string(buffer->Id);
+        CurrentBuffer = buffer.get();
+        state.Buffers.push_back(std::move(buffer));
+    }
+    return *CurrentBuffer;
+}
+
+static int64_t TotalPixels(TraceState& State) {
+    int64_t total = 0;
+    for (const auto& buffer : State.Buffers) {
+        total += buffer->Pixels.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+int64_t TraceClock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SetTracing(bool Enabled) {
+    TraceState& state = GetTraceState();
+    {
+        std::lock_guard<std::mutex> lock(state.Lock);
+        if (state.Origin == 0) {
+            state.Origin = TraceClock();
+            state.PixelsBefore = TotalPixels(state);
+        }
+    }
+    TraceEnabled.store(Enabled);
+}
+
+void ResetTrace() {
+    TraceState& state = GetTraceState();
+    std::lock_guard<std::mutex> lock(state.Lock);
+    for (const auto& buffer : state.Buffers) {
+        buffer->Cleared.store(buffer->Written.load());
+    }
+    state.Origin = TraceClock();
+    state.Frames.clear();
+    state.PixelsBefore = TotalPixels(state);
+    state.PendingInput = 0;
+}
+
+void RecordTraceScope(const char* Name, int64_t Start, int64_t End) {
+    TraceBuffer& buffer = ThreadBuffer();
+    if (!buffer.Events) {
+        std::lock_guard<std::mutex> lock(GetTraceState().Lock);
+        buffer.Events.reset(new TraceEvent[TRACE_BUFFER_EVENTS]);
+    }
+    uint64_t index = buffer.Written.load(std::memory_order_relaxed);
+    buffer.Events[index % TRACE_BUFFER_EVENTS] = { Name, Start, End };
+    buffer.Written.store(index + 1, std::memory_order_release);
+}
+
+void SetTraceThreadName(const char* Name) {
+    TraceBuffer& buffer = ThreadBuffer();
+    std::lock_guard<std::mutex> lock(GetTraceState().Lock);
+    buffer.Name = Name;
+}
+
+void AddPixelsWritten(int64_t Count) {
+    std::atomic<int64_t>& pixels = ThreadBuffer().Pixels;
+    pixels.store(pixels.load(std::memory_order_relaxed) + Count, std::memory_order_relaxed);
+}
+
+void TraceInput() {
+    TraceState& state = GetTraceState();
+    if (IsTracing() && state.PendingInput == 0) {
+        state.PendingInput = TraceClock();
+    }
+}
+
+void ForgetTraceInput() {
+    GetTraceState().PendingInput = 0;
+}
+
+void TraceFrame(int64_t PixelsPresented) {
+    if (!IsTracing()) {
+        return;
+    }
+    TraceState& state = GetTraceState();
+    int64_t now = TraceClock();
+    std::lock_guard<std::mutex> lock(state.Lock);
+    int64_t total = TotalPixels(state);
+    double latency = state.PendingInput ? (now - state.PendingInput) / 1e6 : -1;
+    state.Frames.push_back({ now, total - state.PixelsBefore, PixelsPresented, latency });
+    if (state.Frames.size() > TRACE_MAX_FRAMES) {
+        state.Frames.pop_front();
+    }
+    state.PixelsBefore = total;
+    state.PendingInput = 0;
+}
+
+struct ThreadEvent {
+    int Thread;
+    TraceEvent Event;
+};
+
+// Every scope still in the buffers, oldest first per thread. Takes the lock.
+static std::vector<ThreadEvent> CollectEvents(TraceState& State) {
+    std::vector<ThreadEvent> events;
+    for (const auto& buffer : State.Buffers) {
+        if (!buffer->Events) {
+            continue;
+        }
+        uint64_t end = buffer->Written.load(std::memory_order_acquire);
+        uint64_t begin = std::max(buffer->Cleared.load(), end > TRACE_BUFFER_EVENTS ? end - TRACE_BUFFER_EVENTS : 0);
+        size_t first = events.size();
+        for (uint64_t i = begin; i < end; i++) {
+            events.push_back({ buffer->Id, buffer->Events[i % TRACE_BUFFER_EVENTS] });
+        }
+        // Anything the thread has lapped since is unreliable.
+        uint64_t after = buffer->Written.load(std::memory_order_acquire);
+        if (after - begin > TRACE_BUFFER_EVENTS) {
+            size_t lapped = (size_t)std::min(after - begin - TRACE_BUFFER_EVENTS, end - begin);
+            events.erase(events.begin() + first, events.begin() + first + lapped);
+        }
+    }
+    return events;
+}
+
+static std::string JsonString(const std::string& Text) {
+    std::string result = "\"";
+    for (char c : Text) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result + "\"";
+}
+
+bool WriteTraceJson(const std::filesystem::path& Path) {
+    TraceState& state = GetTraceState();
+    std::ofstream file(Path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    char line[512];
+    std::lock_guard<std::mutex> lock(state.Lock);
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"paint\"}}";
+    for (const auto& buffer : state.Buffers) {
+        file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->Id << ",\"args\":{\"name\":" << JsonString(buffer->Name) << "}}";
+    }
+    for (const ThreadEvent& event : CollectEvents(state)) {
+        snprintf(line, sizeof(line), ",\n{\"name\":%s,\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+            JsonString(event.Event.Name).c_str(), event.Thread, (event.Event.Start - state.Origin) / 1e3, (event.Event.End - event.Event.Start) / 1e3);
+        file << line;
+    }
+    for (const FrameSample& frame : state.Frames) {
+        double ts = (frame.Time - state.Origin) / 1e3;
+        snprintf(line, sizeof(line), ",\n{\"name\":\"pixels\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"written\":%lld,\"presented\":%lld}}",
+            ts, (long long)frame.Written, (long long)frame.Presented);
+        file << line;
+        if (frame.LatencyMs >= 0) {
+            snprintf(line, sizeof(line), ",\n{\"name\":\"input to present\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"ms\":%.3f}}", ts, frame.LatencyMs);
+            file << line;
+        }
+    }
+    file << "\n]}\n";
+    return (bool)file;
+}
+
+// One row of the summary from Values, sorted in place.
+static void WriteSummaryRow(std::ofstream& File, const char* Kind, const std::string& Name, std::vector<double>& Values, const char* Unit) {
+    if (Values.empty()) {
+        return;
+    }
+    std::sort(Values.begin(), Values.end());
+    double total = 0;
+    for (double value : Values) {
+        total += value;
+    }
+    auto percentile = [&](double P) {
+        size_t rank = (size_t)std::max(0.0, P * Values.size() - 1e-9);
+        return Values[std::min(rank, Values.size() - 1)];
+    };
+    char line[512];
+    snprintf(line, sizeof(line), "%s,%s,%zu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%s\n", Kind, Name.c_str(), Values.size(),
+        total, total / Values.size(), percentile(0.5), percentile(0.9), percentile(0.99), Values.back(), Unit);
+    File << line;
+}
+
+bool WriteTraceSummary(const std::filesystem::path& Path) {
+    TraceState& state = GetTraceState();
+    std::ofstream file(Path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(state.Lock);
+    file << "kind,name,count,total,mean,p50,p90,p99,max,unit\n";
+
+    std::map<std::string, std::vector<double>> scopes;
+    for (const ThreadEvent& event : CollectEvents(state)) {
+        scopes[event.Event.Name].push_back((event.Event.End - event.Event.Start) / 1e3);
+    }
+    for (auto& [name, durations] : scopes) {
+        WriteSummaryRow(file, "scope", name, durations, "us");
+    }
+
+    std::vector<double> latency, written, presented, overdraw;
+    for (const FrameSample& frame : state.Frames) {
+        if (frame.LatencyMs >= 0) {
+            latency.push_back(frame.LatencyMs);
+        }
+        written.push_back((double)frame.Written);
+        presented.push_back((double)frame.Presented);
+        if (frame.Presented > 0) {
+            overdraw.push_back((double)frame.Written / frame.Presented);
+        }
+    }
+    WriteSummaryRow(file, "latency", "input to present", latency, "ms");
+    WriteSummaryRow(file, "frame", "pixels written", written, "pixels");
+    WriteSummaryRow(file, "frame", "pixels presented", presented, "pixels");
+    WriteSummaryRow(file, "frame", "overdraw", overdraw, "written per presented");
+    return (bool)file;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <filesystem>
+
+// Timing and counting for finding out where a frame's time goes, off until
+// SetTracing turns it on. Off, a scope or a count costs one relaxed load and
+// a branch.
+//
+// Each thread records into its own ring buffer, so recording takes no lock
+// and a thread keeps only its latest TRACE_BUFFER_EVENTS scopes.
+
+constexpr int TRACE_BUFFER_EVENTS = 1 << 16;
+
+extern std::atomic<bool> TraceEnabled;
+
+inline bool IsTracing() {
+    return TraceEnabled.load(std::memory_order_relaxed);
+}
+
+void SetTracing(bool Enabled);
+// Drops everything recorded so far.
+void ResetTrace();
+
+// Nanoseconds on a clock that only moves forward.
+int64_t TraceClock();
+
+void RecordTraceScope(const char* Name, int64_t Start, int64_t End);
+
+// Times its own lifetime under Name, which must be a string literal or
+// otherwise outlive the trace.
+struct TraceScope {
+    const char* Name;
+    int64_t Start;
+
+    explicit TraceScope(const char* Name) : Name(Name), Start(IsTracing() ? TraceClock() : 0) {}
+    ~TraceScope() {
+        if (Start) {
+            RecordTraceScope(Name, Start, TraceClock());
+        }
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+// Shown next to the thread's events in the trace.
+void SetTraceThreadName(const char* Name);
+
+void AddPixelsWritten(int64_t Count);
+// Pixels the drawing functions wrote, uniform tiles counted in full.
+inline void TracePixelsWritten(int64_t Count) {
+    if (IsTracing()) {
+        AddPixelsWritten(Count);
+    }
+}
+
+// An input event arrived. Input to present latency runs from the earliest one
+// not yet on screen to the next TraceFrame.
+void TraceInput();
+// Nothing is going to be presented for the input so far, e.g. the pointer
+// moved without drawing; it isn't counted.
+void ForgetTraceInput();
+// A frame reached the screen, PixelsPresented of them. Samples the pixels
+// written since the last frame and the input latency.
+void TraceFrame(int64_t PixelsPresented);
+
+// Everything recorded, as Chrome trace event JSON for chrome://tracing or
+// ui.perfetto.dev: a slice per scope on its thread, and per frame a counter
+// track of pixels written and presented and one of input latency.
+bool WriteTraceJson(const std::filesystem::path& Path);
+// Per scope name its count, total and mean, and 50th, 90th and 99th
+// percentile and longest duration in microseconds; then the same for input
+// latency in milliseconds and for pixels per frame, with overdraw as pixels
+// written per pixel presented.
+bool WriteTraceSummary(const std::filesystem::path& Path);
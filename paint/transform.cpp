@@ -0,0 +1,213 @@
+#include "transform.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "cpu.h"
+#include "span.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+void ReverseRow(const u32* Source, u32* Dest, int Count) {
+    int i = 0;
+#if PAINT_SSE2
+    // Four pixels from the end of Source, reversed, to the front of Dest.
+    for (; i + 4 <= Count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(Source + Count - 4 - i));
+        _mm_storeu_si128((__m128i*)(Dest + i), _mm_shuffle_epi32(pixels, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+#endif
+    for (; i < Count; i++) {
+        Dest[i] = Source[Count - 1 - i];
+    }
+}
+
+// Dest is Height x Width: Dest[x][y] = Source[y][x] for a Width x Height
+// source. Works in 4x4 blocks so both sides are read and written a row at a time.
+void TransposeBlock(const u32* Source, size_t SourceStride, u32* Dest, size_t DestStride, int Width, int Height) {
+    int y = 0;
+#if PAINT_SSE2
+    for (; y + 4 <= Height; y += 4) {
+        int x = 0;
+        for (; x + 4 <= Width; x += 4) {
+            const u32* s = Source + y * SourceStride + x;
+            __m128i r0 = _mm_loadu_si128((const __m128i*)s);
+            __m128i r1 = _mm_loadu_si128((const __m128i*)(s + SourceStride));
+            __m128i r2 = _mm_loadu_si128((const __m128i*)(s + 2 * SourceStride));
+            __m128i r3 = _mm_loadu_si128((const __m128i*)(s + 3 * SourceStride));
+            __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+            __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+            __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+            __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+            u32* d = Dest + x * DestStride + y;
+            _mm_storeu_si128((__m128i*)d, _mm_unpacklo_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*)(d + DestStride), _mm_unpackhi_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*)(d + 2 * DestStride), _mm_unpacklo_epi64(t2, t3));
+            _mm_storeu_si128((__m128i*)(d + 3 * DestStride), _mm_unpackhi_epi64(t2, t3));
+        }
+        for (; x < Width; x++) {
+            for (int i = 0; i < 4; i++) {
+                Dest[x * DestStride + y + i] = Source[(y + i) * SourceStride + x];
+            }
+        }
+    }
+#endif
+    for (; y < Height; y++) {
+        for (int x = 0; x < Width; x++) {
+            Dest[x * DestStride + y] = Source[y * SourceStride + x];
+        }
+    }
+}
+
+// Every transform is an optional transpose followed by optional mirroring of
+// the result's columns and rows.
+struct TransformSteps {
+    bool Swap;
+    bool ReverseX;
+    bool ReverseY;
+};
+
+static TransformSteps StepsFor(CanvasTransform Transform) {
+    switch (Transform) {
+    case TRANSFORM_FLIP_HORIZONTAL:
+        return { false, true, false };
+    case TRANSFORM_FLIP_VERTICAL:
+        return { false, false, true };
+    case TRANSFORM_ROTATE_90:
+        return { true, true, false };
+    case TRANSFORM_ROTATE_180:
+        return { false, true, true };
+    case TRANSFORM_ROTATE_270:
+        return { true, false, true };
+    default:
+        return { true, false, false };
+    }
+}
+
+// Builds one destination tile. The source pixels it needs form one rectangle
+// of at most a tile, spread over up to four source tiles; unless they sit in
+// one tile they are gathered into a linear block first so the transpose and
+// reversal run on plain rows.
+static TileRef TransformTile(const Canvas& Source, const Canvas& Dest, int Tile, TransformSteps Steps) {
+    PixelRect bounds = TileBounds(Dest, Tile);
+    int width = bounds.X1 - bounds.X0;
+    int height = bounds.Y1 - bounds.Y0;
+
+    // The tile's rectangle before mirroring, then before transposing.
+    PixelRect mirrored = bounds;
+    if (Steps.ReverseX) {
+        mirrored.X0 = Dest.Width - bounds.X1;
+        mirrored.X1 = Dest.Width - bounds.X0;
+    }
+    if (Steps.ReverseY) {
+        mirrored.Y0 = Dest.Height - bounds.Y1;
+        mirrored.Y1 = Dest.Height - bounds.Y0;
+    }
+    PixelRect source = mirrored;
+    if (Steps.Swap) {
+        source = { mirrored.Y0, mirrored.X0, mirrored.Y1, mirrored.X1 };
+    }
+
+    // Tiles are immutable once shared, so a uniform source is reused as is.
+    u32 color;
+    if (IsRegionUniform(Source, source, color)) {
+        return Source.Tiles[TileIndex(Source, source.X0, source.Y0)];
+    }
+
+    // When the canvas size is a multiple of the tile size, every source
+    // rectangle is exactly one tile.
+    u32 block[TILE_SIZE * TILE_SIZE];
+    u32 swapped[TILE_SIZE * TILE_SIZE];
+    const u32* rows = block;
+    const CanvasTile& first = *Source.Tiles[TileIndex(Source, source.X0, source.Y0)];
+    bool inOneTile = (source.X0 >> TILE_SHIFT) == ((source.X1 - 1) >> TILE_SHIFT) && (source.Y0 >> TILE_SHIFT) == ((source.Y1 - 1) >> TILE_SHIFT);
+    if (inOneTile && !first.Pixels.empty()) {
+        rows = &first.Pixels[(source.Y0 & TILE_MASK) * TILE_SIZE + (source.X0 & TILE_MASK)];
+    }
+    else {
+        for (int y = source.Y0; y < source.Y1; y++) {
+            ReadCanvasSpan(Source, y, source.X0, source.X1, block + (y - source.Y0) * TILE_SIZE);
+        }
+    }
+    if (Steps.Swap) {
+        TransposeBlock(rows, TILE_SIZE, swapped, TILE_SIZE, source.X1 - source.X0, source.Y1 - source.Y0);
+        rows = swapped;
+    }
+
+    TileRef result = MakePixelTile(Dest);
+
+    for (int y = 0; y < height; y++) {
+        const u32* from = rows + (Steps.ReverseY ? height - 1 - y : y) * TILE_SIZE;
+        u32* to = &result->Pixels[y * TILE_SIZE];
+        if (Steps.ReverseX) {
+            ReverseRow(from, to, width);
+        }
+        else {
+            memcpy(to, from, width * sizeof(u32));
+        }
+    }
+    return result;
+}
+
+void TransformCanvas(Canvas& Target, CanvasTransform Transform) {
+    TraceScope trace("TransformCanvas");
+    TransformSteps steps = StepsFor(Transform);
+
+    Canvas result;
+    result.Width = steps.Swap ? Target.Height : Target.Width;
+    result.Height = steps.Swap ? Target.Width : Target.Height;
+    result.TilesX = (result.Width + TILE_SIZE - 1) / TILE_SIZE;
+    result.TilesY = (result.Height + TILE_SIZE - 1) / TILE_SIZE;
+    result.LiveBytes = Target.LiveBytes;
+    result.Tiles.resize((size_t)result.TilesX * result.TilesY);
+
+    // Jobs only read Target and each writes its own slot of result.Tiles.
+    ParallelFor((int)result.Tiles.size(), [&](int Tile) {
+        result.Tiles[Tile] = TransformTile(Target, result, Tile, steps);
+    });
+
+    // Damage covers both shapes when the size changes.
+    PixelRect before = CanvasBounds(Target);
+    SetCanvasTiles(Target, result.Width, result.Height, std::move(result.Tiles));
+    Target.Selection.reset();
+    PixelRect after = Union(before, CanvasBounds(Target));
+    MarkDirty(Target, after.X0, after.Y0, after.X1, after.Y1);
+}
+
+void ResizeCanvas(Canvas& Target, int Width, int Height, u32 Color) {
+    TraceScope trace("ResizeCanvas");
+    int oldWidth = Target.Width;
+    int oldHeight = Target.Height;
+    int oldTilesX = Target.TilesX;
+    int tilesX = (Width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (Height + TILE_SIZE - 1) / TILE_SIZE;
+    int keptX = std::min(tilesX, Target.TilesX);
+    int keptY = std::min(tilesY, Target.TilesY);
+
+    std::vector<TileRef> tiles((size_t)tilesX * tilesY, MakeUniformTile(Target, Color));
+    for (int ty = 0; ty < keptY; ty++) {
+        for (int tx = 0; tx < keptX; tx++) {
+            tiles[(size_t)ty * tilesX + tx] = std::move(Target.Tiles[(size_t)ty * oldTilesX + tx]);
+        }
+    }
+
+    PixelRect before = CanvasBounds(Target);
+    SetCanvasTiles(Target, Width, Height, std::move(tiles));
+    // A selection no longer lines up with the pixels.
+    Target.Selection.reset();
+    // Tiles on the old edge run past it, and what they hold there was never
+    // meant to be seen.
+    if (Width > oldWidth) {
+        FillRect(Target, oldWidth, 0, Width, std::min(oldHeight, Height), Color);
+    }
+    if (Height > oldHeight) {
+        FillRect(Target, 0, oldHeight, Width, Height, Color);
+    }
+    // What was cut off changed too.
+    if (Width < oldWidth) {
+        MarkDirty(Target, Width, 0, oldWidth, before.Y1);
+    }
+    if (Height < oldHeight) {
+        MarkDirty(Target, 0, Height, before.X1, oldHeight);
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "canvas.h"
+
+enum CanvasTransform {
+    TRANSFORM_FLIP_HORIZONTAL,
+    TRANSFORM_FLIP_VERTICAL,
+    TRANSFORM_ROTATE_90,  // clockwise
+    TRANSFORM_ROTATE_180,
+    TRANSFORM_ROTATE_270,
+    TRANSFORM_TRANSPOSE   // across the main diagonal
+};
+
+// Rebuilds the tile grid under Transform, one destination tile per job on the
+// worker pool. Rotating by 90 or 270 degrees and transposing swap the canvas
+// width and height.
+void TransformCanvas(Canvas& Target, CanvasTransform Transform);
+
+// Changes the canvas size, keeping every pixel where it was and filling new
+// area with Color. Tiles are kept by pointer and only the ones on the old edge
+// are written, so the cost follows the number of tiles, not what they hold,
+// and undo history still shares them.
+void ResizeCanvas(Canvas& Target, int Width, int Height, u32 Color);
+
+// Row primitives the transforms are built from, exposed for the benchmarks.
+void ReverseRow(const u32* Source, u32* Dest, int Count);
+void TransposeBlock(const u32* Source, size_t SourceStride, u32* Dest, size_t DestStride, int Width, int Height);
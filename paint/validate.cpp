@@ -0,0 +1,399 @@
+#include "validate.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "antialias.h"
+#include "bmp.h"
+#include "cpu.h"
+#include "selection.h"
+#include "trace.h"
+
+void ApplyRasterOp(Canvas& Target, const RasterOp& Op) {
+    switch (Op.Kind) {
+    case RASTER_PIXEL:
+        DrawPixel(Target, Op.X, Op.Y, Op.Color);
+        break;
+    case RASTER_LINE:
+        if (Op.AntiAlias) {
+            DrawLineAA(Target, Op.X, Op.Y, Op.X2, Op.Y2, Op.Color, Op.LineWidth, Op.Brush);
+        }
+        else {
+            DrawLine(Target, Op.X, Op.Y, Op.X2, Op.Y2, Op.Color, Op.LineWidth, Op.Brush);
+        }
+        break;
+    case RASTER_RECTANGLE:
+        DrawRectangle(Target, Op.X, Op.Y, Op.Width, Op.Height, Op.Color, Op.LineWidth, Op.Filled);
+        break;
+    case RASTER_CIRCLE:
+        if (Op.AntiAlias) {
+            DrawCircleAA(Target, Op.X, Op.Y, Op.Radius, Op.Color, Op.LineWidth, Op.Filled);
+        }
+        else {
+            DrawCircle(Target, Op.X, Op.Y, Op.Radius, Op.Color, Op.LineWidth, Op.Filled);
+        }
+        break;
+    case RASTER_ELLIPSE:
+        DrawEllipse(Target, Op.X, Op.Y, Op.Width, Op.Height, Op.Color, Op.LineWidth, Op.Filled);
+        break;
+    case RASTER_FLOOD_FILL:
+        FloodFill(Target, Op.X, Op.Y, Op.Color, Op.Tolerance);
+        break;
+    case RASTER_CLEAR:
+        ClearScreen(Target, Op.Color);
+        break;
+    case RASTER_FLIP_HORIZONTAL:
+        FlipScreenHorizontal(Target);
+        break;
+    case RASTER_FLIP_VERTICAL:
+        FlipScreenVertical(Target);
+        break;
+    case RASTER_BEGIN_STROKE:
+        BeginBlendedStroke(Target, Op.Opacity, Op.Blend);
+        break;
+    case RASTER_END_STROKE:
+        EndBlendedStroke(Target);
+        break;
+    }
+}
+
+PixelRect ApplyReferenceOp(ReferenceImage& Image, const RasterOp& Op) {
+    switch (Op.Kind) {
+    case RASTER_PIXEL:
+        return ReferencePixel(Image, Op.X, Op.Y, Op.Color);
+    case RASTER_LINE:
+        if (Op.AntiAlias) {
+            return ReferenceLineAA(Image, Op.X, Op.Y, Op.X2, Op.Y2, Op.Color, Op.LineWidth, Op.Brush);
+        }
+        return ReferenceLine(Image, Op.X, Op.Y, Op.X2, Op.Y2, Op.Color, Op.LineWidth, Op.Brush);
+    case RASTER_RECTANGLE:
+        return ReferenceRectangle(Image, Op.X, Op.Y, Op.Width, Op.Height, Op.Color, Op.LineWidth, Op.Filled);
+    case RASTER_CIRCLE:
+        if (Op.AntiAlias) {
+            return ReferenceCircleAA(Image, Op.X, Op.Y, Op.Radius, Op.Color, Op.LineWidth, Op.Filled);
+        }
+        return ReferenceCircle(Image, Op.X, Op.Y, Op.Radius, Op.Color, Op.LineWidth, Op.Filled);
+    case RASTER_ELLIPSE:
+        return ReferenceEllipse(Image, Op.X, Op.Y, Op.Width, Op.Height, Op.Color, Op.LineWidth, Op.Filled);
+    case RASTER_FLOOD_FILL:
+        return ReferenceFloodFill(Image, Op.X, Op.Y, Op.Color, Op.Tolerance);
+    case RASTER_CLEAR:
+        return ReferenceClear(Image, Op.Color);
+    case RASTER_FLIP_HORIZONTAL:
+        return ReferenceFlipHorizontal(Image);
+    case RASTER_FLIP_VERTICAL:
+        return ReferenceFlipVertical(Image);
+    case RASTER_BEGIN_STROKE:
+        ReferenceBeginStroke(Image, Op.Opacity, Op.Blend);
+        return { 0, 0, 0, 0 };
+    default:
+        ReferenceEndStroke(Image);
+        return { 0, 0, 0, 0 };
+    }
+}
+
+std::string DescribeRasterOp(const RasterOp& Op) {
+    static const char* brushNames[] = { "round", "square" };
+    static const char* toleranceNames[] = { "exact", "channel", "distance" };
+    static const char* blendNames[] = { "normal", "multiply", "screen", "add" };
+    char text[160];
+    switch (Op.Kind) {
+    case RASTER_PIXEL:
+        snprintf(text, sizeof(text), "DrawPixel(%d, %d, 0x%06x)", Op.X, Op.Y, Op.Color);
+        break;
+    case RASTER_LINE:
+        snprintf(text, sizeof(text), "%s(%d, %d, %d, %d, 0x%06x, width %d, %s)", Op.AntiAlias ? "DrawLineAA" : "DrawLine", Op.X, Op.Y, Op.X2, Op.Y2, Op.Color, Op.LineWidth, brushNames[Op.Brush]);
+        break;
+    case RASTER_RECTANGLE:
+        snprintf(text, sizeof(text), "DrawRectangle(%d, %d, %d, %d, 0x%06x, width %d, %s)", Op.X, Op.Y, Op.Width, Op.Height, Op.Color, Op.LineWidth, Op.Filled ? "filled" : "outline");
+        break;
+    case RASTER_CIRCLE:
+        snprintf(text, sizeof(text), "%s(%d, %d, radius %d, 0x%06x, width %d, %s)", Op.AntiAlias ? "DrawCircleAA" : "DrawCircle", Op.X, Op.Y, Op.Radius, Op.Color, Op.LineWidth, Op.Filled ? "filled" : "outline");
+        break;
+    case RASTER_ELLIPSE:
+        snprintf(text, sizeof(text), "DrawEllipse(%d, %d, %d, %d, 0x%06x, width %d, %s)", Op.X, Op.Y, Op.Width, Op.Height, Op.Color, Op.LineWidth, Op.Filled ? "filled" : "outline");
+        break;
+    case RASTER_FLOOD_FILL:
+        snprintf(text, sizeof(text), "FloodFill(%d, %d, 0x%06x, %s %d)", Op.X, Op.Y, Op.Color, toleranceNames[Op.Tolerance.Mode], Op.Tolerance.Amount);
+        break;
+    case RASTER_CLEAR:
+        snprintf(text, sizeof(text), "ClearScreen(0x%06x)", Op.Color);
+        break;
+    case RASTER_FLIP_HORIZONTAL:
+        snprintf(text, sizeof(text), "FlipScreenHorizontal()");
+        break;
+    case RASTER_FLIP_VERTICAL:
+        snprintf(text, sizeof(text), "FlipScreenVertical()");
+        break;
+    case RASTER_BEGIN_STROKE:
+        snprintf(text, sizeof(text), "BeginBlendedStroke(opacity %d, %s)", Op.Opacity, blendNames[Op.Blend]);
+        break;
+    case RASTER_END_STROKE:
+        snprintf(text, sizeof(text), "EndBlendedStroke()");
+        break;
+    }
+    return text;
+}
+
+void SetValidation(RasterValidator& Validator, const Canvas& Target, bool Enabled) {
+    Validator.Enabled = Enabled;
+    Validator.HasFailure = false;
+    if (Enabled) {
+        CopyCanvasToReference(Target, Validator.Shadow);
+    }
+    else {
+        Validator.Shadow = ReferenceImage();
+    }
+}
+
+void SyncValidator(RasterValidator& Validator, const Canvas& Target) {
+    if (Validator.Enabled) {
+        CopyCanvasToReference(Target, Validator.Shadow);
+    }
+}
+
+static int FindMismatchScalar(const u32* A, const u32* B, int Count) {
+    for (int i = 0; i < Count; i++) {
+        if (A[i] != B[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#if PAINT_X86
+PAINT_TARGET_AVX2 static int FindMismatchAVX2(const u32* A, const u32* B, int Count) {
+    int i = 0;
+    for (; i + 8 <= Count; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(A + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(B + i));
+        int equal = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b)));
+        if (equal != 0xff) {
+            return i + FindMismatchScalar(A + i, B + i, 8);
+        }
+    }
+    int rest = FindMismatchScalar(A + i, B + i, Count - i);
+    return rest < 0 ? -1 : i + rest;
+}
+#endif
+
+int FindMismatch(const u32* A, const u32* B, int Count) {
+#if PAINT_X86
+    if (GetCpuFeatures().AVX2) {
+        return FindMismatchAVX2(A, B, Count);
+    }
+#endif
+    int i = 0;
+#if PAINT_SSE2
+    for (; i + 4 <= Count; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(A + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(B + i));
+        if (_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b))) != 0xf) {
+            return i + FindMismatchScalar(A + i, B + i, 4);
+        }
+    }
+#endif
+    int rest = FindMismatchScalar(A + i, B + i, Count - i);
+    return rest < 0 ? -1 : i + rest;
+}
+
+bool WriteDiffImage(const ReferenceImage& Expected, const Canvas& Actual, const PixelRect& Rect, const std::filesystem::path& Path) {
+    int width = Rect.X1 - Rect.X0;
+    int height = Rect.Y1 - Rect.Y0;
+    std::vector<u32> pixels((size_t)width * height);
+    ResolveCanvas(Actual, Rect, pixels.data(), width);
+    for (int y = 0; y < height; y++) {
+        const u32* expected = &Expected.Pixels[(size_t)(Rect.Y0 + y) * Expected.Width + Rect.X0];
+        u32* row = &pixels[(size_t)y * width];
+        for (int x = 0; x < width; x++) {
+            row[x] = row[x] == expected[x] ? (row[x] >> 2) & 0x3f3f3f : 0xff00ff;
+        }
+    }
+
+    Canvas image;
+    InitCanvas(image, width, height, 0);
+    LoadCanvasPixels(image, pixels.data(), width);
+    return WriteBmp(image, Path, BMP_24_BIT);
+}
+
+// Compares Rect row by row and records the first differing pixel.
+static bool CompareWithShadow(RasterValidator& Validator, const Canvas& Target, const PixelRect& Rect, const RasterOp& Op) {
+    const ReferenceImage& shadow = Validator.Shadow;
+    std::vector<u32> row(std::max(Rect.X1 - Rect.X0, 0));
+    for (int y = Rect.Y0; y < Rect.Y1; y++) {
+        ReadCanvasSpan(Target, y, Rect.X0, Rect.X1, row.data());
+        const u32* expected = &shadow.Pixels[(size_t)y * shadow.Width + Rect.X0];
+        int x = FindMismatch(expected, row.data(), (int)row.size());
+        if (x < 0) {
+            continue;
+        }
+
+        // Later mismatches are still reported, but the first is the one kept.
+        if (Validator.HasFailure) {
+            return false;
+        }
+        ValidationFailure& failure = Validator.Failure;
+        failure.Op = Op;
+        failure.X = Rect.X0 + x;
+        failure.Y = y;
+        failure.Expected = expected[x];
+        failure.Actual = row[x];
+        failure.DiffImage.clear();
+        if (WriteDiffImage(shadow, Target, Rect, Validator.DiffPath)) {
+            failure.DiffImage = Validator.DiffPath;
+        }
+        Validator.HasFailure = true;
+        return false;
+    }
+    return true;
+}
+
+bool RunRasterOp(RasterValidator& Validator, Canvas& Target, const RasterOp& Op) {
+    ApplyRasterOp(Target, Op);
+    if (!Validator.Enabled) {
+        return true;
+    }
+    if (Validator.Shadow.Width != Target.Width || Validator.Shadow.Height != Target.Height) {
+        // Something resized the canvas without syncing; nothing to compare to.
+        CopyCanvasToReference(Target, Validator.Shadow);
+        return true;
+    }
+
+    TraceScope trace("Validate");
+    Validator.Shadow.Selection = Target.Selection;
+    PixelRect touched = ApplyReferenceOp(Validator.Shadow, Op);
+    if (IsEmpty(touched) || CompareWithShadow(Validator, Target, touched, Op)) {
+        return true;
+    }
+    CopyCanvasToReference(Target, Validator.Shadow);
+    return false;
+}
+
+RasterOp RandomRasterOp(std::mt19937& Rng, int Width, int Height) {
+    // Coordinates reach a little past the canvas so clipping is exercised,
+    // and colours come from a small palette so fills find real regions.
+    auto x = [&]() { return (int)(Rng() % (Width + 64)) - 32; };
+    auto y = [&]() { return (int)(Rng() % (Height + 64)) - 32; };
+    static const u32 palette[] = { 0x000000, 0xffffff, 0xff0000, 0x00ff00, 0x0000ff, 0x202020, 0x232323 };
+    RasterOp op;
+    op.Color = palette[Rng() % 7];
+    op.LineWidth = 1 + Rng() % 24;
+    op.Brush = (BrushShape)(Rng() % 2);
+    op.Filled = Rng() % 2;
+
+    int kind = Rng() % 100;
+    if (kind < 10) {
+        op.Kind = RASTER_PIXEL;
+        op.X = x();
+        op.Y = y();
+    }
+    else if (kind < 50) {
+        op.Kind = RASTER_LINE;
+        op.X = x();
+        op.Y = y();
+        // Mostly short segments, as mouse moves produce them.
+        int reach = Rng() % 4 ? 40 : std::max(Width, Height);
+        op.X2 = op.X + (int)(Rng() % (2 * reach + 1)) - reach;
+        op.Y2 = op.Y + (int)(Rng() % (2 * reach + 1)) - reach;
+        if (Rng() % 8 == 0) {
+            op.LineWidth = 1;
+        }
+        op.AntiAlias = Rng() % 3 == 0;
+    }
+    else if (kind < 65) {
+        op.Kind = RASTER_RECTANGLE;
+        op.X = x();
+        op.Y = y();
+        op.Width = (int)(Rng() % Width) - Width / 2;
+        op.Height = (int)(Rng() % Height) - Height / 2;
+    }
+    else if (kind < 75) {
+        op.Kind = RASTER_CIRCLE;
+        op.X = x();
+        op.Y = y();
+        op.Radius = Rng() % (std::min(Width, Height) / 2 + 1);
+        op.LineWidth = 1 + Rng() % 6;
+        op.AntiAlias = Rng() % 3 == 0;
+    }
+    else if (kind < 80) {
+        op.Kind = RASTER_ELLIPSE;
+        op.X = x();
+        op.Y = y();
+        op.Width = (int)(Rng() % Width) - Width / 2;
+        op.Height = (int)(Rng() % Height) - Height / 2;
+    }
+    else if (kind < 92) {
+        op.Kind = RASTER_FLOOD_FILL;
+        op.X = Rng() % Width;
+        op.Y = Rng() % Height;
+        op.Tolerance = { (ToleranceMode)(Rng() % 3), (int)(Rng() % 16) };
+    }
+    else if (kind < 94) {
+        // Most strokes are blended, and stay open over several operations.
+        op.Kind = RASTER_BEGIN_STROKE;
+        op.Opacity = Rng() % 4 ? (uint8_t)(Rng() % 256) : 255;
+        op.Blend = (BlendMode)(Rng() % BLEND_MODE_COUNT);
+    }
+    else if (kind < 95) {
+        op.Kind = RASTER_END_STROKE;
+    }
+    else if (kind < 96) {
+        op.Kind = RASTER_CLEAR;
+    }
+    else if (kind < 98) {
+        op.Kind = RASTER_FLIP_HORIZONTAL;
+    }
+    else {
+        op.Kind = RASTER_FLIP_VERTICAL;
+    }
+    return op;
+}
+
+// Now and then the canvas gets a new selection, or none: a rectangle, an
+// ellipse or a magic wand region, each reaching past the canvas sometimes.
+static void ChangeRandomSelection(std::mt19937& Rng, Canvas& Target) {
+    if (Rng() % 32) {
+        return;
+    }
+    int x = (int)(Rng() % (Target.Width + 64)) - 32;
+    int y = (int)(Rng() % (Target.Height + 64)) - 32;
+    int width = (int)(Rng() % Target.Width) - Target.Width / 2;
+    int height = (int)(Rng() % Target.Height) - Target.Height / 2;
+    switch (Rng() % 4) {
+    case 0:
+        Target.Selection.reset();
+        break;
+    case 1:
+        Target.Selection = std::make_shared<SelectionMask>(SelectRectangle(Target.Width, Target.Height,
+            { std::min(x, x + width), std::min(y, y + height), std::max(x, x + width), std::max(y, y + height) }));
+        break;
+    case 2:
+        Target.Selection = std::make_shared<SelectionMask>(SelectEllipse(Target.Width, Target.Height, x, y, width, height));
+        break;
+    default:
+        Target.Selection = std::make_shared<SelectionMask>(SelectSimilar(Target, (int)(Rng() % Target.Width),
+            (int)(Rng() % Target.Height), { (ToleranceMode)(Rng() % 3), (int)(Rng() % 16) }));
+        break;
+    }
+}
+
+int ReplayRandomOps(RasterValidator& Validator, uint32_t Seed, int Width, int Height, int Count) {
+    std::mt19937 rng(Seed);
+    // Separate, so the operations are the same with or without selections.
+    std::mt19937 selectionRng(Seed ^ 0x5e1ec7);
+    Canvas canvas;
+    InitCanvas(canvas, Width, Height, 0xffffff);
+    SetValidation(Validator, canvas, true);
+
+    // After each operation the whole canvas is compared too, which catches
+    // writes outside the box the reference reported.
+    for (int ops = 1; ops <= Count; ops++) {
+        ChangeRandomSelection(selectionRng, canvas);
+        RasterOp op = RandomRasterOp(rng, Width, Height);
+        if (!RunRasterOp(Validator, canvas, op) || !CompareWithShadow(Validator, canvas, CanvasBounds(canvas), op)) {
+            return ops;
+        }
+    }
+    return Count;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <stdint.h>
+#include <filesystem>
+#include <random>
+#include <string>
+
+#include "fill.h"
+#include "raster.h"
+#include "reference.h"
+
+// Build with PAINT_VALIDATE=1 to start with validation on; it can still be
+// switched at runtime with SetValidation.
+#ifndef PAINT_VALIDATE
+#define PAINT_VALIDATE 0
+#endif
+
+enum RasterOpKind {
+    RASTER_PIXEL,
+    RASTER_LINE,
+    RASTER_RECTANGLE,
+    RASTER_CIRCLE,
+    RASTER_ELLIPSE,
+    RASTER_FLOOD_FILL,
+    RASTER_CLEAR,
+    RASTER_FLIP_HORIZONTAL,
+    RASTER_FLIP_VERTICAL,
+    RASTER_BEGIN_STROKE,
+    RASTER_END_STROKE
+};
+
+// One call of a raster primitive, kept so it can be run on both paths,
+// reported, and replayed.
+struct RasterOp {
+    RasterOpKind Kind = RASTER_PIXEL;
+    int X = 0;      // pixel, line start, rectangle corner, circle centre, fill seed
+    int Y = 0;
+    int X2 = 0;     // line end
+    int Y2 = 0;
+    int Width = 0;  // rectangle or ellipse box, may be negative
+    int Height = 0;
+    int Radius = 0;
+    u32 Color = 0;
+    int LineWidth = 1;
+    BrushShape Brush = ROUND_BRUSH;
+    bool Filled = false;
+    bool AntiAlias = false; // lines and circles
+    FillTolerance Tolerance = { TOLERANCE_EXACT, 0 };
+    uint8_t Opacity = 255;  // stroke start
+    BlendMode Blend = BLEND_NORMAL;
+};
+
+void ApplyRasterOp(Canvas& Target, const RasterOp& Op);
+// Returns the bounding box the reference may have written.
+PixelRect ApplyReferenceOp(ReferenceImage& Image, const RasterOp& Op);
+std::string DescribeRasterOp(const RasterOp& Op);
+
+struct ValidationFailure {
+    RasterOp Op;
+    int X = 0;          // first differing pixel, in row order
+    int Y = 0;
+    u32 Expected = 0;   // reference
+    u32 Actual = 0;     // canvas
+    std::filesystem::path DiffImage; // empty if it couldn't be written
+};
+
+// Keeps a reference copy of the canvas in step with it. Every operation run
+// through RunRasterOp is drawn on both, and the box the reference touched is
+// compared. Only the first mismatch is kept in Failure until HasFailure is
+// cleared; the shadow is then resynced so later operations are still checked
+// on their own, and RunRasterOp keeps returning false for each that differs.
+struct RasterValidator {
+    bool Enabled = PAINT_VALIDATE;
+    ReferenceImage Shadow;
+    std::filesystem::path DiffPath = std::filesystem::temp_directory_path() / "paint_validation_diff.bmp";
+    bool HasFailure = false;
+    ValidationFailure Failure;
+};
+
+void SetValidation(RasterValidator& Validator, const Canvas& Target, bool Enabled);
+// For changes that don't go through RunRasterOp: undo, loading, transforms.
+void SyncValidator(RasterValidator& Validator, const Canvas& Target);
+
+// Returns false only when this operation produced the first mismatch.
+bool RunRasterOp(RasterValidator& Validator, Canvas& Target, const RasterOp& Op);
+
+// Index of the first differing pixel, or -1.
+int FindMismatch(const u32* A, const u32* B, int Count);
+
+// Writes Rect of the canvas with every pixel that differs from Expected in
+// magenta and the rest darkened.
+bool WriteDiffImage(const ReferenceImage& Expected, const Canvas& Actual, const PixelRect& Rect, const std::filesystem::path& Path);
+
+RasterOp RandomRasterOp(std::mt19937& Rng, int Width, int Height);
+
+// Draws Count random operations on a Width x Height canvas through Validator,
+// comparing the whole canvas after each one, under a selection that changes
+// now and then. Returns the number of operations run, stopping after the
+// first mismatch.
+int ReplayRandomOps(RasterValidator& Validator, uint32_t Seed, int Width, int Height, int Count);
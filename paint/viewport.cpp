@@ -0,0 +1,195 @@
+#include "viewport.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "span.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// Rewrites the part of one tile of Dest that Rect covers, Dest being Source
+// halved. Source rows and columns past its edge repeat the last one.
+static void DownsampleTile(Canvas& Dest, const Canvas& Source, int Tile, const PixelRect& Rect) {
+    PixelRect bounds = TileBounds(Dest, Tile);
+    PixelRect below = Intersect({ bounds.X0 * 2, bounds.Y0 * 2, bounds.X1 * 2, bounds.Y1 * 2 }, CanvasBounds(Source));
+    // Four source tiles of one colour halve to that colour.
+    u32 color;
+    if (IsRegionUniform(Source, below, color)) {
+        const CanvasTile& current = *Dest.Tiles[Tile];
+        if (!current.Pixels.empty() || current.Uniform != color) {
+            SetTileUniform(Dest, Tile, MakeUniformTile(Dest, color));
+        }
+        return;
+    }
+
+    // Outside Rect the source didn't change, so whatever the tile held there,
+    // its uniform colour included, is still right.
+    PixelRect part = Intersect(Rect, bounds);
+    u32* pixels = WritableTile(Dest, Tile);
+    u32 top[TILE_SIZE];
+    u32 bottom[TILE_SIZE];
+    // A dest row takes two source rows of the same source tiles, half its
+    // width from each of up to two of them. Whole pairs inside a tile with
+    // pixels are read in place; the rest, uniform tiles and the canvas edge,
+    // go through a copy.
+    for (int y = part.Y0; y < part.Y1; y++) {
+        int sourceY = y * 2;
+        int nextY = std::min(sourceY + 1, Source.Height - 1);
+        u32* row = pixels + (y & TILE_MASK) * TILE_SIZE;
+        for (int x = part.X0; x < part.X1;) {
+            int end = std::min(part.X1, ((x * 2) | TILE_MASK) / 2 + 1);
+            int count = end - x;
+            int x0 = x * 2;
+            int x1 = std::min(end * 2, Source.Width);
+            const CanvasTile& tile = *Source.Tiles[TileIndex(Source, x0, sourceY)];
+            if (!tile.Pixels.empty() && x1 - x0 == count * 2 && nextY == sourceY + 1) {
+                const u32* first = &tile.Pixels[(sourceY & TILE_MASK) * TILE_SIZE + (x0 & TILE_MASK)];
+                DownsampleRow(row + (x & TILE_MASK), first, first + TILE_SIZE, count);
+            }
+            else {
+                ReadCanvasSpan(Source, sourceY, x0, x1, top);
+                ReadCanvasSpan(Source, nextY, x0, x1, bottom);
+                if (x1 - x0 < count * 2) {
+                    top[count * 2 - 1] = top[count * 2 - 2];
+                    bottom[count * 2 - 1] = bottom[count * 2 - 2];
+                }
+                DownsampleRow(row + (x & TILE_MASK), top, bottom, count);
+            }
+            x = end;
+        }
+    }
+}
+
+static void DownsampleRect(Canvas& Dest, const Canvas& Source, const PixelRect& Rect) {
+    if (IsEmpty(Rect)) {
+        return;
+    }
+    int firstRow = Rect.Y0 >> TILE_SHIFT;
+    int rows = ((Rect.Y1 - 1) >> TILE_SHIFT) - firstRow + 1;
+    auto downsampleRow = [&](int Row) {
+        int rowTile = (firstRow + Row) * Dest.TilesX;
+        for (int tx = Rect.X0 >> TILE_SHIFT; tx <= (Rect.X1 - 1) >> TILE_SHIFT; tx++) {
+            DownsampleTile(Dest, Source, rowTile + tx, Rect);
+        }
+    };
+    // Each job writes only its own row of tiles.
+    if ((size_t)(Rect.X1 - Rect.X0) * (Rect.Y1 - Rect.Y0) * 4 >= PARALLEL_RASTER_PIXELS) {
+        ParallelFor(rows, downsampleRow);
+    }
+    else {
+        for (int row = 0; row < rows; row++) {
+            downsampleRow(row);
+        }
+    }
+}
+
+void MarkMipsStale(MipPyramid& Pyramid, const std::vector<PixelRect>& Rects) {
+    for (DamageTracker& stale : Pyramid.Stale) {
+        for (const PixelRect& rect : Rects) {
+            AddDamage(stale, rect);
+        }
+    }
+}
+
+void UpdateMipPyramid(MipPyramid& Pyramid, const Canvas& Source, int Count) {
+    TraceScope trace("UpdateMipPyramid");
+    const Canvas& first = Pyramid.Levels[0];
+    if (first.Tiles.empty() || first.Width != (Source.Width + 1) / 2 || first.Height != (Source.Height + 1) / 2) {
+        int width = Source.Width;
+        int height = Source.Height;
+        for (int i = 0; i < MIP_LEVELS; i++) {
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+            InitCanvas(Pyramid.Levels[i], width, height, 0);
+            InitDamageTracker(Pyramid.Stale[i], Source.Width, Source.Height);
+            AddDamage(Pyramid.Stale[i], CanvasBounds(Source));
+        }
+    }
+
+    Count = std::min(Count, MIP_LEVELS);
+    for (int i = 0; i < Count; i++) {
+        const Canvas& below = i == 0 ? Source : Pyramid.Levels[i - 1];
+        Canvas& level = Pyramid.Levels[i];
+        int shift = i + 1;
+        int round = (1 << shift) - 1;
+        for (const PixelRect& rect : TakeDamage(Pyramid.Stale[i])) {
+            PixelRect part = { rect.X0 >> shift, rect.Y0 >> shift, (rect.X1 + round) >> shift, (rect.Y1 + round) >> shift };
+            DownsampleRect(level, below, Intersect(part, CanvasBounds(level)));
+        }
+    }
+}
+
+void ScreenToCanvas(const Viewport& View, float X, float Y, float& CanvasX, float& CanvasY) {
+    float scale = ldexpf(1.0f, -View.Zoom);
+    CanvasX = (X - View.OffsetX + 0.5f) * scale - 0.5f;
+    CanvasY = (Y - View.OffsetY + 0.5f) * scale - 0.5f;
+}
+
+PixelRect CanvasToScreen(const Viewport& View, const PixelRect& Rect) {
+    if (View.Zoom >= 0) {
+        int zoom = View.Zoom;
+        return { (Rect.X0 << zoom) + View.OffsetX, (Rect.Y0 << zoom) + View.OffsetY, (Rect.X1 << zoom) + View.OffsetX, (Rect.Y1 << zoom) + View.OffsetY };
+    }
+    int shift = -View.Zoom;
+    int round = (1 << shift) - 1;
+    return { (Rect.X0 >> shift) + View.OffsetX, (Rect.Y0 >> shift) + View.OffsetY, ((Rect.X1 + round) >> shift) + View.OffsetX, ((Rect.Y1 + round) >> shift) + View.OffsetY };
+}
+
+void ZoomViewport(Viewport& View, int Zoom, int AnchorX, int AnchorY) {
+    float x, y;
+    ScreenToCanvas(View, (float)AnchorX, (float)AnchorY, x, y);
+    View.Zoom = std::clamp(Zoom, MIN_ZOOM, MAX_ZOOM);
+    float scale = ldexpf(1.0f, View.Zoom);
+    View.OffsetX = (int)lroundf(AnchorX + 0.5f - (x + 0.5f) * scale);
+    View.OffsetY = (int)lroundf(AnchorY + 0.5f - (y + 0.5f) * scale);
+}
+
+void PresentViewport(const Viewport& View, const Canvas& Source, const MipPyramid& Pyramid, const PixelRect& Rect, u32* Dest, size_t DestStride, u32 Background) {
+    const Canvas& shown = View.Zoom < 0 ? Pyramid.Levels[-View.Zoom - 1] : Source;
+    int zoom = std::max(View.Zoom, 0);
+    PixelRect covered = { View.OffsetX, View.OffsetY, View.OffsetX + (shown.Width << zoom), View.OffsetY + (shown.Height << zoom) };
+    PixelRect inside = Intersect(Rect, covered);
+    for (int y = Rect.Y0; y < Rect.Y1; y++) {
+        u32* row = Dest + (size_t)(y - Rect.Y0) * DestStride;
+        if (IsEmpty(inside) || y < inside.Y0 || y >= inside.Y1) {
+            std::fill(row, row + (Rect.X1 - Rect.X0), Background);
+        }
+        else {
+            std::fill(row, row + (inside.X0 - Rect.X0), Background);
+            std::fill(row + (inside.X1 - Rect.X0), row + (Rect.X1 - Rect.X0), Background);
+        }
+    }
+    if (IsEmpty(inside)) {
+        return;
+    }
+
+    u32* out = Dest + (size_t)(inside.Y0 - Rect.Y0) * DestStride + (inside.X0 - Rect.X0);
+    if (zoom == 0) {
+        PixelRect part = { inside.X0 - View.OffsetX, inside.Y0 - View.OffsetY, inside.X1 - View.OffsetX, inside.Y1 - View.OffsetY };
+        ResolveCanvas(shown, part, out, DestStride);
+        return;
+    }
+    // Zoomed in, each canvas row is read once, spread out into one window
+    // row and copied to the rest of its block.
+    int x0 = (inside.X0 - View.OffsetX) >> zoom;
+    int x1 = ((inside.X1 - 1 - View.OffsetX) >> zoom) + 1;
+    int width = inside.X1 - inside.X0;
+    std::vector<u32> pixels(x1 - x0);
+    for (int y = inside.Y0; y < inside.Y1;) {
+        int canvasY = (y - View.OffsetY) >> zoom;
+        int rows = std::min(inside.Y1, View.OffsetY + ((canvasY + 1) << zoom)) - y;
+        ReadCanvasSpan(shown, canvasY, x0, x1, pixels.data());
+        int x = inside.X0;
+        for (int canvasX = x0; canvasX < x1; canvasX++) {
+            int end = std::min(inside.X1, View.OffsetX + ((canvasX + 1) << zoom));
+            std::fill(out + (x - inside.X0), out + (end - inside.X0), pixels[canvasX - x0]);
+            x = end;
+        }
+        for (int r = 1; r < rows; r++) {
+            memcpy(out + r * DestStride, out, width * sizeof(u32));
+        }
+        out += rows * DestStride;
+        y += rows;
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+
+#include "canvas.h"
+#include "damage.h"
+
+// Zoom goes in powers of two, 2^Zoom screen pixels to a canvas pixel: from
+// 1/16x to 32x.
+constexpr int MIN_ZOOM = -4;
+constexpr int MAX_ZOOM = 5;
+constexpr int MIP_LEVELS = -MIN_ZOOM;
+
+// Halved copies of a canvas for showing it zoomed out. Levels[i] is the
+// source halved i + 1 times, rounded up, each pixel the mean of the 2x2
+// block under it. The levels are tiled canvases, so a region of one colour
+// stays a single uniform tile all the way up and costs nothing to halve.
+//
+// Levels are only brought up to date when they are looked at, and then only
+// where the source changed since.
+struct MipPyramid {
+    Canvas Levels[MIP_LEVELS];
+    // Source regions each level hasn't caught up with yet.
+    DamageTracker Stale[MIP_LEVELS];
+};
+
+// Notes that Rects of the source changed. Costs nothing until the levels are
+// looked at.
+void MarkMipsStale(MipPyramid& Pyramid, const std::vector<PixelRect>& Rects);
+// Brings the first Count levels up to date with Source, each from the one
+// below. A source of a new size rebuilds them all.
+void UpdateMipPyramid(MipPyramid& Pyramid, const Canvas& Source, int Count);
+
+// Which part of the canvas the window shows.
+struct Viewport {
+    int Zoom = 0;
+    // Where the canvas origin lands in the window, in window pixels.
+    int OffsetX = 0;
+    int OffsetY = 0;
+};
+
+// The canvas position under the centre of window pixel (X, Y), in canvas
+// pixels; rounded, it is the canvas pixel shown there.
+void ScreenToCanvas(const Viewport& View, float X, float Y, float& CanvasX, float& CanvasY);
+// The window pixels Rect of the canvas shows in, rounded outwards.
+PixelRect CanvasToScreen(const Viewport& View, const PixelRect& Rect);
+// Changes the zoom, clamped to the levels above, keeping the canvas point
+// under window pixel (AnchorX, AnchorY) where it is.
+void ZoomViewport(Viewport& View, int Zoom, int AnchorX, int AnchorY);
+
+// Resolves Rect of the window into Dest, which points at Rect's top-left
+// pixel, DestStride pixels a row. Zoomed out, it reads the pyramid level the
+// zoom needs, which must be up to date; zoomed in, each canvas pixel becomes
+// a square block. Whatever the canvas doesn't cover is Background.
+void PresentViewport(const Viewport& View, const Canvas& Source, const MipPyramid& Pyramid, const PixelRect& Rect, u32* Dest, size_t DestStride, u32 Background);